@@ -0,0 +1,220 @@
+/*Microbenchmarks of the server's CPU hot paths. Nothing here touches the
+  GPU: the model pre- and postprocessing run on host buffers and no model
+  is loaded, TensorRT is only linked because DataChannel pulls it in.
+
+  build, from the repository root (the target is there when google benchmark is found):
+    cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build --target server_bench
+
+  run from the repository root (the codec benchmarks read client/images/test4.png)
+  and keep the JSON for comparison between revisions:
+    build/server_bench --benchmark_out=bench.json --benchmark_out_format=json
+    compare.py benchmarks base.json bench.json    # from the google benchmark tools
+*/
+#include <atomic>
+#include <random>
+#include <thread>
+#include <sys/socket.h>
+#include <benchmark/benchmark.h>
+#include <opencv2/opencv.hpp>
+#include <spdlog/spdlog.h>
+#include "imageProcess.hpp"
+#include "Datachannel.hpp"
+#include "Threadpool.hpp"
+#include "utils.hpp"
+
+const char *TEST_IMAGE = "client/images/test4.png";
+const int DETECTOR_INPUT_W = 640;   // centerface_480_640
+const int DETECTOR_INPUT_H = 480;
+
+static std::vector<FaceBox> randomBoxes(int nums, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<float> pos(0, 640), size(20, 120), conf(0.5, 1);
+    std::vector<FaceBox> boxes(nums);
+    for(FaceBox &box : boxes)
+        box = {conf(rng), pos(rng), pos(rng), size(rng), size(rng)};
+    return boxes;
+}
+
+static cv::Mat loadTestImage(benchmark::State &state) {
+    cv::Mat img = cv::imread(TEST_IMAGE, cv::IMREAD_COLOR);
+    if(img.empty())
+        state.SkipWithError("client/images/test4.png not found, run from the repository root");
+    return img;
+}
+
+static void BM_IOUCalculate(benchmark::State &state) {
+    std::vector<FaceBox> boxes = randomBoxes(2, 1);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(IOUCalculate(boxes[0], boxes[1]));
+}
+BENCHMARK(BM_IOUCalculate);
+
+static void BM_NmsDetect(benchmark::State &state) {
+    std::vector<FaceBox> boxes = randomBoxes(state.range(0), 2);
+    for(auto _ : state) {
+        std::vector<FaceBox> detections = boxes;
+        NmsDetect(detections);
+        benchmark::DoNotOptimize(detections.data());
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_NmsDetect)->RangeMultiplier(4)->Range(4, 1024)->Complexity();
+
+static void BM_PreprocessDetection(benchmark::State &state) {
+    cv::Mat img(state.range(1), state.range(0), CV_8UC3);
+    cv::randu(img, 0, 255);
+    std::vector<float> input(3 * DETECTOR_INPUT_W * DETECTOR_INPUT_H);
+    for(auto _ : state)
+        PreprocessDetection(img, input.data(), DETECTOR_INPUT_W, DETECTOR_INPUT_H);
+    state.SetBytesProcessed(state.iterations() * img.total() * img.elemSize());
+}
+BENCHMARK(BM_PreprocessDetection)->Args({640, 480})->Args({1280, 720})->Args({1920, 1080});
+
+static void BM_DecodeDetection(benchmark::State &state) {
+    // a background heatmap with state.range(0) faces above the threshold
+    int cells = DETECTOR_INPUT_W / 4 * DETECTOR_INPUT_H / 4;
+    std::vector<float> heatmap(cells, 0.01f), scale(2 * cells, 1.0f), offset(2 * cells, 0.0f);
+    std::mt19937_64 rng(3);
+    for(int i = 0; i < state.range(0); ++i)
+        heatmap[rng() % cells] = 0.9f;
+    for(auto _ : state) {
+        std::vector<FaceBox> boxes = DecodeDetection(heatmap.data(), scale.data(), offset.data(),
+            DETECTOR_INPUT_W, DETECTOR_INPUT_H, cv::Size(1280, 720));
+        benchmark::DoNotOptimize(boxes.data());
+    }
+}
+BENCHMARK(BM_DecodeDetection)->Arg(0)->Arg(8)->Arg(64);
+
+static void BM_PreprocessGeneration(benchmark::State &state) {
+    cv::Mat img(state.range(0), state.range(0), CV_8UC3);
+    cv::randu(img, 0, 255);
+    std::vector<float> input(3 * img.total());
+    for(auto _ : state)
+        PreprocessGeneration(img, input.data());
+    state.SetBytesProcessed(state.iterations() * img.total() * img.elemSize());
+}
+BENCHMARK(BM_PreprocessGeneration)->Arg(256)->Arg(512)->Arg(1024);
+
+static void BM_PostprocessGeneration(benchmark::State &state) {
+    cv::Mat output(state.range(0), state.range(0), CV_32FC3);
+    cv::randu(output, -1, 1);
+    cv::Mat img(state.range(0), state.range(0), CV_8UC3);
+    for(auto _ : state)
+        PostprocessGeneration((const float *)output.data, img);
+    state.SetBytesProcessed(state.iterations() * output.total() * output.elemSize());
+}
+BENCHMARK(BM_PostprocessGeneration)->Arg(256)->Arg(512)->Arg(1024);
+
+static void BM_ThreadSafeQueue(benchmark::State &state) {
+    // every benchmark thread pushes and pops on the one shared queue
+    static ThreadSafeQueue<int> queue;
+    for(auto _ : state) {
+        queue.push(1);
+        benchmark::DoNotOptimize(queue.pop());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadSafeQueue)->ThreadRange(1, 16)->UseRealTime();
+
+static void BM_ThreadPoolDispatch(benchmark::State &state) {
+    // round trip of a batch of empty tasks, from submission until the last one ran
+    const int batch = 256;
+    ThreadPool pool(state.range(0));
+    std::atomic<int> done(0);
+    std::function<void(void *)> task = [&done](void *) { done++; };
+    for(auto _ : state) {
+        done = 0;
+        for(int i = 0; i < batch; ++i) {
+            TaskAttr attr;
+            attr.flowId = i % 16;
+            pool.threadPoolAdd(task, nullptr, attr);
+        }
+        while(done.load() < batch)
+            std::this_thread::yield();
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_ThreadPoolDispatch)->Arg(1)->Arg(4)->Arg(16)->UseRealTime();
+
+static void BM_SendImage(benchmark::State &state) {
+    cv::Mat img = loadTestImage(state);
+    if(img.empty())
+        return;
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    // the peer drains until the channel closes its end
+    std::thread drain([fd = fds[1]]() {
+        char buf[65536];
+        while(recv(fd, buf, sizeof(buf), 0) > 0);
+        close(fd);
+    });
+    {
+        DataChannel channel(fds[0]);
+        for(auto _ : state)
+            channel.sendImage(img);
+    }
+    drain.join();
+}
+BENCHMARK(BM_SendImage)->UseRealTime();
+
+static void BM_RecvImage(benchmark::State &state) {
+    cv::Mat img = loadTestImage(state);
+    if(img.empty())
+        return;
+    std::vector<uchar> encoded;
+    cv::imencode(".png", img, encoded);
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    // the peer keeps sending legacy frames until the channel closes its end
+    std::thread feed([fd = fds[1], &encoded]() {
+        int length = encoded.size();
+        while(send(fd, &length, sizeof(length), MSG_NOSIGNAL) == sizeof(length) &&
+            send(fd, encoded.data(), encoded.size(), MSG_NOSIGNAL) == (ssize_t)encoded.size());
+        close(fd);
+    });
+    {
+        DataChannel channel(fds[0]);
+        for(auto _ : state)
+            benchmark::DoNotOptimize(channel.recvImage().data);
+    }
+    feed.join();
+    state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_RecvImage)->UseRealTime();
+
+static void BM_Encode(benchmark::State &state, const char *ext) {
+    cv::Mat img = loadTestImage(state);
+    if(img.empty())
+        return;
+    std::vector<uchar> encoded;
+    for(auto _ : state)
+        cv::imencode(ext, img, encoded);
+    state.SetBytesProcessed(state.iterations() * img.total() * img.elemSize());
+    state.counters["encoded_bytes"] = encoded.size();
+}
+BENCHMARK_CAPTURE(BM_Encode, png, ".png");
+BENCHMARK_CAPTURE(BM_Encode, jpeg, ".jpg");
+
+static void BM_Decode(benchmark::State &state, const char *ext) {
+    cv::Mat img = loadTestImage(state);
+    if(img.empty())
+        return;
+    std::vector<uchar> encoded;
+    cv::imencode(ext, img, encoded);
+    for(auto _ : state)
+        benchmark::DoNotOptimize(cv::imdecode(encoded, cv::IMREAD_COLOR).data);
+    state.SetBytesProcessed(state.iterations() * img.total() * img.elemSize());
+}
+BENCHMARK_CAPTURE(BM_Decode, png, ".png");
+BENCHMARK_CAPTURE(BM_Decode, jpeg, ".jpg");
+
+int main(int argc, char **argv) {
+    // the channel logs every image it moves
+    spdlog::set_level(spdlog::level::warn);
+    benchmark::Initialize(&argc, argv);
+    if(benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
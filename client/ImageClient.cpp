@@ -0,0 +1,416 @@
+#include "ImageClient.hpp"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <spdlog/spdlog.h>
+
+typedef std::chrono::steady_clock Clock;
+
+template <typename dataType>
+static bool sendAll(int sockfd, const dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t sendBytes = send(sockfd, buf, fileSize, MSG_NOSIGNAL);
+        if(sendBytes == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= sendBytes;
+        buf += sendBytes;
+    }
+    return true;
+}
+
+static void setTimeout(int fd, int optname, int timeoutMs) {
+    struct timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, optname, &timeout, sizeof(timeout));
+}
+
+static bool isRetryable(int status) {
+    return status == STATUS_CLIENT_IO_ERROR || status == STATUS_CLIENT_TIMEOUT || status == STATUS_OVERLOADED ||
+        status == STATUS_UNAVAILABLE;
+}
+
+ClientConnection::ClientConnection(ImageClient *client)
+    : _client(client), _fd(-1), _closing(false), inFlightCount(0) {
+    _reader = std::thread(&ClientConnection::readLoop, this);
+}
+
+ClientConnection::~ClientConnection() {
+    close();
+}
+
+bool ClientConnection::connectServer() {
+    const ClientOptions &options = _client->getOptions();
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result = nullptr;
+    if(getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(), &hints, &result) != 0 || result == nullptr)
+        return false;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bool connected = fd != -1;
+    if(connected) {
+        setTimeout(fd, SO_SNDTIMEO, options.connectTimeoutMs);
+        connected = connect(fd, result->ai_addr, result->ai_addrlen) == 0;
+    }
+    freeaddrinfo(result);
+    if(!connected) {
+        if(fd != -1)
+            ::close(fd);
+        return false;
+    }
+    // a server that stops reading fails the send like it fails the reply
+    setTimeout(fd, SO_SNDTIMEO, options.requestTimeoutMs);
+    setTimeout(fd, SO_RCVTIMEO, CLIENT_IO_SLICE_MS);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    _fd = fd;
+    _connected.notify_one();
+    return true;
+}
+
+bool ClientConnection::send(std::shared_ptr<PendingRequest> request) {
+    const ClientOptions &options = _client->getOptions();
+    std::lock_guard<std::mutex> lock(_mtx);
+    if(_closing || (_fd == -1 && !connectServer()))
+        return false;
+    request->connection = this;
+    request->deadline = options.requestTimeoutMs > 0 ?
+        Clock::now() + std::chrono::milliseconds(options.requestTimeoutMs) : Clock::time_point::max();
+    // queued before it is sent, the reply may come before send returns
+    _inFlight.push_back(request);
+    if(!sendAll(_fd, request->wire.data(), request->wire.size()))
+        shutdown(_fd, SHUT_RDWR);   // the reader fails it with the others
+    return true;
+}
+
+void ClientConnection::close() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if(_closing)
+            return;
+        _closing = true;
+        if(_fd != -1)
+            shutdown(_fd, SHUT_RDWR);
+    }
+    _connected.notify_one();
+    _reader.join();
+}
+
+bool ClientConnection::recvUntil(int fd, uchar *buf, size_t nbBytes, int &status) {
+    while(nbBytes > 0) {
+        ssize_t readbytes = recv(fd, buf, nbBytes, 0);
+        if(readbytes > 0) {
+            nbBytes -= readbytes;
+            buf += readbytes;
+            continue;
+        }
+        if(readbytes == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // an idle connection waits, one with a request past its deadline is given up
+            std::lock_guard<std::mutex> lock(_mtx);
+            if(_closing)
+                return false;
+            if(!_inFlight.empty() && Clock::now() >= _inFlight.front()->deadline) {
+                status = STATUS_CLIENT_TIMEOUT;
+                return false;
+            }
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+void ClientConnection::readLoop() {
+    while(true) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _connected.wait(lock, [this]() { return _closing || _fd != -1; });
+            if(_fd == -1)
+                return;
+            fd = _fd;
+        }
+        // returns once fd failed, the next send connects again
+        readReplies(fd);
+    }
+}
+
+void ClientConnection::readReplies(int fd) {
+    std::vector<uchar> body;
+    while(true) {
+        int status = STATUS_CLIENT_IO_ERROR;
+        ResponseHeader header;
+        if(!recvUntil(fd, (uchar *)&header, sizeof(header), status) || header.magic != PROTOCOL_MAGIC) {
+            fail(fd, status);
+            return;
+        }
+        body.resize((size_t)header.boxCount * sizeof(WireBox) + header.payloadSize);
+        if(!recvUntil(fd, body.data(), body.size(), status)) {
+            fail(fd, status);
+            return;
+        }
+        std::shared_ptr<PendingRequest> request;
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if(_inFlight.empty()) {
+                spdlog::error("Reply without a request, closing the connection.");
+                request = nullptr;
+            }
+            else {
+                request = _inFlight.front();
+                _inFlight.pop_front();
+            }
+        }
+        if(request == nullptr) {
+            fail(fd, STATUS_CLIENT_IO_ERROR);
+            return;
+        }
+
+        ImageResult result;
+        result.status = header.status;
+        if(header.sizePercent > 0)
+            result.sizePercent = header.sizePercent;
+        const WireBox *boxes = (const WireBox *)body.data();
+        for(uint32_t i = 0; i < header.boxCount; ++i) {
+            WireBox box = boxes[i];
+            box.x *= request->scaleX;
+            box.w *= request->scaleX;
+            box.y *= request->scaleY;
+            box.h *= request->scaleY;
+            result.boxes.push_back(box);
+        }
+        const uchar *payload = body.data() + header.boxCount * sizeof(WireBox);
+        if(header.flags & RESPONSE_FLAG_IMAGE_LIST) {
+            size_t pos = 0;
+            while(pos + sizeof(uint32_t) <= header.payloadSize) {
+                uint32_t length;
+                memcpy(&length, payload + pos, sizeof(length));
+                pos += sizeof(length);
+                if(pos + length > header.payloadSize)
+                    break;
+                result.images.push_back(cv::imdecode(cv::Mat(1, length, CV_8UC1, (void *)(payload + pos)), cv::IMREAD_COLOR));
+                pos += length;
+            }
+        }
+        else if(header.payloadSize > 0)
+            result.image = cv::imdecode(cv::Mat(1, header.payloadSize, CV_8UC1, (void *)payload), cv::IMREAD_COLOR);
+        _client->attemptDone(request, std::move(result));
+    }
+}
+
+void ClientConnection::fail(int fd, int status) {
+    std::deque<std::shared_ptr<PendingRequest>> failed;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        failed.swap(_inFlight);
+        if(_fd == fd)
+            _fd = -1;
+    }
+    ::close(fd);
+    // the head of the line timed out, the requests behind it only lost their connection
+    for(size_t i = 0; i < failed.size(); ++i) {
+        ImageResult result;
+        result.status = i == 0 ? status : STATUS_CLIENT_IO_ERROR;
+        _client->attemptDone(failed[i], std::move(result));
+    }
+}
+
+ImageClient::ImageClient(const ClientOptions &options)
+    : _options(options), _rng(std::random_device()()), _closing(false) {
+    if(_options.connections <= 0 || _options.pipelineDepth <= 0)
+        throw std::runtime_error("Connections and pipeline depth must be positive.");
+    for(int i = 0; i < _options.connections; ++i)
+        _pool.push_back(new ClientConnection(this));
+    _timer = std::thread(&ImageClient::timerLoop, this);
+}
+
+ImageClient::~ImageClient() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _closing = true;
+    }
+    _retryDue.notify_all();
+    _slotFree.notify_all();
+    _timer.join();
+    for(ClientConnection *connection : _pool)
+        delete connection;
+}
+
+std::shared_ptr<PendingRequest> ImageClient::prepare(const cv::Mat &img, const RequestOptions &options,
+    ResultCallback done, ClientConnection *pinned) {
+    std::shared_ptr<PendingRequest> request = std::make_shared<PendingRequest>();
+    request->attempts = 0;
+    request->done = done;
+    request->connection = nullptr;
+    request->pinned = pinned;
+
+    // the server resizes detection and generation anyway, the upload can be that small
+    cv::Mat upload = img;
+    cv::Size serverSize = img.size();
+    bool fixedSize = options.taskMode == IMAGE_DETECTION || options.taskMode == IMAGE_GENERATION;
+    if(fixedSize) {
+        serverSize = options.size;
+        if(img.cols > serverSize.width || img.rows > serverSize.height)
+            cv::resize(img, upload, serverSize, 0, 0, cv::INTER_AREA);
+    }
+    else if(options.maxSide > 0 && std::max(img.cols, img.rows) > options.maxSide) {
+        double scale = double(options.maxSide) / std::max(img.cols, img.rows);
+        cv::resize(img, upload, cv::Size(), scale, scale, cv::INTER_AREA);
+        serverSize = upload.size();
+    }
+    request->scaleX = float(img.cols) / serverSize.width;
+    request->scaleY = float(img.rows) / serverSize.height;
+
+    std::vector<int> params;
+    if(options.codec == ".jpg" || options.codec == ".jpeg")
+        params = {cv::IMWRITE_JPEG_QUALITY, options.quality};
+    else if(options.codec == ".webp")
+        params = {cv::IMWRITE_WEBP_QUALITY, options.quality};
+    else if(options.codec == ".png")
+        params = {cv::IMWRITE_PNG_COMPRESSION, 1};  // the upload is sent once, favour speed
+    std::vector<uchar> payload;
+    if(!cv::imencode(options.codec, upload, payload, params))
+        throw std::runtime_error("Encode with " + options.codec + " failed.");
+
+    RequestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTOCOL_MAGIC;
+    header.payloadSize = payload.size();
+    header.taskMode = options.taskMode;
+    header.flags = options.flags;
+    header.priority = options.priority;
+    if(options.taskMode == IMAGE_GENERATION && options.minSizePercent > 0) {
+        header.flags |= FLAG_ADAPTIVE_SIZE;
+        header.minSizePercent = std::min(options.minSizePercent, 100);
+    }
+    else
+        header.chain = options.chain;
+    if(fixedSize) {
+        header.width = serverSize.width;
+        header.height = serverSize.height;
+    }
+    // the server drops what the client won't wait for
+    header.deadlineMs = options.deadlineMs > 0 ? options.deadlineMs : _options.requestTimeoutMs;
+    request->wire.resize(sizeof(header) + payload.size());
+    memcpy(request->wire.data(), &header, sizeof(header));
+    memcpy(request->wire.data() + sizeof(header), payload.data(), payload.size());
+    return request;
+}
+
+void ImageClient::dispatch(std::shared_ptr<PendingRequest> request) {
+    request->attempts++;
+    ClientConnection *connection = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _slotFree.wait(lock, [&]() {
+            if(_closing)
+                return true;
+            if(request->pinned != nullptr)
+                connection = request->pinned->inFlightCount < _options.pipelineDepth ? request->pinned : nullptr;
+            else
+                for(ClientConnection *candidate : _pool)
+                    if(candidate->inFlightCount < _options.pipelineDepth &&
+                        (connection == nullptr || candidate->inFlightCount < connection->inFlightCount))
+                        connection = candidate;
+            return connection != nullptr;
+        });
+        if(connection != nullptr)
+            connection->inFlightCount++;
+    }
+    if(connection == nullptr || !connection->send(request)) {
+        if(connection != nullptr) {
+            std::lock_guard<std::mutex> lock(_mtx);
+            connection->inFlightCount--;
+        }
+        request->connection = nullptr;
+        ImageResult result;
+        result.status = STATUS_CLIENT_IO_ERROR;
+        attemptDone(request, std::move(result));
+    }
+}
+
+void ImageClient::attemptDone(std::shared_ptr<PendingRequest> request, ImageResult result) {
+    result.attempts = request->attempts;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if(request->connection != nullptr)
+            request->connection->inFlightCount--;
+        request->connection = nullptr;
+        // stream frames are not retried, a late frame would arrive out of order
+        if(isRetryable(result.status) && request->pinned == nullptr &&
+            request->attempts <= _options.maxRetries && !_closing) {
+            // full jitter, clients failed together don't come back together
+            int cap = std::min(_options.retryMaxMs, _options.retryBaseMs << std::min(request->attempts - 1, 16));
+            int delayMs = std::uniform_int_distribution<int>(0, std::max(cap, 0))(_rng);
+            _retries.insert({Clock::now() + std::chrono::milliseconds(delayMs), request});
+            _retryDue.notify_one();
+            _slotFree.notify_all();
+            return;
+        }
+    }
+    _slotFree.notify_all();
+    request->done(std::move(result));
+}
+
+void ImageClient::timerLoop() {
+    std::unique_lock<std::mutex> lock(_mtx);
+    while(!_closing) {
+        if(_retries.empty()) {
+            _retryDue.wait(lock);
+            continue;
+        }
+        auto due = _retries.begin();
+        if(Clock::now() < due->first) {
+            _retryDue.wait_until(lock, due->first);
+            continue;
+        }
+        std::shared_ptr<PendingRequest> request = due->second;
+        _retries.erase(due);
+        lock.unlock();
+        dispatch(request);
+        lock.lock();
+    }
+    // closing, the waiting retries end with their last error
+    std::multimap<Clock::time_point, std::shared_ptr<PendingRequest>> retries;
+    retries.swap(_retries);
+    lock.unlock();
+    for(auto &retry : retries) {
+        ImageResult result;
+        result.status = STATUS_CLIENT_IO_ERROR;
+        result.attempts = retry.second->attempts;
+        retry.second->done(std::move(result));
+    }
+}
+
+void ImageClient::submit(const cv::Mat &img, const RequestOptions &options, ResultCallback done) {
+    dispatch(prepare(img, options, done, nullptr));
+}
+
+std::future<ImageResult> ImageClient::submit(const cv::Mat &img, const RequestOptions &options) {
+    std::shared_ptr<std::promise<ImageResult>> promise = std::make_shared<std::promise<ImageResult>>();
+    submit(img, options, [promise](ImageResult result) { promise->set_value(std::move(result)); });
+    return promise->get_future();
+}
+
+std::unique_ptr<ImageStream> ImageClient::openStream() {
+    return std::unique_ptr<ImageStream>(new ImageStream(this));
+}
+
+void ImageStream::submit(const cv::Mat &img, const RequestOptions &options, ResultCallback done) {
+    _client->dispatch(_client->prepare(img, options, done, &_connection));
+}
+
+std::future<ImageResult> ImageStream::submit(const cv::Mat &img, const RequestOptions &options) {
+    std::shared_ptr<std::promise<ImageResult>> promise = std::make_shared<std::promise<ImageResult>>();
+    submit(img, options, [promise](ImageResult result) { promise->set_value(std::move(result)); });
+    return promise->get_future();
+}
@@ -0,0 +1,175 @@
+/*ImageClient is the client library of the image server. Requests are
+  submitted asynchronously and completed through a callback or a future.
+
+  The client keeps a pool of connections and pipelines several requests on
+  each: the server answers the requests of one connection in order, so the
+  replies are matched to the requests in the order they were sent. A new
+  request goes to the pooled connection with the fewest requests in flight,
+  and submit blocks while every connection is at the pipelining depth.
+
+  Before the upload the image is shrunk to what the server will work on:
+  detection and generation are resized to the processing size on the server
+  anyway, tracking and chains can be capped by a longest side. It is then
+  encoded with the chosen codec. Boxes in the result are mapped back to the
+  coordinates of the submitted image.
+
+  An attempt fails on an IO error, on a timeout or when the server is
+  overloaded; it is retried after a backoff with full jitter. A timed out
+  request blocks the replies behind it, so its connection is closed and the
+  requests pipelined on it are retried too.
+
+  Tracking and motion-gated frames keep state in their server connection.
+  They are sent on an ImageStream, a connection of their own.*/
+#ifndef IMAGECLIENT_HPP
+#define IMAGECLIENT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "../server/Protocol.hpp"
+
+// client side results, next to the server's ResponseStatus
+const int STATUS_CLIENT_IO_ERROR = -1;
+const int STATUS_CLIENT_TIMEOUT = -2;
+
+const int CLIENT_IO_SLICE_MS = 100;     // how often a waiting reader checks for timeouts
+
+struct ClientOptions {
+    std::string host = "127.0.0.1";
+    int port = 5001;
+    int connections = 4;
+    int pipelineDepth = 4;          // requests in flight on one connection
+    int connectTimeoutMs = 1000;
+    int requestTimeoutMs = 30000;   // one attempt, 0 waits forever
+    int maxRetries = 2;
+    int retryBaseMs = 50;           // the backoff doubles from here per attempt
+    int retryMaxMs = 2000;
+};
+
+struct RequestOptions {
+    TaskMode taskMode = IMAGE_DETECTION;
+    uint8_t flags = 0;
+    uint8_t priority = PRIORITY_DEFAULT;
+    uint8_t chain = 0;
+    cv::Size size = cv::Size(512, 512); // detection and generation run at this size
+    // generation: under load the server may go down to this percent of size, 0 disables
+    int minSizePercent = 0;
+    int maxSide = 0;                // tracking and chains: longest uploaded side, 0 keeps the image
+    uint32_t deadlineMs = 0;        // server side, 0 uses the request timeout
+    // ".jpg" is a fraction of ".png" for camera frames, ".png" sends the exact pixels
+    std::string codec = ".jpg";
+    int quality = 90;
+};
+
+struct ImageResult {
+    int status = STATUS_CLIENT_IO_ERROR;    // ResponseStatus or STATUS_CLIENT_*
+    int attempts = 0;
+    std::vector<WireBox> boxes;     // in the coordinates of the submitted image
+    cv::Mat image;                  // at the server's processing size
+    int sizePercent = 100;          // of the requested size, the generation was adapted to load
+    std::vector<cv::Mat> images;    // replies with RESPONSE_FLAG_IMAGE_LIST
+};
+
+typedef std::function<void(ImageResult)> ResultCallback;
+
+class ImageClient;
+
+// one request with everything needed to send it again
+struct PendingRequest {
+    std::vector<uchar> wire;        // header and payload
+    float scaleX;                   // server coordinates to the submitted image
+    float scaleY;
+    int attempts;
+    std::chrono::steady_clock::time_point deadline;     // of the current attempt
+    ResultCallback done;
+    class ClientConnection *connection;     // of the current attempt
+    class ClientConnection *pinned;         // the stream connection, nullptr for the pool
+};
+
+class ClientConnection {
+    private:
+        ImageClient *_client;
+        std::mutex _mtx;            // guards the members below, held while sending
+        int _fd;
+        std::deque<std::shared_ptr<PendingRequest>> _inFlight;
+        std::condition_variable _connected;
+        std::thread _reader;        // reads the replies of one socket after the other
+        bool _closing;
+
+        bool connectServer();
+        void readLoop();
+        void readReplies(int fd);
+        // fails every request in flight on fd and drops the connection
+        void fail(int fd, int status);
+        bool recvUntil(int fd, uchar *buf, size_t nbBytes, int &status);
+    public:
+        int inFlightCount;          // guarded by the client's mutex
+
+        ClientConnection(ImageClient *client);
+        ~ClientConnection();
+        // connects on first use, false when the server can't be reached
+        bool send(std::shared_ptr<PendingRequest> request);
+        void close();
+};
+
+class ImageStream;
+
+class ImageClient {
+    friend class ClientConnection;
+    friend class ImageStream;
+    private:
+        ClientOptions _options;
+        std::vector<ClientConnection *> _pool;
+        std::mutex _mtx;            // guards the in flight counts and the retries
+        std::condition_variable _slotFree;
+        std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<PendingRequest>> _retries;
+        std::condition_variable _retryDue;
+        std::thread _timer;
+        std::mt19937 _rng;
+        bool _closing;
+
+        std::shared_ptr<PendingRequest> prepare(const cv::Mat &img, const RequestOptions &options,
+            ResultCallback done, ClientConnection *pinned);
+        void dispatch(std::shared_ptr<PendingRequest> request);
+        // called by a connection when an attempt ended
+        void attemptDone(std::shared_ptr<PendingRequest> request, ImageResult result);
+        void timerLoop();
+    public:
+        ImageClient(const ClientOptions &options = ClientOptions());
+        // fails what is still in flight
+        ~ImageClient();
+
+        void submit(const cv::Mat &img, const RequestOptions &options, ResultCallback done);
+        std::future<ImageResult> submit(const cv::Mat &img, const RequestOptions &options);
+        ImageResult process(const cv::Mat &img, const RequestOptions &options) { return submit(img, options).get(); }
+        // a connection of its own for a tracking or motion-gated stream
+        std::unique_ptr<ImageStream> openStream();
+        const ClientOptions& getOptions() const { return _options; }
+};
+
+// frames of one stream, sent in order on one connection. A stream is
+// destroyed before its client
+class ImageStream {
+    friend class ImageClient;
+    private:
+        ImageClient *_client;
+        ClientConnection _connection;
+
+        ImageStream(ImageClient *client) : _client(client), _connection(client) {}
+    public:
+        void submit(const cv::Mat &img, const RequestOptions &options, ResultCallback done);
+        std::future<ImageResult> submit(const cv::Mat &img, const RequestOptions &options);
+};
+
+#endif
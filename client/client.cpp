@@ -1,144 +1,121 @@
+/*Sends an image, or the frames of a video, to the server through the
+  client library (ImageClient.hpp) and writes what comes back.
+
+  An image is processed once and the reply is written to --out. A video is
+  sent as one stream: tracking and motion-gated frames need their own
+  connection, and the frames are pipelined on it, so the upload of the
+  next frames overlaps the processing of the current one.
+
+  usage:
+    client [image] [--host 127.0.0.1] [--port 5001]
+           [--mode detection|generation|tracking|chain] [--chain 0]
+           [--codec .jpg|.png|.webp] [--quality 90] [--out ./image/recv.png]
+    client --video file [--mode tracking] [--depth 4] ...
+*/
 #include <iostream>
 #include <string>
 #include <vector>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
+#include <deque>
+#include <chrono>
 #include <opencv2/opencv.hpp>
 #include <spdlog/spdlog.h>
-
-template <typename dataType>
-bool recvAll(int sockfd, dataType *buf, size_t fileSize) {
-    while (fileSize > 0)
-    {
-        ssize_t readbytes = recv(sockfd, buf, fileSize, 0);
-        if(readbytes == -1){
-            if(errno == EAGAIN || errno == EWOULDBLOCK)
-                continue;
-            else
-                false;
+#include "ImageClient.hpp"
+
+const char *MODE_NAMES[] = {"detection", "generation", "tracking", "chain"};
+const int MODE_NUMS = 4;
+
+struct ClientConfig {
+    std::string image = "./image/selfie.png";
+    std::string video;
+    std::string out = "./image/recv.png";
+    ClientOptions client;
+    RequestOptions request;
+};
+
+static ClientConfig parseArgs(int argc, char *argv[]) {
+    ClientConfig config;
+    config.request.taskMode = IMAGE_GENERATION;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg.compare(0, 2, "--") != 0) {
+            config.image = arg;
+            continue;
         }
-        fileSize -= readbytes;
-        buf += readbytes;
-    }
-    return true;
-}
-
-template <typename dataType>
-bool sendAll(int sockfd, const dataType *buf, size_t fileSize) {
-    while (fileSize > 0)
-    {
-        ssize_t sendBytes= send(sockfd, buf, fileSize, 0);
-        if(sendBytes == -1)
-            return false;
-        fileSize -= sendBytes;
-        buf += sendBytes;
+        if(i + 1 >= argc)
+            throw std::runtime_error("Missing value of " + arg);
+        std::string value = argv[++i];
+        if(arg == "--host") config.client.host = value;
+        else if(arg == "--port") config.client.port = std::stoi(value);
+        else if(arg == "--video") config.video = value;
+        else if(arg == "--out") config.out = value;
+        else if(arg == "--codec") config.request.codec = value;
+        else if(arg == "--quality") config.request.quality = std::stoi(value);
+        else if(arg == "--chain") config.request.chain = std::stoi(value);
+        else if(arg == "--depth") config.client.pipelineDepth = std::stoi(value);
+        else if(arg == "--mode") {
+            int mode = std::find(MODE_NAMES, MODE_NAMES + MODE_NUMS, value) - MODE_NAMES;
+            if(mode == MODE_NUMS)
+                throw std::runtime_error("Unknown mode " + value);
+            config.request.taskMode = (TaskMode)mode;
+        }
+        else
+            throw std::runtime_error("Unknown option " + arg);
     }
-    return true;
+    return config;
 }
 
-int main() {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd == -1)
-        throw std::runtime_error("Create client socket error.");
-    struct sockaddr_in serverAddr;
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_port = htons(5001);
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if(connect(sockfd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
-        throw std::runtime_error("Connect error.");
-    std::cout << "Successfully connected to the server." << std::endl;
-
-    cv::Mat image = cv::imread("./image/selfie.png", cv::IMREAD_COLOR);
-    std::vector<uchar> encode_data;
-    cv::imencode(".png", image, encode_data);
-    std::string str_encode(encode_data.begin(), encode_data.end());
-
-    int length = str_encode.size();
-    if(send(sockfd , &length, sizeof(int), 0) <= 0)
-        spdlog::error("Send image length failed.");
-
-    if(sendAll(sockfd, str_encode.c_str(), str_encode.size()))
-        spdlog::info("Send image successful.");
-    else
-        spdlog::info("Send image failed.");
-
-    // receive the size of image byte stream
-    int image_size = 0;
-    recv(sockfd, &image_size, sizeof(int), 0);
-    spdlog::info("Recevied image size : {}", image_size);
-
-    // receive the image byte stream
-    uchar buf[image_size];
-    memset(buf, 0, image_size);
-    recvAll(sockfd, buf, image_size);
-    std::vector<uchar> encode(buf, buf + sizeof(buf) / sizeof(buf[0]));
-    image = cv::imdecode(encode, cv::IMREAD_COLOR);
+static int processImage(ImageClient &client, const ClientConfig &config) {
+    cv::Mat image = cv::imread(config.image, cv::IMREAD_COLOR);
     if(image.empty())
-        spdlog::error("Image decode error! Maybe receive image failed.");
-    cv::imwrite("./image/recv.png", image);
-
-    close(sockfd);
+        throw std::runtime_error("Can't read " + config.image);
+    ImageResult result = client.process(image, config.request);
+    if(result.status != STATUS_OK) {
+        spdlog::error("Request failed with status {} after {} attempts.", result.status, result.attempts);
+        return 1;
+    }
+    for(const WireBox &box : result.boxes)
+        spdlog::info("Box at ({}, {}) size {}x{} confidence {:.2f}", box.x, box.y, box.w, box.h, box.confidence);
+    if(!result.image.empty())
+        cv::imwrite(config.out, result.image);
+    for(size_t i = 0; i < result.images.size(); ++i)
+        cv::imwrite(config.out + "." + std::to_string(i) + ".png", result.images[i]);
     return 0;
 }
 
-// int main() {
-//     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-//     if(sockfd == -1)
-//         throw std::runtime_error("Create client socket error.");
-//     struct sockaddr_in serverAddr;
-//     memset(&serverAddr, 0, sizeof(serverAddr));
-//     serverAddr.sin_port = htons(5001);
-//     serverAddr.sin_family = AF_INET;
-//     serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-//     if(connect(sockfd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
-//         throw std::runtime_error("Connect error.");
-//     std::cout << "Successfully connected to the server." << std::endl;
-
-//     cv::VideoCapture cap("./image/multi_face.avi");
-//     if (!cap.isOpened()) {
-//         std::cout << "Something Wrong with the Camera!!" << std::endl;
-//         return -1;
-//     }
-//     cv::namedWindow("output",0);
-
-//     cv::Mat frame;
-//     while (true) {
-//         clock_t start_time = clock();
-//         cap.read(frame);
-//         // 图像数据转换为字符串并发送给客户端
-//         std::vector<uchar> encode_data;
-//         cv::imencode(".png", frame, encode_data);
-//         std::string str_encode(encode_data.begin(), encode_data.end());
-
-//         int length = str_encode.size();
-//         send(sockfd , &length, sizeof(int), 0);
-//         if(sendAll(sockfd, str_encode.c_str(), str_encode.size()))
-//             spdlog::info("Send image successful.");
-//         else 
-//             spdlog::info("Send image failed.");
-
-//         // receive the size of image byte stream
-//         int image_size = 0;
-//         recv(sockfd, &image_size, sizeof(int), 0);
-//         spdlog::info("Recevied image size : {}", image_size);
-
-//         // receive the image byte stream
-//         uchar buf[image_size];
-//         memset(buf, 0, image_size);
-//         recvAll(sockfd, buf, image_size);
-//         std::vector<uchar> encode(buf, buf + sizeof(buf) / sizeof(buf[0]));
-//         frame = cv::imdecode(encode, cv::IMREAD_COLOR);
-//         clock_t end_time = clock();
-//         double duration = double(end_time - start_time) / CLOCKS_PER_SEC * 1000;
-//         std::cout << "程序执行时间：" << duration << " 毫秒" << std::endl;
-//         cv::imshow("output", frame); 
-//         cv::waitKey(1);
-//     }
+static int processVideo(ImageClient &client, const ClientConfig &config) {
+    cv::VideoCapture capture(config.video);
+    if(!capture.isOpened())
+        throw std::runtime_error("Can't open " + config.video);
+    std::unique_ptr<ImageStream> stream = client.openStream();
+    std::deque<std::future<ImageResult>> pending;
+    size_t frames = 0, failed = 0;
+    auto start = std::chrono::steady_clock::now();
+    cv::Mat frame;
+    // the stream blocks at the pipelining depth, the oldest reply is due first
+    while(capture.read(frame)) {
+        pending.push_back(stream->submit(frame, config.request));
+        while(pending.size() > (size_t)config.client.pipelineDepth ||
+            (!pending.empty() && pending.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+            failed += pending.front().get().status != STATUS_OK;
+            pending.pop_front();
+            frames++;
+        }
+    }
+    for(; !pending.empty(); pending.pop_front(), frames++)
+        failed += pending.front().get().status != STATUS_OK;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    spdlog::info("{} frames in {:.1f}s, {:.1f} fps, {} failed.", frames, seconds, frames / seconds, failed);
+    return failed > 0;
+}
 
-//     close(sockfd); // guanbi de shi hou ye hui fa chu xinhao
-//     return 0;
-// }
\ No newline at end of file
+int main(int argc, char *argv[]) {
+    try {
+        ClientConfig config = parseArgs(argc, argv);
+        ImageClient client(config.client);
+        return config.video.empty() ? processImage(client, config) : processVideo(client, config);
+    }
+    catch(std::exception &err) {
+        spdlog::error(err.what());
+        return 1;
+    }
+}
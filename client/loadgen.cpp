@@ -0,0 +1,450 @@
+/*Load generator for the image server. Every connection runs on its own
+  thread and keeps one request in flight, the server handles the requests of
+  a connection one at a time anyway.
+
+  closed loop: a connection sends its next request as soon as the reply
+      arrives, this measures the capacity at the given concurrency.
+  open loop: requests are scheduled by a Poisson process of --rate requests
+      per second over all connections. Latency is measured from the time a
+      request was scheduled, not from the time it could be sent, so a
+      stalled server can't hide its queueing delay by holding the client
+      back (coordinated omission). The uncorrected latency is reported too.
+
+  usage:
+    loadgen [--host 127.0.0.1] [--port 5001] [--connections 8]
+            [--mode closed|open] [--rate 50] [--duration 30] [--warmup 5]
+            [--images dir | --video file] [--max-frames 300]
+            [--mix detection=3,generation=1,tracking=0,chain=0] [--chain 0] [--size 512x512]
+            [--deadline ms] [--boxes-only] [--adaptive 50] [--seed 1] [--json out.json]
+*/
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+#include <spdlog/spdlog.h>
+#include "../server/Protocol.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+const int MAX_CORPUS_FRAMES = 300;
+const double PERCENTILES[] = {50, 90, 99, 99.9};
+const char *TASK_NAMES[] = {"detection", "generation", "tracking", "chain"};
+const int TASK_NUMS = 4;
+
+struct LoadConfig {
+    std::string host = "127.0.0.1";
+    int port = 5001;
+    int connections = 8;
+    bool openLoop = false;
+    double rate = 50;           // open loop requests per second, all connections together
+    double duration = 30;
+    double warmup = 5;          // seconds excluded from the report
+    std::string imageDir;
+    std::string video;
+    int maxFrames = MAX_CORPUS_FRAMES;
+    double mix[TASK_NUMS] = {1, 0, 0, 0};
+    int chain = 0;              // chain id of the chain requests
+    int minSizePercent = 0;     // generation may be scaled down to it under load, 0 disables
+    int width = 0;
+    int height = 0;
+    uint32_t deadlineMs = 0;
+    bool boxesOnly = false;
+    uint64_t seed = 1;
+    std::string jsonFile;
+};
+
+// what one connection measured after the warmup
+struct ConnStats {
+    std::vector<uint64_t> latencyUs;        // from the scheduled start
+    std::vector<uint64_t> serviceUs;        // from the actual send
+    uint64_t statusCount[RESPONSE_STATUS_NUMS] = {0};
+    uint64_t taskCount[TASK_NUMS] = {0};
+    uint64_t ioErrors = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesRecv = 0;
+    uint64_t adaptedCount = 0;              // generation replies with a size percent
+    uint64_t sizePercentSum = 0;
+};
+
+template <typename dataType>
+bool recvAll(int sockfd, dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t readbytes = recv(sockfd, buf, fileSize, 0);
+        if(readbytes == 0)
+            return false;
+        if(readbytes == -1){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= readbytes;
+        buf += readbytes;
+    }
+    return true;
+}
+
+template <typename dataType>
+bool sendAll(int sockfd, const dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t sendBytes = send(sockfd, buf, fileSize, MSG_NOSIGNAL);
+        if(sendBytes == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= sendBytes;
+        buf += sendBytes;
+    }
+    return true;
+}
+
+static int connectServer(const LoadConfig &config) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd == -1)
+        return -1;
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_port = htons(config.port);
+    serverAddr.sin_family = AF_INET;
+    if(inet_pton(AF_INET, config.host.c_str(), &serverAddr.sin_addr) != 1 ||
+        connect(sockfd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sockfd;
+}
+
+// the corpus is encoded once up front so the client doesn't compete with the server for CPU
+static std::vector<std::vector<uchar>> loadCorpus(const LoadConfig &config) {
+    std::vector<std::vector<uchar>> corpus;
+    if(!config.video.empty()) {
+        cv::VideoCapture cap(config.video);
+        if(!cap.isOpened())
+            throw std::runtime_error("Open video " + config.video + " failed.");
+        cv::Mat frame;
+        while((int)corpus.size() < config.maxFrames && cap.read(frame)) {
+            corpus.emplace_back();
+            cv::imencode(".png", frame, corpus.back());
+        }
+    }
+    else {
+        std::string dir = config.imageDir.empty() ? "./images" : config.imageDir;
+        DIR *dirp = opendir(dir.c_str());
+        if(dirp == nullptr)
+            throw std::runtime_error("Open image directory " + dir + " failed.");
+        std::vector<std::string> files;
+        while(struct dirent *entry = readdir(dirp)) {
+            std::string name = entry->d_name;
+            size_t dot = name.find_last_of('.');
+            std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+            if(ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".bmp")
+                files.push_back(dir + "/" + name);
+        }
+        closedir(dirp);
+        // a fixed order keeps runs reproducible
+        std::sort(files.begin(), files.end());
+        for(const std::string &file : files) {
+            if((int)corpus.size() >= config.maxFrames)
+                break;
+            cv::Mat image = cv::imread(file, cv::IMREAD_COLOR);
+            if(image.empty()) {
+                spdlog::warn("Skip unreadable image {}", file);
+                continue;
+            }
+            corpus.emplace_back();
+            cv::imencode(".png", image, corpus.back());
+        }
+    }
+    if(corpus.empty())
+        throw std::runtime_error("The corpus is empty.");
+    return corpus;
+}
+
+static void runConnection(const LoadConfig &config, const std::vector<std::vector<uchar>> &corpus,
+    int connId, Clock::time_point start, ConnStats &stats, std::atomic<uint64_t> &completed) {
+    int sockfd = connectServer(config);
+    if(sockfd == -1) {
+        spdlog::error("Connection {} failed to connect.", connId);
+        stats.ioErrors++;
+        return;
+    }
+    std::mt19937_64 rng(config.seed * 1000003 + connId);
+    std::discrete_distribution<int> pickTask(config.mix, config.mix + TASK_NUMS);
+    // superposed Poisson processes of rate/N per connection form one of the full rate
+    std::exponential_distribution<double> gap(config.rate / config.connections);
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.warmup + config.duration));
+    Clock::time_point measureFrom = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.warmup));
+
+    // spread the connections over the corpus, a video is walked in order for tracking
+    size_t frame = config.video.empty() ? connId % corpus.size() : 0;
+    Clock::time_point scheduled = start;
+    std::vector<uchar> reply;
+    while(true) {
+        if(config.openLoop) {
+            scheduled += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(gap(rng)));
+            if(scheduled >= end)
+                break;
+            std::this_thread::sleep_until(scheduled);
+        }
+        else {
+            scheduled = Clock::now();
+            if(scheduled >= end)
+                break;
+        }
+
+        const std::vector<uchar> &payload = corpus[frame];
+        frame = (frame + 1) % corpus.size();
+        int task = pickTask(rng);
+        RequestHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = PROTOCOL_MAGIC;
+        header.payloadSize = payload.size();
+        header.taskMode = task;
+        header.flags = config.boxesOnly ? FLAG_BOXES_ONLY : 0;
+        header.width = config.width;
+        header.height = config.height;
+        header.deadlineMs = config.deadlineMs;
+        header.chain = task == IMAGE_CHAIN ? config.chain : 0;
+        if(task == IMAGE_GENERATION && config.minSizePercent > 0) {
+            header.flags |= FLAG_ADAPTIVE_SIZE;
+            header.minSizePercent = config.minSizePercent;
+        }
+
+        Clock::time_point sent = Clock::now();
+        ResponseHeader response;
+        bool ok = sendAll(sockfd, (const uchar *)&header, sizeof(header)) &&
+            sendAll(sockfd, payload.data(), payload.size()) &&
+            recvAll(sockfd, (uchar *)&response, sizeof(response)) &&
+            response.magic == PROTOCOL_MAGIC;
+        if(ok) {
+            reply.resize(response.boxCount * sizeof(WireBox) + response.payloadSize);
+            ok = recvAll(sockfd, reply.data(), reply.size());
+        }
+        Clock::time_point done = Clock::now();
+        if(!ok) {
+            spdlog::error("Connection {} lost, stop it.", connId);
+            stats.ioErrors++;
+            break;
+        }
+        completed++;
+        if(scheduled < measureFrom)
+            continue;
+        stats.latencyUs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(done - scheduled).count());
+        stats.serviceUs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(done - sent).count());
+        if(response.status < RESPONSE_STATUS_NUMS)
+            stats.statusCount[response.status]++;
+        stats.taskCount[task]++;
+        if(response.sizePercent > 0) {
+            stats.adaptedCount++;
+            stats.sizePercentSum += response.sizePercent;
+        }
+        stats.bytesSent += sizeof(header) + payload.size();
+        stats.bytesRecv += sizeof(response) + reply.size();
+    }
+    close(sockfd);
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if(sorted.empty())
+        return 0;
+    size_t rank = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[rank];
+}
+
+static std::string latencyJson(const std::vector<uint64_t> &sorted) {
+    std::string json = "{";
+    for(double p : PERCENTILES)
+        json += fmt::format("\"p{}\": {:.3f}, ", p, percentile(sorted, p) / 1000.0);
+    json += fmt::format("\"max\": {:.3f}}}", sorted.empty() ? 0.0 : sorted.back() / 1000.0);
+    return json;
+}
+
+static void printLatency(const char *name, const std::vector<uint64_t> &sorted) {
+    std::string line = fmt::format("  {:<22}", name);
+    for(double p : PERCENTILES)
+        line += fmt::format("p{:<5} {:>9.2f} ms  ", p, percentile(sorted, p) / 1000.0);
+    line += fmt::format("max {:>9.2f} ms", sorted.empty() ? 0.0 : sorted.back() / 1000.0);
+    std::cout << line << std::endl;
+}
+
+static void report(const LoadConfig &config, const std::vector<ConnStats> &conns) {
+    ConnStats total;
+    for(const ConnStats &stats : conns) {
+        total.latencyUs.insert(total.latencyUs.end(), stats.latencyUs.begin(), stats.latencyUs.end());
+        total.serviceUs.insert(total.serviceUs.end(), stats.serviceUs.begin(), stats.serviceUs.end());
+        for(int i = 0; i < RESPONSE_STATUS_NUMS; ++i)
+            total.statusCount[i] += stats.statusCount[i];
+        for(int i = 0; i < TASK_NUMS; ++i)
+            total.taskCount[i] += stats.taskCount[i];
+        total.ioErrors += stats.ioErrors;
+        total.bytesSent += stats.bytesSent;
+        total.bytesRecv += stats.bytesRecv;
+        total.adaptedCount += stats.adaptedCount;
+        total.sizePercentSum += stats.sizePercentSum;
+    }
+    std::sort(total.latencyUs.begin(), total.latencyUs.end());
+    std::sort(total.serviceUs.begin(), total.serviceUs.end());
+    double throughput = total.latencyUs.size() / config.duration;
+    double goodput = total.statusCount[STATUS_OK] / config.duration;
+
+    std::cout << fmt::format("{} loop, {} connections, {:.0f} s measured after {:.0f} s warmup",
+        config.openLoop ? "open" : "closed", config.connections, config.duration, config.warmup);
+    if(config.openLoop)
+        std::cout << fmt::format(", offered {:.1f} req/s", config.rate);
+    std::cout << std::endl;
+    std::cout << fmt::format("  requests {}  throughput {:.1f} req/s  ok {:.1f} req/s  io errors {}",
+        total.latencyUs.size(), throughput, goodput, total.ioErrors) << std::endl;
+    std::string statusLine = "  status";
+    for(int i = 0; i < RESPONSE_STATUS_NUMS; ++i)
+        statusLine += fmt::format("  {} {}", RESPONSE_STATUS_NAMES[i], total.statusCount[i]);
+    std::cout << statusLine << std::endl;
+    if(total.adaptedCount > 0)
+        std::cout << fmt::format("  generation size {:.1f}% of requested on average",
+            double(total.sizePercentSum) / total.adaptedCount) << std::endl;
+    printLatency(config.openLoop ? "latency (corrected)" : "latency", total.latencyUs);
+    if(config.openLoop)
+        printLatency("latency (uncorrected)", total.serviceUs);
+
+    if(config.jsonFile.empty())
+        return;
+    std::string json = "{\n";
+    json += fmt::format("  \"mode\": \"{}\",\n", config.openLoop ? "open" : "closed");
+    json += fmt::format("  \"connections\": {},\n", config.connections);
+    json += fmt::format("  \"offered_rate\": {},\n", config.openLoop ? config.rate : 0);
+    json += fmt::format("  \"duration_s\": {},\n", config.duration);
+    json += fmt::format("  \"warmup_s\": {},\n", config.warmup);
+    json += fmt::format("  \"seed\": {},\n", config.seed);
+    json += fmt::format("  \"requests\": {},\n", total.latencyUs.size());
+    json += fmt::format("  \"throughput_rps\": {:.3f},\n", throughput);
+    json += fmt::format("  \"ok_rps\": {:.3f},\n", goodput);
+    json += fmt::format("  \"io_errors\": {},\n", total.ioErrors);
+    json += fmt::format("  \"bytes_sent\": {},\n", total.bytesSent);
+    json += fmt::format("  \"bytes_received\": {},\n", total.bytesRecv);
+    json += "  \"tasks\": {";
+    for(int i = 0; i < TASK_NUMS; ++i)
+        json += fmt::format("{}\"{}\": {}", i ? ", " : "", TASK_NAMES[i], total.taskCount[i]);
+    json += "},\n  \"status\": {";
+    for(int i = 0; i < RESPONSE_STATUS_NUMS; ++i)
+        json += fmt::format("{}\"{}\": {}", i ? ", " : "", RESPONSE_STATUS_NAMES[i], total.statusCount[i]);
+    json += "},\n";
+    json += "  \"latency_ms\": " + latencyJson(total.latencyUs) + ",\n";
+    json += "  \"uncorrected_latency_ms\": " + latencyJson(total.serviceUs) + "\n}\n";
+    std::ofstream out(config.jsonFile);
+    out << json;
+    if(!out)
+        spdlog::error("Write report {} failed.", config.jsonFile);
+}
+
+static void parseMix(const std::string &value, LoadConfig &config) {
+    std::fill(config.mix, config.mix + TASK_NUMS, 0);
+    size_t pos = 0;
+    while(pos < value.size()) {
+        size_t comma = value.find(',', pos);
+        std::string item = value.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        double weight = eq == std::string::npos ? 1 : std::stod(item.substr(eq + 1));
+        int task = std::find(TASK_NAMES, TASK_NAMES + TASK_NUMS, name) - TASK_NAMES;
+        if(task == TASK_NUMS)
+            throw std::runtime_error("Unknown task " + name);
+        config.mix[task] = weight;
+        if(comma == std::string::npos)
+            break;
+        pos = comma + 1;
+    }
+}
+
+static LoadConfig parseArgs(int argc, char *argv[]) {
+    LoadConfig config;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg == "--boxes-only") {
+            config.boxesOnly = true;
+            continue;
+        }
+        if(i + 1 >= argc)
+            throw std::runtime_error("Missing value of " + arg);
+        std::string value = argv[++i];
+        if(arg == "--host") config.host = value;
+        else if(arg == "--port") config.port = std::stoi(value);
+        else if(arg == "--connections") config.connections = std::stoi(value);
+        else if(arg == "--mode") config.openLoop = value == "open";
+        else if(arg == "--rate") config.rate = std::stod(value);
+        else if(arg == "--duration") config.duration = std::stod(value);
+        else if(arg == "--warmup") config.warmup = std::stod(value);
+        else if(arg == "--images") config.imageDir = value;
+        else if(arg == "--video") config.video = value;
+        else if(arg == "--max-frames") config.maxFrames = std::stoi(value);
+        else if(arg == "--mix") parseMix(value, config);
+        else if(arg == "--size") {
+            if(sscanf(value.c_str(), "%dx%d", &config.width, &config.height) != 2)
+                throw std::runtime_error("Size must look like 512x512");
+        }
+        else if(arg == "--chain") config.chain = std::stoi(value);
+        else if(arg == "--adaptive") config.minSizePercent = std::stoi(value);
+        else if(arg == "--deadline") config.deadlineMs = std::stoul(value);
+        else if(arg == "--seed") config.seed = std::stoull(value);
+        else if(arg == "--json") config.jsonFile = value;
+        else
+            throw std::runtime_error("Unknown option " + arg);
+    }
+    if(config.connections <= 0 || config.duration <= 0 || (config.openLoop && config.rate <= 0))
+        throw std::runtime_error("Connections, duration and rate must be positive.");
+    return config;
+}
+
+int main(int argc, char *argv[]) {
+    LoadConfig config;
+    std::vector<std::vector<uchar>> corpus;
+    try {
+        config = parseArgs(argc, argv);
+        corpus = loadCorpus(config);
+    }
+    catch(std::exception &err) {
+        spdlog::error(err.what());
+        return 1;
+    }
+    spdlog::info("Loaded {} frames, start {} connections.", corpus.size(), config.connections);
+
+    std::vector<ConnStats> conns(config.connections);
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> completed(0);
+    Clock::time_point start = Clock::now();
+    for(int i = 0; i < config.connections; ++i)
+        threads.emplace_back(runConnection, std::cref(config), std::cref(corpus), i, start,
+            std::ref(conns[i]), std::ref(completed));
+
+    // progress once a second until the run is over
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.warmup + config.duration));
+    uint64_t lastCompleted = 0;
+    while(Clock::now() < end) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t now = completed.load();
+        spdlog::info("{} req/s", now - lastCompleted);
+        lastCompleted = now;
+    }
+    for(std::thread &thread : threads)
+        thread.join();
+
+    report(config, conns);
+    return 0;
+}
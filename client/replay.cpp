@@ -0,0 +1,330 @@
+/*Replays a traffic capture of the server (IMAGESERVER_CAPTURE, see
+  server/CaptureFormat.hpp) against a server. Every captured connection is
+  replayed on its own connection and keeps its request order, so tracking
+  and motion-gated streams see their frames in sequence.
+
+  --speed 1 replays at the captured pace, --speed N N times faster and
+  --speed 0 as fast as possible (each connection sends the next request
+  when the reply arrives). With a pace, latency is measured from the time
+  the request was due, so a slow server can't hide its queueing delay.
+
+  --save writes the latency of every request as CSV, --baseline compares
+  against such a file of an earlier run request by request.
+
+  usage:
+    replay capture.bin [--host 127.0.0.1] [--port 5001] [--speed 1]
+           [--limit N] [--save run.csv] [--baseline base.csv]
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string.h>
+#include <spdlog/spdlog.h>
+#include "../server/CaptureFormat.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+const double PERCENTILES[] = {50, 90, 99, 99.9};
+const int STATUS_IO_ERROR = -1;
+
+struct ReplayConfig {
+    std::string capture;
+    std::string host = "127.0.0.1";
+    int port = 5001;
+    double speed = 1;
+    size_t limit = 0;           // 0 replays the whole capture
+    std::string saveFile;
+    std::string baselineFile;
+};
+
+struct CapturedRequest {
+    CaptureRecord record;
+    std::vector<uint8_t> payload;
+};
+
+struct ReplayResult {
+    int64_t latencyUs = -1;     // -1 when the request was not answered
+    int status = STATUS_IO_ERROR;
+};
+
+template <typename dataType>
+bool recvAll(int sockfd, dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t readbytes = recv(sockfd, buf, fileSize, 0);
+        if(readbytes == 0)
+            return false;
+        if(readbytes == -1){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= readbytes;
+        buf += readbytes;
+    }
+    return true;
+}
+
+template <typename dataType>
+bool sendAll(int sockfd, const dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t sendBytes = send(sockfd, buf, fileSize, MSG_NOSIGNAL);
+        if(sendBytes == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= sendBytes;
+        buf += sendBytes;
+    }
+    return true;
+}
+
+static int connectServer(const ReplayConfig &config) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sockfd == -1)
+        return -1;
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_port = htons(config.port);
+    serverAddr.sin_family = AF_INET;
+    if(inet_pton(AF_INET, config.host.c_str(), &serverAddr.sin_addr) != 1 ||
+        connect(sockfd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sockfd;
+}
+
+static std::vector<CapturedRequest> loadCapture(const ReplayConfig &config) {
+    std::ifstream in(config.capture, std::ios::binary);
+    if(!in)
+        throw std::runtime_error("Open capture " + config.capture + " failed.");
+    CaptureFileHeader header;
+    if(!in.read((char *)&header, sizeof(header)) || header.magic != CAPTURE_MAGIC)
+        throw std::runtime_error(config.capture + " is not a capture file.");
+    if(header.version != CAPTURE_VERSION)
+        throw std::runtime_error("Unsupported capture version " + std::to_string(header.version));
+
+    std::vector<CapturedRequest> requests;
+    CapturedRequest request;
+    while(in.read((char *)&request.record, sizeof(request.record))) {
+        request.payload.resize(request.record.header.payloadSize);
+        // a capture cut short by a crash ends with a partial record
+        if(!in.read((char *)request.payload.data(), request.payload.size()))
+            break;
+        requests.push_back(request);
+        if(config.limit > 0 && requests.size() >= config.limit)
+            break;
+    }
+    return requests;
+}
+
+// sends one captured request and waits for its reply, returns the reply status
+static int replayRequest(int sockfd, const CapturedRequest &request, std::vector<uint8_t> &reply) {
+    const RequestHeader &header = request.record.header;
+    if(header.magic == PROTOCOL_MAGIC) {
+        ResponseHeader response;
+        if(!sendAll(sockfd, (const uint8_t *)&header, sizeof(header)) ||
+            !sendAll(sockfd, request.payload.data(), request.payload.size()) ||
+            !recvAll(sockfd, (uint8_t *)&response, sizeof(response)) || response.magic != PROTOCOL_MAGIC)
+            return STATUS_IO_ERROR;
+        reply.resize(response.boxCount * sizeof(WireBox) + response.payloadSize);
+        return recvAll(sockfd, reply.data(), reply.size()) ? response.status : STATUS_IO_ERROR;
+    }
+    // a legacy client sent a bare length and gets a bare length back
+    int length = request.payload.size();
+    if(!sendAll(sockfd, (const uint8_t *)&length, sizeof(length)) ||
+        !sendAll(sockfd, request.payload.data(), request.payload.size()) ||
+        !recvAll(sockfd, (uint8_t *)&length, sizeof(length)) || length < 0)
+        return STATUS_IO_ERROR;
+    reply.resize(length);
+    return recvAll(sockfd, reply.data(), reply.size()) ? STATUS_OK : STATUS_IO_ERROR;
+}
+
+static void replayConnection(const ReplayConfig &config, const std::vector<CapturedRequest> &requests,
+    const std::vector<size_t> &indices, Clock::time_point start, std::vector<ReplayResult> &results) {
+    int sockfd = connectServer(config);
+    if(sockfd == -1) {
+        spdlog::error("Connect to {}:{} failed.", config.host, config.port);
+        return;
+    }
+    std::vector<uint8_t> reply;
+    for(size_t index : indices) {
+        const CapturedRequest &request = requests[index];
+        Clock::time_point due = Clock::now();
+        if(config.speed > 0) {
+            due = start + std::chrono::microseconds(int64_t(request.record.arrivalUs / config.speed));
+            std::this_thread::sleep_until(due);
+        }
+        int status = replayRequest(sockfd, request, reply);
+        results[index].status = status;
+        if(status == STATUS_IO_ERROR) {
+            spdlog::error("Connection of captured connection {} lost.", request.record.connId);
+            break;
+        }
+        results[index].latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - due).count();
+    }
+    close(sockfd);
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, double p) {
+    if(sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()))];
+}
+
+static void saveResults(const std::string &file, const std::vector<ReplayResult> &results) {
+    std::ofstream out(file);
+    out << "index,latency_us,status\n";
+    for(size_t i = 0; i < results.size(); ++i)
+        out << i << "," << results[i].latencyUs << "," << results[i].status << "\n";
+    if(!out)
+        spdlog::error("Write {} failed.", file);
+}
+
+static std::vector<ReplayResult> loadResults(const std::string &file) {
+    std::ifstream in(file);
+    if(!in)
+        throw std::runtime_error("Open baseline " + file + " failed.");
+    std::vector<ReplayResult> results;
+    std::string line;
+    std::getline(in, line);
+    while(std::getline(in, line)) {
+        size_t index;
+        ReplayResult result;
+        char comma;
+        std::istringstream fields(line);
+        if(!(fields >> index >> comma >> result.latencyUs >> comma >> result.status))
+            continue;
+        if(index >= results.size())
+            results.resize(index + 1);
+        results[index] = result;
+    }
+    return results;
+}
+
+static void report(const ReplayConfig &config, const std::vector<ReplayResult> &results, double wallSeconds) {
+    std::vector<int64_t> latencies;
+    std::map<int, size_t> statusCount;
+    for(const ReplayResult &result : results) {
+        statusCount[result.status]++;
+        if(result.latencyUs >= 0)
+            latencies.push_back(result.latencyUs);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << fmt::format("replayed {} requests in {:.1f} s ({:.1f} req/s) at speed {}",
+        results.size(), wallSeconds, latencies.size() / wallSeconds, config.speed) << std::endl;
+    std::string statusLine = "  status";
+    for(auto &status : statusCount)
+        statusLine += fmt::format("  {}: {}", status.first == STATUS_IO_ERROR ? "io_error" : std::to_string(status.first), status.second);
+    std::cout << statusLine << std::endl;
+
+    if(config.baselineFile.empty()) {
+        for(double p : PERCENTILES)
+            std::cout << fmt::format("  p{:<5} {:>9.2f} ms", p, percentile(latencies, p) / 1000.0) << std::endl;
+        return;
+    }
+
+    // compare on the requests answered in both runs only
+    std::vector<ReplayResult> baseline = loadResults(config.baselineFile);
+    std::vector<int64_t> base, current;
+    std::vector<double> ratios;
+    for(size_t i = 0; i < std::min(baseline.size(), results.size()); ++i) {
+        if(baseline[i].latencyUs < 0 || results[i].latencyUs < 0)
+            continue;
+        base.push_back(baseline[i].latencyUs);
+        current.push_back(results[i].latencyUs);
+        ratios.push_back(double(results[i].latencyUs + 1) / double(baseline[i].latencyUs + 1));
+    }
+    std::sort(base.begin(), base.end());
+    std::sort(current.begin(), current.end());
+    std::sort(ratios.begin(), ratios.end());
+    std::cout << fmt::format("  {} requests answered in both runs", base.size()) << std::endl;
+    std::cout << fmt::format("  {:<7} {:>12} {:>12} {:>12} {:>8}", "", "baseline ms", "current ms", "delta ms", "delta") << std::endl;
+    for(double p : PERCENTILES) {
+        double before = percentile(base, p) / 1000.0;
+        double after = percentile(current, p) / 1000.0;
+        std::cout << fmt::format("  p{:<6} {:>12.2f} {:>12.2f} {:>+12.2f} {:>+7.1f}%", p, before, after,
+            after - before, before > 0 ? (after / before - 1) * 100 : 0.0) << std::endl;
+    }
+    if(!ratios.empty())
+        std::cout << fmt::format("  median per-request ratio {:.3f}", ratios[ratios.size() / 2]) << std::endl;
+}
+
+static ReplayConfig parseArgs(int argc, char *argv[]) {
+    ReplayConfig config;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg.compare(0, 2, "--") != 0) {
+            config.capture = arg;
+            continue;
+        }
+        if(i + 1 >= argc)
+            throw std::runtime_error("Missing value of " + arg);
+        std::string value = argv[++i];
+        if(arg == "--host") config.host = value;
+        else if(arg == "--port") config.port = std::stoi(value);
+        else if(arg == "--speed") config.speed = std::stod(value);
+        else if(arg == "--limit") config.limit = std::stoul(value);
+        else if(arg == "--save") config.saveFile = value;
+        else if(arg == "--baseline") config.baselineFile = value;
+        else
+            throw std::runtime_error("Unknown option " + arg);
+    }
+    if(config.capture.empty())
+        throw std::runtime_error("No capture file given.");
+    return config;
+}
+
+int main(int argc, char *argv[]) {
+    ReplayConfig config;
+    std::vector<CapturedRequest> requests;
+    try {
+        config = parseArgs(argc, argv);
+        requests = loadCapture(config);
+    }
+    catch(std::exception &err) {
+        spdlog::error(err.what());
+        return 1;
+    }
+
+    std::map<uint64_t, std::vector<size_t>> connections;
+    for(size_t i = 0; i < requests.size(); ++i)
+        connections[requests[i].record.connId].push_back(i);
+    spdlog::info("Replay {} requests of {} connections.", requests.size(), connections.size());
+
+    std::vector<ReplayResult> results(requests.size());
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for(auto &connection : connections)
+        threads.emplace_back(replayConnection, std::cref(config), std::cref(requests),
+            std::cref(connection.second), start, std::ref(results));
+    for(std::thread &thread : threads)
+        thread.join();
+    double wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if(!config.saveFile.empty())
+        saveResults(config.saveFile, results);
+    try {
+        report(config, results, wallSeconds);
+    }
+    catch(std::exception &err) {
+        spdlog::error(err.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,520 @@
+#include "Router.hpp"
+#include <stdexcept>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <spdlog/spdlog.h>
+#include <spdlog/fmt/fmt.h>
+#include "../server/Metrics.hpp"
+
+const char *MODEL_NAMES[MODEL_NUMS] = {"detector", "generator"};
+
+template <typename dataType>
+static bool recvAll(int sockfd, dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t readbytes = recv(sockfd, buf, fileSize, 0);
+        if(readbytes == 0)
+            return false;
+        if(readbytes == -1){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= readbytes;
+        buf += readbytes;
+    }
+    return true;
+}
+
+template <typename dataType>
+static bool sendAll(int sockfd, const dataType *buf, size_t fileSize) {
+    while (fileSize > 0)
+    {
+        ssize_t sendBytes = send(sockfd, buf, fileSize, MSG_NOSIGNAL);
+        if(sendBytes == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        fileSize -= sendBytes;
+        buf += sendBytes;
+    }
+    return true;
+}
+
+static void setTimeout(int fd, int timeoutMs) {
+    struct timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// a blocking connection, connect bounded by timeoutMs
+static int connectTo(const struct sockaddr_in &addr, int timeoutMs) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1)
+        return -1;
+    setTimeout(fd, timeoutMs);
+    if(connect(fd, (const sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static struct sockaddr_in resolve(const std::string &host, int port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result = nullptr;
+    if(getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr)
+        throw std::runtime_error("Can't resolve backend host " + host);
+    struct sockaddr_in addr = *(struct sockaddr_in *)result->ai_addr;
+    freeaddrinfo(result);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+BackendAddress parseBackendAddress(const std::string &text) {
+    BackendAddress address;
+    size_t first = text.find(':');
+    if(first == std::string::npos)
+        throw std::runtime_error("Backend must look like host:port[:adminPort], got " + text);
+    size_t second = text.find(':', first + 1);
+    address.host = text.substr(0, first);
+    try {
+        address.port = std::stoi(text.substr(first + 1, second - first - 1));
+        // the admin port follows the data port by default, like 5001 and 9101
+        address.adminPort = second == std::string::npos ?
+            address.port + 4100 : std::stoi(text.substr(second + 1));
+    }
+    catch(std::exception &) {
+        throw std::runtime_error("Backend must look like host:port[:adminPort], got " + text);
+    }
+    if(address.port <= 0 || address.port > 65535 || address.adminPort <= 0 || address.adminPort > 65535)
+        throw std::runtime_error("Backend port out of bound: " + text);
+    return address;
+}
+
+void requestWork(const RequestHeader &header, double work[MODEL_NUMS]) {
+    work[MODEL_DETECTOR] = 0;
+    work[MODEL_GENERATOR] = 0;
+    switch(header.taskMode) {
+        case IMAGE_DETECTION:
+        case IMAGE_TRACKING:
+            work[MODEL_DETECTOR] = DETECTOR_WORK;
+            break;
+        case IMAGE_CHAIN:
+            // the router doesn't know the chain, charge the default one
+            work[MODEL_DETECTOR] = DETECTOR_WORK;
+            work[MODEL_GENERATOR] = GENERATOR_WORK;
+            break;
+        default:
+            work[MODEL_GENERATOR] = GENERATOR_WORK;
+            break;
+    }
+}
+
+Backend::Backend(const BackendAddress &address)
+    : failures(0), healthy(false), requests(0), errors(0) {
+    _name = fmt::format("{}:{}", address.host, address.port);
+    _addr = resolve(address.host, address.port);
+    _adminAddr = resolve(address.host, address.adminPort);
+    for(int m = 0; m < MODEL_NUMS; ++m) {
+        outstanding[m] = 0;
+        instances[m] = 0;
+    }
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+Backend::~Backend() {
+    closeIdle();
+    pthread_mutex_destroy(&_mtx);
+}
+
+int Backend::connectBackend(bool pooled) {
+    while(pooled) {
+        pthread_mutex_lock(&_mtx);
+        if(_idle.empty()) {
+            pthread_mutex_unlock(&_mtx);
+            break;
+        }
+        int fd = _idle.back();
+        _idle.pop_back();
+        pthread_mutex_unlock(&_mtx);
+        // the backend may have closed an idle connection, e.g. when it restarted
+        char probe;
+        ssize_t peeked = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return fd;
+        close(fd);
+    }
+    int fd = connectTo(_addr, HEALTH_CHECK_TIMEOUT_MS);
+    if(fd == -1)
+        return -1;
+    // requests wait for their model as long as the backend lets them
+    setTimeout(fd, 0);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+void Backend::releaseConnection(int fd, bool reusable) {
+    if(reusable) {
+        pthread_mutex_lock(&_mtx);
+        if((int)_idle.size() < MAX_IDLE_BACKEND_CONNECTIONS) {
+            _idle.push_back(fd);
+            fd = -1;
+        }
+        pthread_mutex_unlock(&_mtx);
+    }
+    if(fd != -1)
+        close(fd);
+}
+
+void Backend::closeIdle() {
+    pthread_mutex_lock(&_mtx);
+    std::vector<int> idle;
+    idle.swap(_idle);
+    pthread_mutex_unlock(&_mtx);
+    for(int fd : idle)
+        close(fd);
+}
+
+bool Backend::scrape(double scraped[MODEL_NUMS]) {
+    int fd = connectTo(_adminAddr, HEALTH_CHECK_TIMEOUT_MS);
+    if(fd == -1)
+        return false;
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    std::string reply;
+    if(sendAll(fd, request, sizeof(request) - 1)) {
+        // the admin server closes the connection after the reply
+        char buf[4096];
+        ssize_t readbytes;
+        while((readbytes = recv(fd, buf, sizeof(buf), 0)) > 0)
+            reply.append(buf, readbytes);
+    }
+    close(fd);
+    size_t lineEnd = reply.find("\r\n");
+    if(lineEnd == std::string::npos || reply.substr(0, lineEnd).find(" 200 ") == std::string::npos)
+        return false;
+    // a server without the gauge serves every model with one instance
+    for(int m = 0; m < MODEL_NUMS; ++m) {
+        scraped[m] = 1;
+        std::string series = fmt::format("\nimageserver_model_instances{{model=\"{}\"}} ", MODEL_NAMES[m]);
+        size_t pos = reply.find(series);
+        if(pos != std::string::npos)
+            scraped[m] = atof(reply.c_str() + pos + series.size());
+    }
+    return true;
+}
+
+Router::Router(int port, const std::vector<BackendAddress> &backends)
+    : _clients(0), _unrouted(0) {
+    if(port < 0 || port > 65535)
+        throw std::runtime_error("Port out of bound.");
+    if(backends.empty())
+        throw std::runtime_error("The router needs at least one backend.");
+    _port = port;
+    for(const BackendAddress &address : backends)
+        _backends.push_back(new Backend(address));
+    pthread_mutex_init(&_mtx, NULL);
+
+    _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(_listenFd == -1)
+        throw std::runtime_error("Router socket create failed.");
+    int reuse = 1;
+    setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(_listenFd, (sockaddr *)&addr, sizeof(addr)) == -1)
+        throw std::runtime_error("Router bind failed.");
+    if(listen(_listenFd, 128) == -1)
+        throw std::runtime_error("Router listen failed.");
+
+    // the first round decides which backends take requests from the start
+    checkHealth();
+    if(pthread_create(&_healthThread, NULL, start_health, this) != 0)
+        throw std::runtime_error("Health check thread create failed.");
+    pthread_detach(_healthThread);
+    registerMetrics();
+}
+
+Router::~Router() {
+    // the health thread and the sessions run for the life of the process
+    close(_listenFd);
+}
+
+void Router::registerMetrics() {
+    Metrics &metrics = getMetrics();
+    metrics.addGauge("imageserver_router_clients", "Open client connections.", "",
+        [this]() { return double(_clients.load()); });
+    metrics.addCounter("imageserver_router_unrouted_total", "Requests no backend answered.", "",
+        [this]() { return double(_unrouted.load()); });
+    // the series of one metric have to be listed together
+    for(Backend *backend : _backends)
+        metrics.addGauge("imageserver_router_backend_healthy", "Whether the backend takes requests.",
+            fmt::format("backend=\"{}\"", backend->getName()),
+            [this, backend]() {
+                pthread_mutex_lock(&_mtx);
+                bool healthy = backend->healthy;
+                pthread_mutex_unlock(&_mtx);
+                return double(healthy);
+            });
+    for(Backend *backend : _backends)
+        metrics.addCounter("imageserver_router_requests_total", "Requests sent to the backend.",
+            fmt::format("backend=\"{}\"", backend->getName()),
+            [backend]() { return double(backend->requests.load()); });
+    for(Backend *backend : _backends)
+        metrics.addCounter("imageserver_router_backend_errors_total", "Requests the backend failed to answer.",
+            fmt::format("backend=\"{}\"", backend->getName()),
+            [backend]() { return double(backend->errors.load()); });
+    for(Backend *backend : _backends)
+        for(int m = 0; m < MODEL_NUMS; ++m)
+            metrics.addGauge("imageserver_router_outstanding_work", "Weighted work sent and not answered yet.",
+                fmt::format("backend=\"{}\",model=\"{}\"", backend->getName(), MODEL_NAMES[m]),
+                [this, backend, m]() {
+                    pthread_mutex_lock(&_mtx);
+                    double work = backend->outstanding[m];
+                    pthread_mutex_unlock(&_mtx);
+                    return work;
+                });
+}
+
+void* Router::start_health(void *args) {
+    Router *router = (Router *)args;
+    while(true) {
+        usleep(HEALTH_CHECK_INTERVAL_MS * 1000);
+        router->checkHealth();
+    }
+    return NULL;
+}
+
+void Router::checkHealth() {
+    for(Backend *backend : _backends) {
+        double scraped[MODEL_NUMS];
+        bool up = backend->scrape(scraped);
+        bool wentDown = false;
+        pthread_mutex_lock(&_mtx);
+        if(up) {
+            if(!backend->healthy)
+                spdlog::info("Backend {} is up, {} detectors and {} generators.", backend->getName(),
+                    scraped[MODEL_DETECTOR], scraped[MODEL_GENERATOR]);
+            backend->healthy = true;
+            backend->failures = 0;
+            for(int m = 0; m < MODEL_NUMS; ++m)
+                backend->instances[m] = scraped[m];
+        }
+        else if(++backend->failures >= UNHEALTHY_AFTER_FAILURES && backend->healthy) {
+            backend->healthy = false;
+            wentDown = true;
+        }
+        pthread_mutex_unlock(&_mtx);
+        if(wentDown) {
+            spdlog::warn("Backend {} is down.", backend->getName());
+            backend->closeIdle();
+        }
+    }
+}
+
+void Router::markFailed(Backend *backend) {
+    bool wentDown = false;
+    pthread_mutex_lock(&_mtx);
+    if(++backend->failures >= UNHEALTHY_AFTER_FAILURES && backend->healthy) {
+        backend->healthy = false;
+        wentDown = true;
+    }
+    pthread_mutex_unlock(&_mtx);
+    if(wentDown) {
+        spdlog::warn("Backend {} is down after failed requests.", backend->getName());
+        backend->closeIdle();
+    }
+}
+
+Backend* Router::pick(const double work[MODEL_NUMS], Backend *exclude) {
+    Backend *best = nullptr;
+    double bestScore = 0, bestTotal = 0;
+    pthread_mutex_lock(&_mtx);
+    for(Backend *backend : _backends) {
+        if(!backend->healthy || backend == exclude)
+            continue;
+        // the load on the models the request needs, relative to their instances
+        double score = 0, total = 0;
+        bool serves = true;
+        for(int m = 0; m < MODEL_NUMS; ++m) {
+            total += backend->outstanding[m];
+            if(work[m] == 0)
+                continue;
+            if(backend->instances[m] <= 0)
+                serves = false;
+            else
+                score += (backend->outstanding[m] + work[m]) / backend->instances[m];
+        }
+        if(!serves)
+            continue;
+        if(best == nullptr || score < bestScore || (score == bestScore && total < bestTotal)) {
+            best = backend;
+            bestScore = score;
+            bestTotal = total;
+        }
+    }
+    if(best != nullptr)
+        for(int m = 0; m < MODEL_NUMS; ++m)
+            best->outstanding[m] += work[m];
+    pthread_mutex_unlock(&_mtx);
+    return best;
+}
+
+void Router::finish(Backend *backend, const double work[MODEL_NUMS]) {
+    pthread_mutex_lock(&_mtx);
+    for(int m = 0; m < MODEL_NUMS; ++m)
+        backend->outstanding[m] -= work[m];
+    pthread_mutex_unlock(&_mtx);
+}
+
+bool Router::forward(Session &session, int backendFd) {
+    if(!sendAll(backendFd, session.request.data(), session.request.size()))
+        return false;
+    ResponseHeader header;
+    if(!recvAll(backendFd, (uint8_t *)&header, sizeof(header)) || header.magic != PROTOCOL_MAGIC)
+        return false;
+    size_t bodyBytes = (size_t)header.boxCount * sizeof(WireBox) + header.payloadSize;
+    session.response.resize(sizeof(header) + bodyBytes);
+    memcpy(session.response.data(), &header, sizeof(header));
+    return recvAll(backendFd, session.response.data() + sizeof(header), bodyBytes);
+}
+
+void Router::serveClient(Session &session) {
+    while(true) {
+        RequestHeader header;
+        if(!recvAll(session.clientFd, (uint8_t *)&header, sizeof(header)))
+            break;
+        if(header.magic != PROTOCOL_MAGIC) {
+            spdlog::warn("Legacy client without a request header, connect it to a backend directly.");
+            break;
+        }
+        if(header.payloadSize > MAX_ROUTED_FRAME_BYTES) {
+            ResponseHeader response = {PROTOCOL_MAGIC, 0, 0, STATUS_BAD_REQUEST, 0, 0, 0};
+            sendAll(session.clientFd, (const uint8_t *)&response, sizeof(response));
+            break;
+        }
+        session.request.resize(sizeof(header) + header.payloadSize);
+        memcpy(session.request.data(), &header, sizeof(header));
+        if(!recvAll(session.clientFd, session.request.data() + sizeof(header), header.payloadSize))
+            break;
+
+        double work[MODEL_NUMS];
+        requestWork(header, work);
+        bool stateful = header.taskMode == IMAGE_TRACKING || (header.flags & FLAG_MOTION_GATE);
+        bool answered = false;
+        Backend *failed = nullptr;
+        for(int attempt = 0; attempt < MAX_ROUTE_ATTEMPTS && !answered; ++attempt) {
+            Backend *backend = nullptr;
+            int fd = -1;
+            if(stateful && session.pinned != nullptr) {
+                backend = session.pinned;
+                fd = session.pinnedFd;
+                pthread_mutex_lock(&_mtx);
+                for(int m = 0; m < MODEL_NUMS; ++m)
+                    backend->outstanding[m] += work[m];
+                pthread_mutex_unlock(&_mtx);
+            }
+            else {
+                backend = pick(work, failed);
+                if(backend == nullptr)
+                    break;
+                // the state of a stream lives in its backend connection, it isn't shared
+                fd = backend->connectBackend(!stateful);
+                if(fd == -1) {
+                    finish(backend, work);
+                    backend->errors++;
+                    markFailed(backend);
+                    failed = backend;
+                    continue;
+                }
+                if(stateful) {
+                    session.pinned = backend;
+                    session.pinnedFd = fd;
+                }
+            }
+            backend->requests++;
+            answered = forward(session, fd);
+            finish(backend, work);
+            if(answered) {
+                if(!stateful)
+                    backend->releaseConnection(fd, true);
+                continue;
+            }
+            backend->errors++;
+            if(stateful) {
+                // the stream starts over on the next backend, with a fresh tracker
+                session.pinned = nullptr;
+                session.pinnedFd = -1;
+            }
+            backend->releaseConnection(fd, false);
+            markFailed(backend);
+            failed = backend;
+        }
+
+        if(!answered) {
+            _unrouted++;
+            ResponseHeader response = {PROTOCOL_MAGIC, 0, 0, STATUS_OVERLOADED, 0, 0, 0};
+            if(!sendAll(session.clientFd, (const uint8_t *)&response, sizeof(response)))
+                break;
+            continue;
+        }
+        if(!sendAll(session.clientFd, session.response.data(), session.response.size()))
+            break;
+    }
+}
+
+void* Router::start_session(void *args) {
+    std::pair<Router *, int> *started = (std::pair<Router *, int> *)args;
+    Router *router = started->first;
+    Session session;
+    session.clientFd = started->second;
+    session.pinned = nullptr;
+    session.pinnedFd = -1;
+    delete started;
+
+    router->_clients++;
+    router->serveClient(session);
+    router->_clients--;
+    if(session.pinnedFd != -1)
+        close(session.pinnedFd);
+    close(session.clientFd);
+    return NULL;
+}
+
+void Router::run() {
+    spdlog::info("Routing port {} to {} backends.", _port, _backends.size());
+    while(true) {
+        int clientFd = accept(_listenFd, NULL, NULL);
+        if(clientFd == -1) {
+            if(errno != EINTR)
+                spdlog::error("Accept failed: {}", strerror(errno));
+            continue;
+        }
+        int nodelay = 1;
+        setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        // one thread per client, it blocks on the client and then on the backend
+        pthread_t thread;
+        std::pair<Router *, int> *args = new std::pair<Router *, int>(this, clientFd);
+        if(pthread_create(&thread, NULL, start_session, args) != 0) {
+            spdlog::error("Session thread create failed.");
+            delete args;
+            close(clientFd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,121 @@
+/*Router fronts several ImageServer processes behind one port. Clients speak
+  the normal protocol to it; each request is read whole and sent to the
+  backend with the least outstanding work on the models it needs, where the
+  work is weighted by task cost and divided by the backend's model
+  instances. Backend connections are pooled and reused across clients.
+
+  Tracking and motion-gated requests keep state in the backend's connection,
+  so a client sending them is pinned to one backend connection of its own
+  until it disconnects.
+
+  Every backend's /metrics is scraped periodically. It tells the model
+  instances of the backend and, by failing, that the backend is down; a
+  down backend gets no requests until a later scrape succeeds.*/
+#ifndef ROUTER_HPP
+#define ROUTER_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "../server/Protocol.hpp"
+
+const int DEFAULT_ROUTER_PORT = 5000;
+const int DEFAULT_ROUTER_ADMIN_PORT = 9100;
+const int HEALTH_CHECK_INTERVAL_MS = 1000;
+const int HEALTH_CHECK_TIMEOUT_MS = 500;
+const int UNHEALTHY_AFTER_FAILURES = 2;     // failed scrapes in a row
+const int MAX_IDLE_BACKEND_CONNECTIONS = 16;
+const int MAX_ROUTE_ATTEMPTS = 2;           // a request whose backend failed is tried once more elsewhere
+const uint32_t MAX_ROUTED_FRAME_BYTES = 64 << 20;   // the server's default frame limit
+
+// generation is about 20x as expensive as detection
+const double DETECTOR_WORK = 1;
+const double GENERATOR_WORK = 20;
+
+typedef enum {
+    MODEL_DETECTOR,
+    MODEL_GENERATOR,
+    MODEL_NUMS,
+} ModelKind;
+
+struct BackendAddress {
+    std::string host;
+    int port;
+    int adminPort;
+};
+
+// parses host:port[:adminPort], throws runtime_error
+BackendAddress parseBackendAddress(const std::string &text);
+
+class Backend {
+    private:
+        std::string _name;
+        struct sockaddr_in _addr;
+        struct sockaddr_in _adminAddr;
+        std::vector<int> _idle;         // pooled connections, guarded by _mtx
+        pthread_mutex_t _mtx;
+
+    public:
+        // load and health, guarded by the router's mutex
+        double outstanding[MODEL_NUMS];     // work sent and not answered yet
+        double instances[MODEL_NUMS];       // from the last scrape
+        int failures;
+        bool healthy;
+
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> errors;
+
+        Backend(const BackendAddress &address);
+        ~Backend();
+        const std::string& getName() const { return _name; }
+
+        // a pooled connection or a new one, -1 when the backend can't be reached
+        int connectBackend(bool pooled = true);
+        // reusable is false after an IO error, the connection is closed then
+        void releaseConnection(int fd, bool reusable);
+        void closeIdle();
+        // scrapes /metrics, false when the backend didn't answer
+        bool scrape(double scraped[MODEL_NUMS]);
+};
+
+class Router {
+    private:
+        int _port;
+        int _listenFd;
+        std::vector<Backend *> _backends;
+        pthread_mutex_t _mtx;           // guards the load and health of the backends
+        pthread_t _healthThread;
+        std::atomic<int64_t> _clients;
+        std::atomic<uint64_t> _unrouted;    // requests no backend could take
+
+        struct Session {
+            int clientFd;
+            Backend *pinned;            // the backend of a stateful stream
+            int pinnedFd;
+            std::vector<uint8_t> request;
+            std::vector<uint8_t> response;
+        };
+
+        static void* start_health(void *args);
+        static void* start_session(void *args);
+        void checkHealth();
+        void serveClient(Session &session);
+        // the least loaded healthy backend other than exclude, its load taken
+        Backend* pick(const double work[MODEL_NUMS], Backend *exclude);
+        void finish(Backend *backend, const double work[MODEL_NUMS]);
+        // one attempt on one backend connection, false on an IO error
+        bool forward(Session &session, int backendFd);
+        void markFailed(Backend *backend);
+        void registerMetrics();
+    public:
+        Router(int port, const std::vector<BackendAddress> &backends);
+        ~Router();
+        void run();
+};
+
+// the work a request puts on each model of a backend
+void requestWork(const RequestHeader &header, double work[MODEL_NUMS]);
+
+#endif
@@ -0,0 +1,52 @@
+/*Routes the requests of many clients over several ImageServer processes,
+  see Router.hpp. A backend's admin port defaults to its port + 4100, the
+  way 5001 pairs with 9101; the router's own /metrics is served on
+  --admin-port.
+
+  Local test with two servers:
+    IMAGESERVER_PORT=5001 IMAGESERVER_ADMIN_PORT=9101 ./server &
+    IMAGESERVER_PORT=5002 IMAGESERVER_ADMIN_PORT=9102 ./server &
+    ./router --backend 127.0.0.1:5001 --backend 127.0.0.1:5002
+    ./loadgen --port 5000 --mix detection=3,generation=1
+
+  usage:
+    router --backend host:port[:adminPort] [--backend ...]
+           [--port 5000] [--admin-port 9100]
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "Router.hpp"
+#include "../server/AdminServer.hpp"
+#include "../server/Metrics.hpp"
+
+int main(int argc, char *argv[]) {
+    int port = DEFAULT_ROUTER_PORT;
+    int adminPort = DEFAULT_ROUTER_ADMIN_PORT;
+    std::vector<BackendAddress> backends;
+    Router *router;
+    try {
+        for(int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if(i + 1 >= argc)
+                throw std::runtime_error("Missing value of " + arg);
+            std::string value = argv[++i];
+            if(arg == "--backend") backends.push_back(parseBackendAddress(value));
+            else if(arg == "--port") port = std::stoi(value);
+            else if(arg == "--admin-port") adminPort = std::stoi(value);
+            else
+                throw std::runtime_error("Unknown option " + arg);
+        }
+        router = new Router(port, backends);
+        AdminServer *admin = new AdminServer(adminPort);
+        admin->addHandler("/metrics", []() { return getMetrics().renderPrometheus(); });
+        admin->start();
+    }
+    catch(std::exception &err) {
+        spdlog::error("Open router failed! Error info: {}", err.what());
+        return 1;
+    }
+    router->run();
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "AccuracyGate.hpp"
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+
+const double MAX_PSNR = 100.0;      // identical outputs, cv::PSNR is infinite
+
+// plain IoU of center based boxes, IOUCalculate is DIoU
+static double boxIou(const FaceBox &a, const FaceBox &b) {
+    double left = std::max(a.x - a.w / 2, b.x - b.w / 2);
+    double top = std::max(a.y - a.h / 2, b.y - b.h / 2);
+    double right = std::min(a.x + a.w / 2, b.x + b.w / 2);
+    double bottom = std::min(a.y + a.h / 2, b.y + b.h / 2);
+    if(right <= left || bottom <= top)
+        return 0;
+    double inter = (right - left) * (bottom - top);
+    double uni = a.w * a.h + b.w * b.h - inter;
+    return uni > 0 ? inter / uni : 0;
+}
+
+std::string AccuracyReport::describe() const {
+    return fmt::format("{} samples, recall {:.3f}, mean IoU {:.3f}, PSNR {:.1f} dB, {}",
+        samples, recall, meanIou, psnr, passed ? "passed" : "refused");
+}
+
+AccuracyReport checkDetectorAccuracy(ImageDetector &reference, ImageDetector &candidate,
+    const std::vector<cv::Mat> &images, const AccuracyTolerance &tolerance) {
+    int referenceBoxes = 0, matched = 0;
+    double iouSum = 0;
+    for(const cv::Mat &image : images) {
+        cv::Mat img = image.clone();
+        TrtSession &refSession = reference.getSession(img.size());
+        std::vector<FaceBox> expected = reference.detect(img, refSession.buffers, refSession.context);
+        TrtSession &candSession = candidate.getSession(img.size());
+        std::vector<FaceBox> actual = candidate.detect(img, candSession.buffers, candSession.context);
+        // greedy, the most confident reference boxes pick first
+        std::sort(expected.begin(), expected.end(), [](const FaceBox &a, const FaceBox &b) {
+            return a.confidence > b.confidence;
+        });
+        std::vector<bool> used(actual.size(), false);
+        for(const FaceBox &box : expected) {
+            int best = -1;
+            double bestIou = tolerance.matchIou;
+            for(size_t j = 0; j < actual.size(); ++j) {
+                double iou = boxIou(box, actual[j]);
+                if(!used[j] && iou >= bestIou) {
+                    best = j;
+                    bestIou = iou;
+                }
+            }
+            referenceBoxes++;
+            if(best >= 0) {
+                used[best] = true;
+                matched++;
+                iouSum += bestIou;
+            }
+        }
+    }
+    AccuracyReport report;
+    report.samples = images.size();
+    // no faces in the reference, nothing the candidate could miss
+    report.recall = referenceBoxes > 0 ? double(matched) / referenceBoxes : 1.0;
+    report.meanIou = matched > 0 ? iouSum / matched : 1.0;
+    report.psnr = 0;
+    report.passed = report.recall >= tolerance.minRecall && report.meanIou >= tolerance.minMeanIou;
+    return report;
+}
+
+AccuracyReport checkGeneratorAccuracy(ImageGenerator &reference, ImageGenerator &candidate,
+    const std::vector<cv::Mat> &images, cv::Size size, const AccuracyTolerance &tolerance) {
+    double psnrSum = 0;
+    for(const cv::Mat &image : images) {
+        cv::Mat expected, actual;
+        cv::resize(image, expected, size);
+        actual = expected.clone();
+        TrtSession &refSession = reference.getSession(size);
+        reference.inference(expected, refSession.buffers, refSession.context);
+        TrtSession &candSession = candidate.getSession(size);
+        candidate.inference(actual, candSession.buffers, candSession.context);
+        psnrSum += std::min(MAX_PSNR, cv::PSNR(expected, actual));
+    }
+    AccuracyReport report;
+    report.samples = images.size();
+    report.recall = 1.0;
+    report.meanIou = 1.0;
+    report.psnr = images.empty() ? MAX_PSNR : psnrSum / images.size();
+    report.passed = report.psnr >= tolerance.minPsnr;
+    return report;
+}
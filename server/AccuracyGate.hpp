@@ -0,0 +1,42 @@
+/*AccuracyGate decides whether a quantized model may stand in for its FP32
+  reference. Both run over the held-out calibration images:
+
+  - detector: the reference boxes are matched greedily to the candidate's
+    by IoU. Recall is the share of reference boxes matched, the mean IoU is
+    taken over the matches.
+  - generator: the outputs are compared by PSNR.
+
+  The variant passes when every measure is within the tolerance.*/
+#ifndef ACCURACYGATE_HPP
+#define ACCURACYGATE_HPP
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "trtModel/imageDetector.hpp"
+#include "trtModel/ImageGenerator.hpp"
+
+struct AccuracyTolerance {
+    double matchIou = 0.5;      // a candidate box closer than this matches
+    double minRecall = 0.95;
+    double minMeanIou = 0.85;
+    double minPsnr = 30.0;      // dB
+};
+
+struct AccuracyReport {
+    int samples;
+    double recall;              // detector
+    double meanIou;             // detector
+    double psnr;                // generator, mean over the samples
+    bool passed;
+
+    std::string describe() const;
+};
+
+AccuracyReport checkDetectorAccuracy(ImageDetector &reference, ImageDetector &candidate,
+    const std::vector<cv::Mat> &images, const AccuracyTolerance &tolerance);
+// the generators run at size
+AccuracyReport checkGeneratorAccuracy(ImageGenerator &reference, ImageGenerator &candidate,
+    const std::vector<cv::Mat> &images, cv::Size size, const AccuracyTolerance &tolerance);
+
+#endif
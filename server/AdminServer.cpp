@@ -0,0 +1,125 @@
+#include "AdminServer.hpp"
+#include <stdexcept>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <spdlog/spdlog.h>
+
+const int ADMIN_IO_TIMEOUT_S = 2;       // a stalled scraper can't hold the admin thread
+const size_t ADMIN_MAX_REQUEST = 8192;
+
+AdminServer::AdminServer(int port) {
+    if(port < 0 || port > 65535)
+        throw std::runtime_error("Admin port out of bound.");
+    _port = port;
+
+    _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(_listenFd == -1)
+        throw std::runtime_error("Admin socket create failed.");
+
+    int reuse = 1;
+    setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    memset(&_servAddr, 0, sizeof(_servAddr));
+    _servAddr.sin_family = AF_INET;
+    _servAddr.sin_port = htons(port);
+    _servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(_listenFd, (sockaddr *)&_servAddr, sizeof(_servAddr)) == -1) {
+        close(_listenFd);
+        throw std::runtime_error("Admin bind failed.");
+    }
+    if(listen(_listenFd, 16) == -1) {
+        close(_listenFd);
+        throw std::runtime_error("Admin listen failed.");
+    }
+}
+
+AdminServer::~AdminServer() {
+    // the accept loop runs for the life of the process
+    close(_listenFd);
+}
+
+void AdminServer::addHandler(const std::string &path, std::function<std::string()> handler) {
+    _handlers[path] = handler;
+}
+
+void AdminServer::addProbe(const std::string &path, std::function<bool(std::string &)> probe) {
+    _probes[path] = probe;
+}
+
+void AdminServer::start() {
+    if(pthread_create(&_thread, NULL, start_thread, this) != 0)
+        throw std::runtime_error("Admin thread create failed.");
+    pthread_detach(_thread);
+    spdlog::info("Admin endpoint listening on port {}", _port);
+}
+
+void* AdminServer::start_thread(void *args) {
+    AdminServer *admin = (AdminServer *)args;
+    admin->serve();
+    return NULL;
+}
+
+void AdminServer::serve() {
+    while(true) {
+        int clientFd = accept(_listenFd, NULL, NULL);
+        if(clientFd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            spdlog::error("Admin accept failed : {}", strerror(errno));
+            return;
+        }
+        struct timeval timeout = {ADMIN_IO_TIMEOUT_S, 0};
+        setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        handleClient(clientFd);
+        close(clientFd);
+    }
+}
+
+void AdminServer::handleClient(int clientFd) {
+    // only the request line matters, read until the end of the headers
+    std::string request;
+    char buf[1024];
+    while(request.find("\r\n\r\n") == std::string::npos && request.size() < ADMIN_MAX_REQUEST) {
+        ssize_t n = recv(clientFd, buf, sizeof(buf), 0);
+        if(n <= 0)
+            break;
+        request.append(buf, n);
+    }
+
+    std::string status = "400 Bad Request";
+    std::string body;
+    size_t methodEnd = request.find(' ');
+    size_t pathEnd = methodEnd == std::string::npos ? methodEnd : request.find(' ', methodEnd + 1);
+    if(pathEnd != std::string::npos) {
+        std::string method = request.substr(0, methodEnd);
+        std::string path = request.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+        path = path.substr(0, path.find('?'));
+        auto it = _handlers.find(path);
+        auto probe = _probes.find(path);
+        if(method != "GET")
+            status = "405 Method Not Allowed";
+        else if(it != _handlers.end()) {
+            status = "200 OK";
+            body = it->second();
+        }
+        else if(probe != _probes.end())
+            status = probe->second(body) ? "200 OK" : "503 Service Unavailable";
+        else
+            status = "404 Not Found";
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while(sent < response.size()) {
+        ssize_t n = send(clientFd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0)
+            return;
+        sent += n;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef ADMINSERVER_HPP
+#define ADMINSERVER_HPP
+
+#include <functional>
+#include <map>
+#include <string>
+#include <pthread.h>
+#include <netinet/in.h>
+
+const int DEFAULT_ADMIN_PORT = 9101;
+
+/*AdminServer answers plain HTTP GET requests on its own port, away from the
+  image traffic. Each path maps to a handler that renders the response body.
+  A probe is a handler that also decides between 200 and 503, for load
+  balancers and deploy scripts that wait on a path. Requests are served one
+  at a time on a dedicated thread and every connection is closed after the
+  reply.*/
+class AdminServer {
+    private:
+        int _port;
+        int _listenFd;
+        struct sockaddr_in _servAddr;
+        pthread_t _thread;
+        std::map<std::string, std::function<std::string()>> _handlers;
+        std::map<std::string, std::function<bool(std::string &)>> _probes;
+
+        static void* start_thread(void *args);
+        void serve();
+        void handleClient(int clientFd);
+    public:
+        AdminServer(int port);
+        ~AdminServer();
+        // register before start, the handlers are not guarded
+        void addHandler(const std::string &path, std::function<std::string()> handler);
+        // the probe fills the body and returns false to answer 503
+        void addProbe(const std::string &path, std::function<bool(std::string &)> probe);
+        void start();
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include "ArtifactCache.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <spdlog/spdlog.h>
+
+const char LOCK_SUFFIX[] = ".lock";
+const char TMP_SUFFIX[] = ".tmp";
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void syncPath(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+std::string ArtifactKey::fileName() const {
+    std::string recipe = backend + '\0' + precision + '\0' + profile + '\0' + device;
+    Hash128 digest = hashBytes(recipe.data(), recipe.size(), sourceDigest.lo);
+    digest.hi = hashCombine(digest.hi, sourceDigest.hi);
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)digest.hi, (unsigned long long)digest.lo);
+    return name + "-" + hex + extension;
+}
+
+ArtifactCache::ArtifactCache() : _dir(DEFAULT_ARTIFACT_DIR), _maxBytes(DEFAULT_ARTIFACT_CACHE_BYTES) {
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+ArtifactCache::~ArtifactCache() {
+    pthread_mutex_destroy(&_mtx);
+}
+
+void ArtifactCache::configure(const std::string &dir, size_t maxBytes) {
+    pthread_mutex_lock(&_mtx);
+    _dir = dir;
+    _maxBytes = maxBytes;
+    pthread_mutex_unlock(&_mtx);
+}
+
+std::string ArtifactCache::getOrBuild(const ArtifactKey &key, ArtifactBuilder build, bool &built) {
+    pthread_mutex_lock(&_mtx);
+    std::string dir = _dir;
+    pthread_mutex_unlock(&_mtx);
+    built = false;
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        throw std::runtime_error("Can't create the artifact cache " + dir);
+    std::string path = dir + "/" + key.fileName();
+    if(access(path.c_str(), R_OK) == 0) {
+        utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+        return path;
+    }
+
+    // one builder per artifact, the others wait here and find it built
+    int lockFd = open((path + LOCK_SUFFIX).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(lockFd < 0)
+        throw std::runtime_error("Can't open the lock of " + path + " : " + strerror(errno));
+    while(flock(lockFd, LOCK_EX) != 0) {
+        if(errno != EINTR) {
+            close(lockFd);
+            throw std::runtime_error("Can't lock " + path + " : " + strerror(errno));
+        }
+    }
+    if(access(path.c_str(), R_OK) == 0) {
+        close(lockFd);
+        spdlog::info("Artifact {} was built by another builder.", path);
+        utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+        return path;
+    }
+
+    // the lock holder owns the temporary file, a crashed builder's leftover is overwritten
+    std::string tmpPath = path + TMP_SUFFIX;
+    try {
+        build(tmpPath);
+        syncPath(tmpPath);
+        if(rename(tmpPath.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("Can't rename " + tmpPath + " : " + strerror(errno));
+        syncPath(dir);
+    }
+    catch(...) {
+        unlink(tmpPath.c_str());
+        close(lockFd);
+        throw;
+    }
+    close(lockFd);
+    built = true;
+    spdlog::info("Artifact {} built.", path);
+    evict(path);
+    return path;
+}
+
+std::string ArtifactCache::getPath(const ArtifactKey &key) {
+    pthread_mutex_lock(&_mtx);
+    std::string dir = _dir;
+    pthread_mutex_unlock(&_mtx);
+    return dir + "/" + key.fileName();
+}
+
+void ArtifactCache::evict(const std::string &keep) {
+    pthread_mutex_lock(&_mtx);
+    std::string dir = _dir;
+    size_t maxBytes = _maxBytes;
+    pthread_mutex_unlock(&_mtx);
+
+    struct Entry {
+        std::string path;
+        size_t size;
+        struct timespec used;
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    DIR *d = opendir(dir.c_str());
+    if(d == nullptr)
+        return;
+    while(struct dirent *ent = readdir(d)) {
+        std::string name = ent->d_name;
+        // lock files stay, removing one could let two builders in
+        if(name[0] == '.' || endsWith(name, LOCK_SUFFIX) || endsWith(name, TMP_SUFFIX))
+            continue;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        entries.push_back({path, (size_t)st.st_size, st.st_mtim});
+        total += st.st_size;
+    }
+    closedir(d);
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for(const Entry &entry : entries) {
+        if(total <= maxBytes)
+            break;
+        if(entry.path == keep)
+            continue;
+        // a reader that already opened or mapped the file keeps its copy
+        if(unlink(entry.path.c_str()) == 0) {
+            total -= entry.size;
+            spdlog::info("Evicted artifact {} of {} bytes.", entry.path, entry.size);
+        }
+    }
+}
+
+ArtifactCache& getArtifactCache() {
+    static ArtifactCache *cache = new ArtifactCache();
+    return *cache;
+}
@@ -0,0 +1,65 @@
+/*ArtifactCache keeps compiled models on disk, addressed by everything that
+  went into compiling them: the model bytes, the backend version, the
+  precision, the shape profile and the device. A changed model or a new
+  backend gets a new key, so a stale artifact is never loaded, and a fresh
+  node that shares the cache directory loads instead of compiling.
+
+  An artifact is built at most once. Builders take an flock on the
+  artifact's lock file, so other threads and processes wait for the build
+  and then load its result. The build goes to a temporary file that is
+  synced and renamed into place, a reader never sees a partial artifact.
+
+  The directory is bounded to a byte budget. After a build the least
+  recently used artifacts are removed, a hit refreshes the file's mtime.*/
+#ifndef ARTIFACTCACHE_HPP
+#define ARTIFACTCACHE_HPP
+
+#include <functional>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "Hash.hpp"
+
+const char DEFAULT_ARTIFACT_DIR[] = "./model/cache";
+const size_t DEFAULT_ARTIFACT_CACHE_BYTES = size_t(4) << 30;
+
+// what an artifact was compiled from, hashed into its file name
+struct ArtifactKey {
+    std::string name;           // readable prefix of the file name, the model's stem
+    std::string extension;      // ".plan" for TensorRT
+    Hash128 sourceDigest;       // the model file's bytes
+    std::string backend;        // backend and its version
+    std::string precision;
+    std::string profile;        // input shapes the artifact was built for
+    std::string device;         // what the artifact runs on
+
+    std::string fileName() const;
+};
+
+// writes the artifact to the temporary path, throws when it can't be built
+typedef std::function<void(const std::string &tmpPath)> ArtifactBuilder;
+
+class ArtifactCache {
+    private:
+        pthread_mutex_t _mtx;   // guards the settings
+        std::string _dir;
+        size_t _maxBytes;
+
+        void evict(const std::string &keep);
+    public:
+        ArtifactCache();
+        ~ArtifactCache();
+        // set before the models load
+        void configure(const std::string &dir, size_t maxBytes);
+        // path of the artifact, built under the lock when it's missing. built tells
+        // whether this call ran the builder
+        std::string getOrBuild(const ArtifactKey &key, ArtifactBuilder build, bool &built);
+        // where the artifact of the key is kept, built or not. For what a build leaves
+        // beside its artifact, the directory exists once getOrBuild ran
+        std::string getPath(const ArtifactKey &key);
+};
+
+ArtifactCache& getArtifactCache();
+
+#endif
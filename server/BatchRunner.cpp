@@ -0,0 +1,717 @@
+#include "BatchRunner.hpp"
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#include <spdlog/spdlog.h>
+#include "ModelPool.hpp"
+#include "BufferPool.hpp"
+#include "Hash.hpp"
+
+const int TAR_BLOCK = 512;
+const int MODEL_POLL_MS = 100;      // while waiting for the model to load
+
+const char BATCH_USAGE[] = "usage: server --batch <directory|archive.tar|video> --out <directory> "
+    "[--task detection|generation] [--size N] [--format .png] [--decoders N] [--writers N] [--restart]";
+
+/*BoundedQueue hands the items from one stage to the next. A full queue
+  holds the stage before it back, so the reader can't run ahead of the
+  models with the whole input in memory. Closing it lets the next stage
+  drain what is left and stop.*/
+template <typename T>
+class BoundedQueue {
+    private:
+        pthread_mutex_t _mtx;
+        pthread_cond_t _notEmpty;
+        pthread_cond_t _notFull;
+        std::queue<T> _queue;
+        size_t _capacity;
+        bool _closed;
+    public:
+        BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false) {
+            pthread_mutex_init(&_mtx, NULL);
+            pthread_cond_init(&_notEmpty, NULL);
+            pthread_cond_init(&_notFull, NULL);
+        }
+
+        ~BoundedQueue() {
+            pthread_mutex_destroy(&_mtx);
+            pthread_cond_destroy(&_notEmpty);
+            pthread_cond_destroy(&_notFull);
+        }
+
+        void push(T data) {
+            pthread_mutex_lock(&_mtx);
+            while(_queue.size() >= _capacity)
+                pthread_cond_wait(&_notFull, &_mtx);
+            _queue.push(data);
+            pthread_cond_signal(&_notEmpty);
+            pthread_mutex_unlock(&_mtx);
+        }
+
+        // false once the queue is closed and empty
+        bool pop(T &data) {
+            pthread_mutex_lock(&_mtx);
+            while(_queue.empty() && !_closed)
+                pthread_cond_wait(&_notEmpty, &_mtx);
+            if(_queue.empty()) {
+                pthread_mutex_unlock(&_mtx);
+                return false;
+            }
+            data = _queue.front();
+            _queue.pop();
+            pthread_cond_signal(&_notFull);
+            pthread_mutex_unlock(&_mtx);
+            return true;
+        }
+
+        void close() {
+            pthread_mutex_lock(&_mtx);
+            _closed = true;
+            pthread_cond_broadcast(&_notEmpty);
+            pthread_mutex_unlock(&_mtx);
+        }
+};
+
+// the inputs in a stable order, a rerun sees them in the same order as the checkpointed run
+class BatchSource {
+    public:
+        virtual ~BatchSource() {}
+        // fills the next image, false at the end. A skipped image only gets its name
+        virtual bool next(BatchItem &item, bool skip) = 0;
+};
+
+static bool readFile(const std::string &path, std::vector<uchar> &data) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(fp == nullptr)
+        return false;
+    fseeko(fp, 0, SEEK_END);
+    off_t size = ftello(fp);
+    fseeko(fp, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size >= 0 && fread(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    return ok;
+}
+
+static bool makeDirs(const std::string &path) {
+    for(size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        std::string dir = path.substr(0, pos);
+        if(!dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            return false;
+        if(pos == std::string::npos)
+            return true;
+    }
+}
+
+static void syncPath(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+class DirectorySource : public BatchSource {
+    private:
+        std::string _dir;
+        std::vector<std::string> _names;
+        size_t _pos;
+
+        void walk(const std::string &prefix) {
+            std::string dir = prefix.empty() ? _dir : _dir + "/" + prefix;
+            DIR *d = opendir(dir.c_str());
+            if(d == nullptr)
+                throw std::runtime_error("Can't open " + dir);
+            while(struct dirent *ent = readdir(d)) {
+                std::string name = ent->d_name;
+                if(name == "." || name == "..")
+                    continue;
+                std::string relative = prefix.empty() ? name : prefix + "/" + name;
+                struct stat st;
+                if(stat((_dir + "/" + relative).c_str(), &st) != 0)
+                    continue;
+                if(S_ISDIR(st.st_mode))
+                    walk(relative);
+                else if(S_ISREG(st.st_mode) && isImageFile(lowerExtension(name)))
+                    _names.push_back(relative);
+            }
+            closedir(d);
+        }
+    public:
+        DirectorySource(const std::string &dir) : _dir(dir), _pos(0) {
+            walk("");
+            std::sort(_names.begin(), _names.end());
+            spdlog::info("{} images under {}.", _names.size(), dir);
+        }
+
+        bool next(BatchItem &item, bool skip) {
+            if(_pos >= _names.size())
+                return false;
+            item.name = _names[_pos++];
+            if(!skip && !readFile(_dir + "/" + item.name, item.encoded))
+                item.error = "unreadable";
+            return true;
+        }
+};
+
+// a ustar archive read front to back, with the GNU and pax long names
+class TarSource : public BatchSource {
+    private:
+        std::string _path;
+        FILE *_fp;
+        std::string _longName;      // from the entry before, for the next one
+
+        static uint64_t parseNumber(const char *field, int len) {
+            uint64_t value = 0;
+            // GNU base-256 for sizes past the 11 octal digits
+            if(field[0] & 0x80) {
+                value = field[0] & 0x7f;
+                for(int i = 1; i < len; ++i)
+                    value = (value << 8) | (unsigned char)field[i];
+                return value;
+            }
+            for(int i = 0; i < len && field[i] != '\0'; ++i)
+                if(field[i] >= '0' && field[i] <= '7')
+                    value = value * 8 + (field[i] - '0');
+            return value;
+        }
+
+        static bool checksumOk(const char *header) {
+            uint64_t sum = 0;
+            for(int i = 0; i < TAR_BLOCK; ++i)
+                sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+            return sum == parseNumber(header + 148, 8);
+        }
+
+        void readData(std::string &data, uint64_t size) {
+            data.resize(size);
+            if(fread(&data[0], 1, size, _fp) != size)
+                throw std::runtime_error("Truncated entry in " + _path);
+            skipPadding(size);
+        }
+
+        void skipPadding(uint64_t size) {
+            uint64_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+            if(padding > 0)
+                fseeko(_fp, padding, SEEK_CUR);
+        }
+    public:
+        TarSource(const std::string &path) : _path(path) {
+            _fp = fopen(path.c_str(), "rb");
+            if(_fp == nullptr)
+                throw std::runtime_error("Can't open " + path);
+        }
+
+        ~TarSource() {
+            fclose(_fp);
+        }
+
+        bool next(BatchItem &item, bool skip) {
+            char header[TAR_BLOCK];
+            while(true) {
+                if(fread(header, 1, TAR_BLOCK, _fp) != TAR_BLOCK)
+                    return false;
+                // the archive ends with zero blocks
+                if(std::all_of(header, header + TAR_BLOCK, [](char c) { return c == '\0'; }))
+                    return false;
+                if(!checksumOk(header))
+                    throw std::runtime_error("Corrupt header in " + _path);
+                uint64_t size = parseNumber(header + 124, 12);
+                char type = header[156];
+                if(type == 'L' || type == 'x' || type == 'g') {
+                    std::string data;
+                    readData(data, size);
+                    if(type == 'L')
+                        _longName = data.c_str();
+                    // pax records are "<length> <key>=<value>\n"
+                    for(size_t pos = 0; type == 'x' && pos < data.size(); ) {
+                        size_t space = data.find(' ', pos);
+                        size_t length = atol(data.c_str() + pos);
+                        if(space == std::string::npos || length == 0 || pos + length > data.size())
+                            break;
+                        std::string record = data.substr(space + 1, pos + length - space - 2);
+                        if(record.compare(0, 5, "path=") == 0)
+                            _longName = record.substr(5);
+                        pos += length;
+                    }
+                    continue;
+                }
+                std::string name = _longName;
+                _longName.clear();
+                if(name.empty()) {
+                    name.assign(header, strnlen(header, 100));
+                    const char *prefix = header + 345;
+                    if(memcmp(header + 257, "ustar", 5) == 0 && prefix[0] != '\0')
+                        name = std::string(prefix, strnlen(prefix, 155)) + "/" + name;
+                }
+                if((type != '0' && type != '\0') || !isImageFile(lowerExtension(name))) {
+                    fseeko(_fp, size, SEEK_CUR);
+                    skipPadding(size);
+                    continue;
+                }
+                item.name = name;
+                if(skip) {
+                    fseeko(_fp, size, SEEK_CUR);
+                    skipPadding(size);
+                }
+                else {
+                    item.encoded.resize(size);
+                    if(fread(item.encoded.data(), 1, size, _fp) != size)
+                        throw std::runtime_error("Truncated entry in " + _path);
+                    skipPadding(size);
+                }
+                return true;
+            }
+        }
+};
+
+// the frames are decoded here, a video can only be read in order
+class VideoSource : public BatchSource {
+    private:
+        cv::VideoCapture _capture;
+        uint64_t _frame;
+    public:
+        VideoSource(const std::string &path) : _capture(path), _frame(0) {
+            if(!_capture.isOpened())
+                throw std::runtime_error("Can't open the video " + path);
+        }
+
+        bool next(BatchItem &item, bool skip) {
+            if(skip ? !_capture.grab() : !_capture.read(item.image))
+                return false;
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%08llu", (unsigned long long)_frame++);
+            item.name = name;
+            return true;
+        }
+};
+
+static BatchSource* openSource(const std::string &input) {
+    struct stat st;
+    if(stat(input.c_str(), &st) != 0)
+        throw std::runtime_error("Can't find the input " + input);
+    std::string ext = lowerExtension(input);
+    if(S_ISDIR(st.st_mode))
+        return new DirectorySource(input);
+    if(ext == ".tar")
+        return new TarSource(input);
+    if(isVideoFile(ext))
+        return new VideoSource(input);
+    throw std::runtime_error("The input " + input + " is neither a directory, a .tar nor a video.");
+}
+
+static const char* batchTaskName(TaskMode taskMode) {
+    return taskMode == IMAGE_GENERATION ? "generation" : "detection";
+}
+
+static std::string jsonEscape(const std::string &s) {
+    std::string out;
+    for(char c : s) {
+        if(c == '"' || c == '\\')
+            out += std::string("\\") + c;
+        else if((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        }
+        else
+            out += c;
+    }
+    return out;
+}
+
+// the outputs are written under the input's names, those climbing out of the output are refused
+static bool isSafeName(const std::string &name) {
+    if(name.empty() || name[0] == '/')
+        return false;
+    std::string padded = "/" + name + "/";
+    return padded.find("/../") == std::string::npos;
+}
+
+static int parsePositive(const std::string &option, const char *value) {
+    int n = atoi(value);
+    if(n <= 0)
+        throw std::runtime_error(option + " takes a positive number.\n" + BATCH_USAGE);
+    return n;
+}
+
+BatchOptions parseBatchOptions(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    BatchOptions options;
+    options.taskMode = IMAGE_DETECTION;
+    options.size = DYNAMIC_OPT_SIZE;
+    options.format = ".png";
+    options.decodeThreads = std::max(2L, cpus / 2);
+    options.encodeThreads = std::max(2L, cpus / 2);
+    options.restart = false;
+    for(int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if(option == "--restart") {
+            options.restart = true;
+            continue;
+        }
+        if(i + 1 >= argc)
+            throw std::runtime_error(BATCH_USAGE);
+        const char *value = argv[++i];
+        if(option == "--batch")
+            options.input = value;
+        else if(option == "--out")
+            options.outDir = value;
+        else if(option == "--task" && std::string(value) == "detection")
+            options.taskMode = IMAGE_DETECTION;
+        else if(option == "--task" && std::string(value) == "generation")
+            options.taskMode = IMAGE_GENERATION;
+        else if(option == "--size")
+            options.size = parsePositive(option, value);
+        else if(option == "--format" && value[0] == '.')
+            options.format = value;
+        else if(option == "--decoders")
+            options.decodeThreads = parsePositive(option, value);
+        else if(option == "--writers")
+            options.encodeThreads = parsePositive(option, value);
+        else
+            throw std::runtime_error(BATCH_USAGE);
+    }
+    if(options.input.empty() || options.outDir.empty())
+        throw std::runtime_error(BATCH_USAGE);
+    // the generator's dynamic profile
+    if(options.size < DYNAMIC_MIN_SIZE || options.size > DYNAMIC_MAX_SIZE)
+        throw std::runtime_error("--size is out of " + std::to_string(DYNAMIC_MIN_SIZE) + " to " +
+            std::to_string(DYNAMIC_MAX_SIZE) + ".");
+    return options;
+}
+
+BatchRunner::BatchRunner(ModelPool *models, const BatchOptions &options)
+    : _models(models), _options(options), _source(nullptr), _skip(0), _modelFailed(false),
+      _next(0), _listing(0), _results(nullptr), _resultsBytes(0), _done(0), _failed(0), _sinceCheckpoint(0), _reportedDone(0) {
+    _decodeQue = new BoundedQueue<BatchItem *>(BATCH_QUEUE_DEPTH);
+    _modelQue = new BoundedQueue<BatchItem *>(BATCH_QUEUE_DEPTH);
+    _writeQue = new BoundedQueue<BatchItem *>(BATCH_QUEUE_DEPTH);
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+BatchRunner::~BatchRunner() {
+    if(_results != nullptr)
+        fclose(_results);
+    delete _source;
+    delete _decodeQue;
+    delete _modelQue;
+    delete _writeQue;
+    pthread_mutex_destroy(&_mtx);
+}
+
+void BatchRunner::waitForModel() {
+    ModelKind kind = _options.taskMode == IMAGE_GENERATION ? MODEL_GENERATOR : MODEL_DETECTOR;
+    ModelLoader *loader = _models->getLoader();
+    loader->start(kind);
+    while(loader->getState(kind) != MODEL_READY) {
+        if(loader->getState(kind) == MODEL_FAILED)
+            throw std::runtime_error(std::string("The ") + modelKindName(kind) + " failed to load.");
+        usleep(MODEL_POLL_MS * 1000);
+    }
+}
+
+void BatchRunner::restoreCheckpoint() {
+    std::string checkpointPath = _options.outDir + "/" + BATCH_CHECKPOINT_FILE;
+    std::string resultsPath = _options.outDir + "/" + BATCH_RESULTS_FILE;
+    if(!_options.restart && ifFileExists(checkpointPath.c_str())) {
+        Config checkpoint;
+        checkpoint.load(checkpointPath);
+        if(checkpoint.getString("input") != _options.input || checkpoint.getString("task") != batchTaskName(_options.taskMode))
+            throw std::runtime_error("The checkpoint in " + _options.outDir + " is of " + checkpoint.getString("task") +
+                " over " + checkpoint.getString("input") + ", pass --restart to start over.");
+        _skip = checkpoint.getInt("next", 0);
+        _resultsBytes = checkpoint.getInt("results_bytes", 0);
+        _listing = strtoull(checkpoint.getString("listing").c_str(), nullptr, 16);
+        // the lines written after the checkpoint are written again
+        if(truncate(resultsPath.c_str(), _resultsBytes) != 0)
+            throw std::runtime_error("Can't truncate " + resultsPath + " : " + strerror(errno));
+        _results = fopen(resultsPath.c_str(), "ab");
+        spdlog::info("Resume {} after {} images.", _options.input, _skip);
+    }
+    else
+        _results = fopen(resultsPath.c_str(), "wb");
+    if(_results == nullptr)
+        throw std::runtime_error("Can't open " + resultsPath + " : " + strerror(errno));
+    _next = _skip;
+}
+
+void BatchRunner::skipDone() {
+    // the results kept are by position, they only hold for the input they were made from
+    uint64_t listing = 0;
+    uint64_t index = 0;
+    BatchItem skipped;
+    while(index < _skip && _source->next(skipped, true)) {
+        listing = hashCombine(listing, hashBytes(skipped.name.data(), skipped.name.size()).lo);
+        index++;
+    }
+    if(index < _skip || listing != _listing)
+        throw std::runtime_error(_options.input + " changed since the checkpoint in " + _options.outDir +
+            ", pass --restart to start over.");
+}
+
+void BatchRunner::saveCheckpoint() {
+    // the results first, the checkpoint never points past what is on disk
+    fflush(_results);
+    fsync(fileno(_results));
+    std::string path = _options.outDir + "/" + BATCH_CHECKPOINT_FILE;
+    std::string tmpPath = path + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "w");
+    if(fp == nullptr) {
+        spdlog::error("Write the checkpoint {} failed : {}", tmpPath, strerror(errno));
+        return;
+    }
+    fprintf(fp, "# written by the batch mode, a rerun over the same input continues from here\n");
+    fprintf(fp, "input = %s\ntask = %s\nnext = %llu\nresults_bytes = %llu\nlisting = %016llx\n", _options.input.c_str(),
+        batchTaskName(_options.taskMode), (unsigned long long)_next, (unsigned long long)_resultsBytes,
+        (unsigned long long)_listing);
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    if(rename(tmpPath.c_str(), path.c_str()) != 0) {
+        spdlog::error("Rename the checkpoint {} failed : {}", tmpPath, strerror(errno));
+        return;
+    }
+    syncPath(_options.outDir);
+    _sinceCheckpoint = 0;
+}
+
+std::string BatchRunner::resultLine(const BatchItem &item, const std::string &output) const {
+    std::string line = "{\"name\":\"" + jsonEscape(item.name) + "\"";
+    if(!item.error.empty())
+        return line + ",\"error\":\"" + jsonEscape(item.error) + "\"}\n";
+    if(_options.taskMode == IMAGE_GENERATION)
+        return line + ",\"output\":\"" + jsonEscape(output) + "\"}\n";
+    // center based boxes in the image's pixels, as on the wire
+    line += fmt::format(",\"width\":{},\"height\":{},\"boxes\":[", item.image.cols, item.image.rows);
+    for(size_t i = 0; i < item.boxes.size(); ++i) {
+        const FaceBox &box = item.boxes[i];
+        line += fmt::format("{}{{\"confidence\":{:.4f},\"x\":{:.1f},\"y\":{:.1f},\"w\":{:.1f},\"h\":{:.1f}}}",
+            i > 0 ? "," : "", box.confidence, box.x, box.y, box.w, box.h);
+    }
+    return line + "]}\n";
+}
+
+void BatchRunner::complete(BatchItem *item, const std::string &output) {
+    std::string line = resultLine(*item, output);
+    uint64_t nameHash = hashBytes(item->name.data(), item->name.size()).lo;
+    if(!item->error.empty())
+        spdlog::warn("Batch image {} failed : {}", item->name, item->error);
+
+    pthread_mutex_lock(&_mtx);
+    _done++;
+    if(!item->error.empty())
+        _failed++;
+    _pending[item->index] = std::make_pair(nameHash, line);
+    while(!_pending.empty() && _pending.begin()->first == _next) {
+        const std::string &ready = _pending.begin()->second.second;
+        fwrite(ready.data(), 1, ready.size(), _results);
+        _resultsBytes += ready.size();
+        _listing = hashCombine(_listing, _pending.begin()->second.first);
+        _pending.erase(_pending.begin());
+        _next++;
+        _sinceCheckpoint++;
+    }
+    if(_sinceCheckpoint >= (uint64_t)BATCH_CHECKPOINT_EVERY)
+        saveCheckpoint();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double sinceReport = std::chrono::duration<double>(now - _reportedAt).count();
+    if(sinceReport >= BATCH_REPORT_INTERVAL_S) {
+        double elapsed = std::chrono::duration<double>(now - _startedAt).count();
+        spdlog::info("Batch: {} images done, {} failed, {:.1f} images/s, {:.1f} overall.", _done, _failed,
+            (_done - _reportedDone) / sinceReport, _done / elapsed);
+        _reportedAt = now;
+        _reportedDone = _done;
+    }
+    pthread_mutex_unlock(&_mtx);
+    delete item;
+}
+
+void* BatchRunner::read_thread(void *args) {
+    ((BatchRunner *)args)->readItems();
+    return NULL;
+}
+
+void* BatchRunner::decode_thread(void *args) {
+    ((BatchRunner *)args)->decodeItems();
+    return NULL;
+}
+
+void* BatchRunner::model_thread(void *args) {
+    ((BatchRunner *)args)->runModels();
+    return NULL;
+}
+
+void* BatchRunner::write_thread(void *args) {
+    ((BatchRunner *)args)->writeItems();
+    return NULL;
+}
+
+void BatchRunner::readItems() {
+    uint64_t index = _skip;      // skipDone read those before
+    try {
+        while(!_modelFailed.load()) {
+            BatchItem *item = new BatchItem;
+            if(!_source->next(*item, false)) {
+                delete item;
+                break;
+            }
+            item->index = index++;
+            _decodeQue->push(item);
+        }
+    }
+    catch(std::exception &err) {
+        spdlog::error("Read {} failed after {} images : {}", _options.input, index, err.what());
+        _readError = err.what();
+    }
+}
+
+void BatchRunner::decodeItems() {
+    BatchItem *item;
+    while(_decodeQue->pop(item)) {
+        if(item->error.empty() && !item->encoded.empty()) {
+            item->image.allocator = getPooledMatAllocator();
+            cv::imdecode(item->encoded, cv::IMREAD_COLOR, &item->image);
+            std::vector<uchar>().swap(item->encoded);
+        }
+        if(item->error.empty() && item->image.empty())
+            item->error = "undecodable";
+        // the generator runs at one size, the detector takes any
+        if(item->error.empty() && _options.taskMode == IMAGE_GENERATION)
+            cv::resize(item->image, item->image, cv::Size(_options.size, _options.size));
+        _modelQue->push(item);
+    }
+}
+
+void BatchRunner::runModels() {
+    // a backfill waits for its model however long it takes
+    CancelToken token;
+    ModelKind kind = _options.taskMode == IMAGE_GENERATION ? MODEL_GENERATOR : MODEL_DETECTOR;
+    BatchItem *item;
+    while(_modelQue->pop(item)) {
+        if(!item->error.empty()) {
+            _writeQue->push(item);
+            continue;
+        }
+        // a wait that timed out is retried, a failed model ends the run. Its items aren't
+        // written, the checkpoint stops before them
+        void *model = nullptr;
+        while(model == nullptr && !_modelFailed.load()) {
+            model = _models->acquireTrtModel(_options.taskMode, &token);
+            if(model == nullptr && _models->getLoader()->getState(kind) == MODEL_FAILED)
+                _modelFailed = true;
+        }
+        if(model == nullptr) {
+            delete item;
+            continue;
+        }
+        try {
+            if(_options.taskMode == IMAGE_DETECTION) {
+                ImageDetector *detector = (ImageDetector *)model;
+                TrtSession &session = detector->getSession(item->image.size());
+                item->boxes = detector->detect(item->image, session.buffers, session.context);
+            }
+            else {
+                ImageGenerator *generator = (ImageGenerator *)model;
+                TrtSession &session = generator->getSession(item->image.size());
+                generator->inference(item->image, session.buffers, session.context);
+            }
+        }
+        catch(std::exception &err) {
+            item->error = err.what();
+        }
+        _models->addTrtModel(_options.taskMode, model);
+        _writeQue->push(item);
+    }
+}
+
+void BatchRunner::writeItems() {
+    BatchItem *item;
+    while(_writeQue->pop(item)) {
+        std::string output;
+        if(item->error.empty() && _options.taskMode == IMAGE_GENERATION) {
+            size_t dot = item->name.find_last_of('.');
+            size_t slash = item->name.find_last_of('/');
+            std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ?
+                item->name.substr(0, dot) : item->name;
+            output = std::string(BATCH_IMAGES_DIR) + "/" + stem + _options.format;
+            std::string path = _options.outDir + "/" + output;
+            try {
+                if(!isSafeName(item->name))
+                    item->error = "unsafe name";
+                else if(!makeDirs(path.substr(0, path.find_last_of('/'))) || !cv::imwrite(path, item->image))
+                    item->error = "can't write " + output;
+            }
+            catch(cv::Exception &err) {
+                item->error = err.what();
+            }
+        }
+        complete(item, output);
+    }
+}
+
+BatchStats BatchRunner::run() {
+    if(!makeDirs(_options.outDir))
+        throw std::runtime_error("Can't create " + _options.outDir + " : " + strerror(errno));
+    restoreCheckpoint();
+    _source = openSource(_options.input);
+    skipDone();
+    waitForModel();
+
+    ModelKind kind = _options.taskMode == IMAGE_GENERATION ? MODEL_GENERATOR : MODEL_DETECTOR;
+    int slots = _models->getLoader()->getSlots(kind);
+    spdlog::info("Batch {} of {} into {}: {} decoders, {} model slots, {} writers.", batchTaskName(_options.taskMode),
+        _options.input, _options.outDir, _options.decodeThreads, slots, _options.encodeThreads);
+    _startedAt = std::chrono::steady_clock::now();
+    _reportedAt = _startedAt;
+
+    // each stage is joined before the queue after it is closed, the items flow out in order
+    pthread_t reader;
+    std::vector<pthread_t> decoders(_options.decodeThreads), models(slots), writers(_options.encodeThreads);
+    if(pthread_create(&reader, NULL, read_thread, this) != 0)
+        throw std::runtime_error("Create the batch reader thread failed.");
+    for(pthread_t &thread : decoders)
+        if(pthread_create(&thread, NULL, decode_thread, this) != 0)
+            throw std::runtime_error("Create a batch decode thread failed.");
+    for(pthread_t &thread : models)
+        if(pthread_create(&thread, NULL, model_thread, this) != 0)
+            throw std::runtime_error("Create a batch model thread failed.");
+    for(pthread_t &thread : writers)
+        if(pthread_create(&thread, NULL, write_thread, this) != 0)
+            throw std::runtime_error("Create a batch write thread failed.");
+    pthread_join(reader, NULL);
+    _decodeQue->close();
+    for(pthread_t &thread : decoders)
+        pthread_join(thread, NULL);
+    _modelQue->close();
+    for(pthread_t &thread : models)
+        pthread_join(thread, NULL);
+    _writeQue->close();
+    for(pthread_t &thread : writers)
+        pthread_join(thread, NULL);
+
+    BatchStats stats;
+    pthread_mutex_lock(&_mtx);
+    saveCheckpoint();
+    stats.done = _done;
+    stats.failed = _failed;
+    pthread_mutex_unlock(&_mtx);
+    stats.skipped = _skip;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _startedAt).count();
+    spdlog::info("Batch done: {} images in {:.1f}s, {:.1f} images/s, {} failed, {} done by an earlier run.",
+        stats.done, stats.seconds, stats.seconds > 0 ? stats.done / stats.seconds : 0.0, stats.failed, stats.skipped);
+    if(_modelFailed.load())
+        throw std::runtime_error(std::string("The ") + modelKindName(kind) + " failed. A rerun continues from the checkpoint.");
+    if(!_readError.empty())
+        throw std::runtime_error("The input ended early, " + _readError + ". A rerun continues from the checkpoint.");
+    return stats;
+}
@@ -0,0 +1,123 @@
+/*BatchRunner is the offline mode of the server, for backfills. It reads
+  the images of a directory tree, of a tar archive or the frames of a video
+  and runs them through the server's models, in a ModelPool of its own, without
+  the network between:
+
+    reader -> decoders -> model slots -> writers
+
+  Every stage has its own threads and a bounded queue in front of it, so
+  decoding and encoding overlap the models and each model slot is kept busy.
+
+  results.jsonl in the output directory gets one line per input, in input
+  order: the boxes of a detection, or the file a generated image was written
+  to under images/. The checkpoint records how many inputs are done, a
+  digest of their names and the length of the results at that point. A
+  rerun truncates the results there and skips those inputs, the few done
+  past the checkpoint are done again. It refuses an input whose first names
+  no longer match the digest, the results kept would belong to other files.*/
+#ifndef BATCHRUNNER_HPP
+#define BATCHRUNNER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <pthread.h>
+#include <opencv2/core.hpp>
+#include "Protocol.hpp"
+#include "trtModel/imageProcess.hpp"
+
+class ModelPool;
+
+const int BATCH_QUEUE_DEPTH = 64;           // items waiting in front of each stage
+const int BATCH_CHECKPOINT_EVERY = 1000;    // items between checkpoints
+const int BATCH_REPORT_INTERVAL_S = 10;
+const char BATCH_RESULTS_FILE[] = "results.jsonl";
+const char BATCH_CHECKPOINT_FILE[] = "checkpoint";
+const char BATCH_IMAGES_DIR[] = "images";
+
+struct BatchOptions {
+    std::string input;          // a directory, a .tar archive or a video file
+    std::string outDir;
+    TaskMode taskMode;          // IMAGE_DETECTION or IMAGE_GENERATION
+    int size;                   // generation: the side the images are resized to
+    std::string format;         // generation: the extension of the images written, e.g. ".png"
+    int decodeThreads;
+    int encodeThreads;
+    bool restart;               // ignore the checkpoint and start over
+};
+
+// throws runtime_error with the usage on a malformed command line
+BatchOptions parseBatchOptions(int argc, char *argv[]);
+
+struct BatchStats {
+    uint64_t done;              // this run, the skipped ones not counted
+    uint64_t failed;            // of done, unreadable inputs and model errors
+    uint64_t skipped;           // done by an earlier run
+    double seconds;
+};
+
+struct BatchItem {
+    uint64_t index;             // in input order, counting images only
+    std::string name;           // relative to the input
+    std::vector<uchar> encoded; // the file, empty for a video frame
+    cv::Mat image;
+    std::vector<FaceBox> boxes;
+    std::string error;          // empty unless the item failed
+};
+
+class BatchSource;
+template <typename T> class BoundedQueue;
+
+class BatchRunner {
+    private:
+        ModelPool *_models;
+        BatchOptions _options;
+        BatchSource *_source;
+        uint64_t _skip;             // from the checkpoint
+        std::string _readError;     // the input ended early
+        std::atomic<bool> _modelFailed; // the rest is left for a rerun
+
+        BoundedQueue<BatchItem *> *_decodeQue;
+        BoundedQueue<BatchItem *> *_modelQue;
+        BoundedQueue<BatchItem *> *_writeQue;
+
+        // the results are written in input order, those done early wait here
+        pthread_mutex_t _mtx;
+        std::map<uint64_t, std::pair<uint64_t, std::string>> _pending;    // the hash of the name and the line
+        uint64_t _next;
+        uint64_t _listing;          // digest of the names of the _next first inputs
+        FILE *_results;
+        uint64_t _resultsBytes;
+        uint64_t _done;
+        uint64_t _failed;
+        uint64_t _sinceCheckpoint;
+        std::chrono::steady_clock::time_point _startedAt;
+        std::chrono::steady_clock::time_point _reportedAt;
+        uint64_t _reportedDone;
+
+        static void* read_thread(void *args);
+        static void* decode_thread(void *args);
+        static void* model_thread(void *args);
+        static void* write_thread(void *args);
+        void readItems();
+        void decodeItems();
+        void runModels();
+        void writeItems();
+
+        void waitForModel();
+        void restoreCheckpoint();
+        void skipDone();            // throws runtime_error when the input doesn't start as the checkpoint's did
+        void saveCheckpoint();      // with _mtx held
+        void complete(BatchItem *item, const std::string &output);   // frees the item
+        std::string resultLine(const BatchItem &item, const std::string &output) const;
+    public:
+        BatchRunner(ModelPool *models, const BatchOptions &options);
+        ~BatchRunner();
+        // blocks until every input is done, throws runtime_error when the input or the output can't be used
+        BatchStats run();
+};
+
+#endif
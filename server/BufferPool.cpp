@@ -0,0 +1,196 @@
+#include "BufferPool.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+BufferPool::BufferPool(size_t maxIdleBytes)
+    : _maxIdleBytes(maxIdleBytes), _hits(0), _misses(0), _idleBytes(0), _usedBytes(0) {
+    for(int i = 0; i < BUFFER_CLASS_NUMS; ++i)
+        pthread_mutex_init(&_classes[i].mtx, NULL);
+}
+
+BufferPool::~BufferPool() {
+    for(int i = 0; i < BUFFER_CLASS_NUMS; ++i) {
+        for(void *data : _classes[i].free)
+            free(data);
+        pthread_mutex_destroy(&_classes[i].mtx);
+    }
+}
+
+int BufferPool::classOf(size_t nbBytes) {
+    if(nbBytes <= ((size_t)1 << BUFFER_MIN_SHIFT))
+        return 0;
+    // four classes per power of two, the two bits below the top one pick the quarter
+    size_t last = nbBytes - 1;
+    int shift = 63 - __builtin_clzll(last);
+    int quarter = (last >> (shift - 2)) & 3;
+    return (shift - BUFFER_MIN_SHIFT) * 4 + quarter + 1;
+}
+
+size_t BufferPool::classSize(int sizeClass) {
+    return (size_t)(4 + sizeClass % 4) << (sizeClass / 4 + BUFFER_MIN_SHIFT - 2);
+}
+
+size_t BufferPool::roundUp(size_t nbBytes) {
+    int sizeClass = classOf(nbBytes);
+    if(sizeClass >= BUFFER_CLASS_NUMS)
+        return (nbBytes + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    return classSize(sizeClass);
+}
+
+void* BufferPool::allocate(size_t nbBytes) {
+    int sizeClass = classOf(nbBytes);
+    size_t capacity = roundUp(nbBytes);
+    void *data = nullptr;
+    if(sizeClass < BUFFER_CLASS_NUMS) {
+        SizeClass &cls = _classes[sizeClass];
+        pthread_mutex_lock(&cls.mtx);
+        if(!cls.free.empty()) {
+            data = cls.free.back();
+            cls.free.pop_back();
+        }
+        pthread_mutex_unlock(&cls.mtx);
+        if(data != nullptr) {
+            _idleBytes -= capacity;
+            _usedBytes += capacity;
+            _hits++;
+            return data;
+        }
+        _usedBytes += capacity;
+    }
+    _misses++;
+    if(posix_memalign(&data, BUFFER_ALIGNMENT, capacity) != 0)
+        throw std::bad_alloc();
+    return data;
+}
+
+void BufferPool::release(void *data, size_t nbBytes) {
+    if(data == nullptr)
+        return;
+    int sizeClass = classOf(nbBytes);
+    if(sizeClass >= BUFFER_CLASS_NUMS) {
+        free(data);
+        return;
+    }
+    size_t capacity = classSize(sizeClass);
+    _usedBytes -= capacity;
+    // over the limit the buffer goes back to the heap instead of growing the pool
+    if(_idleBytes.fetch_add(capacity) + capacity > _maxIdleBytes) {
+        _idleBytes -= capacity;
+        free(data);
+        return;
+    }
+    SizeClass &cls = _classes[sizeClass];
+    pthread_mutex_lock(&cls.mtx);
+    cls.free.push_back(data);
+    pthread_mutex_unlock(&cls.mtx);
+}
+
+BufferPoolStats BufferPool::getStats() const {
+    BufferPoolStats stats;
+    stats.hits = _hits.load();
+    stats.misses = _misses.load();
+    stats.idleBytes = _idleBytes.load();
+    stats.usedBytes = _usedBytes.load();
+    return stats;
+}
+
+BufferPool& getBufferPool() {
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+PooledBuffer::PooledBuffer(size_t size) : _data(nullptr), _size(0), _capacity(0) {
+    resize(size);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other)
+    : _data(other._data), _size(other._size), _capacity(other._capacity) {
+    other._data = nullptr;
+    other._size = other._capacity = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer &&other) {
+    if(this != &other) {
+        clear();
+        _data = other._data;
+        _size = other._size;
+        _capacity = other._capacity;
+        other._data = nullptr;
+        other._size = other._capacity = 0;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    clear();
+}
+
+void PooledBuffer::resize(size_t size) {
+    if(size > _capacity) {
+        uchar *data = (uchar *)getBufferPool().allocate(size);
+        if(_size > 0)
+            memcpy(data, _data, _size);
+        getBufferPool().release(_data, _capacity);
+        _data = data;
+        _capacity = BufferPool::roundUp(size);
+    }
+    _size = size;
+}
+
+void PooledBuffer::assign(const uchar *data, size_t size) {
+    _size = 0;      // nothing to keep on a reallocation
+    resize(size);
+    if(size > 0)
+        memcpy(_data, data, size);
+}
+
+void PooledBuffer::clear() {
+    getBufferPool().release(_data, _capacity);
+    _data = nullptr;
+    _size = _capacity = 0;
+}
+
+cv::UMatData* PooledMatAllocator::allocate(int dims, const int *sizes, int type, void *data0,
+    size_t *step, cv::AccessFlag, cv::UMatUsageFlags) const {
+    // the same layout as OpenCV's own allocator, only the memory comes from the pool
+    size_t total = CV_ELEM_SIZE(type);
+    for(int i = dims - 1; i >= 0; --i) {
+        if(step) {
+            if(data0 && step[i] != CV_AUTOSTEP) {
+                CV_Assert(total <= step[i]);
+                total = step[i];
+            }
+            else
+                step[i] = total;
+        }
+        total *= sizes[i];
+    }
+    cv::UMatData *u = new cv::UMatData(this);
+    u->size = total;
+    if(data0) {
+        u->data = u->origdata = (uchar *)data0;
+        u->flags |= cv::UMatData::USER_ALLOCATED;
+    }
+    else
+        u->data = u->origdata = (uchar *)getBufferPool().allocate(total);
+    return u;
+}
+
+bool PooledMatAllocator::allocate(cv::UMatData *data, cv::AccessFlag, cv::UMatUsageFlags) const {
+    return data != nullptr;
+}
+
+void PooledMatAllocator::deallocate(cv::UMatData *data) const {
+    if(data == nullptr)
+        return;
+    CV_Assert(data->urefcount == 0 && data->refcount == 0);
+    if(!(data->flags & cv::UMatData::USER_ALLOCATED))
+        getBufferPool().release(data->origdata, data->size);
+    delete data;
+}
+
+cv::MatAllocator* getPooledMatAllocator() {
+    static PooledMatAllocator *allocator = new PooledMatAllocator();
+    return allocator;
+}
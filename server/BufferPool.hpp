@@ -0,0 +1,100 @@
+/*Pooled, 64 byte aligned buffers for the network and codec data path.
+  Buffers are handed out in size classes, four per power of two from 4 KiB
+  to 64 MiB, so a buffer returned by one request fits the next request of a
+  similar size. Released buffers stay in a per-class free list until the
+  pool holds its idle byte limit, larger buffers bypass the pool.
+
+  PooledBuffer owns one buffer (request payloads, cached responses) and
+  PooledMatAllocator lets a cv::Mat draw its pixels from the same pool.*/
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+
+const size_t BUFFER_ALIGNMENT = 64;
+const int BUFFER_MIN_SHIFT = 12;                // smallest class 4 KiB
+const int BUFFER_CLASS_NUMS = 57;               // largest class 64 MiB
+const size_t DEFAULT_BUFFER_POOL_BYTES = 512 << 20;
+
+struct BufferPoolStats {
+    uint64_t hits;          // allocations served from a free list
+    uint64_t misses;        // allocations that went to the heap
+    uint64_t idleBytes;     // bytes waiting in the free lists
+    uint64_t usedBytes;     // pooled bytes handed out
+};
+
+class BufferPool {
+    private:
+        struct SizeClass {
+            pthread_mutex_t mtx;
+            std::vector<void *> free;
+        };
+        SizeClass _classes[BUFFER_CLASS_NUMS];
+        size_t _maxIdleBytes;
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _idleBytes;
+        std::atomic<uint64_t> _usedBytes;
+
+        static int classOf(size_t nbBytes);
+        static size_t classSize(int sizeClass);
+    public:
+        BufferPool(size_t maxIdleBytes = DEFAULT_BUFFER_POOL_BYTES);
+        ~BufferPool();
+
+        // the capacity a request of nbBytes is rounded up to
+        static size_t roundUp(size_t nbBytes);
+        // nbBytes has to be passed back unchanged (or as the rounded capacity) on release
+        void* allocate(size_t nbBytes);
+        void release(void *data, size_t nbBytes);
+        void setMaxIdleBytes(size_t maxIdleBytes) { _maxIdleBytes = maxIdleBytes; }
+        BufferPoolStats getStats() const;
+};
+
+// the process wide pool, never destroyed so late cv::Mat releases stay valid
+BufferPool& getBufferPool();
+
+class PooledBuffer {
+    private:
+        uchar *_data;
+        size_t _size;
+        size_t _capacity;
+    public:
+        PooledBuffer() : _data(nullptr), _size(0), _capacity(0) {}
+        explicit PooledBuffer(size_t size);
+        PooledBuffer(PooledBuffer &&other);
+        PooledBuffer& operator=(PooledBuffer &&other);
+        PooledBuffer(const PooledBuffer &) = delete;
+        PooledBuffer& operator=(const PooledBuffer &) = delete;
+        ~PooledBuffer();
+
+        // keeps the first min(size, old size) bytes
+        void resize(size_t size);
+        void assign(const uchar *data, size_t size);
+        void clear();
+        uchar* data() { return _data; }
+        const uchar* data() const { return _data; }
+        size_t size() const { return _size; }
+        size_t capacity() const { return _capacity; }
+        bool empty() const { return _size == 0; }
+        // a header over the bytes for the codecs, no copy
+        cv::Mat asMat() const { return cv::Mat(1, (int)_size, CV_8UC1, (void *)_data); }
+};
+
+class PooledMatAllocator : public cv::MatAllocator {
+    public:
+        cv::UMatData* allocate(int dims, const int *sizes, int type, void *data0,
+            size_t *step, cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override;
+        bool allocate(cv::UMatData *data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override;
+        void deallocate(cv::UMatData *data) const override;
+};
+
+// set as Mat::allocator before the Mat is created, outputs written into it keep using it
+cv::MatAllocator* getPooledMatAllocator();
+
+#endif
@@ -0,0 +1,40 @@
+/*CancelToken tells a request whether its result is still wanted. It fires
+  when the connection of the request hangs up or when the client supplied
+  deadline expires. Workers check it between the stages of a request.*/
+#ifndef CANCELTOKEN_HPP
+#define CANCELTOKEN_HPP
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+class CancelToken {
+    private:
+        const std::atomic<bool> *_connClosed;   // owned by the connection, outlives the request
+        bool _hasDeadline;
+        TimePoint _deadline;
+    public:
+        CancelToken() : _connClosed(nullptr), _hasDeadline(false) {}
+
+        void bindConnection(const std::atomic<bool> *connClosed) { _connClosed = connClosed; }
+        void setDeadline(TimePoint deadline) {
+            _hasDeadline = true;
+            _deadline = deadline;
+        }
+        bool hasDeadline() const { return _hasDeadline; }
+        TimePoint getDeadline() const { return _deadline; }
+
+        bool isHungUp() const { return _connClosed != nullptr && _connClosed->load(std::memory_order_relaxed); }
+        bool isExpired() const { return _hasDeadline && std::chrono::steady_clock::now() >= _deadline; }
+        bool isCancelled() const { return isHungUp() || isExpired(); }
+};
+
+// thrown at a stage boundary to drop a cancelled request
+class RequestCancelled : public std::runtime_error {
+    public:
+        RequestCancelled(const std::string &stage) : std::runtime_error(stage) {}
+};
+
+#endif
@@ -0,0 +1,31 @@
+/*This header define the file format of a traffic capture. A capture is a
+  CaptureFileHeader followed by one CaptureRecord per request, each record
+  is followed by the request payload (header.payloadSize bytes). Records
+  are appended in arrival order. Like the wire format, the fields are in
+  host byte order.*/
+#ifndef CAPTUREFORMAT_HPP
+#define CAPTUREFORMAT_HPP
+
+#include <stdint.h>
+#include "Protocol.hpp"
+
+const uint32_t CAPTURE_MAGIC = 0x43435753;  // "SWCC"
+const uint32_t CAPTURE_VERSION = 1;
+
+struct CaptureFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t startUnixUs;   // wall clock time of the first record's time base
+};
+
+struct CaptureRecord {
+    uint64_t arrivalUs;     // since the capture started
+    uint64_t connId;        // requests of one connection keep their order on replay
+    RequestHeader header;   // magic != PROTOCOL_MAGIC for a legacy request
+    uint32_t reserved;
+};
+
+static_assert(sizeof(CaptureFileHeader) == 16, "CaptureFileHeader layout changed");
+static_assert(sizeof(CaptureRecord) == 40, "CaptureRecord layout changed");
+
+#endif
@@ -0,0 +1,77 @@
+#include "Config.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static std::string trim(const std::string &text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if(begin == std::string::npos)
+        return "";
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+void Config::parse(const std::string &text, const std::string &source) {
+    std::istringstream in(text);
+    std::string line;
+    int lineNum = 0;
+    while(std::getline(in, line)) {
+        lineNum++;
+        size_t comment = line.find('#');
+        if(comment != std::string::npos)
+            line.resize(comment);
+        line = trim(line);
+        if(line.empty())
+            continue;
+        size_t eq = line.find('=');
+        std::string key = trim(line.substr(0, eq));
+        if(eq == std::string::npos || key.empty())
+            throw std::runtime_error(source + ":" + std::to_string(lineNum) + ": expected key = value");
+        _values[key] = trim(line.substr(eq + 1));
+    }
+}
+
+void Config::load(const std::string &path) {
+    std::ifstream file(path);
+    if(!file)
+        throw std::runtime_error("Open config " + path + " failed.");
+    std::stringstream text;
+    text << file.rdbuf();
+    parse(text.str(), path);
+}
+
+std::string Config::getString(const std::string &key, const std::string &fallback) const {
+    auto it = _values.find(key);
+    return it == _values.end() ? fallback : it->second;
+}
+
+long Config::getInt(const std::string &key, long fallback) const {
+    auto it = _values.find(key);
+    if(it == _values.end())
+        return fallback;
+    try {
+        return std::stol(it->second);
+    }
+    catch(std::exception &) {
+        throw std::runtime_error("Config " + key + " is not an integer: " + it->second);
+    }
+}
+
+double Config::getDouble(const std::string &key, double fallback) const {
+    auto it = _values.find(key);
+    if(it == _values.end())
+        return fallback;
+    try {
+        return std::stod(it->second);
+    }
+    catch(std::exception &) {
+        throw std::runtime_error("Config " + key + " is not a number: " + it->second);
+    }
+}
+
+std::vector<std::pair<std::string, std::string>> Config::getPrefixed(const std::string &prefix) const {
+    std::vector<std::pair<std::string, std::string>> entries;
+    for(auto it = _values.lower_bound(prefix); it != _values.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+        entries.push_back({it->first.substr(prefix.size()), it->second});
+    return entries;
+}
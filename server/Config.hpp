@@ -0,0 +1,28 @@
+/*Config holds the server configuration file: one `key = value` per line,
+  `#` starts a comment and blank lines are skipped. A later value replaces
+  an earlier one, so a file loaded over the built-in defaults only has to
+  name what it changes. Modules read the keys they know.*/
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+class Config {
+    private:
+        std::map<std::string, std::string> _values;
+    public:
+        // throws runtime_error naming the source and line of a malformed entry
+        void parse(const std::string &text, const std::string &source);
+        void load(const std::string &path);
+
+        bool has(const std::string &key) const { return _values.count(key) > 0; }
+        std::string getString(const std::string &key, const std::string &fallback = "") const;
+        long getInt(const std::string &key, long fallback) const;
+        double getDouble(const std::string &key, double fallback) const;
+        // the entries whose key starts with prefix, the prefix stripped off
+        std::vector<std::pair<std::string, std::string>> getPrefixed(const std::string &prefix) const;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "ConnectionTable.hpp"
+#include <stdexcept>
+#include <sys/resource.h>
+
+const int DEFAULT_MAX_FDS = 65536;
+
+ConnectionTable::ConnectionTable() : _size(0) {
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        _maxFds = limit.rlim_cur;
+    else
+        _maxFds = DEFAULT_MAX_FDS;
+    _pageNums = (_maxFds + CONNECTION_PAGE_SLOTS - 1) / CONNECTION_PAGE_SLOTS;
+    _pages = new std::atomic<Slot *>[_pageNums];
+    for(int i = 0; i < _pageNums; ++i)
+        _pages[i].store(nullptr);
+}
+
+ConnectionTable::~ConnectionTable() {
+    for(int i = 0; i < _pageNums; ++i)
+        delete[] _pages[i].load();
+    delete[] _pages;
+}
+
+ConnectionTable::Slot* ConnectionTable::findSlot(int fd) const {
+    if(fd < 0 || fd >= _maxFds)
+        return nullptr;
+    Slot *page = _pages[fd / CONNECTION_PAGE_SLOTS].load(std::memory_order_acquire);
+    return page == nullptr ? nullptr : &page[fd % CONNECTION_PAGE_SLOTS];
+}
+
+ConnHandle ConnectionTable::insert(int fd, std::shared_ptr<DataChannel> channel) {
+    if(fd < 0 || fd >= _maxFds)
+        throw std::runtime_error("Socket fd beyond the connection table.");
+    std::atomic<Slot *> &page = _pages[fd / CONNECTION_PAGE_SLOTS];
+    if(page.load(std::memory_order_relaxed) == nullptr) {
+        Slot *slots = new Slot[CONNECTION_PAGE_SLOTS];
+        for(int i = 0; i < CONNECTION_PAGE_SLOTS; ++i)
+            slots[i].generation.store(0, std::memory_order_relaxed);
+        page.store(slots, std::memory_order_release);
+    }
+    Slot *slot = findSlot(fd);
+    uint32_t generation = slot->generation.load(std::memory_order_relaxed);
+    if(generation & 1)
+        throw std::runtime_error("Socket fd already holds a connection.");
+    std::atomic_store(&slot->channel, channel);
+    slot->generation.store(generation + 1, std::memory_order_release);
+    _size++;
+    return makeConnHandle(fd, generation + 1);
+}
+
+std::shared_ptr<DataChannel> ConnectionTable::remove(ConnHandle handle) {
+    Slot *slot = findSlot(connHandleFd(handle));
+    if(slot == nullptr || slot->generation.load(std::memory_order_relaxed) != connHandleGeneration(handle))
+        return nullptr;
+    // the generation moves first, a lookup racing with us fails its second check
+    slot->generation.store(connHandleGeneration(handle) + 1, std::memory_order_release);
+    _size--;
+    return std::atomic_exchange(&slot->channel, std::shared_ptr<DataChannel>());
+}
+
+std::shared_ptr<DataChannel> ConnectionTable::lookup(ConnHandle handle) const {
+    Slot *slot = findSlot(connHandleFd(handle));
+    uint32_t generation = connHandleGeneration(handle);
+    if(slot == nullptr || slot->generation.load(std::memory_order_acquire) != generation)
+        return nullptr;
+    std::shared_ptr<DataChannel> channel = std::atomic_load(&slot->channel);
+    // removed, and maybe reused, while we loaded the channel
+    if(slot->generation.load(std::memory_order_acquire) != generation)
+        return nullptr;
+    return channel;
+}
+
+bool ConnectionTable::isCurrent(ConnHandle handle) const {
+    Slot *slot = findSlot(connHandleFd(handle));
+    return slot != nullptr && slot->generation.load(std::memory_order_acquire) == connHandleGeneration(handle);
+}
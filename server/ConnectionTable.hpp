@@ -0,0 +1,63 @@
+/*ConnectionTable maps socket fds to their connections. Slots are indexed
+  by the fd itself and allocated a page at a time up to RLIMIT_NOFILE, so
+  a lookup is two array reads instead of a tree walk. Every slot carries a
+  generation that is odd while a connection holds it and bumped on insert
+  and remove. Tasks keep a ConnHandle (fd and generation) instead of a
+  bare fd, so a handle that outlived its connection is detected even
+  after the kernel handed the fd to a new client.
+
+  Only the event loop inserts and removes, any thread may look up.*/
+#ifndef CONNECTIONTABLE_HPP
+#define CONNECTIONTABLE_HPP
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+class DataChannel;
+
+const int CONNECTION_PAGE_SLOTS = 4096;
+
+typedef uint64_t ConnHandle;
+
+inline ConnHandle makeConnHandle(int fd, uint32_t generation) {
+    return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+inline int connHandleFd(ConnHandle handle) {
+    return (int)(uint32_t)handle;
+}
+
+inline uint32_t connHandleGeneration(ConnHandle handle) {
+    return handle >> 32;
+}
+
+class ConnectionTable {
+    private:
+        struct Slot {
+            std::atomic<uint32_t> generation;       // odd while a connection holds the slot
+            std::shared_ptr<DataChannel> channel;   // only through std::atomic_load and atomic_store
+        };
+
+        int _maxFds;
+        int _pageNums;
+        std::atomic<Slot *> *_pages;                // never freed before the table
+        std::atomic<size_t> _size;
+
+        Slot* findSlot(int fd) const;
+    public:
+        ConnectionTable();
+        ~ConnectionTable();
+
+        // event loop only, throws if the fd is beyond the process fd limit
+        ConnHandle insert(int fd, std::shared_ptr<DataChannel> channel);
+        // the removed connection, nullptr if the handle is stale
+        std::shared_ptr<DataChannel> remove(ConnHandle handle);
+
+        // nullptr if the handle is stale
+        std::shared_ptr<DataChannel> lookup(ConnHandle handle) const;
+        bool isCurrent(ConnHandle handle) const;
+        size_t size() const { return _size.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -1,25 +1,61 @@
 #include "Datachannel.hpp"
+#include <sys/uio.h>
+
+const int SOCKET_IO_TIMEOUT_MS = 5000;  // give up on a peer that stalls mid-frame
+const int FRAME_RECV_MAX_MS = 30000;    // and on one that trickles a frame in, however it paces the bytes
+const double GENERATION_COST = 20;      // a generation at GENERATION_COST_SIZE costs 20 detections
+const int GENERATION_COST_SIZE = 512;
+const size_t ENCODE_SCRATCH_MAX = 16 << 20;  // a thread gives encode space beyond this back
+
+// imencode only writes into a vector, each worker keeps one and reuses its capacity
+static thread_local std::vector<uchar> encodeScratch;
+static thread_local std::vector<uchar> encodeItemScratch;     // one image of a list
+
+std::atomic<uint64_t> DataChannel::_responseCount[RESPONSE_STATUS_NUMS];
+std::atomic<uint64_t> DataChannel::_nextConnId(1);
+std::atomic<uint64_t> DataChannel::_droppedCount(0);
 
 DataChannel::DataChannel(int sockfd) 
-    : _sockfd(sockfd) {
+    : _sockfd(sockfd), _connId(_nextConnId++), _handle(0), _closed(false), _peerShutdown(false), _tracker(nullptr), _motionGate(nullptr),
+      _bufferedBytes(0), _headerPending(false), _frameDeadline(std::chrono::steady_clock::now()) {
     pthread_mutex_init(&_mtx, NULL);
 }
 
 DataChannel::~DataChannel() {
-    spdlog::error("Free DataChannel of {}", _sockfd);
+    LOG_DEBUG("Free DataChannel of {}", _sockfd);
+    delete _tracker;
+    delete _motionGate;
+    close(_sockfd);
     pthread_mutex_destroy(&_mtx);
 }
 
+// wait until the non-blocking socket is ready for the given poll events
+static bool waitSocket(int sockfd, short events, int timeoutMs = SOCKET_IO_TIMEOUT_MS) {
+    if(timeoutMs <= 0)
+        return false;
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = events;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeoutMs) > 0 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+// fails on a stall of SOCKET_IO_TIMEOUT_MS and once the deadline passed
 template <typename dataType>
-bool recvAll(int sockfd, dataType *buf, size_t fileSize) {
+bool recvAll(int sockfd, dataType *buf, size_t fileSize, TimePoint deadline) {
     while (fileSize > 0)
     {
         ssize_t readbytes = recv(sockfd, buf, fileSize, 0);
+        if(readbytes == 0)
+            return false;   // the peer closed the connection
         if(readbytes == -1){
-            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            int leftMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                waitSocket(sockfd, POLLIN, std::min(SOCKET_IO_TIMEOUT_MS, leftMs)))
                 continue;
             else
-                false;
+                return false;
         }
         fileSize -= readbytes;
         buf += readbytes;
@@ -27,78 +63,669 @@ bool recvAll(int sockfd, dataType *buf, size_t fileSize) {
     return true;
 }
 
-template <typename dataType>
-bool sendAll(int sockfd, const dataType *buf, size_t fileSize) {
-    while (fileSize > 0)
-    {
-        ssize_t sendBytes= send(sockfd, buf, fileSize, 0);
-        if(sendBytes == -1)
+// sends the buffers as one message, resuming after partial writes
+static bool sendAllv(int sockfd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while(msg.msg_iovlen > 0) {
+        // MSG_NOSIGNAL: a client that went away must not raise SIGPIPE in the server
+        ssize_t sendBytes = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if(sendBytes == -1) {
+            if((errno == EAGAIN || errno == EWOULDBLOCK) && waitSocket(sockfd, POLLOUT))
+                continue;
             return false;
-        fileSize -= sendBytes;
-        buf += sendBytes;
+        }
+        while(msg.msg_iovlen > 0 && (size_t)sendBytes >= msg.msg_iov->iov_len) {
+            sendBytes -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uchar *)msg.msg_iov->iov_base + sendBytes;
+            msg.msg_iov->iov_len -= sendBytes;
+        }
     }
     return true;
 }
 
+cv::Mat DataChannel::decodeImage(const PooledBuffer &payload) {
+    cv::Mat img;
+    if(payload.empty())
+        return img;
+    // the codec reads the received bytes in place and writes the pixels into the pool
+    img.allocator = getPooledMatAllocator();
+    cv::imdecode(payload.asMat(), cv::IMREAD_COLOR, &img);
+    return img;
+}
+
 cv::Mat DataChannel::recvImage() {
-    pthread_mutex_lock(&_mtx);
-    // receive the size of image byte stream
-    int image_size = 0;
-    if(recv(_sockfd, &image_size, sizeof(int), 0) == -1 && errno == EAGAIN){
-        pthread_mutex_unlock(&_mtx);
+    RequestHeader header;
+    PooledBuffer payload;
+    if(!recvRequest(header, payload))
         return {};
-    }
+    cv::Mat img = decodeImage(payload);
+    if(img.empty())
+        LOG_ERROR("Image decode error! Maybe receive image failed.");
+    return img;
+}
 
-    spdlog::info("Recevied image size : {}", image_size);
+bool DataChannel::recvHeader(RequestHeader &header) {
+    memset(&header, 0, sizeof(header));
+    pthread_mutex_lock(&_mtx);
+    // a request starts either with the protocol magic or with the legacy image size
+    uint32_t prefix = 0;
+    ssize_t readbytes = recv(_sockfd, &prefix, sizeof(prefix), 0);
+    // the frame has a bounded time from its first byte on, a slow peer can't hold the worker
+    _frameDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(FRAME_RECV_MAX_MS);
+    bool received = readbytes > 0 &&
+        recvAll(_sockfd, (uchar *)&prefix + readbytes, sizeof(prefix) - readbytes, _frameDeadline);
+    if(received && parseRequestPrefix(prefix, header))
+        received = recvAll(_sockfd, (uchar *)&header + sizeof(prefix), sizeof(header) - sizeof(prefix),
+            _frameDeadline);
+    pthread_mutex_unlock(&_mtx);
+    if(received)
+        LOG_DEBUG("Recevied image size : {}", header.payloadSize);
+    return received;
+}
+
+bool DataChannel::recvPayload(const RequestHeader &header, PooledBuffer &payload) {
+    pthread_mutex_lock(&_mtx);
     // receive the image byte stream
-    uchar buf[image_size];
-    memset(buf, 0, image_size);
-    recvAll(_sockfd, buf, image_size);
+    payload.resize(header.payloadSize);
+    bool received = recvAll(_sockfd, payload.data(), payload.size(), _frameDeadline);
     pthread_mutex_unlock(&_mtx);
+    return received;
+}
 
-    std::vector<uchar> encode_data(buf, buf + sizeof(buf) / sizeof(buf[0]));
-    cv::Mat img = cv::imdecode(encode_data, cv::IMREAD_COLOR);
-    if(img.empty())
-        spdlog::error("Image decode error! Maybe receive image failed.");
-    return img;
+bool DataChannel::recvRequest(RequestHeader &header, PooledBuffer &payload, size_t maxFrameBytes) {
+    if(!recvHeader(header))
+        return false;
+    if(header.payloadSize > maxFrameBytes) {
+        LOG_WARN("Refuse a frame of {} bytes.", header.payloadSize);
+        return false;
+    }
+    return recvPayload(header, payload);
 }
 
 void DataChannel::sendImage(cv::Mat img) {
-    std::vector<uchar> encode_data;
-    cv::imencode(".png", img, encode_data);
-    std::string str_encode(encode_data.begin(), encode_data.end());
+    RequestHeader legacy;
+    memset(&legacy, 0, sizeof(legacy));
+    const std::vector<uchar> &encoded = encodeImage(legacy, img);
 
     pthread_mutex_lock(&_mtx);
-    int length = str_encode.size();
-    if(send(_sockfd , &length, sizeof(int), 0) <= 0) 
-        spdlog::error("Send image length failed.");
-    if(sendAll(_sockfd, str_encode.c_str(), str_encode.size()))
-        spdlog::info("Send image successful.");
+    int length = encoded.size();
+    struct iovec iov[2] = {{&length, sizeof(int)}, {(void *)encoded.data(), encoded.size()}};
+    if(sendAllv(_sockfd, iov, 2))
+        LOG_DEBUG("Send image successful.");
     else 
-        spdlog::info("Send image failed.");
+        LOG_WARN("Send image failed.");
+    pthread_mutex_unlock(&_mtx);
+}
+
+const std::vector<uchar>& DataChannel::encodeImage(const RequestHeader &request, const cv::Mat &img) {
+    // one oversized image must not pin its buffer in the thread forever
+    if(encodeScratch.capacity() > ENCODE_SCRATCH_MAX)
+        std::vector<uchar>().swap(encodeScratch);
+    encodeScratch.clear();
+    if(!(request.flags & FLAG_BOXES_ONLY) && !img.empty()) {
+        StageTimer timer(STAGE_ENCODE);
+        cv::imencode(".png", img, encodeScratch);
+    }
+    return encodeScratch;
+}
+
+const std::vector<uchar>& DataChannel::encodeImageList(const RequestHeader &request, const std::vector<cv::Mat> &imgs) {
+    if(encodeScratch.capacity() > ENCODE_SCRATCH_MAX)
+        std::vector<uchar>().swap(encodeScratch);
+    encodeScratch.clear();
+    if(request.flags & FLAG_BOXES_ONLY)
+        return encodeScratch;
+    StageTimer timer(STAGE_ENCODE);
+    for(const cv::Mat &img : imgs) {
+        cv::imencode(".png", img, encodeItemScratch);
+        uint32_t length = encodeItemScratch.size();
+        encodeScratch.insert(encodeScratch.end(), (const uchar *)&length, (const uchar *)&length + sizeof(length));
+        encodeScratch.insert(encodeScratch.end(), encodeItemScratch.begin(), encodeItemScratch.end());
+    }
+    if(encodeItemScratch.capacity() > ENCODE_SCRATCH_MAX)
+        std::vector<uchar>().swap(encodeItemScratch);
+    return encodeScratch;
+}
+
+void DataChannel::sendResponse(const RequestHeader &request, cv::Mat img, 
+    const std::vector<WireBox> &boxes, uint8_t status) {
+    if(status == STATUS_OK) {
+        const std::vector<uchar> &encoded = encodeImage(request, img);
+        sendEncoded(request, encoded.data(), encoded.size(), boxes, status);
+    }
+    else
+        sendEncoded(request, nullptr, 0, boxes, status);
+}
+
+void DataChannel::sendEncoded(const RequestHeader &request, const uchar *encoded, size_t nbEncoded,
+    const std::vector<WireBox> &boxes, uint8_t status, uint8_t responseFlags, uint8_t sizePercent) {
+    bool sent = false;
+    StageTimer timer(STAGE_SEND);
+    pthread_mutex_lock(&_mtx);
+    if(request.magic != PROTOCOL_MAGIC) {
+        // legacy clients only understand the bare image reply
+        int length = nbEncoded;
+        struct iovec iov[2] = {{&length, sizeof(int)}, {(void *)encoded, nbEncoded}};
+        sent = sendAllv(_sockfd, iov, 2);
+    }
+    else {
+        ResponseHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = PROTOCOL_MAGIC;
+        header.payloadSize = nbEncoded;
+        header.boxCount = boxes.size();
+        header.status = status;
+        header.flags = responseFlags;
+        header.sizePercent = sizePercent;
+        // header, boxes and image leave in one syscall straight from where they were built
+        struct iovec iov[3] = {
+            {&header, sizeof(header)},
+            {(void *)boxes.data(), boxes.size() * sizeof(WireBox)},
+            {(void *)encoded, nbEncoded},
+        };
+        sent = sendAllv(_sockfd, iov, 3);
+    }
     pthread_mutex_unlock(&_mtx);
+    if(status < RESPONSE_STATUS_NUMS)
+        _responseCount[status]++;
+    if(sent)
+        LOG_DEBUG("Send image successful.");
+    else 
+        LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Send image failed.");
+}
+
+static CacheKey makeCacheKey(TaskConfig *conf, const RequestHeader &header, const PooledBuffer &payload) {
+    CacheKey key;
+    key.digest = hashBytes(payload.data(), payload.size());
+    key.payloadSize = payload.size();
+    key.taskMode = conf->taskMode;
+    key.flags = header.flags;
+    key.chain = conf->taskMode == IMAGE_CHAIN ? header.chain : 0;
+    key.width = conf->imgSize.width;
+    key.height = conf->imgSize.height;
+    key.modelVersion = conf->server->getModelPool()->getModelVersion(conf->taskMode);
+    return key;
 }
 
+// the read phase, the request itself is scheduled once its header is known
 void DataChannel::handleImage(void *args) {
     TaskConfig *conf = (TaskConfig *)args;
-    spdlog::info("Start process image.");
-    cv::Mat img = recvImage();
-    cv::resize(img, img, conf->imgSize);
-    if(img.empty())
-        spdlog::warn("Receive image failed.");
-    TrtPipeline *trtModel = (TrtPipeline *)(conf->server->getTrtModel(conf->taskMode));
-    std::shared_ptr<nvinfer1::IExecutionContext> context = trtModel->createContext(conf->imgSize);
-    std::shared_ptr<BufferManager> buffers = trtModel->createBuffer(context);
-    buffers->configContextTensorAddress(context);
-    trtModel->inference(img, buffers, context);
-    conf->server->addTrtModel(conf->taskMode, trtModel);
-    sendImage(img);
-    spdlog::info("Image process finished.");
+    TraceScope trace(conf->traceId);
+    LogScope log(_sockfd, conf->requestId);
+    setLogStage("recv");
+    LOG_DEBUG("Start process image.");
+    MemoryBudget *budget = conf->server->getMemoryBudget();
+    bool reserved = false;
+    if(_headerPending) {
+        _headerPending = false;
+        // resumed after a pause, the budget already took the payload bytes for us,
+        // unless the connection closed meanwhile and they were given back
+        if(!budget->claim(_bufferedBytes)) {
+            LOG_DEBUG("Paused read of a closed connection dropped.");
+            finishRequest(conf);
+            return;
+        }
+        conf->header = _pendingHeader;
+        conf->arrival = _pendingArrival;
+        // the pause was the server's, the peer gets the whole frame time for the payload
+        _frameDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(FRAME_RECV_MAX_MS);
+        reserved = true;
+    }
+    recordStageSpan(STAGE_RECV_WAIT, conf->arrival);
+    TimePoint recvStart = std::chrono::steady_clock::now();
+    if(!reserved && !recvHeader(conf->header)) {
+        LOG_DEBUG("Receive image failed, the peer closed.");
+        finishRequest(conf);
+        return;
+    }
+
+    size_t nbPayload = conf->header.payloadSize;
+    if(!reserved) {
+        if(!budget->checkFrame(nbPayload)) {
+            // the stream can't be resynchronized without reading the frame, drop the connection
+            LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Refuse a frame of {} bytes, close the connection.", nbPayload);
+            sendResponse(conf->header, cv::Mat(), {}, STATUS_BAD_REQUEST);
+            shutdown(_sockfd, SHUT_RDWR);
+            finishRequest(conf);    // the rearmed socket reports the hangup
+            return;
+        }
+        // the pending state is set first, the budget may resume us before reserve returns
+        _pendingHeader = conf->header;
+        _pendingArrival = conf->arrival;
+        _headerPending = true;
+        std::shared_ptr<DataChannel> self = shared_from_this();
+        ImageServer *server = conf->server;
+        // a paused connection is watched for a hangup, it would never be read again to notice one
+        if(!budget->reserve(nbPayload, _bufferedBytes, [self, server]() { server->rearmConnection(self->getHandle()); },
+            [self, server]() { server->watchHangup(self->getHandle()); })) {
+            // only a hangup is watched, nothing more is read until the budget resumes it
+            LOG_DEBUG("Memory budget exhausted, pause reading {} bytes.", nbPayload);
+            delete conf;
+            return;
+        }
+        _headerPending = false;
+    }
+    conf->budgetBytes = nbPayload;
+    if(!recvPayload(conf->header, conf->payload)) {
+        LOG_DEBUG("Receive image failed, the peer closed.");
+        finishRequest(conf);
+        return;
+    }
+    recordStageSpan(STAGE_RECV, recvStart);
+    if(TrafficCapture *capture = conf->server->getTrafficCapture())
+        capture->record(conf->arrival, _connId, conf->header, conf->payload);
+    conf->inFlight.arm(conf->server->getInFlightGauge());
+
+    const RequestHeader &header = conf->header;
+    conf->token.bindConnection(&_closed);
+    if(header.magic == PROTOCOL_MAGIC) {
+        if(header.deadlineMs > 0)
+            conf->token.setDeadline(conf->arrival + std::chrono::milliseconds(header.deadlineMs));
+        conf->taskMode = (TaskMode)header.taskMode;
+        if(header.width > 0 && header.height > 0)
+            conf->imgSize = cv::Size(header.width, header.height);
+    }
+    if(!isKnownTaskMode(conf->taskMode)) {
+        LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Unknown task mode {}.", header.taskMode);
+        sendResponse(header, cv::Mat(), {}, STATUS_BAD_REQUEST);
+        finishRequest(conf);
+        return;
+    }
+    if(conf->taskMode == IMAGE_CHAIN) {
+        conf->chain = conf->server->getModelChain(header.chain);
+        if(conf->chain == nullptr) {
+            LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Unknown model chain {}.", header.chain);
+            sendResponse(header, cv::Mat(), {}, STATUS_BAD_REQUEST);
+            finishRequest(conf);
+            return;
+        }
+    }
+    // the generator's dynamic profile, every other size is refused by the engine
+    if(conf->taskMode == IMAGE_GENERATION &&
+        (std::min(conf->imgSize.width, conf->imgSize.height) < DYNAMIC_MIN_SIZE ||
+         std::max(conf->imgSize.width, conf->imgSize.height) > DYNAMIC_MAX_SIZE)) {
+        LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Generation size {}x{} is out of {} to {}.", conf->imgSize.width,
+            conf->imgSize.height, DYNAMIC_MIN_SIZE, DYNAMIC_MAX_SIZE);
+        sendResponse(header, cv::Mat(), {}, STATUS_BAD_REQUEST);
+        finishRequest(conf);
+        return;
+    }
+
+    // models load in the background, a request for one still loading is turned away for a retry
+    ModelState modelState = conf->server->getModelPool()->getModelState(conf->taskMode, conf->chain);
+    if(modelState != MODEL_READY) {
+        LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Models of task mode {} are {}.", conf->taskMode, modelStateName(modelState));
+        sendResponse(header, cv::Mat(), {}, modelState == MODEL_FAILED ? STATUS_SERVER_ERROR : STATUS_OVERLOADED);
+        finishRequest(conf);
+        return;
+    }
+
+    // hear about a hangup while the request is queued or in flight. A client that shut
+    // down its side already sent its FIN, watching would cancel what it still waits for
+    if(!_peerShutdown.load())
+        conf->server->watchHangup(_handle);
+    conf->queuedAt = std::chrono::steady_clock::now();
+    std::function<void(void *)> func = std::bind(&DataChannel::handleProcess, shared_from_this(), std::placeholders::_1);
+    if(!conf->server->addTaskToThreadPool(func, conf, makeTaskAttr(conf))) {
+        sendResponse(header, cv::Mat(), {}, STATUS_OVERLOADED);
+        finishRequest(conf);
+    }
+}
+
+void DataChannel::handleProcess(void *args) {
+    TaskConfig *conf = (TaskConfig *)args;
+    TraceScope trace(conf->traceId);
+    LogScope log(_sockfd, conf->requestId);
+    processRequest(conf);
+    finishRequest(conf);
+}
+
+void DataChannel::finishRequest(TaskConfig *conf) {
+    // only requests that were read count, a failed read is a closing peer
+    if(conf->inFlight.isArmed())
+        recordStageSpan(STAGE_TOTAL, conf->arrival);
+    if(!isClosed())
+        conf->server->rearmConnection(_handle);
+    MemoryBudget *budget = conf->server->getMemoryBudget();
+    size_t budgetBytes = conf->budgetBytes;
+    delete conf;
+    // after the payload is freed, this may resume paused connections
+    if(budgetBytes > 0)
+        budget->release(budgetBytes, _bufferedBytes);
+}
+
+TaskAttr DataChannel::makeTaskAttr(TaskConfig *conf) {
+    TaskAttr attr;
+    uint8_t priority = conf->header.priority;
+    bool generates = conf->taskMode == IMAGE_GENERATION ||
+        (conf->taskMode == IMAGE_CHAIN && conf->chain->hasStep(STEP_GENERATE));
+    if(priority == PRIORITY_DEFAULT)
+        priority = generates ? PRIORITY_BATCH : PRIORITY_INTERACTIVE;
+    attr.taskClass = priority == PRIORITY_BATCH ? TASK_CLASS_BATCH : TASK_CLASS_INTERACTIVE;
+    if(conf->token.hasDeadline())
+        attr.deadline = conf->token.getDeadline();
+    attr.flowId = _connId;
+    // cost in detector runs, the generator scales with the pixels it produces
+    if(conf->taskMode == IMAGE_GENERATION)
+        attr.cost = GENERATION_COST * conf->imgSize.area() / double(GENERATION_COST_SIZE * GENERATION_COST_SIZE);
+    // the face count is unknown until the detector ran, charge one face
+    else if(generates) {
+        int size = 0;
+        for(const ChainStep &step : conf->chain->steps)
+            if(step.type == STEP_GENERATE)
+                size = step.size;
+        attr.cost = 1 + GENERATION_COST * size * size / double(GENERATION_COST_SIZE * GENERATION_COST_SIZE);
+    }
+    return attr;
+}
+
+void DataChannel::checkCancelled(TaskConfig *conf, const char *stage) {
+    if(conf->token.isCancelled())
+        throw RequestCancelled(stage);
+}
+
+void DataChannel::processRequest(TaskConfig *conf) {
+    const RequestHeader &header = conf->header;
+    const PooledBuffer &payload = conf->payload;
+
+    // results that depend on the connection's session can't be shared
+    bool cacheable = conf->taskMode != IMAGE_TRACKING && !(header.flags & FLAG_MOTION_GATE);
+    ResultCache *cache = conf->server->getResultCache();
+    CacheKey key;
+    bool inFlight = false;
+
+    recordStageSpan(STAGE_QUEUE_WAIT, conf->queuedAt);
+    std::shared_ptr<CachedResult> result = std::make_shared<CachedResult>();
+    const std::vector<uchar> *encoded = nullptr;
+    try {
+        checkCancelled(conf, "queue");
+        // the size is chosen before the cache key, results of each size are kept apart
+        if(conf->taskMode == IMAGE_GENERATION && (header.flags & FLAG_ADAPTIVE_SIZE))
+            conf->imgSize = conf->server->getResolutionController()->choose(
+                conf->imgSize, header.minSizePercent, conf->sizePercent);
+        if(cacheable) {
+            key = makeCacheKey(conf, header, payload);
+            std::shared_ptr<const CachedResult> cached;
+            if(cache->lookup(key, cached, &conf->token) == CACHE_HIT) {
+                checkCancelled(conf, "send");
+                sendEncoded(header, cached->encoded.data(), cached->encoded.size(), cached->boxes,
+                    STATUS_OK, cached->responseFlags, conf->sizePercent);
+                LOG_DEBUG("Image process finished from cache.");
+                return;
+            }
+            inFlight = true;
+        }
+
+        setLogStage("decode");
+        cv::Mat img;
+        {
+            StageTimer timer(STAGE_DECODE);
+            img = decodeImage(payload);
+        }
+        if(!img.empty()) {
+            size_t decodedBytes = img.total() * img.elemSize();
+            conf->server->getMemoryBudget()->charge(decodedBytes, _bufferedBytes);
+            conf->budgetBytes += decodedBytes;
+        }
+        if(img.empty()) {
+            LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Image decode error! Maybe receive image failed.");
+            if(inFlight)
+                cache->abandon(key);
+            sendResponse(header, img, {}, STATUS_BAD_REQUEST);
+            return;
+        }
+        checkCancelled(conf, "decode");
+
+        setLogStage("inference");
+        std::vector<cv::Mat> crops;
+        if(conf->taskMode == IMAGE_TRACKING)
+            trackFrame(conf, header, img, result->boxes);
+        else if(conf->taskMode == IMAGE_CHAIN)
+            runChain(conf, img, result->boxes, crops);
+        else {
+            {
+                StageTimer timer(STAGE_RESIZE);
+                cv::resize(img, img, conf->imgSize);
+            }
+            if(header.flags & FLAG_MOTION_GATE)
+                gateFrame(conf, img, result->boxes);
+            else
+                runModel(conf, img, result->boxes);
+        }
+        // a computed result is still worth encoding for the cache
+        if(!inFlight)
+            checkCancelled(conf, "inference");
+        setLogStage("encode");
+        if(conf->taskMode == IMAGE_CHAIN && conf->chain->repliesCrops()) {
+            encoded = &encodeImageList(header, crops);
+            result->responseFlags = RESPONSE_FLAG_IMAGE_LIST;
+        }
+        else if(conf->taskMode == IMAGE_CHAIN && !conf->chain->hasStep(STEP_CROP))
+            encoded = &encodeImage(header, cv::Mat());  // boxes only
+        else
+            encoded = &encodeImage(header, img);
+    }
+    catch(RequestCancelled &cancelled) {
+        // waiters on this key have to be released even if the request is dropped
+        if(inFlight)
+            cache->abandon(key);
+        if(conf->token.isHungUp()) {
+            LOG_DEBUG("Drop request of closed connection after {}.", cancelled.what());
+            _droppedCount++;
+        }
+        else {
+            LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Request exceeded its deadline after {}.", cancelled.what());
+            sendResponse(header, cv::Mat(), {}, STATUS_DEADLINE_EXCEEDED);
+        }
+        return;
+    }
+    catch(ModelUnavailable &err) {
+        LOG_EVERY_SEC(LOG_LEVEL_WARN, 10, "Image process gave up : {}", err.what());
+        if(inFlight)
+            cache->abandon(key);
+        sendResponse(header, cv::Mat(), {}, STATUS_UNAVAILABLE);
+        return;
+    }
+    catch(std::exception &err) {
+        LOG_EVERY_SEC(LOG_LEVEL_ERROR, 10, "Image process failed : {}", err.what());
+        if(inFlight)
+            cache->abandon(key);
+        sendResponse(header, cv::Mat(), {}, STATUS_SERVER_ERROR);
+        return;
+    }
+
+    // the result is still worth caching even if this client went away, the
+    // cache keeps its own copy since the encode scratch is reused
+    if(inFlight) {
+        result->encoded.assign(encoded->data(), encoded->size());
+        cache->complete(key, result);
+    }
+    if(conf->token.isHungUp()) {
+        LOG_DEBUG("Drop reply of closed connection.");
+        _droppedCount++;
+        return;
+    }
+    setLogStage("send");
+    sendEncoded(header, encoded->data(), encoded->size(), result->boxes, STATUS_OK, result->responseFlags,
+        conf->sizePercent);
+    LOG_DEBUG("Image process finished.");
+}
+
+void* DataChannel::acquireModel(TaskConfig *conf, TaskMode taskMode) {
+    TimePoint waitStart = std::chrono::steady_clock::now();
+    void *model = conf->server->getModelPool()->acquireTrtModel(taskMode, &conf->token);
+    recordStageSpan(STAGE_MODEL_WAIT, waitStart);
+    if(model == nullptr) {
+        checkCancelled(conf, "model acquire");
+        throw ModelUnavailable("no model instance for task mode " + std::to_string(taskMode));
+    }
+    return model;
+}
+
+void DataChannel::runModel(TaskConfig *conf, cv::Mat &img, std::vector<WireBox> &boxes, ToneMap *tone, bool keepTone) {
+    TrtPipeline *trtModel = (TrtPipeline *)acquireModel(conf, conf->taskMode);
+    // every generation feeds the controller, adaptive requests or not
+    if(conf->taskMode == IMAGE_GENERATION)
+        conf->server->getResolutionController()->observe(std::chrono::steady_clock::now() - conf->arrival);
+    try {
+        checkCancelled(conf, "model acquire");
+        TrtSession &session = trtModel->getSession(img.size());
+        // the boxes are the detector's reply, they are drawn only when the image is wanted too
+        if(conf->taskMode == IMAGE_DETECTION) {
+            std::vector<FaceBox> faces = static_cast<ImageDetector *>(trtModel)->detect(img, session.buffers, session.context);
+            if(!(conf->header.flags & FLAG_BOXES_ONLY))
+                DrawDetections(img, faces);
+            for(const FaceBox &face : faces) {
+                WireBox box = {-1, face.confidence, face.x, face.y, face.w, face.h};
+                boxes.push_back(box);
+            }
+        }
+        else if(conf->taskMode == IMAGE_GENERATION && tone != nullptr)
+            static_cast<ImageGenerator *>(trtModel)->generate(img, session.buffers, session.context, *tone, keepTone);
+        else
+            trtModel->inference(img, session.buffers, session.context);
+    }
+    catch(...) {
+        conf->server->getModelPool()->addTrtModel(conf->taskMode, trtModel);
+        throw;
+    }
+    conf->server->getModelPool()->addTrtModel(conf->taskMode, trtModel);
+}
+
+void DataChannel::gateFrame(TaskConfig *conf, cv::Mat &img, std::vector<WireBox> &boxes) {
+    if(_motionGate == nullptr)
+        _motionGate = new MotionGate();
+
+    // only the generator maps regions one to one, the detector needs the whole frame
+    cv::Rect roi;
+    ToneMap tone = _motionGate->getLastTone();
+    GateDecision decision = _motionGate->check(img, conf->taskMode, conf->taskMode == IMAGE_GENERATION, roi);
+    if(decision == GATE_REUSE) {
+        LOG_DEBUG("Frame unchanged, reuse the last result.");
+        img = _motionGate->getLastResult();
+        boxes = _motionGate->getLastBoxes();
+        return;
+    }
+    if(decision == GATE_ROI) {
+        LOG_DEBUG("Frame changed in ({}, {}, {}, {}).", roi.x, roi.y, roi.width, roi.height);
+        cv::Mat result = _motionGate->getLastResult().clone();
+        cv::Mat patch = img(roi).clone();
+        // only the generator gets a region, it has no boxes. The region is mapped like
+        // the frame it is pasted into, a stretch by its own range would leave a seam
+        runModel(conf, patch, boxes, &tone, true);
+        patch.copyTo(result(roi));
+        img = result;
+    }
+    else
+        runModel(conf, img, boxes, &tone);
+    _motionGate->storeResult(img, boxes, tone);
+}
+
+std::vector<FaceBox> DataChannel::detectFaces(TaskConfig *conf, cv::Mat &frame) {
+    ImageDetector *detector = (ImageDetector *)acquireModel(conf, IMAGE_DETECTION);
+    std::vector<FaceBox> detections;
+    try {
+        TrtSession &session = detector->getSession(frame.size());
+        detections = detector->detect(frame, session.buffers, session.context);
+    }
+    catch(...) {
+        conf->server->getModelPool()->addDetector(detector);
+        throw;
+    }
+    conf->server->getModelPool()->addDetector(detector);
+    return detections;
+}
+
+void DataChannel::runChain(TaskConfig *conf, cv::Mat &frame, std::vector<WireBox> &boxes, std::vector<cv::Mat> &crops) {
+    std::vector<FaceBox> faces;
+    std::vector<cv::Rect> regions;
+    for(const ChainStep &step : conf->chain->steps) {
+        checkCancelled(conf, "chain step");
+        if(step.type == STEP_DETECT) {
+            faces = detectFaces(conf, frame);
+            std::sort(faces.begin(), faces.end(),
+                [](const FaceBox &a, const FaceBox &b) { return a.confidence > b.confidence; });
+            if(faces.size() > MAX_CHAIN_FACES)
+                faces.resize(MAX_CHAIN_FACES);
+        }
+        else if(step.type == STEP_CROP) {
+            // crops are views into the frame, nothing is copied until a step writes
+            std::vector<FaceBox> kept;
+            for(const FaceBox &face : faces) {
+                cv::Rect region = chainCropRegion(face, step.margin, frame.size());
+                if(region.area() == 0)
+                    continue;
+                kept.push_back(face);
+                regions.push_back(region);
+                crops.push_back(frame(region));
+            }
+            faces = kept;
+        }
+        else if(step.type == STEP_GENERATE && !crops.empty())
+            generateCrops(conf, crops, step.size);
+        else if(step.type == STEP_COMPOSITE) {
+            for(size_t i = 0; i < crops.size(); ++i) {
+                cv::Mat target = frame(regions[i]);
+                cv::resize(crops[i], target, target.size());
+            }
+        }
+    }
+    for(const FaceBox &face : faces) {
+        WireBox box = {-1, face.confidence, face.x, face.y, face.w, face.h};
+        boxes.push_back(box);
+    }
+}
+
+void DataChannel::generateCrops(TaskConfig *conf, std::vector<cv::Mat> &crops, int size) {
+    ImageGenerator *generator = (ImageGenerator *)acquireModel(conf, IMAGE_GENERATION);
+    // the engine's profile has batch 1, the faces run back to back on one held
+    // instance and one session instead of acquiring the generator per face
+    try {
+        TrtSession &session = generator->getSession(cv::Size(size, size));
+        for(cv::Mat &crop : crops) {
+            checkCancelled(conf, "generate");
+            cv::Mat input;
+            input.allocator = getPooledMatAllocator();
+            cv::resize(crop, input, cv::Size(size, size));
+            generator->inference(input, session.buffers, session.context);
+            crop = input;
+        }
+    }
+    catch(...) {
+        conf->server->getModelPool()->addGenerator(generator);
+        throw;
+    }
+    conf->server->getModelPool()->addGenerator(generator);
+}
+
+void DataChannel::trackFrame(TaskConfig *conf, const RequestHeader &header, cv::Mat &frame, std::vector<WireBox> &boxes) {
+    if(_tracker == nullptr)
+        _tracker = new FaceTracker();
+
+    // the detector only runs on key frames, the tracker fills the frames between
+    if(_tracker->needDetection())
+        _tracker->update(frame, detectFaces(conf, frame));
+    else
+        _tracker->propagate(frame);
+
+    for(const TrackedFace &track : _tracker->getTracks()) {
+        WireBox box = {track.id, track.box.confidence, track.box.x, track.box.y, track.box.w, track.box.h};
+        boxes.push_back(box);
+    }
+    if(!(header.flags & FLAG_BOXES_ONLY))
+        _tracker->drawTracks(frame);
 }
 
 void DataChannel::handleVideo(void *args) {
     TaskConfig *conf = (TaskConfig *)args;
-    TrtPipeline *trtModel = (TrtPipeline *)(conf->server->getTrtModel(conf->taskMode));
+    TrtPipeline *trtModel = (TrtPipeline *)(conf->server->getModelPool()->getTrtModel(conf->taskMode));
     std::shared_ptr<nvinfer1::IExecutionContext> context = trtModel->createContext(conf->imgSize);
     std::shared_ptr<BufferManager> buffers = trtModel->createBuffer(context);
     buffers->configContextTensorAddress(context);
@@ -109,6 +736,6 @@ void DataChannel::handleVideo(void *args) {
         trtModel->inference(img, buffers, context);
         sendImage(img);
     }   
-    conf->server->addTrtModel(conf->taskMode, trtModel);
-    spdlog::info("Video process stopped.");
+    conf->server->getModelPool()->addTrtModel(conf->taskMode, trtModel);
+    LOG_INFO("Video process stopped.");
 }
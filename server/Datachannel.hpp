@@ -5,30 +5,112 @@ send and process operation.*/
 
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <memory>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <opencv2/opencv.hpp>
 #include <spdlog/spdlog.h>
 #include "imageDetector.hpp"
 #include "ImageGenerator.hpp"
+#include "FaceTracker.hpp"
+#include "Protocol.hpp"
+#include "MotionGate.hpp"
+#include "Metrics.hpp"
+#include "BufferPool.hpp"
+#include "MemoryBudget.hpp"
+#include "ConnectionTable.hpp"
+#include "ModelChain.hpp"
+#include "Tracer.hpp"
+#include "CancelToken.hpp"
 #include "Server.hpp"
 #include "utils.hpp"
 
 class ImageServer;
 class ThreadPool;
-class DataChannel {
+struct TaskConfig;
+struct TaskAttr;
+
+class DataChannel : public std::enable_shared_from_this<DataChannel> {
     private:
         int _sockfd;
+        uint64_t _connId;           // unlike the fd never reused
+        ConnHandle _handle;         // the connection table slot, set before the first read
         pthread_mutex_t _mtx;
+        std::atomic<bool> _closed;  // set by the event loop on hangup, read by the tokens of in-flight requests
+        std::atomic<bool> _peerShutdown;    // the client shut down its side with requests still unread
+        // tracking session of the video stream on this connection. Frames of one
+        // connection are handled one at a time (EPOLLONESHOT), so no lock is needed.
+        FaceTracker *_tracker;
+        MotionGate *_motionGate;
+        TimePoint _readableAt;      // set by the event loop before the read task is queued
+        std::atomic<size_t> _bufferedBytes;     // charged to the memory budget
+        // a read paused by the memory budget, touched only by the connection's read task
+        bool _headerPending;
+        RequestHeader _pendingHeader;
+        TimePoint _pendingArrival;
+        TimePoint _frameDeadline;   // of the frame being read, set when its header is
+
+        static std::atomic<uint64_t> _responseCount[RESPONSE_STATUS_NUMS];
+        static std::atomic<uint64_t> _nextConnId;
+        static std::atomic<uint64_t> _droppedCount;    // replies not sent because the client hung up
+
+        // throws RequestCancelled when the request's result is no longer wanted
+        void checkCancelled(TaskConfig *conf, const char *stage);
+        // a model instance, throws RequestCancelled or ModelUnavailable when there is none
+        void* acquireModel(TaskConfig *conf, TaskMode taskMode);
+        void processRequest(TaskConfig *conf);
+        void finishRequest(TaskConfig *conf);
+        TaskAttr makeTaskAttr(TaskConfig *conf);
+        // the detector's boxes are added to boxes
+        // generation: with a tone the map of the output is returned in it, with keepTone too
+        // the output is mapped by it instead
+        void runModel(TaskConfig *conf, cv::Mat &img, std::vector<WireBox> &boxes,
+            ToneMap *tone = nullptr, bool keepTone = false);
+        void gateFrame(TaskConfig *conf, cv::Mat &img, std::vector<WireBox> &boxes);
+        void trackFrame(TaskConfig *conf, const RequestHeader &header, cv::Mat &frame, std::vector<WireBox> &boxes);
+        std::vector<FaceBox> detectFaces(TaskConfig *conf, cv::Mat &frame);
+        // runs conf->chain on the frame, crops is filled from the crop step on
+        void runChain(TaskConfig *conf, cv::Mat &frame, std::vector<WireBox> &boxes, std::vector<cv::Mat> &crops);
+        void generateCrops(TaskConfig *conf, std::vector<cv::Mat> &crops, int size);
     public:
         DataChannel(int sockfd);
         ~DataChannel();
         cv::Mat recvImage();
         void sendImage(cv::Mat img);
+        bool recvHeader(RequestHeader &header);
+        bool recvPayload(const RequestHeader &header, PooledBuffer &payload);
+        bool recvRequest(RequestHeader &header, PooledBuffer &payload, size_t maxFrameBytes = DEFAULT_MAX_FRAME_BYTES);
+        // the image decoded into pooled memory, empty if the payload is not an image
+        static cv::Mat decodeImage(const PooledBuffer &payload);
+        // encodes into the calling thread's scratch space, valid until its next encode
+        const std::vector<uchar>& encodeImage(const RequestHeader &request, const cv::Mat &img);
+        // the images as RESPONSE_FLAG_IMAGE_LIST payload, in the same scratch space
+        const std::vector<uchar>& encodeImageList(const RequestHeader &request, const std::vector<cv::Mat> &imgs);
+        void sendResponse(const RequestHeader &request, cv::Mat img, 
+            const std::vector<WireBox> &boxes, uint8_t status = STATUS_OK);
+        void sendEncoded(const RequestHeader &request, const uchar *encoded, size_t nbEncoded,
+            const std::vector<WireBox> &boxes, uint8_t status = STATUS_OK, uint8_t responseFlags = 0,
+            uint8_t sizePercent = 0);
         void recvVideo(void *arg);
         int getSocketFd() { return _sockfd; }
+        uint64_t getConnId() const { return _connId; }
+        void setHandle(ConnHandle handle) { _handle = handle; }
+        ConnHandle getHandle() const { return _handle; }
+        std::atomic<size_t>& getBufferedBytes() { return _bufferedBytes; }
+        void markClosed() { _closed = true; }
+        bool isClosed() const { return _closed.load(); }
+        void markPeerShutdown() { _peerShutdown = true; }
+        void setReadableAt(TimePoint readableAt) { _readableAt = readableAt; }
+        TimePoint getReadableAt() const { return _readableAt; }
+
+        static uint64_t getResponseCount(uint8_t status) { return _responseCount[status].load(); }
+        static uint64_t getDroppedCount() { return _droppedCount.load(); }
 
     public:
         void handleImage(void *args);
+        void handleProcess(void *args);
         void handleVideo(void *args);
 
         void debug() {spdlog::error("Debug info.");}
@@ -28,7 +28,23 @@ int Epoll::epollMod(int fd, uint32_t evs) {
     return epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &ev);
 }
 
-int Epoll::epollDel(int fd, uint32_t evs) {
+int Epoll::epollAdd(int fd, uint32_t evs, uint64_t data) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.u64 = data;
+    ev.events = evs;
+    return epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int Epoll::epollMod(int fd, uint32_t evs, uint64_t data) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.u64 = data;
+    ev.events = evs;
+    return epoll_ctl(_epollFd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int Epoll::epollDel(int fd, uint32_t) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     return epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, &ev);
@@ -39,11 +55,17 @@ int Epoll::wait(int timeout) {
 }
 
 int Epoll::getEventFd(size_t i) {
-    if(i >= _events.size() || i < 0)
+    if(i >= _events.size())
         throw std::runtime_error("Index i out of events array size.");
     return _events[i].data.fd;
 }
 
+uint64_t Epoll::getEventData(size_t i) {
+    if(i >= _events.size())
+        throw std::runtime_error("Index i out of events array size.");
+    return _events[i].data.u64;
+}
+
 uint32_t Epoll::getEvents(size_t i) {
     return _events[i].events;
 }
\ No newline at end of file
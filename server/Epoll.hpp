@@ -19,9 +19,13 @@ public:
     int getFd() { return _epollFd; }
     int epollAdd(int fd, uint32_t);
     int epollMod(int fd, uint32_t);
+    // data comes back with the event instead of the fd
+    int epollAdd(int fd, uint32_t, uint64_t data);
+    int epollMod(int fd, uint32_t, uint64_t data);
     int epollDel(int fd, uint32_t);
     int wait(int timeout);
     int getEventFd(size_t i);
+    uint64_t getEventData(size_t i);
     uint32_t getEvents(size_t i);
 };
 
@@ -0,0 +1,60 @@
+/*Fast non-cryptographic hashing of request payloads. Two independent
+  64-bit lanes are computed in a single pass over the bytes, which gives a
+  128-bit digest for content addressing at memory bandwidth speed.*/
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+struct Hash128 {
+    uint64_t lo;
+    uint64_t hi;
+    bool operator==(const Hash128 &other) const { return lo == other.lo && hi == other.hi; }
+};
+
+inline uint64_t hashRotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// splitmix64 finalizer, spreads every input bit over the whole word
+inline uint64_t hashAvalanche(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+inline Hash128 hashBytes(const void *data, size_t len, uint64_t seed = 0) {
+    const uint64_t P1 = 0x9e3779b185ebca87ULL;
+    const uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t a = seed ^ P1;
+    uint64_t b = seed ^ P2 ^ len;
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        uint64_t w0, w1;
+        memcpy(&w0, p + i, 8);
+        memcpy(&w1, p + i + 8, 8);
+        a = hashRotl(a ^ (w0 * P2), 31) * P1;
+        b = hashRotl(b ^ (w1 * P1), 29) * P2;
+    }
+    uint64_t tail[2] = {0, 0};
+    memcpy(tail, p + i, len - i);
+    a = hashRotl(a ^ (tail[0] * P2), 31) * P1;
+    b = hashRotl(b ^ (tail[1] * P1), 29) * P2;
+
+    Hash128 digest;
+    digest.lo = hashAvalanche(a + hashRotl(b, 17) + len);
+    digest.hi = hashAvalanche(b ^ hashRotl(a, 41) ^ P1);
+    return digest;
+}
+
+inline uint64_t hashCombine(uint64_t h, uint64_t value) {
+    return hashAvalanche(h ^ (value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+#endif
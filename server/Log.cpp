@@ -0,0 +1,163 @@
+#include "Log.hpp"
+
+static thread_local LogContext logContext = {-1, 0, nullptr};
+
+static const spdlog::level::level_enum SPDLOG_LEVELS[] = {
+    spdlog::level::trace, spdlog::level::debug, spdlog::level::info,
+    spdlog::level::warn, spdlog::level::err,
+};
+
+AsyncLogger::AsyncLogger() : _tail(0), _head(0), _dropped(0), _sleeping(false), _stop(false) {
+    for(int i = 0; i < LOG_RING_SIZE; ++i)
+        _slots[i].seq.store(i, std::memory_order_relaxed);
+    pthread_mutex_init(&_mtx, NULL);
+    pthread_cond_init(&_condv, NULL);
+    // the spdlog registry has to outlive the log thread, make sure it is constructed first
+    spdlog::default_logger_raw();
+    if(LOG_ACTIVE_LEVEL < LOG_LEVEL_INFO)
+        spdlog::set_level(SPDLOG_LEVELS[LOG_ACTIVE_LEVEL]);
+    if(pthread_create(&_thread, NULL, start_thread, this) != 0)
+        throw std::runtime_error("Log thread create failed.");
+}
+
+AsyncLogger::~AsyncLogger() {
+    _stop = true;
+    pthread_mutex_lock(&_mtx);
+    pthread_cond_signal(&_condv);
+    pthread_mutex_unlock(&_mtx);
+    pthread_join(_thread, NULL);
+    pthread_mutex_destroy(&_mtx);
+    pthread_cond_destroy(&_condv);
+}
+
+LogSlot* AsyncLogger::claim() {
+    uint64_t pos = _tail.load(std::memory_order_relaxed);
+    while(true) {
+        LogSlot &slot = _slots[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)slot.seq.load(std::memory_order_acquire) - (int64_t)pos;
+        if(diff == 0) {
+            if(_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.time = std::chrono::system_clock::now();
+                slot.context = logContext;
+                return &slot;
+            }
+        }
+        else if(diff < 0) {
+            // the log thread is a full ring behind, never block a worker on it
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        else
+            pos = _tail.load(std::memory_order_relaxed);
+    }
+}
+
+void AsyncLogger::publish(LogSlot *slot) {
+    slot->seq.store(slot->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    if(_sleeping.load(std::memory_order_relaxed)) {
+        pthread_mutex_lock(&_mtx);
+        pthread_cond_signal(&_condv);
+        pthread_mutex_unlock(&_mtx);
+    }
+}
+
+bool AsyncLogger::drainOne() {
+    LogSlot &slot = _slots[_head & (LOG_RING_SIZE - 1)];
+    if(slot.seq.load(std::memory_order_acquire) != _head + 1)
+        return false;
+
+    fmt::memory_buffer line;
+    if(slot.context.fd >= 0)
+        fmt::format_to(std::back_inserter(line), "fd={} ", slot.context.fd);
+    if(slot.context.requestId != 0)
+        fmt::format_to(std::back_inserter(line), "req={} ", slot.context.requestId);
+    if(slot.context.stage != nullptr)
+        fmt::format_to(std::back_inserter(line), "stage={} ", slot.context.stage);
+    if(line.size() > 0)
+        fmt::format_to(std::back_inserter(line), "| ");
+    fmt::format_to(std::back_inserter(line), "{}", slot.message);
+    if(slot.suppressed > 0)
+        fmt::format_to(std::back_inserter(line), " ({} similar suppressed)", slot.suppressed);
+    spdlog::default_logger_raw()->log(slot.time, spdlog::source_loc{}, SPDLOG_LEVELS[slot.level],
+        spdlog::string_view_t(line.data(), line.size()));
+
+    slot.seq.store(_head + LOG_RING_SIZE, std::memory_order_release);
+    _head++;
+    return true;
+}
+
+void* AsyncLogger::start_thread(void *args) {
+    AsyncLogger *logger = (AsyncLogger *)args;
+    logger->run();
+    return NULL;
+}
+
+void AsyncLogger::run() {
+    uint64_t reportedDrops = 0;
+    while(true) {
+        while(drainOne());
+        uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+        if(dropped != reportedDrops) {
+            spdlog::warn("Log ring full, dropped {} messages.", dropped - reportedDrops);
+            reportedDrops = dropped;
+        }
+        if(_stop.load()) {
+            while(drainOne());
+            spdlog::default_logger_raw()->flush();
+            return;
+        }
+        // a producer seeing _sleeping wakes us, the timeout covers the race in between
+        _sleeping = true;
+        if(!drainOne()) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_IDLE_WAIT_MS * 1000000L;
+            if(ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&_mtx);
+            if(!_stop.load())
+                pthread_cond_timedwait(&_condv, &_mtx, &ts);
+            pthread_mutex_unlock(&_mtx);
+        }
+        _sleeping = false;
+    }
+}
+
+AsyncLogger& getAsyncLogger() {
+    static AsyncLogger logger;
+    return logger;
+}
+
+const LogContext& getLogContext() {
+    return logContext;
+}
+
+void setLogStage(const char *stage) {
+    logContext.stage = stage;
+}
+
+LogScope::LogScope(int fd, uint64_t requestId) : _previous(logContext) {
+    logContext.fd = fd;
+    logContext.requestId = requestId;
+    logContext.stage = nullptr;
+}
+
+LogScope::~LogScope() {
+    logContext = _previous;
+}
+
+bool LogRateLimiter::allow(uint64_t &suppressed) {
+    int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t window = _window.load(std::memory_order_relaxed);
+    if(second != window && _window.compare_exchange_strong(window, second, std::memory_order_relaxed))
+        _count.store(0, std::memory_order_relaxed);
+    if(_count.fetch_add(1, std::memory_order_relaxed) >= _perSecond) {
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
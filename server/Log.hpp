@@ -0,0 +1,146 @@
+/*Asynchronous logging for the request path. A LOG_* call formats its
+  message into a slot of a bounded lock-free multi-producer ring and
+  returns, a dedicated thread drains the ring into spdlog. When the ring is
+  full the message is dropped and counted instead of blocking a worker.
+
+  Every record carries the fields of the request the calling thread works
+  on (connection fd, request id, stage), set through LogScope.
+
+  Levels below LOG_ACTIVE_LEVEL compile to nothing, build with
+  -DLOG_ACTIVE_LEVEL=LOG_LEVEL_TRACE to keep the trace and debug calls.
+  LOG_EVERY_SEC and LOG_SAMPLED limit a single call site.*/
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <stdint.h>
+#include <spdlog/spdlog.h>
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+#ifndef LOG_ACTIVE_LEVEL
+#define LOG_ACTIVE_LEVEL LOG_LEVEL_INFO
+#endif
+
+const int LOG_RING_SIZE = 8192;         // a power of two
+const int LOG_MESSAGE_SIZE = 240;
+const int LOG_IDLE_WAIT_MS = 10;        // how long the log thread sleeps when it missed a wakeup
+
+// the request a thread works on, copied into its log records
+struct LogContext {
+    int fd;
+    uint64_t requestId;
+    const char *stage;
+};
+
+struct LogSlot {
+    std::atomic<uint64_t> seq;
+    int level;
+    LogContext context;
+    uint64_t suppressed;                // messages the rate limit dropped before this one
+    std::chrono::system_clock::time_point time;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+class AsyncLogger {
+    private:
+        LogSlot _slots[LOG_RING_SIZE];
+        alignas(64) std::atomic<uint64_t> _tail;    // next slot to claim
+        alignas(64) uint64_t _head;                 // next slot to drain, log thread only
+        std::atomic<uint64_t> _dropped;
+        std::atomic<bool> _sleeping;
+        std::atomic<bool> _stop;
+        pthread_mutex_t _mtx;
+        pthread_cond_t _condv;
+        pthread_t _thread;
+
+        LogSlot* claim();
+        void publish(LogSlot *slot);
+        bool drainOne();
+        static void* start_thread(void *args);
+        void run();
+    public:
+        AsyncLogger();
+        ~AsyncLogger();     // drains what is left
+
+        template <typename... Args>
+        void log(int level, uint64_t suppressed, fmt::format_string<Args...> format, Args&&... args) {
+            LogSlot *slot = claim();
+            if(slot == nullptr)
+                return;
+            auto end = fmt::format_to_n(slot->message, LOG_MESSAGE_SIZE - 1, format, std::forward<Args>(args)...).out;
+            *end = '\0';
+            slot->level = level;
+            slot->suppressed = suppressed;
+            publish(slot);
+        }
+        uint64_t getDropped() const { return _dropped.load(); }
+};
+
+AsyncLogger& getAsyncLogger();
+
+const LogContext& getLogContext();
+void setLogStage(const char *stage);
+
+// sets the request fields of the calling thread while the object lives
+class LogScope {
+    private:
+        LogContext _previous;
+    public:
+        LogScope(int fd, uint64_t requestId);
+        ~LogScope();
+};
+
+// lets at most perSecond messages of one call site through every second
+class LogRateLimiter {
+    private:
+        int _perSecond;
+        std::atomic<int64_t> _window;
+        std::atomic<int> _count;
+        std::atomic<uint64_t> _suppressed;
+    public:
+        LogRateLimiter(int perSecond) : _perSecond(perSecond), _window(0), _count(0), _suppressed(0) {}
+        // suppressed returns how many messages were dropped since the last allowed one
+        bool allow(uint64_t &suppressed);
+};
+
+#define LOG_AT(level, ...) getAsyncLogger().log(level, 0, __VA_ARGS__)
+
+#if LOG_ACTIVE_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do {} while(0)
+#endif
+
+#if LOG_ACTIVE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while(0)
+#endif
+
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// at most perSecond messages per second from this call site
+#define LOG_EVERY_SEC(level, perSecond, ...) do { \
+        static LogRateLimiter logLimiter_(perSecond); \
+        uint64_t logSuppressed_; \
+        if(level >= LOG_ACTIVE_LEVEL && logLimiter_.allow(logSuppressed_)) \
+            getAsyncLogger().log(level, logSuppressed_, __VA_ARGS__); \
+    } while(0)
+
+// one message in every n from this call site
+#define LOG_SAMPLED(level, n, ...) do { \
+        static std::atomic<uint64_t> logCount_(0); \
+        if(level >= LOG_ACTIVE_LEVEL && logCount_.fetch_add(1, std::memory_order_relaxed) % (n) == 0) \
+            getAsyncLogger().log(level, 0, __VA_ARGS__); \
+    } while(0)
+
+#endif
@@ -0,0 +1,121 @@
+#include "MemoryBudget.hpp"
+#include <vector>
+
+MemoryBudget::MemoryBudget(size_t maxBytes, size_t connectionMaxBytes, size_t maxFrameBytes)
+    : _maxBytes(maxBytes), _connectionMaxBytes(connectionMaxBytes), _maxFrameBytes(maxFrameBytes),
+      _usedBytes(0), _pauses(0), _rejectedFrames(0) {
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+MemoryBudget::~MemoryBudget() {
+    pthread_mutex_destroy(&_mtx);
+}
+
+void MemoryBudget::setLimits(size_t maxBytes, size_t connectionMaxBytes, size_t maxFrameBytes) {
+    pthread_mutex_lock(&_mtx);
+    _maxBytes = maxBytes;
+    _connectionMaxBytes = connectionMaxBytes;
+    _maxFrameBytes = maxFrameBytes;
+    pthread_mutex_unlock(&_mtx);
+}
+
+bool MemoryBudget::fits(size_t nbBytes, size_t connectionBytes) const {
+    // an empty budget takes any frame, otherwise a frame over the limit would wait forever
+    bool global = _usedBytes == 0 || _usedBytes + nbBytes <= _maxBytes;
+    bool connection = connectionBytes == 0 || connectionBytes + nbBytes <= _connectionMaxBytes;
+    return global && connection;
+}
+
+bool MemoryBudget::checkFrame(size_t nbBytes) {
+    if(nbBytes <= _maxFrameBytes)
+        return true;
+    _rejectedFrames++;
+    return false;
+}
+
+bool MemoryBudget::reserve(size_t nbBytes, std::atomic<size_t> &connectionBytes, std::function<void()> resume,
+    std::function<void()> pause) {
+    pthread_mutex_lock(&_mtx);
+    // queued connections go first, a stream of small frames must not starve a big one
+    if(_waiters.empty() && fits(nbBytes, connectionBytes)) {
+        _usedBytes += nbBytes;
+        connectionBytes += nbBytes;
+        pthread_mutex_unlock(&_mtx);
+        return true;
+    }
+    if(pause)
+        pause();
+    _waiters.push_back({nbBytes, &connectionBytes, resume});
+    _pauses++;
+    pthread_mutex_unlock(&_mtx);
+    return false;
+}
+
+void MemoryBudget::charge(size_t nbBytes, std::atomic<size_t> &connectionBytes) {
+    pthread_mutex_lock(&_mtx);
+    _usedBytes += nbBytes;
+    connectionBytes += nbBytes;
+    pthread_mutex_unlock(&_mtx);
+}
+
+void MemoryBudget::release(size_t nbBytes, std::atomic<size_t> &connectionBytes) {
+    std::vector<std::function<void()>> resumed;
+    pthread_mutex_lock(&_mtx);
+    _usedBytes -= nbBytes;
+    connectionBytes -= nbBytes;
+    while(!_waiters.empty() && fits(_waiters.front().nbBytes, *_waiters.front().connectionBytes)) {
+        Waiter &waiter = _waiters.front();
+        _usedBytes += waiter.nbBytes;
+        *waiter.connectionBytes += waiter.nbBytes;
+        _granted[waiter.connectionBytes] += waiter.nbBytes;
+        resumed.push_back(waiter.resume);
+        _waiters.pop_front();
+    }
+    pthread_mutex_unlock(&_mtx);
+    for(auto &resume : resumed)
+        resume();
+}
+
+bool MemoryBudget::claim(std::atomic<size_t> &connectionBytes) {
+    pthread_mutex_lock(&_mtx);
+    bool granted = _granted.erase(&connectionBytes) > 0;
+    pthread_mutex_unlock(&_mtx);
+    return granted;
+}
+
+void MemoryBudget::cancel(std::atomic<size_t> &connectionBytes) {
+    // the resume callbacks hold their connection, they are destroyed outside the lock
+    std::vector<std::function<void()>> dropped;
+    size_t grantedBytes = 0;
+    pthread_mutex_lock(&_mtx);
+    for(auto it = _waiters.begin(); it != _waiters.end(); ) {
+        if(it->connectionBytes == &connectionBytes) {
+            dropped.push_back(it->resume);
+            it = _waiters.erase(it);
+        }
+        else
+            ++it;
+    }
+    auto granted = _granted.find(&connectionBytes);
+    if(granted != _granted.end()) {
+        grantedBytes = granted->second;
+        _granted.erase(granted);
+    }
+    pthread_mutex_unlock(&_mtx);
+    bool left = !dropped.empty();
+    dropped.clear();
+    // a waiter that left the head of the queue may let the next ones in
+    if(grantedBytes > 0 || left)
+        release(grantedBytes, connectionBytes);
+}
+
+MemoryBudgetStats MemoryBudget::getStats() {
+    MemoryBudgetStats stats;
+    pthread_mutex_lock(&_mtx);
+    stats.usedBytes = _usedBytes;
+    stats.pausedConnections = _waiters.size();
+    pthread_mutex_unlock(&_mtx);
+    stats.pauses = _pauses.load();
+    stats.rejectedFrames = _rejectedFrames.load();
+    return stats;
+}
@@ -0,0 +1,79 @@
+/*MemoryBudget bounds the bytes the server holds for requests: the received
+  payloads and the images decoded from them. A frame larger than the frame
+  limit is refused outright. Below that, a connection whose payload doesn't
+  fit the global budget or its own connection budget is paused: its read
+  stops after the header and the connection waits in a FIFO until released
+  bytes make room, then its read is resumed. An empty budget always admits
+  one frame, so a single request up to the frame limit makes progress.
+
+  The bytes of a resumed connection are granted before its read runs again.
+  The read claims them. A connection closed before that cancels, which
+  returns the grant or drops it from the queue, whichever comes first.*/
+#ifndef MEMORYBUDGET_HPP
+#define MEMORYBUDGET_HPP
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+const size_t DEFAULT_MAX_FRAME_BYTES = 64 << 20;
+const size_t DEFAULT_CONNECTION_BUDGET_BYTES = 256 << 20;
+const size_t DEFAULT_MEMORY_BUDGET_BYTES = (size_t)1 << 30;
+
+struct MemoryBudgetStats {
+    uint64_t usedBytes;
+    uint64_t pausedConnections;     // waiting right now
+    uint64_t pauses;
+    uint64_t rejectedFrames;
+};
+
+class MemoryBudget {
+    private:
+        struct Waiter {
+            size_t nbBytes;
+            std::atomic<size_t> *connectionBytes;
+            std::function<void()> resume;
+        };
+
+        size_t _maxBytes;
+        size_t _connectionMaxBytes;
+        size_t _maxFrameBytes;
+        size_t _usedBytes;              // guarded by _mtx
+        std::deque<Waiter> _waiters;    // guarded by _mtx
+        // bytes taken for resumed connections whose read hasn't claimed them, guarded by _mtx
+        std::unordered_map<std::atomic<size_t> *, size_t> _granted;
+        pthread_mutex_t _mtx;
+        std::atomic<uint64_t> _pauses;
+        std::atomic<uint64_t> _rejectedFrames;
+
+        bool fits(size_t nbBytes, size_t connectionBytes) const;
+    public:
+        MemoryBudget(size_t maxBytes = DEFAULT_MEMORY_BUDGET_BYTES,
+            size_t connectionMaxBytes = DEFAULT_CONNECTION_BUDGET_BYTES,
+            size_t maxFrameBytes = DEFAULT_MAX_FRAME_BYTES);
+        ~MemoryBudget();
+
+        // called before the server runs
+        void setLimits(size_t maxBytes, size_t connectionMaxBytes, size_t maxFrameBytes);
+        // false for a frame that is never admitted, the caller drops the connection
+        bool checkFrame(size_t nbBytes);
+        // takes the bytes for a connection, or queues it and returns false. The bytes
+        // are taken on its behalf before resume is called, from whatever thread released them.
+        // pause runs when it is queued, before any resume can
+        bool reserve(size_t nbBytes, std::atomic<size_t> &connectionBytes, std::function<void()> resume,
+            std::function<void()> pause = nullptr);
+        // bytes that are already allocated (a decoded image), counted without waiting
+        void charge(size_t nbBytes, std::atomic<size_t> &connectionBytes);
+        void release(size_t nbBytes, std::atomic<size_t> &connectionBytes);
+        // the resumed read takes the bytes granted to it, false once the connection was cancelled
+        bool claim(std::atomic<size_t> &connectionBytes);
+        // a closed connection leaves the queue, or gives back the bytes granted and not claimed
+        void cancel(std::atomic<size_t> &connectionBytes);
+        MemoryBudgetStats getStats();
+};
+
+#endif
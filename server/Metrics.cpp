@@ -0,0 +1,148 @@
+#include "Metrics.hpp"
+#include "Tracer.hpp"
+#include <set>
+#include <spdlog/fmt/fmt.h>
+
+const double EXPORT_QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+static const char *STAGE_NAMES[STAGE_NUMS] = {
+    "recv_wait", "recv", "queue_wait", "decode", "resize", "model_wait",
+    "preprocess", "inference", "postprocess", "encode", "send", "total",
+};
+
+const char* stageName(Stage stage) {
+    return STAGE_NAMES[stage];
+}
+
+// threads take shards round robin, a shard is only shared past HIST_SHARDS threads
+static int threadShard() {
+    static std::atomic<int> nextShard(0);
+    static thread_local int shard = nextShard++ % HIST_SHARDS;
+    return shard;
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for(int i = 0; i < HIST_SHARDS; ++i) {
+        for(int j = 0; j < HIST_BUCKETS; ++j)
+            _shards[i].buckets[j].store(0, std::memory_order_relaxed);
+        _shards[i].sumUs.store(0, std::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::bucketOf(uint64_t us) {
+    if(us < HIST_SUB_BUCKETS)
+        return us;
+    if(us > 0xffffffffULL)
+        us = 0xffffffffULL;
+    int exponent = 63 - __builtin_clzll(us);
+    int sub = (us >> (exponent - 4)) & (HIST_SUB_BUCKETS - 1);
+    return (exponent - 3) * HIST_SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucketValue(int index) {
+    if(index < HIST_SUB_BUCKETS)
+        return index;
+    int exponent = index / HIST_SUB_BUCKETS + 3;
+    int sub = index % HIST_SUB_BUCKETS;
+    uint64_t width = 1ULL << (exponent - 4);
+    return (HIST_SUB_BUCKETS + sub) * width + width / 2;
+}
+
+void LatencyHistogram::record(uint64_t us) {
+    Shard &shard = _shards[threadShard()];
+    shard.buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+    shard.sumUs.fetch_add(us, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::snapshot(std::vector<uint64_t> &counts, uint64_t &total, uint64_t &sumUs) const {
+    counts.assign(HIST_BUCKETS, 0);
+    total = 0;
+    sumUs = 0;
+    for(int i = 0; i < HIST_SHARDS; ++i) {
+        for(int j = 0; j < HIST_BUCKETS; ++j) {
+            uint64_t count = _shards[i].buckets[j].load(std::memory_order_relaxed);
+            counts[j] += count;
+            total += count;
+        }
+        sumUs += _shards[i].sumUs.load(std::memory_order_relaxed);
+    }
+}
+
+uint64_t LatencyHistogram::quantile(const std::vector<uint64_t> &counts, uint64_t total, double q) {
+    if(total == 0)
+        return 0;
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += counts[i];
+        if(seen >= rank)
+            return bucketValue(i);
+    }
+    return bucketValue(HIST_BUCKETS - 1);
+}
+
+Metrics::Metrics() {
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+Metrics::~Metrics() {
+    pthread_mutex_destroy(&_mtx);
+}
+
+void Metrics::addCounter(const std::string &name, const std::string &help,
+    const std::string &labels, std::function<double()> read) {
+    pthread_mutex_lock(&_mtx);
+    _sampled.push_back({name, "counter", help, labels, read});
+    pthread_mutex_unlock(&_mtx);
+}
+
+void Metrics::addGauge(const std::string &name, const std::string &help,
+    const std::string &labels, std::function<double()> read) {
+    pthread_mutex_lock(&_mtx);
+    _sampled.push_back({name, "gauge", help, labels, read});
+    pthread_mutex_unlock(&_mtx);
+}
+
+std::string Metrics::renderPrometheus() {
+    std::string out;
+    out += "# HELP imageserver_stage_latency_seconds Latency of each request stage since start.\n";
+    out += "# TYPE imageserver_stage_latency_seconds summary\n";
+    std::vector<uint64_t> counts;
+    for(int s = 0; s < STAGE_NUMS; ++s) {
+        uint64_t total, sumUs;
+        _stages[s].snapshot(counts, total, sumUs);
+        for(double q : EXPORT_QUANTILES)
+            out += fmt::format("imageserver_stage_latency_seconds{{stage=\"{}\",quantile=\"{}\"}} {:.6f}\n",
+                STAGE_NAMES[s], q, LatencyHistogram::quantile(counts, total, q) / 1e6);
+        out += fmt::format("imageserver_stage_latency_seconds_sum{{stage=\"{}\"}} {:.6f}\n", STAGE_NAMES[s], sumUs / 1e6);
+        out += fmt::format("imageserver_stage_latency_seconds_count{{stage=\"{}\"}} {}\n", STAGE_NAMES[s], total);
+    }
+
+    pthread_mutex_lock(&_mtx);
+    std::set<std::string> described;
+    for(const Sampled &metric : _sampled) {
+        if(described.insert(metric.name).second) {
+            out += fmt::format("# HELP {} {}\n", metric.name, metric.help);
+            out += fmt::format("# TYPE {} {}\n", metric.name, metric.type);
+        }
+        if(metric.labels.empty())
+            out += fmt::format("{} {}\n", metric.name, metric.read());
+        else
+            out += fmt::format("{}{{{}}} {}\n", metric.name, metric.labels, metric.read());
+    }
+    pthread_mutex_unlock(&_mtx);
+    return out;
+}
+
+void recordStageSpan(Stage stage, std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end) {
+    getMetrics().recordStage(stage, elapsedUs(start, end));
+    uint64_t traceId = getCurrentTrace();
+    if(traceId != 0)
+        getTracer().record(traceId, stage, start, end);
+}
+
+Metrics& getMetrics() {
+    static Metrics metrics;
+    return metrics;
+}
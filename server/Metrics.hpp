@@ -0,0 +1,122 @@
+/*This header define the server's instrumentation. Stage latencies go into
+  log-linear histograms (16 linear sub-buckets per power of two, ~6%
+  precision) that are sharded per thread, so recording is a relaxed atomic
+  add on a cache line no other thread writes. Counters and gauges are
+  rendered together with the histograms in Prometheus text format.*/
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+typedef enum {
+    STAGE_RECV_WAIT,        // readable socket until a worker reads it
+    STAGE_RECV,
+    STAGE_QUEUE_WAIT,       // read until the request is scheduled
+    STAGE_DECODE,
+    STAGE_RESIZE,
+    STAGE_MODEL_WAIT,       // waiting for a free model instance
+    STAGE_PREPROCESS,
+    STAGE_INFERENCE,
+    STAGE_POSTPROCESS,
+    STAGE_ENCODE,
+    STAGE_SEND,
+    STAGE_TOTAL,
+    STAGE_NUMS
+} Stage;
+
+const char* stageName(Stage stage);
+
+const int HIST_SUB_BUCKETS = 16;
+const int HIST_BUCKETS = (32 - 3) * HIST_SUB_BUCKETS;  // microseconds up to 2^32
+const int HIST_SHARDS = 32;
+
+class LatencyHistogram {
+    private:
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> buckets[HIST_BUCKETS];
+            std::atomic<uint64_t> sumUs;
+        };
+        Shard _shards[HIST_SHARDS];
+
+        static int bucketOf(uint64_t us);
+        static uint64_t bucketValue(int index);  // midpoint of the bucket
+    public:
+        LatencyHistogram();
+        void record(uint64_t us);
+        // merged over all shards
+        void snapshot(std::vector<uint64_t> &counts, uint64_t &total, uint64_t &sumUs) const;
+        static uint64_t quantile(const std::vector<uint64_t> &counts, uint64_t total, double q);
+};
+
+class Metrics {
+    private:
+        // a counter or gauge owned by another component, read at render time
+        struct Sampled {
+            std::string name;
+            std::string type;
+            std::string help;
+            std::string labels;     // rendered as is inside {}
+            std::function<double()> read;
+        };
+
+        LatencyHistogram _stages[STAGE_NUMS];
+        std::vector<Sampled> _sampled;
+        pthread_mutex_t _mtx;       // guards _sampled
+    public:
+        Metrics();
+        ~Metrics();
+
+        void recordStage(Stage stage, uint64_t us) { _stages[stage].record(us); }
+        void addCounter(const std::string &name, const std::string &help,
+            const std::string &labels, std::function<double()> read);
+        void addGauge(const std::string &name, const std::string &help,
+            const std::string &labels, std::function<double()> read);
+        std::string renderPrometheus();
+};
+
+// the process wide metrics
+Metrics& getMetrics();
+
+inline uint64_t elapsedUs(std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+// records end - start into the stage histogram, and as a span when the
+// calling thread works on a sampled request
+void recordStageSpan(Stage stage, std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now());
+
+// records the lifetime of the object into one stage
+class StageTimer {
+    private:
+        Stage _stage;
+        std::chrono::steady_clock::time_point _start;
+    public:
+        StageTimer(Stage stage) : _stage(stage), _start(std::chrono::steady_clock::now()) {}
+        ~StageTimer() { recordStageSpan(_stage, _start); }
+};
+
+// keeps a gauge raised while the object lives
+class GaugeGuard {
+    private:
+        std::atomic<int64_t> *_gauge;
+    public:
+        GaugeGuard() : _gauge(nullptr) {}
+        ~GaugeGuard() { if(_gauge) (*_gauge)--; }
+        bool isArmed() const { return _gauge != nullptr; }
+        void arm(std::atomic<int64_t> *gauge) {
+            if(_gauge)
+                return;
+            _gauge = gauge;
+            (*_gauge)++;
+        }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "ModelChain.hpp"
+#include <sstream>
+#include <stdexcept>
+
+bool ModelChain::hasStep(ChainStepType type) const {
+    for(const ChainStep &step : steps)
+        if(step.type == type)
+            return true;
+    return false;
+}
+
+static ChainStep parseStep(const std::string &text) {
+    std::istringstream in(text);
+    std::string name;
+    in >> name;
+    ChainStep step = {STEP_DETECT, 0, 0};
+    if(name == "detect")
+        step.type = STEP_DETECT;
+    else if(name == "crop") {
+        step.type = STEP_CROP;
+        if(!(in >> step.margin) || step.margin < 0)
+            throw std::runtime_error("crop needs a margin >= 0");
+    }
+    else if(name == "generate") {
+        step.type = STEP_GENERATE;
+        if(!(in >> step.size) || step.size < MIN_CHAIN_GENERATE_SIZE || step.size > MAX_CHAIN_GENERATE_SIZE)
+            throw std::runtime_error("generate needs a size from " + std::to_string(MIN_CHAIN_GENERATE_SIZE) +
+                " to " + std::to_string(MAX_CHAIN_GENERATE_SIZE));
+    }
+    else if(name == "composite")
+        step.type = STEP_COMPOSITE;
+    else
+        throw std::runtime_error("unknown step '" + name + "'");
+    std::string rest;
+    if(in >> rest)
+        throw std::runtime_error("unexpected '" + rest + "' after " + name);
+    return step;
+}
+
+ModelChain parseModelChain(const std::string &spec) {
+    ModelChain chain;
+    chain.spec = spec;
+    size_t pos = 0;
+    while(pos <= spec.size()) {
+        size_t bar = spec.find('|', pos);
+        std::string text = spec.substr(pos, bar == std::string::npos ? std::string::npos : bar - pos);
+        ChainStep step = parseStep(text);
+        // every step consumes what the step before it made
+        if(chain.steps.empty() ? step.type != STEP_DETECT : step.type != chain.steps.back().type + 1)
+            throw std::runtime_error("steps must run detect | crop | generate | composite in order: " + spec);
+        chain.steps.push_back(step);
+        if(bar == std::string::npos)
+            break;
+        pos = bar + 1;
+    }
+    return chain;
+}
+
+std::vector<std::pair<int, ModelChain>> loadModelChains(const Config &config) {
+    std::vector<std::pair<int, ModelChain>> chains;
+    for(auto &entry : config.getPrefixed("chain.")) {
+        // an empty value removes a built-in chain
+        if(entry.second.empty())
+            continue;
+        int id = -1;
+        try {
+            id = std::stoi(entry.first);
+        }
+        catch(std::exception &) {}
+        if(id < 0 || id > UINT8_MAX || std::to_string(id) != entry.first)
+            throw std::runtime_error("Chain id " + entry.first + " is not a number from 0 to 255.");
+        try {
+            chains.push_back({id, parseModelChain(entry.second)});
+        }
+        catch(std::runtime_error &err) {
+            throw std::runtime_error("Chain " + entry.first + ": " + err.what());
+        }
+    }
+    return chains;
+}
+
+cv::Rect chainCropRegion(const FaceBox &face, float margin, cv::Size frame) {
+    float w = face.w * (1 + 2 * margin);
+    float h = face.h * (1 + 2 * margin);
+    cv::Rect region(cvRound(face.x - w / 2), cvRound(face.y - h / 2), cvRound(w), cvRound(h));
+    return region & cv::Rect(0, 0, frame.width, frame.height);
+}
@@ -0,0 +1,60 @@
+/*A model chain runs several steps on one request inside the server, so the
+  intermediate crops never leave memory and are never re-encoded. Chains
+  are declared in the config and picked by the request's chain id:
+
+    chain.<id> = detect | crop <margin> | generate <size> | composite
+
+  detect finds the faces, crop cuts each face with margin times its size
+  added around it, generate stylizes every crop at size x size, composite
+  pastes the stylized faces back into the frame. Steps keep this order and
+  each may be left out from crop on: a chain without composite replies with
+  the crops, one per box, and a chain of detect alone replies with boxes.*/
+#ifndef MODELCHAIN_HPP
+#define MODELCHAIN_HPP
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "imageProcess.hpp"
+#include "Config.hpp"
+
+const int MAX_CHAIN_FACES = 32;         // faces a chain works on, the most confident first
+const int MIN_CHAIN_GENERATE_SIZE = 256;    // the generator's optimization profile
+const int MAX_CHAIN_GENERATE_SIZE = 1024;
+
+// built in, a config file may replace or add chains
+const char *const DEFAULT_MODEL_CHAINS =
+    "chain.0 = detect | crop 0.3 | generate 256 | composite\n"
+    "chain.1 = detect | crop 0.3 | generate 256\n";
+
+typedef enum {
+    STEP_DETECT,
+    STEP_CROP,
+    STEP_GENERATE,
+    STEP_COMPOSITE,
+} ChainStepType;
+
+struct ChainStep {
+    ChainStepType type;
+    float margin;           // crop
+    int size;               // generate
+};
+
+struct ModelChain {
+    std::string spec;
+    std::vector<ChainStep> steps;
+
+    bool hasStep(ChainStepType type) const;
+    // the reply is an image list rather than one image
+    bool repliesCrops() const { return hasStep(STEP_CROP) && !hasStep(STEP_COMPOSITE); }
+};
+
+// throws runtime_error for a malformed spec or steps out of order
+ModelChain parseModelChain(const std::string &spec);
+// the chains of a config by id, ids have to fit the request header
+std::vector<std::pair<int, ModelChain>> loadModelChains(const Config &config);
+
+// the face grown by margin on every side, clipped to the frame
+cv::Rect chainCropRegion(const FaceBox &face, float margin, cv::Size frame);
+
+#endif
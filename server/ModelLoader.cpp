@@ -0,0 +1,255 @@
+#include "ModelLoader.hpp"
+#include <spdlog/spdlog.h>
+
+struct LoadArgs {
+    ModelLoader *loader;
+    ModelKind kind;
+};
+
+static int64_t steadyNowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char* modelKindName(ModelKind kind) {
+    static const char *names[MODEL_KIND_NUMS] = {"detector", "generator"};
+    return kind < MODEL_KIND_NUMS ? names[kind] : "unknown";
+}
+
+const char* modelStateName(ModelState state) {
+    static const char *names[MODEL_STATE_NUMS] = {"unloaded", "loading", "warming", "ready", "failed"};
+    return state < MODEL_STATE_NUMS ? names[state] : "unknown";
+}
+
+ModelLoader::ModelLoader() : _budgetBytes(0) {
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+ModelLoader::~ModelLoader() {
+    // a loader still running would hand its slots to a server being destroyed
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        if(_models[kind].joinable)
+            pthread_join(_models[kind].thread, NULL);
+    pthread_mutex_destroy(&_mtx);
+}
+
+void ModelLoader::addModel(ModelKind kind, int slots, cv::Size warmUpSize, ModelFactory create,
+    ModelPublisher publish, ModelWithdrawer withdraw) {
+    ModelEntry &entry = _models[kind];
+    entry.slots = slots;
+    entry.warmUpSize = warmUpSize;
+    entry.create = create;
+    entry.publish = publish;
+    entry.withdraw = withdraw;
+}
+
+void ModelLoader::start(ModelKind kind) {
+    ModelEntry &entry = _models[kind];
+    // requests call this for every model they need, the resident ones return here
+    if(entry.state.load() != MODEL_UNLOADED)
+        return;
+    pthread_mutex_lock(&_mtx);
+    if(entry.loading || entry.state.load() != MODEL_UNLOADED) {
+        pthread_mutex_unlock(&_mtx);
+        return;
+    }
+    // the previous load of an evicted model is done, only its thread is left
+    if(entry.joinable)
+        pthread_join(entry.thread, NULL);
+    entry.joinable = false;
+    entry.loading = true;
+    entry.startedAt = std::chrono::steady_clock::now();
+    entry.state = MODEL_LOADING;
+    LoadArgs *args = new LoadArgs{this, kind};
+    if(pthread_create(&entry.thread, NULL, load_thread, args) != 0) {
+        delete args;
+        entry.loading = false;
+        entry.state = MODEL_FAILED;
+        spdlog::error("Create the {} loader thread failed.", modelKindName(kind));
+    }
+    else
+        entry.joinable = true;
+    pthread_mutex_unlock(&_mtx);
+}
+
+void ModelLoader::startAll() {
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        start((ModelKind)kind);
+}
+
+void ModelLoader::touch(ModelKind kind) {
+    _models[kind].lastUsedUs.store(steadyNowUs(), std::memory_order_relaxed);
+}
+
+void* ModelLoader::load_thread(void *args) {
+    LoadArgs *load = (LoadArgs *)args;
+    load->loader->loadKind(load->kind);
+    delete load;
+    return NULL;
+}
+
+void ModelLoader::loadKind(ModelKind kind) {
+    ModelEntry &entry = _models[kind];
+    // a model loaded before has a known size, room is made before it comes in
+    pthread_mutex_lock(&_mtx);
+    size_t knownBytes = entry.knownBytes;
+    pthread_mutex_unlock(&_mtx);
+    makeRoom(kind, knownBytes);
+
+    spdlog::info("Load the {} with {} slots.", modelKindName(kind), entry.slots);
+    TrtPipeline *model = nullptr;
+    try {
+        model = entry.create();
+        entry.version = model->getModelVersion();
+    }
+    catch(std::exception &err) {
+        spdlog::error("Load the {} failed : {}", modelKindName(kind), err.what());
+        pthread_mutex_lock(&_mtx);
+        entry.loading = false;
+        entry.state = MODEL_FAILED;
+        pthread_mutex_unlock(&_mtx);
+        return;
+    }
+    entry.state = MODEL_WARMING;
+    // the other slots are made before the first is published, a request could be using it after
+    size_t bytes = model->getWeightBytes();
+    std::vector<TrtPipeline *> models = {model};
+    for(int i = 1; i < entry.slots; ++i)
+        models.push_back(model->createSlot());
+    for(TrtPipeline *slotModel : models) {
+        size_t slotBytes = slotModel->getSlotBytes();
+        if(publishSlot(kind, slotModel))
+            bytes += slotBytes;
+    }
+
+    pthread_mutex_lock(&_mtx);
+    entry.knownBytes = bytes;
+    entry.residentBytes = entry.ready.load() > 0 ? bytes : 0;
+    entry.loading = false;
+    if(entry.ready.load() == 0)
+        entry.state = MODEL_FAILED;
+    pthread_mutex_unlock(&_mtx);
+    spdlog::info("{} {} slots of {} ready, {} MB resident.", entry.ready.load(), modelKindName(kind),
+        entry.slots, bytes >> 20);
+    // the first load of a model learns its size only now
+    makeRoom(kind, 0);
+}
+
+bool ModelLoader::publishSlot(ModelKind kind, TrtPipeline *model) {
+    ModelEntry &entry = _models[kind];
+    try {
+        model->warmUp(entry.warmUpSize, WARMUP_RUNS);
+    }
+    catch(std::exception &err) {
+        spdlog::error("Warm up a {} slot failed : {}", modelKindName(kind), err.what());
+        delete model;
+        return false;
+    }
+    entry.publish(model);
+    if(entry.ready.fetch_add(1) == 0) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - entry.startedAt).count();
+        entry.lastLoadSeconds = seconds;
+        entry.loadSecondsTotal = entry.loadSecondsTotal.load() + seconds;
+        entry.loads++;
+        touch(kind);
+        entry.state = MODEL_READY;
+        spdlog::info("The {} is ready after {:.1f}s.", modelKindName(kind), seconds);
+    }
+    return true;
+}
+
+void ModelLoader::makeRoom(ModelKind keep, size_t incoming) {
+    if(_budgetBytes == 0)
+        return;
+    pthread_mutex_lock(&_mtx);
+    bool tried[MODEL_KIND_NUMS] = {};
+    while(true) {
+        size_t total = incoming;
+        for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+            total += _models[kind].residentBytes.load();
+        if(total <= _budgetBytes)
+            break;
+        // the least recently used idle model goes first
+        int victim = -1;
+        for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind) {
+            const ModelEntry &entry = _models[kind];
+            if(kind == keep || tried[kind] || entry.pinned || entry.loading || entry.state.load() != MODEL_READY)
+                continue;
+            if(victim < 0 || entry.lastUsedUs.load() < _models[victim].lastUsedUs.load())
+                victim = kind;
+        }
+        if(victim < 0) {
+            spdlog::warn("Models hold {} MB over the budget of {} MB, nothing idle to evict.",
+                (total - _budgetBytes) >> 20, _budgetBytes >> 20);
+            break;
+        }
+        tried[victim] = true;
+        evict((ModelKind)victim);
+    }
+    pthread_mutex_unlock(&_mtx);
+}
+
+bool ModelLoader::evict(ModelKind kind) {
+    ModelEntry &entry = _models[kind];
+    // every slot has to be idle, a slot in use is given back with the others
+    int slots = entry.ready.load();
+    std::vector<TrtPipeline *> taken;
+    while((int)taken.size() < slots) {
+        TrtPipeline *model = entry.withdraw();
+        if(model == nullptr)
+            break;
+        taken.push_back(model);
+    }
+    if((int)taken.size() < slots) {
+        for(TrtPipeline *model : taken)
+            entry.publish(model);
+        return false;
+    }
+    size_t bytes = entry.residentBytes.load();
+    double idleSeconds = (steadyNowUs() - entry.lastUsedUs.load()) / 1e6;
+    entry.state = MODEL_UNLOADED;
+    entry.ready = 0;
+    entry.residentBytes = 0;
+    entry.evictions++;
+    // the last slot releases the engine
+    for(TrtPipeline *model : taken)
+        delete model;
+    spdlog::info("Evicted the {}, {} MB idle for {:.1f}s.", modelKindName(kind), bytes >> 20, idleSeconds);
+    return true;
+}
+
+bool ModelLoader::isServable(ModelKind kind) const {
+    ModelState state = getState(kind);
+    return state == MODEL_READY || (state != MODEL_FAILED && _models[kind].loads.load() > 0);
+}
+
+ModelStats ModelLoader::getStats(ModelKind kind) const {
+    const ModelEntry &entry = _models[kind];
+    ModelStats stats;
+    stats.residentBytes = entry.residentBytes.load();
+    stats.loads = entry.loads.load();
+    stats.evictions = entry.evictions.load();
+    stats.lastLoadSeconds = entry.lastLoadSeconds.load();
+    stats.loadSecondsTotal = entry.loadSecondsTotal.load();
+    return stats;
+}
+
+bool ModelLoader::isReady() const {
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind) {
+        ModelState state = getState((ModelKind)kind);
+        if(state == MODEL_FAILED || (state != MODEL_READY && state != MODEL_UNLOADED && _models[kind].loads.load() == 0))
+            return false;
+    }
+    return true;
+}
+
+std::string ModelLoader::renderStates() const {
+    std::string out;
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind) {
+        const ModelEntry &entry = _models[kind];
+        out += std::string(modelKindName((ModelKind)kind)) + " " + modelStateName(getState((ModelKind)kind)) +
+            " " + std::to_string(entry.ready.load()) + "/" + std::to_string(entry.slots) +
+            (entry.pinned ? " pinned" : "") + "\n";
+    }
+    return out;
+}
@@ -0,0 +1,140 @@
+/*ModelLoader brings the models up in the background, so the server
+  accepts connections while engines are read or built. Each model kind goes
+  through its states on a thread of its own:
+
+    unloaded -> loading -> warming -> ready, or failed
+       ^                               |
+       +----------- evicted -----------+
+
+  A kind's engine is loaded once, the detector and the generator in
+  parallel. Its weights are shared by the kind's execution slots, each slot
+  only adds its own contexts and activation buffers, so the concurrency of a
+  model is a slot count rather than a number of loaded copies. Every slot
+  runs WARMUP_RUNS inferences before it is handed to the server, and the
+  kind is ready with its first warm slot.
+
+  The resident models are bounded by a byte budget. A model's size is its
+  plan plus the device memory of its slots, known once it was loaded. When
+  a load would go over the budget, the least recently used models are
+  evicted first. Only idle models are evicted, all of their slots are back
+  with the server, and pinned models never are. An evicted model is loaded
+  again by the next request that needs it.
+
+  A kind starts loading when start() is called for it, either for all kinds
+  at startup or lazily by the first request that needs it.*/
+#ifndef MODELLOADER_HPP
+#define MODELLOADER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+#include "trtModel/TrtPipeline.hpp"
+
+const int WARMUP_RUNS = 2;      // inferences before a slot takes requests
+
+typedef enum {
+    MODEL_DETECTOR,
+    MODEL_GENERATOR,
+    MODEL_KIND_NUMS,
+} ModelKind;
+
+typedef enum {
+    MODEL_UNLOADED,
+    MODEL_LOADING,
+    MODEL_WARMING,
+    MODEL_READY,
+    MODEL_FAILED,
+    MODEL_STATE_NUMS,
+} ModelState;
+
+const char* modelKindName(ModelKind kind);
+const char* modelStateName(ModelState state);
+
+// loads the engine as the first slot, throws when it can't be loaded
+typedef std::function<TrtPipeline*()> ModelFactory;
+// hands a warm slot to the server
+typedef std::function<void(TrtPipeline*)> ModelPublisher;
+// takes an idle slot back from the server, nullptr when every slot is held
+typedef std::function<TrtPipeline*()> ModelWithdrawer;
+
+struct ModelStats {
+    size_t residentBytes;
+    uint64_t loads;
+    uint64_t evictions;
+    double lastLoadSeconds;     // start of the load until the first slot was ready
+    double loadSecondsTotal;
+};
+
+class ModelLoader {
+    private:
+        struct ModelEntry {
+            int slots = 0;
+            bool pinned = false;
+            cv::Size warmUpSize;
+            ModelFactory create;
+            ModelPublisher publish;
+            ModelWithdrawer withdraw;
+            std::atomic<int> state{MODEL_UNLOADED};
+            std::atomic<int> ready{0};          // slots published
+            std::atomic<uint64_t> version{0};   // set before the kind is ready
+            std::atomic<int64_t> lastUsedUs{0}; // steady clock of the last acquire
+            std::atomic<size_t> residentBytes{0};
+            std::atomic<uint64_t> loads{0};
+            std::atomic<uint64_t> evictions{0};
+            std::atomic<double> lastLoadSeconds{0};
+            std::atomic<double> loadSecondsTotal{0};
+            // guarded by _mtx
+            bool loading = false;
+            bool joinable = false;              // the thread of the last load wasn't joined
+            pthread_t thread;
+            size_t knownBytes = 0;              // measured by the last load
+            std::chrono::steady_clock::time_point startedAt;
+        };
+        ModelEntry _models[MODEL_KIND_NUMS];
+        pthread_mutex_t _mtx;       // guards loads starting and evictions
+        size_t _budgetBytes;        // 0 is unbounded
+
+        static void* load_thread(void *args);
+        void loadKind(ModelKind kind);
+        bool publishSlot(ModelKind kind, TrtPipeline *model);
+        // evicts idle models until the resident ones and incoming bytes fit the budget
+        void makeRoom(ModelKind keep, size_t incoming);
+        // called with _mtx held, false when a slot is in use
+        bool evict(ModelKind kind);
+    public:
+        ModelLoader();
+        ~ModelLoader();
+        // declare every kind before the first start
+        void addModel(ModelKind kind, int slots, cv::Size warmUpSize, ModelFactory create,
+            ModelPublisher publish, ModelWithdrawer withdraw);
+        // concurrent requests of the kind, set before it starts
+        void setSlots(ModelKind kind, int slots) { _models[kind].slots = slots; }
+        // a pinned model is never evicted
+        void setPinned(ModelKind kind, bool pinned) { _models[kind].pinned = pinned; }
+        void setBudget(size_t budgetBytes) { _budgetBytes = budgetBytes; }
+        size_t getBudget() const { return _budgetBytes; }
+        // begins loading an unloaded kind, returns at once
+        void start(ModelKind kind);
+        void startAll();
+        // a request took a slot of the kind
+        void touch(ModelKind kind);
+
+        ModelState getState(ModelKind kind) const { return (ModelState)_models[kind].state.load(); }
+        int getSlots(ModelKind kind) const { return _models[kind].slots; }
+        int getReadySlots(ModelKind kind) const { return _models[kind].ready.load(); }
+        uint64_t getVersion(ModelKind kind) const { return _models[kind].version.load(); }
+        // ready, or loaded before and coming back on demand
+        bool isServable(ModelKind kind) const;
+        ModelStats getStats(ModelKind kind) const;
+        // no model failed or is loading for the first time
+        bool isReady() const;
+        // one "kind state ready/slots" line per kind
+        std::string renderStates() const;
+};
+
+#endif
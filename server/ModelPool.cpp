@@ -0,0 +1,275 @@
+#include "ModelPool.hpp"
+#include <algorithm>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include "Metrics.hpp"
+#include "Hash.hpp"
+
+// requests a model runs concurrently, the slots share one copy of the weights
+const int DEFAULT_DETECTOR_SLOTS = 1;
+const int DEFAULT_GENERATOR_SLOTS = 1;
+
+const std::string DETECTOR_ONNX = "./model/CenterFace/centerface_480_640.onnx";
+const std::string GENERATOR_ONNX = "./model/AnimeGANv3/AnimeGANv3_PortraitSketch.onnx";
+const cv::Size DETECTOR_WARMUP_SIZE(640, 480);     // the detector's input, a camera frame
+const std::string DEFAULT_CALIBRATION_DIR = "./client/images";
+
+ModelPool::ModelPool() {
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind) {
+        _quantize[kind] = false;
+        _int8Verdicts[kind] = 0;
+        _quantized[kind] = false;
+    }
+    _calibrationDir = DEFAULT_CALIBRATION_DIR;
+    _loader = new ModelLoader();
+    _loader->addModel(MODEL_DETECTOR, DEFAULT_DETECTOR_SLOTS, DETECTOR_WARMUP_SIZE,
+        [this]() { return createModel(MODEL_DETECTOR); },
+        [this](TrtPipeline *model) { addDetector(static_cast<ImageDetector *>(model)); },
+        [this]() -> TrtPipeline* {
+            ImageDetector *detector = nullptr;
+            return _detectorQue.popFor(detector, 0) ? detector : nullptr;
+        });
+    _loader->addModel(MODEL_GENERATOR, DEFAULT_GENERATOR_SLOTS, cv::Size(DYNAMIC_OPT_SIZE, DYNAMIC_OPT_SIZE),
+        [this]() { return createModel(MODEL_GENERATOR); },
+        [this](TrtPipeline *model) { addGenerator(static_cast<ImageGenerator *>(model)); },
+        [this]() -> TrtPipeline* {
+            ImageGenerator *generator = nullptr;
+            return _generatorQue.popFor(generator, 0) ? generator : nullptr;
+        });
+}
+
+ModelPool::~ModelPool() {
+    delete _loader;     // waits for the loaders, their instances are in the queues after
+    while(!_detectorQue.isEmpty()) {
+        ImageDetector *detector = _detectorQue.pop();
+        delete detector;
+    }
+    while(!_generatorQue.isEmpty()) {
+        ImageGenerator *generator = _generatorQue.pop();
+        delete generator;
+    }
+}
+
+void ModelPool::registerMetrics() {
+    Metrics &metrics = getMetrics();
+    // a backend counts its ready slots, and those an evicted model brings back on demand.
+    // The router skips models still loading for the first time
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addGauge("imageserver_model_instances", "Ready execution slots of a model.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() {
+                if(_loader->getState((ModelKind)kind) == MODEL_READY)
+                    return double(_loader->getReadySlots((ModelKind)kind));
+                return _loader->isServable((ModelKind)kind) ? double(_loader->getSlots((ModelKind)kind)) : 0.0;
+            });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addGauge("imageserver_model_instances_busy", "Execution slots held by a request.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() {
+                int idle = kind == MODEL_DETECTOR ? (int)_detectorQue.size() : (int)_generatorQue.size();
+                return double(std::max(0, _loader->getReadySlots((ModelKind)kind) - idle));
+            });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        for(int state = 0; state < MODEL_STATE_NUMS; ++state)
+            metrics.addGauge("imageserver_model_state", "1 for the current load state of a model.",
+                fmt::format("model=\"{}\",state=\"{}\"", modelKindName((ModelKind)kind), modelStateName((ModelState)state)),
+                [this, kind, state]() { return double(_loader->getState((ModelKind)kind) == state); });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addGauge("imageserver_model_load_seconds", "Cold load latency of the last load of a model.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() { return _loader->getStats((ModelKind)kind).lastLoadSeconds; });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addCounter("imageserver_model_load_seconds_total", "Time spent loading a model until it was ready.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() { return _loader->getStats((ModelKind)kind).loadSecondsTotal; });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addCounter("imageserver_model_loads_total", "Loads of a model, the first and those after an eviction.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() { return double(_loader->getStats((ModelKind)kind).loads); });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addCounter("imageserver_model_evictions_total", "Idle models unloaded to fit the model budget.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() { return double(_loader->getStats((ModelKind)kind).evictions); });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addGauge("imageserver_model_resident_bytes", "Weights and slot memory of a loaded model.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() { return double(_loader->getStats((ModelKind)kind).residentBytes); });
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind)
+        metrics.addGauge("imageserver_model_quantized", "1 when the loaded variant of a model is INT8.",
+            fmt::format("model=\"{}\"", modelKindName((ModelKind)kind)),
+            [this, kind]() { return double(_quantized[kind].load()); });
+    metrics.addGauge("imageserver_model_budget_bytes", "Bytes the resident models are kept under, 0 is unbounded.", "",
+        [this]() { return double(_loader->getBudget()); });
+}
+
+ImageDetector* ModelPool::getDetector() {
+    return _detectorQue.pop();
+}
+
+void ModelPool::addDetector(ImageDetector *detector) {
+    _detectorQue.push(detector);
+}
+    
+ImageGenerator* ModelPool::getGenerator() {
+    return _generatorQue.pop();
+}
+
+void ModelPool::addGenerator(ImageGenerator *generator) {
+    _generatorQue.push(generator);
+}
+
+void* ModelPool::getTrtModel(TaskMode taskMode) {
+    if(taskMode == IMAGE_DETECTION) {
+        return getDetector();
+    }
+    else if(taskMode == IMAGE_GENERATION) {
+        return getGenerator();
+    }
+    else if(taskMode == IMAGE_TRACKING) {
+        return getDetector();
+    }
+    else {
+        return nullptr;
+    }
+}
+
+void ModelPool::addTrtModel(const TaskMode taskMode, void* trtModel) {
+    if(taskMode == IMAGE_DETECTION || taskMode == IMAGE_TRACKING) {
+        ImageDetector *detector = (ImageDetector *)(trtModel);
+        addDetector(detector);
+    }
+    else if(taskMode == IMAGE_GENERATION) {
+        ImageGenerator *generator = (ImageGenerator *)(trtModel);
+        addGenerator(generator);
+    }
+}
+
+void* ModelPool::acquireTrtModel(TaskMode taskMode, const CancelToken *token) {
+    if(taskMode != IMAGE_GENERATION && taskMode != IMAGE_DETECTION && taskMode != IMAGE_TRACKING)
+        return nullptr;
+    ModelKind kind = taskMode == IMAGE_GENERATION ? MODEL_GENERATOR : MODEL_DETECTOR;
+    _loader->touch(kind);
+    TimePoint giveUpAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(MODEL_WAIT_MAX_MS);
+    // wait in short slices so a hangup or an expired deadline frees the worker
+    while(!token->isCancelled() && std::chrono::steady_clock::now() < giveUpAt) {
+        // an evicted model comes back for the requests waiting on it, one whose reload failed won't
+        ModelState state = _loader->getState(kind);
+        if(state == MODEL_FAILED)
+            return nullptr;
+        if(state == MODEL_UNLOADED)
+            _loader->start(kind);
+        if(kind == MODEL_GENERATOR) {
+            ImageGenerator *generator = nullptr;
+            if(_generatorQue.popFor(generator, MODEL_WAIT_SLICE_MS))
+                return generator;
+        }
+        else {
+            ImageDetector *detector = nullptr;
+            if(_detectorQue.popFor(detector, MODEL_WAIT_SLICE_MS))
+                return detector;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t ModelPool::getModelVersion(TaskMode taskMode) {
+    // known once the model is loaded, requests are only run on ready models
+    if(taskMode == IMAGE_DETECTION || taskMode == IMAGE_TRACKING)
+        return _loader->getVersion(MODEL_DETECTOR);
+    else if(taskMode == IMAGE_GENERATION)
+        return _loader->getVersion(MODEL_GENERATOR);
+    else if(taskMode == IMAGE_CHAIN)
+        return hashCombine(_loader->getVersion(MODEL_DETECTOR), _loader->getVersion(MODEL_GENERATOR));
+    return 0;
+}
+
+ModelState ModelPool::getModelState(TaskMode taskMode, const ModelChain *chain) {
+    bool needs[MODEL_KIND_NUMS];
+    needs[MODEL_DETECTOR] = taskMode == IMAGE_DETECTION || taskMode == IMAGE_TRACKING ||
+        (taskMode == IMAGE_CHAIN && chain->hasStep(STEP_DETECT));
+    needs[MODEL_GENERATOR] = taskMode == IMAGE_GENERATION ||
+        (taskMode == IMAGE_CHAIN && chain->hasStep(STEP_GENERATE));
+    ModelState least = MODEL_READY;
+    for(int kind = 0; kind < MODEL_KIND_NUMS; ++kind) {
+        if(!needs[kind])
+            continue;
+        _loader->start((ModelKind)kind);
+        // a model that was evicted is reloaded while its requests wait for a slot
+        if(_loader->isServable((ModelKind)kind))
+            continue;
+        ModelState state = _loader->getState((ModelKind)kind);
+        if(state == MODEL_FAILED)
+            return MODEL_FAILED;
+        least = std::min(least, state);
+    }
+    return least;
+}
+
+void ModelPool::configure(const Config &config) {
+    _loader->setSlots(MODEL_DETECTOR, std::max(1L, config.getInt("model.detector.slots", DEFAULT_DETECTOR_SLOTS)));
+    _loader->setSlots(MODEL_GENERATOR, std::max(1L, config.getInt("model.generator.slots", DEFAULT_GENERATOR_SLOTS)));
+    // latency critical models stay resident whatever the model budget
+    _loader->setPinned(MODEL_DETECTOR, config.getInt("model.detector.pinned", 0) != 0);
+    _loader->setPinned(MODEL_GENERATOR, config.getInt("model.generator.pinned", 0) != 0);
+    // model.<kind>.precision = int8 runs the calibrated variant once it passes the accuracy gate
+    _quantize[MODEL_DETECTOR] = config.getString("model.detector.precision", PRECISION_FP32) == PRECISION_INT8;
+    _quantize[MODEL_GENERATOR] = config.getString("model.generator.precision", PRECISION_FP32) == PRECISION_INT8;
+    _calibrationDir = config.getString("model.calibration_dir", DEFAULT_CALIBRATION_DIR);
+    _tolerance.matchIou = config.getDouble("model.int8.match_iou", _tolerance.matchIou);
+    _tolerance.minRecall = config.getDouble("model.int8.min_recall", _tolerance.minRecall);
+    _tolerance.minMeanIou = config.getDouble("model.int8.min_mean_iou", _tolerance.minMeanIou);
+    _tolerance.minPsnr = config.getDouble("model.int8.min_psnr", _tolerance.minPsnr);
+}
+
+static TrtPipeline* newModel(ModelKind kind, const CalibrationSet *calibration) {
+    if(kind == MODEL_DETECTOR)
+        return new ImageDetector(DETECTOR_ONNX, calibration);
+    return new ImageGenerator(GENERATOR_ONNX, true, calibration);
+}
+
+TrtPipeline* ModelPool::createModel(ModelKind kind) {
+    if(!_quantize[kind] || _int8Verdicts[kind].load() < 0) {
+        _quantized[kind] = false;
+        return newModel(kind, nullptr);
+    }
+    CalibrationSet calibration;
+    try {
+        calibration = loadCalibrationSet(_calibrationDir);
+    }
+    catch(std::runtime_error &err) {
+        spdlog::error("INT8 {} disabled, FP32 is used : {}", modelKindName(kind), err.what());
+        _int8Verdicts[kind] = -1;
+        _quantized[kind] = false;
+        return newModel(kind, nullptr);
+    }
+    // a failed INT8 build or calibration leaves the FP32 model, like a missing calibration set
+    std::unique_ptr<TrtPipeline> candidate;
+    try {
+        candidate.reset(newModel(kind, &calibration));
+    }
+    catch(std::exception &err) {
+        spdlog::error("INT8 {} build failed, FP32 is used : {}", modelKindName(kind), err.what());
+        _int8Verdicts[kind] = -1;
+        _quantized[kind] = false;
+        return newModel(kind, nullptr);
+    }
+    // checked once per process, a reload after an eviction keeps the verdict
+    if(_int8Verdicts[kind].load() > 0) {
+        _quantized[kind] = true;
+        return candidate.release();
+    }
+    std::unique_ptr<TrtPipeline> reference(newModel(kind, nullptr));
+    AccuracyReport report = kind == MODEL_DETECTOR ?
+        checkDetectorAccuracy(*static_cast<ImageDetector *>(reference.get()), *static_cast<ImageDetector *>(candidate.get()),
+            calibration.validation, _tolerance) :
+        checkGeneratorAccuracy(*static_cast<ImageGenerator *>(reference.get()), *static_cast<ImageGenerator *>(candidate.get()),
+            calibration.validation, cv::Size(DYNAMIC_OPT_SIZE, DYNAMIC_OPT_SIZE), _tolerance);
+    _int8Verdicts[kind] = report.passed ? 1 : -1;
+    _quantized[kind] = report.passed;
+    if(!report.passed) {
+        spdlog::error("INT8 {} is out of tolerance, FP32 is used : {}", modelKindName(kind), report.describe());
+        return reference.release();
+    }
+    spdlog::info("INT8 {} enabled : {}", modelKindName(kind), report.describe());
+    return candidate.release();
+}
@@ -0,0 +1,61 @@
+/*ModelPool owns the server's models: the ModelLoader that brings them up
+  and the queues of their idle execution slots. A request takes a slot from
+  its kind's queue and gives it back when done.
+
+  It needs no socket, so the serving ImageServer and the offline
+  BatchRunner both run their models through one.*/
+#ifndef MODELPOOL_HPP
+#define MODELPOOL_HPP
+
+#include <atomic>
+#include <string>
+#include "trtModel/imageDetector.hpp"
+#include "trtModel/ImageGenerator.hpp"
+#include "Protocol.hpp"
+#include "CancelToken.hpp"
+#include "Config.hpp"
+#include "ModelChain.hpp"
+#include "ModelLoader.hpp"
+#include "AccuracyGate.hpp"
+#include "utils.hpp"
+
+const int MODEL_WAIT_SLICE_MS = 10; // how often a request waiting for a model checks its token
+const int MODEL_WAIT_MAX_MS = 30000; // a request without a deadline gives up on the model after this
+
+class ModelPool {
+    private:
+        ThreadSafeQueue<ImageDetector *> _detectorQue;
+        ThreadSafeQueue<ImageGenerator *> _generatorQue;
+        ModelLoader *_loader;
+        // INT8 variants, set before the models load
+        bool _quantize[MODEL_KIND_NUMS];
+        std::string _calibrationDir;
+        AccuracyTolerance _tolerance;
+        std::atomic<int> _int8Verdicts[MODEL_KIND_NUMS];   // of the accuracy gate, 0 until checked
+        std::atomic<bool> _quantized[MODEL_KIND_NUMS];     // the loaded variant is INT8
+
+        // the FP32 model, or its INT8 variant when it is asked for and passes the accuracy gate
+        TrtPipeline* createModel(ModelKind kind);
+    public:
+        ModelPool();        // nothing is loaded until the loader starts a kind
+        ~ModelPool();
+
+        ImageDetector* getDetector();
+        void addDetector(ImageDetector *detector);
+        ImageGenerator* getGenerator();
+        void addGenerator(ImageGenerator *generator);
+        void* getTrtModel(TaskMode taskMode);
+        void addTrtModel(const TaskMode taskMode, void* trtModel);
+        // wait for a model instance. Returns nullptr once the token is cancelled, the model
+        // failed or MODEL_WAIT_MAX_MS passed
+        void* acquireTrtModel(TaskMode taskMode, const CancelToken *token);
+        uint64_t getModelVersion(TaskMode taskMode);
+        // the least ready of the models the task needs, starts loading those not started.
+        // A model being reloaded after an eviction counts as ready
+        ModelState getModelState(TaskMode taskMode, const ModelChain *chain);
+        ModelLoader* getLoader() { return _loader; }
+        void configure(const Config &config); // called before the models start loading
+        void registerMetrics();
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include "MotionGate.hpp"
+
+const int THUMB_SIZE = 64;
+const double PIXEL_DIFF_THRESH = 12;      // luma levels, above sensor noise after area averaging
+const float REUSE_MAX_CHANGED = 0.002f;   // changed thumbnail cells to still reuse the last result
+const float ROI_MAX_CHANGED = 0.25f;      // changed thumbnail cells to still process a region only
+const float ROI_MAX_AREA = 0.5f;          // region area relative to the frame
+const int ROI_MARGIN = 16;
+const int ROI_MIN_SIDE = 256;             // smallest input of the generator profile
+const int ROI_ALIGN = 32;
+
+std::atomic<uint64_t> MotionGate::_fullCount(0);
+std::atomic<uint64_t> MotionGate::_reuseCount(0);
+std::atomic<uint64_t> MotionGate::_roiCount(0);
+
+// grow [lo, hi) around its center to at least minLen, aligned and kept inside [0, limit)
+static void expandRange(int &lo, int &hi, int minLen, int limit) {
+    int len = std::max(hi - lo, minLen);
+    len = (len + ROI_ALIGN - 1) / ROI_ALIGN * ROI_ALIGN;
+    if(len > limit)
+        len = limit;
+    int center = (lo + hi) / 2;
+    lo = std::max(0, center - len / 2);
+    hi = lo + len;
+    if(hi > limit) {
+        hi = limit;
+        lo = limit - len;
+    }
+}
+
+MotionGate::MotionGate() : _taskMode(-1) {
+    _lastTone.scale = 0;
+    _lastTone.offset = 0;
+}
+
+MotionGate::~MotionGate() {
+
+}
+
+GateDecision MotionGate::check(const cv::Mat &frame, int taskMode, bool allowRoi, cv::Rect &roi) {
+    cv::Mat small, thumb;
+    cv::resize(frame, small, cv::Size(THUMB_SIZE, THUMB_SIZE), 0, 0, cv::INTER_AREA);
+    cv::cvtColor(small, thumb, cv::COLOR_BGR2GRAY);
+
+    // a new task mode or frame size invalidates the last result
+    bool comparable = !_lastResult.empty() && taskMode == _taskMode &&
+        _lastResult.rows == frame.rows && _lastResult.cols == frame.cols;
+    _taskMode = taskMode;
+    if(!comparable) {
+        _refThumb = thumb;
+        _fullCount++;
+        return GATE_FULL;
+    }
+
+    cv::Mat diff, mask;
+    cv::absdiff(thumb, _refThumb, diff);
+    cv::threshold(diff, mask, PIXEL_DIFF_THRESH, 255, cv::THRESH_BINARY);
+    float changed = float(cv::countNonZero(mask)) / float(THUMB_SIZE * THUMB_SIZE);
+    // keep the old reference on reuse, so slow drift adds up until it is processed
+    if(changed <= REUSE_MAX_CHANGED) {
+        _reuseCount++;
+        return GATE_REUSE;
+    }
+
+    _refThumb = thumb;
+    if(allowRoi && changed <= ROI_MAX_CHANGED) {
+        cv::Rect cells = cv::boundingRect(mask);
+        float scaleX = float(frame.cols) / THUMB_SIZE;
+        float scaleY = float(frame.rows) / THUMB_SIZE;
+        int left = std::max(0, int(cells.x * scaleX) - ROI_MARGIN);
+        int top = std::max(0, int(cells.y * scaleY) - ROI_MARGIN);
+        int right = std::min(frame.cols, int((cells.x + cells.width) * scaleX) + ROI_MARGIN);
+        int bottom = std::min(frame.rows, int((cells.y + cells.height) * scaleY) + ROI_MARGIN);
+        expandRange(left, right, ROI_MIN_SIDE, frame.cols);
+        expandRange(top, bottom, ROI_MIN_SIDE, frame.rows);
+        roi = cv::Rect(left, top, right - left, bottom - top);
+        if(roi.area() <= ROI_MAX_AREA * frame.rows * frame.cols) {
+            _roiCount++;
+            return GATE_ROI;
+        }
+    }
+    _fullCount++;
+    return GATE_FULL;
+}
+
+GateStats MotionGate::getStats() {
+    GateStats stats;
+    stats.full = _fullCount.load();
+    stats.reuse = _reuseCount.load();
+    stats.roi = _roiCount.load();
+    return stats;
+}
@@ -0,0 +1,56 @@
+/*This header define a per-connection change detector for camera streams.
+  Each frame is reduced to a small luma thumbnail and compared with the
+  thumbnail of the last processed frame to decide how much of the frame
+  has to go through the model again.*/
+#ifndef MOTIONGATE_HPP
+#define MOTIONGATE_HPP
+
+#include <atomic>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "Protocol.hpp"
+#include "imageProcess.hpp"
+
+typedef enum {
+    GATE_FULL,      // process the whole frame
+    GATE_REUSE,     // nothing changed, reply with the last result
+    GATE_ROI,       // only a region changed, process that region
+} GateDecision;
+
+struct GateStats {
+    uint64_t full;
+    uint64_t reuse;
+    uint64_t roi;
+};
+
+class MotionGate {
+    private:
+        int _taskMode;
+        cv::Mat _refThumb;      // thumbnail of the last processed frame
+        cv::Mat _lastResult;
+        std::vector<WireBox> _lastBoxes;    // detection only
+        ToneMap _lastTone;                  // generation only, regions are mapped by it
+
+        static std::atomic<uint64_t> _fullCount;
+        static std::atomic<uint64_t> _reuseCount;
+        static std::atomic<uint64_t> _roiCount;
+    public:
+        MotionGate();
+        ~MotionGate();
+        // roi is only set for GATE_ROI and only when allowRoi is true
+        GateDecision check(const cv::Mat &frame, int taskMode, bool allowRoi, cv::Rect &roi);
+        void storeResult(const cv::Mat &result, const std::vector<WireBox> &boxes, const ToneMap &tone) {
+            _lastResult = result;
+            _lastBoxes = boxes;
+            _lastTone = tone;
+        }
+        const cv::Mat& getLastResult() const { return _lastResult; }
+        const std::vector<WireBox>& getLastBoxes() const { return _lastBoxes; }
+        const ToneMap& getLastTone() const { return _lastTone; }
+
+        // gating decisions of all connections since start
+        static GateStats getStats();
+};
+
+#endif
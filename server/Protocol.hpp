@@ -0,0 +1,100 @@
+/*This header define the wire format shared by the server and its clients.
+  A request either starts with a RequestHeader (magic == PROTOCOL_MAGIC) or,
+  for legacy clients, with a bare int length followed by the encoded image.
+  All fields are sent in host byte order, like the legacy length prefix.*/
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <stdint.h>
+
+const uint32_t PROTOCOL_MAGIC = 0x56435753; // "SWCV"
+
+typedef enum {
+    IMAGE_DETECTION,
+    IMAGE_GENERATION,
+    IMAGE_TRACKING,     // detect-then-track over the frames of one connection
+    IMAGE_CHAIN,        // several models in one request, see ModelChain.hpp
+} TaskMode;
+
+typedef enum {
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = 1,
+    STATUS_SERVER_ERROR = 2,
+    STATUS_DEADLINE_EXCEEDED = 3,
+    STATUS_OVERLOADED = 4,
+    STATUS_UNAVAILABLE = 5,     // the model failed, or no instance of it freed up in time
+} ResponseStatus;
+
+const int RESPONSE_STATUS_NUMS = STATUS_UNAVAILABLE + 1;
+// as metrics and reports name them, keep in step with ResponseStatus
+const char *const RESPONSE_STATUS_NAMES[RESPONSE_STATUS_NUMS] = {"ok", "bad_request", "server_error",
+    "deadline_exceeded", "overloaded", "unavailable"};
+
+typedef enum {
+    PRIORITY_DEFAULT = 0,       // detection and tracking are interactive, generation is batch
+    PRIORITY_INTERACTIVE = 1,
+    PRIORITY_BATCH = 2,
+} RequestPriority;
+
+// request flags
+const uint8_t FLAG_BOXES_ONLY = 0x01;   // reply without the processed image
+const uint8_t FLAG_MOTION_GATE = 0x02;  // frames are from one static camera, reuse results when unchanged
+const uint8_t FLAG_ADAPTIVE_SIZE = 0x04;    // generation: width x height is the most, less is taken under load
+
+// response flags
+const uint8_t RESPONSE_FLAG_IMAGE_LIST = 0x01;  // the payload is one uint32 length and image per box
+
+struct RequestHeader {
+    uint32_t magic;
+    uint32_t payloadSize;   // encoded image bytes following the header
+    uint8_t taskMode;
+    uint8_t flags;
+    uint8_t priority;
+    union {
+        uint8_t chain;          // IMAGE_CHAIN: id of a chain declared in the server config
+        uint8_t minSizePercent; // FLAG_ADAPTIVE_SIZE: the least size accepted, 0 leaves it to the server
+    };
+    uint16_t width;         // 0 keeps the server default size
+    uint16_t height;
+    uint32_t deadlineMs;    // time budget from arrival, 0 means no deadline
+};
+
+struct ResponseHeader {
+    uint32_t magic;
+    uint32_t payloadSize;   // encoded image bytes following the boxes
+    uint32_t boxCount;      // WireBox records following the header
+    uint8_t status;
+    uint8_t flags;
+    uint8_t sizePercent;    // FLAG_ADAPTIVE_SIZE: generated at this percent of width x height, 0 when not adapted
+    uint8_t reserved;
+};
+
+struct WireBox {
+    int32_t trackId;        // -1 when the box is not tracked
+    float confidence;
+    float x;                // box center
+    float y;
+    float w;
+    float h;
+};
+
+static_assert(sizeof(RequestHeader) == 20, "RequestHeader layout changed");
+static_assert(sizeof(ResponseHeader) == 16, "ResponseHeader layout changed");
+static_assert(sizeof(WireBox) == 24, "WireBox layout changed");
+
+// fills the header from the first four bytes of a request, true when the rest of a RequestHeader follows
+inline bool parseRequestPrefix(uint32_t prefix, RequestHeader &header) {
+    if(prefix == PROTOCOL_MAGIC) {
+        header.magic = prefix;
+        return true;
+    }
+    header.payloadSize = prefix;    // a legacy request, the image follows
+    return false;
+}
+
+// a TaskMode this server handles, anything else is a bad request
+inline bool isKnownTaskMode(int taskMode) {
+    return taskMode >= IMAGE_DETECTION && taskMode <= IMAGE_CHAIN;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#include "ResolutionController.hpp"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+ResolutionController::ResolutionController(int minSide, int sloMs)
+    : _sloMs(sloMs), _minSide(minSide), _level(0), _delayMs(0), _windowSumMs(0), _windowCount(0),
+      _windowStart(std::chrono::steady_clock::now()), _scaleDowns(0), _scaleUps(0) {
+    pthread_mutex_init(&_mtx, NULL);
+}
+
+ResolutionController::~ResolutionController() {
+    pthread_mutex_destroy(&_mtx);
+}
+
+void ResolutionController::observe(std::chrono::steady_clock::duration delay) {
+    double delayMs = std::chrono::duration<double, std::milli>(delay).count();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int moved = 0, level;
+    pthread_mutex_lock(&_mtx);
+    _windowSumMs += delayMs;
+    _windowCount++;
+    // the window closes with the first request after it, an idle server keeps its scale
+    if(now - _windowStart >= std::chrono::milliseconds(ADJUST_INTERVAL_MS)) {
+        _delayMs = _windowSumMs / _windowCount;
+        if(_delayMs > SCALE_DOWN_AT * _sloMs && _level + 1 < SCALE_LEVEL_NUMS)
+            moved = 1;
+        else if(_delayMs < SCALE_UP_AT * _sloMs && _level > 0)
+            moved = -1;
+        _level += moved;
+        _windowSumMs = 0;
+        _windowCount = 0;
+        _windowStart = now;
+    }
+    level = _level;
+    double averageMs = _delayMs;
+    pthread_mutex_unlock(&_mtx);
+    if(moved > 0)
+        _scaleDowns++;
+    else if(moved < 0)
+        _scaleUps++;
+    if(moved != 0)
+        spdlog::info("Generation scale {} to {}%, delay {:.0f}ms against a {}ms SLO.",
+            moved > 0 ? "down" : "up", SCALE_LEVELS[level], averageMs, _sloMs);
+}
+
+cv::Size ResolutionController::choose(cv::Size requested, int minSizePercent, uint8_t &sizePercent) {
+    pthread_mutex_lock(&_mtx);
+    int percent = SCALE_LEVELS[_level];
+    pthread_mutex_unlock(&_mtx);
+    percent = std::max(percent, minSizePercent);
+    if(percent >= 100) {
+        sizePercent = 100;
+        return requested;
+    }
+    // aligned sides the generator takes, within what the client accepts
+    auto scaleSide = [&](int side) {
+        int least = (side * minSizePercent + 99) / 100;
+        least = std::max(_minSide, (least + SIZE_ALIGNMENT - 1) / SIZE_ALIGNMENT * SIZE_ALIGNMENT);
+        return std::min(std::max(side * percent / 100 / SIZE_ALIGNMENT * SIZE_ALIGNMENT, least), side);
+    };
+    cv::Size size(scaleSide(requested.width), scaleSide(requested.height));
+    sizePercent = std::max(1, std::min(100, size.width * 100 / requested.width));
+    return size;
+}
+
+ResolutionStats ResolutionController::getStats() {
+    ResolutionStats stats;
+    pthread_mutex_lock(&_mtx);
+    stats.scalePercent = SCALE_LEVELS[_level];
+    stats.delayMs = _delayMs;
+    pthread_mutex_unlock(&_mtx);
+    stats.scaleDowns = _scaleDowns.load();
+    stats.scaleUps = _scaleUps.load();
+    return stats;
+}
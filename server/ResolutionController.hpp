@@ -0,0 +1,61 @@
+/*ResolutionController trades the generator's output size for latency. It
+  averages the delay generation requests see before their model runs (the
+  queue and the wait for a generator) over windows of ADJUST_INTERVAL_MS.
+  When a window's delay gets close to the latency SLO the generation scale
+  steps down, when it falls well below the SLO the scale steps back up. The
+  scale moves at most one step per window, and the gap between the two
+  thresholds keeps it from flapping between two levels.
+
+  Only requests with FLAG_ADAPTIVE_SIZE are scaled, never below the size
+  they declared as acceptable nor below the generator's profile.*/
+#ifndef RESOLUTIONCONTROLLER_HPP
+#define RESOLUTIONCONTROLLER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <stdint.h>
+#include <opencv2/core.hpp>
+
+const int DEFAULT_GENERATION_SLO_MS = 2000;
+const int SCALE_LEVELS[] = {100, 88, 75, 63, 50, 38, 25};  // percent of the requested size
+const int SCALE_LEVEL_NUMS = sizeof(SCALE_LEVELS) / sizeof(SCALE_LEVELS[0]);
+const double SCALE_DOWN_AT = 0.5;       // of the SLO, the delay that steps down
+const double SCALE_UP_AT = 0.2;         // of the SLO, the delay that steps back up
+const int ADJUST_INTERVAL_MS = 1000;
+const int SIZE_ALIGNMENT = 32;          // generated sides are multiples of it
+
+struct ResolutionStats {
+    int scalePercent;
+    double delayMs;             // average of the last window
+    uint64_t scaleDowns;
+    uint64_t scaleUps;
+};
+
+class ResolutionController {
+    private:
+        int _sloMs;
+        int _minSide;
+        int _level;                 // index into SCALE_LEVELS, guarded by _mtx
+        double _delayMs;            // guarded by _mtx
+        double _windowSumMs;        // guarded by _mtx
+        int _windowCount;           // guarded by _mtx
+        std::chrono::steady_clock::time_point _windowStart;  // guarded by _mtx
+        pthread_mutex_t _mtx;
+        std::atomic<uint64_t> _scaleDowns;
+        std::atomic<uint64_t> _scaleUps;
+    public:
+        // minSide is the least side the generator takes
+        ResolutionController(int minSide, int sloMs = DEFAULT_GENERATION_SLO_MS);
+        ~ResolutionController();
+
+        void setSlo(int sloMs) { _sloMs = sloMs; }   // called before the server runs
+        // the delay from arrival until a generation request got its model
+        void observe(std::chrono::steady_clock::duration delay);
+        // the size to generate at within [minSizePercent of requested, requested],
+        // sizePercent is set to what was taken
+        cv::Size choose(cv::Size requested, int minSizePercent, uint8_t &sizePercent);
+        ResolutionStats getStats();
+};
+
+#endif
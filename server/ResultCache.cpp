@@ -0,0 +1,125 @@
+#include "ResultCache.hpp"
+#include <algorithm>
+#include <time.h>
+
+// the end of the next wait slice, no later than the token's deadline
+static struct timespec waitSliceEnd(const CancelToken *token) {
+    int64_t waitNs = CACHE_WAIT_SLICE_MS * 1000000LL;
+    if(token->hasDeadline()) {
+        int64_t leftNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            token->getDeadline() - std::chrono::steady_clock::now()).count();
+        waitNs = std::max<int64_t>(0, std::min(waitNs, leftNs));
+    }
+    // the condition variables wait on the realtime clock
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += waitNs / 1000000000LL;
+    ts.tv_nsec += waitNs % 1000000000LL;
+    if(ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+ResultCache::ResultCache(size_t capacityBytes)
+    : _shardCapacity(capacityBytes / CACHE_SHARDS)
+    , _hits(0), _misses(0), _coalesced(0), _evictions(0) {
+    for(int i = 0; i < CACHE_SHARDS; ++i) {
+        pthread_mutex_init(&_shards[i].mtx, NULL);
+        pthread_cond_init(&_shards[i].condv, NULL);
+        _shards[i].bytes = 0;
+    }
+}
+
+ResultCache::~ResultCache() {
+    for(int i = 0; i < CACHE_SHARDS; ++i) {
+        pthread_mutex_destroy(&_shards[i].mtx);
+        pthread_cond_destroy(&_shards[i].condv);
+    }
+}
+
+CacheLookup ResultCache::lookup(const CacheKey &key, std::shared_ptr<const CachedResult> &result,
+    const CancelToken *token) {
+    Shard &shard = shardOf(key);
+    bool waited = false;
+    pthread_mutex_lock(&shard.mtx);
+    while(true) {
+        auto it = shard.index.find(key);
+        if(it != shard.index.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            result = it->second->second;
+            pthread_mutex_unlock(&shard.mtx);
+            _hits++;
+            return CACHE_HIT;
+        }
+        if(shard.inFlight.count(key) == 0)
+            break;
+        if(!waited) {
+            _coalesced++;
+            waited = true;
+        }
+        if(token == nullptr) {
+            pthread_cond_wait(&shard.condv, &shard.mtx);
+            continue;
+        }
+        // the leader may take long, a waiter whose client left gives its worker back
+        if(token->isCancelled()) {
+            pthread_mutex_unlock(&shard.mtx);
+            throw RequestCancelled("cache wait");
+        }
+        struct timespec ts = waitSliceEnd(token);
+        pthread_cond_timedwait(&shard.condv, &shard.mtx, &ts);
+    }
+    // not cached and nobody computes it (or the computation was abandoned)
+    shard.inFlight.insert(key);
+    pthread_mutex_unlock(&shard.mtx);
+    _misses++;
+    return CACHE_MISS;
+}
+
+void ResultCache::complete(const CacheKey &key, std::shared_ptr<const CachedResult> result) {
+    Shard &shard = shardOf(key);
+    size_t nbBytes = result->nbBytes();
+    pthread_mutex_lock(&shard.mtx);
+    shard.inFlight.erase(key);
+    if(nbBytes <= _shardCapacity && shard.index.count(key) == 0) {
+        while(shard.bytes + nbBytes > _shardCapacity) {
+            auto &victim = shard.lru.back();
+            shard.bytes -= victim.second->nbBytes();
+            shard.index.erase(victim.first);
+            shard.lru.pop_back();
+            _evictions++;
+        }
+        shard.lru.emplace_front(key, result);
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += nbBytes;
+    }
+    pthread_cond_broadcast(&shard.condv);
+    pthread_mutex_unlock(&shard.mtx);
+}
+
+void ResultCache::abandon(const CacheKey &key) {
+    Shard &shard = shardOf(key);
+    pthread_mutex_lock(&shard.mtx);
+    shard.inFlight.erase(key);
+    pthread_cond_broadcast(&shard.condv);
+    pthread_mutex_unlock(&shard.mtx);
+}
+
+CacheStats ResultCache::getStats() {
+    CacheStats stats;
+    stats.hits = _hits.load();
+    stats.misses = _misses.load();
+    stats.coalesced = _coalesced.load();
+    stats.evictions = _evictions.load();
+    stats.bytes = 0;
+    stats.entries = 0;
+    for(int i = 0; i < CACHE_SHARDS; ++i) {
+        pthread_mutex_lock(&_shards[i].mtx);
+        stats.bytes += _shards[i].bytes;
+        stats.entries += _shards[i].index.size();
+        pthread_mutex_unlock(&_shards[i].mtx);
+    }
+    return stats;
+}
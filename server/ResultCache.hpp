@@ -0,0 +1,112 @@
+/*This header define a content-addressed cache of encoded responses.
+  Entries are keyed by the payload digest and everything else that changes
+  the result (task mode, flags, target size, model version). Concurrent
+  misses on one key are coalesced: the first caller computes the result
+  and the others wait for it instead of running the model again.*/
+#ifndef RESULTCACHE_HPP
+#define RESULTCACHE_HPP
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <pthread.h>
+#include <opencv2/core.hpp>
+
+#include "BufferPool.hpp"
+#include "CancelToken.hpp"
+#include "Hash.hpp"
+#include "Protocol.hpp"
+
+const size_t DEFAULT_CACHE_BYTES = 256 << 20;
+const int CACHE_SHARDS = 16;
+const int CACHE_WAIT_SLICE_MS = 10;     // how often a waiter on an in-flight key checks its token
+
+struct CacheKey {
+    Hash128 digest;
+    uint32_t payloadSize;
+    uint8_t taskMode;
+    uint8_t flags;
+    uint16_t width;
+    uint16_t height;
+    uint8_t chain;              // IMAGE_CHAIN only, 0 otherwise
+    uint64_t modelVersion;
+
+    bool operator==(const CacheKey &other) const {
+        return digest == other.digest && payloadSize == other.payloadSize &&
+            taskMode == other.taskMode && flags == other.flags && chain == other.chain &&
+            width == other.width && height == other.height &&
+            modelVersion == other.modelVersion;
+    }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey &key) const {
+        uint64_t h = hashCombine(key.digest.lo, key.modelVersion);
+        h = hashCombine(h, ((uint64_t)key.chain << 56) | ((uint64_t)key.taskMode << 48) | ((uint64_t)key.flags << 32) |
+            ((uint64_t)key.width << 16) | key.height);
+        return h;
+    }
+};
+
+struct CachedResult {
+    std::vector<WireBox> boxes;
+    PooledBuffer encoded;           // encoded image as sent on the wire
+    uint8_t responseFlags = 0;
+    size_t nbBytes() const { return sizeof(CachedResult) + boxes.size() * sizeof(WireBox) + encoded.size(); }
+};
+
+typedef enum {
+    CACHE_HIT,
+    CACHE_MISS,     // the caller owns the computation and must complete() or abandon() it
+} CacheLookup;
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;
+    uint64_t evictions;
+    uint64_t bytes;
+    uint64_t entries;
+};
+
+class ResultCache {
+    private:
+        typedef std::shared_ptr<const CachedResult> ResultPtr;
+        typedef std::list<std::pair<CacheKey, ResultPtr>> LruList;
+
+        struct Shard {
+            pthread_mutex_t mtx;
+            pthread_cond_t condv;       // signalled when an in-flight key finishes
+            LruList lru;                // most recently used first
+            std::unordered_map<CacheKey, LruList::iterator, CacheKeyHash> index;
+            std::unordered_set<CacheKey, CacheKeyHash> inFlight;
+            size_t bytes;
+        };
+
+        Shard _shards[CACHE_SHARDS];
+        size_t _shardCapacity;
+
+        std::atomic<uint64_t> _hits;
+        std::atomic<uint64_t> _misses;
+        std::atomic<uint64_t> _coalesced;
+        std::atomic<uint64_t> _evictions;
+
+        Shard& shardOf(const CacheKey &key) { return _shards[key.digest.hi % CACHE_SHARDS]; }
+    public:
+        ResultCache(size_t capacityBytes = DEFAULT_CACHE_BYTES);
+        ~ResultCache();
+
+        // blocks while another caller computes the same key. Throws RequestCancelled
+        // once the token is cancelled while waiting
+        CacheLookup lookup(const CacheKey &key, std::shared_ptr<const CachedResult> &result,
+            const CancelToken *token = nullptr);
+        void complete(const CacheKey &key, std::shared_ptr<const CachedResult> result);
+        void abandon(const CacheKey &key);
+
+        CacheStats getStats();
+};
+
+#endif
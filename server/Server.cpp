@@ -1,12 +1,12 @@
 #include "Server.hpp"
+#include <algorithm>
 
-const int DEFAULT_DETECTOR_NUMS = 1;
-const int DEFAULT_GENERATOR_NUMS = 1;
+const int DEFAULT_POOL_THREADS = 20;
+const int IO_RESERVED_THREADS = 2;  // workers interactive requests can't take from the socket reads
+const int BATCH_THREADS = 4;        // workers batch requests may hold, waiting or running
 
-const std::string DETECTOR_ONNX = "./model/CenterFace/centerface_480_640.onnx";
-const std::string GENERATOR_ONNX = "./model/AnimeGANv3/AnimeGANv3_PortraitSketch.onnx";
-
-ImageServer::ImageServer(int port){
+ImageServer::ImageServer(int port, int adminPort)
+    : _capture(nullptr), _inFlight(0) {
     if(port < 0 || port > 65535)
         throw std::runtime_error("Port out of bound.");
     _port = port;
@@ -27,33 +27,112 @@ ImageServer::ImageServer(int port){
     
     _epoller = new Epoll();
     _epoller->epollAdd(_listenFd, EPOLLIN | EPOLLET);
-    _threadPool = new ThreadPool(20);
+    _threadPool = new ThreadPool(DEFAULT_POOL_THREADS);
+    _threadPool->setClassLimit(TASK_CLASS_INTERACTIVE, DEFAULT_POOL_THREADS - IO_RESERVED_THREADS);
+    _threadPool->setClassLimit(TASK_CLASS_BATCH, BATCH_THREADS);
+    _resultCache = new ResultCache(DEFAULT_CACHE_BYTES);
+    _memoryBudget = new MemoryBudget();
+    _resolution = new ResolutionController(DYNAMIC_MIN_SIZE);
 
-    for(int i = 0; i < DEFAULT_DETECTOR_NUMS; ++i) {
-        ImageDetector *detector = new ImageDetector(DETECTOR_ONNX);
-        _detectorQue.push(detector);
-    }
+    // nothing is loaded yet, main starts the models
+    _models = new ModelPool();
 
-    for(int i = 0; i < DEFAULT_GENERATOR_NUMS; ++i) {
-        ImageGenerator *generator = new ImageGenerator(GENERATOR_ONNX, true);
-        _generatorQue.push(generator);
-    }
+    registerMetrics();
+    _admin = new AdminServer(adminPort);
+    _admin->addHandler("/metrics", []() { return getMetrics().renderPrometheus(); });
+    _admin->addHandler("/trace", []() { return getTracer().renderChromeJson(); });
+    _admin->addProbe("/ready", [this](std::string &body) {
+        body = _models->getLoader()->renderStates();
+        return _models->getLoader()->isReady();
+    });
+    _admin->start();
+}
+
+void ImageServer::registerMetrics() {
+    Metrics &metrics = getMetrics();
+    const char *classNames[TASK_CLASS_NUMS] = {"io", "interactive", "batch"};
+    for(int c = 0; c < TASK_CLASS_NUMS; ++c)
+        metrics.addGauge("imageserver_queue_depth", "Tasks waiting in the thread pool.",
+            fmt::format("class=\"{}\"", classNames[c]),
+            [this, c]() { return double(_threadPool->getQueueSize((TaskClass)c)); });
+    metrics.addGauge("imageserver_connections", "Open client connections.", "",
+        [this]() { return double(_connections.size()); });
+    metrics.addGauge("imageserver_requests_in_flight", "Requests read and not yet finished.", "",
+        [this]() { return double(_inFlight.load()); });
+    _models->registerMetrics();
+
+    metrics.addCounter("imageserver_cache_hits_total", "Result cache hits.", "",
+        [this]() { return double(_resultCache->getStats().hits); });
+    metrics.addCounter("imageserver_cache_misses_total", "Result cache misses.", "",
+        [this]() { return double(_resultCache->getStats().misses); });
+    metrics.addCounter("imageserver_cache_coalesced_total", "Lookups that waited for an identical request.", "",
+        [this]() { return double(_resultCache->getStats().coalesced); });
+    metrics.addCounter("imageserver_cache_evictions_total", "Results evicted from the cache.", "",
+        [this]() { return double(_resultCache->getStats().evictions); });
+    metrics.addGauge("imageserver_cache_bytes", "Bytes held by the result cache.", "",
+        [this]() { return double(_resultCache->getStats().bytes); });
+
+    metrics.addCounter("imageserver_motion_gate_total", "Motion gate decisions.", "decision=\"full\"",
+        []() { return double(MotionGate::getStats().full); });
+    metrics.addCounter("imageserver_motion_gate_total", "Motion gate decisions.", "decision=\"roi\"",
+        []() { return double(MotionGate::getStats().roi); });
+    metrics.addCounter("imageserver_motion_gate_total", "Motion gate decisions.", "decision=\"reuse\"",
+        []() { return double(MotionGate::getStats().reuse); });
+
+    metrics.addCounter("imageserver_buffer_pool_allocations_total", "Data path buffer allocations.", "source=\"pool\"",
+        []() { return double(getBufferPool().getStats().hits); });
+    metrics.addCounter("imageserver_buffer_pool_allocations_total", "Data path buffer allocations.", "source=\"heap\"",
+        []() { return double(getBufferPool().getStats().misses); });
+    metrics.addGauge("imageserver_buffer_pool_bytes", "Bytes of pooled buffers.", "state=\"idle\"",
+        []() { return double(getBufferPool().getStats().idleBytes); });
+    metrics.addGauge("imageserver_buffer_pool_bytes", "Bytes of pooled buffers.", "state=\"used\"",
+        []() { return double(getBufferPool().getStats().usedBytes); });
+
+    metrics.addGauge("imageserver_memory_budget_used_bytes", "Payload and decoded image bytes held by requests.", "",
+        [this]() { return double(_memoryBudget->getStats().usedBytes); });
+    metrics.addGauge("imageserver_memory_budget_paused_connections", "Connections waiting for the memory budget.", "",
+        [this]() { return double(_memoryBudget->getStats().pausedConnections); });
+    metrics.addCounter("imageserver_memory_budget_pauses_total", "Reads paused by the memory budget.", "",
+        [this]() { return double(_memoryBudget->getStats().pauses); });
+    metrics.addCounter("imageserver_rejected_frames_total", "Frames over the size limit, their connection was closed.", "",
+        [this]() { return double(_memoryBudget->getStats().rejectedFrames); });
+
+    metrics.addGauge("imageserver_generation_scale_percent", "Size adaptive generation requests are served at.", "",
+        [this]() { return double(_resolution->getStats().scalePercent); });
+    metrics.addGauge("imageserver_generation_delay_ms", "Moving average of the wait before a generator runs.", "",
+        [this]() { return _resolution->getStats().delayMs; });
+    metrics.addCounter("imageserver_generation_scale_adjustments_total", "Steps of the generation scale.", "direction=\"down\"",
+        [this]() { return double(_resolution->getStats().scaleDowns); });
+    metrics.addCounter("imageserver_generation_scale_adjustments_total", "Steps of the generation scale.", "direction=\"up\"",
+        [this]() { return double(_resolution->getStats().scaleUps); });
+
+    for(int status = 0; status < RESPONSE_STATUS_NUMS; ++status)
+        metrics.addCounter("imageserver_responses_total", "Responses sent by status.",
+            fmt::format("status=\"{}\"", RESPONSE_STATUS_NAMES[status]),
+            [status]() { return double(DataChannel::getResponseCount(status)); });
+    metrics.addCounter("imageserver_dropped_total", "Requests dropped because the client hung up.", "",
+        []() { return double(DataChannel::getDroppedCount()); });
 }
 
 ImageServer::~ImageServer() {
+    delete _admin;
+    delete _models;     // waits for the loaders, their instances are in the queues after
+    delete _capture;
     delete _epoller;
     delete _threadPool;
-    while(!_detectorQue.isEmpty()) {
-        ImageDetector *detector = _detectorQue.pop();
-        delete detector;
-    }
-    while(!_generatorQue.isEmpty()) {
-        ImageGenerator *generator = _generatorQue.pop();
-        delete generator;
-    }
+    delete _resultCache;
+    delete _memoryBudget;
+    delete _resolution;
     spdlog::error("Image Server Shutdown.");
 }
 
+void ImageServer::startCapture(const std::string &path, double sampleRate, size_t maxBytes) {
+    // called before run(), the workers only read the pointer
+    _capture = new TrafficCapture(path, sampleRate, maxBytes);
+    getMetrics().addCounter("imageserver_captured_total", "Requests written to the traffic capture.", "",
+        [this]() { return double(_capture->getCaptured()); });
+}
+
 void ImageServer::getServerInfo() {
     spdlog::info("Server Socket File Discripter : {}", _listenFd);
     spdlog::info("Server IP : {}", inet_ntoa(_servAddr.sin_addr));
@@ -64,9 +143,9 @@ void ImageServer::run() {
     while(true){
         int event_num = _epoller->wait(-1);
         for(int i = 0; i < event_num; ++i){
-            int fd = _epoller->getEventFd(i);
+            ConnHandle handle = _epoller->getEventData(i);
             int event = _epoller->getEvents(i);
-            if(fd == _listenFd) {
+            if(connHandleFd(handle) == _listenFd) {
                 try {
                     handleNewConnection();
                 }
@@ -74,8 +153,12 @@ void ImageServer::run() {
                     spdlog::error("Accept new connection error : {}", err.what());
                 }
             }
+            else if(event & (EPOLLHUP | EPOLLERR))
+                handleHangup(handle);
+            else if(event & EPOLLRDHUP)
+                handleShutdown(handle, event & EPOLLIN);
             else if(event & EPOLLIN)
-                handleReadEvent(fd);
+                handleReadEvent(handle);
         }
     }
 }
@@ -115,7 +198,7 @@ void ImageServer::handleNewConnection() {
     clientFd = accept(_listenFd, (sockaddr *)&clientAddr, &clientAddrLen);
     if(clientFd < 0)
         throw std::runtime_error("There is a connection failed to accept!");
-    spdlog::info("New connection -> socket fd : {}, IP : {}, Port: {}", clientFd, inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+    LOG_INFO("New connection -> socket fd : {}, IP : {}, Port: {}", clientFd, inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
     
     if(setnonBlocking(clientFd) == -1)
         throw std::runtime_error("Set new client socket non blocking failed!");
@@ -123,68 +206,91 @@ void ImageServer::handleNewConnection() {
     if(setKeepAlive(clientFd) != 0)
         throw std::runtime_error("Set new client socket keepalive failed!");
 
-    if(_epoller->epollAdd(clientFd, EPOLLIN | EPOLLET | EPOLLONESHOT) != 0)
+    // the channel closes the socket if the table refuses it
+    std::shared_ptr<DataChannel> channel = std::make_shared<DataChannel>(clientFd);
+    ConnHandle handle = _connections.insert(clientFd, channel);
+    channel->setHandle(handle);
+    if(_epoller->epollAdd(clientFd, EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT, handle) != 0) {
+        _connections.remove(handle);
         throw std::runtime_error("Add new client socket into Epoll failed.");
-
-    DataChannel *dataChannel = new DataChannel(clientFd);
-    _connections[clientFd] = dataChannel;
+    }
 }
 
-void ImageServer::deleteConnection(int fd) {
-    DataChannel *dataChannel = _connections[fd];
-    _connections.erase(fd);
-    delete dataChannel;
+void ImageServer::deleteConnection(ConnHandle handle) {
+    std::shared_ptr<DataChannel> channel = _connections.remove(handle);
+    if(channel == nullptr)
+        return;
+    // the socket is closed when the last in-flight task releases the channel
+    channel->markClosed();
+    // a paused read never runs again, its place in the budget's queue or the bytes granted to it go back
+    _memoryBudget->cancel(channel->getBufferedBytes());
+    _epoller->epollDel(connHandleFd(handle), 0);
 }
 
-void ImageServer::handleReadEvent(int fd) {
-    spdlog::info("Handle a read event.");
-    DataChannel *dataChannel = _connections[fd];
-    _readQue.push(dataChannel);
+void ImageServer::rearmConnection(ConnHandle handle) {
+    if(!_connections.isCurrent(handle))
+        return;
+    if(_epoller->epollMod(connHandleFd(handle), EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT, handle) != 0)
+        LOG_WARN("Rearm client socket {} failed, the connection is gone.", connHandleFd(handle));
 }
 
-DataChannel* ImageServer::getReadTask() {
-    return _readQue.pop();
+void ImageServer::watchHangup(ConnHandle handle) {
+    if(!_connections.isCurrent(handle))
+        return;
+    if(_epoller->epollMod(connHandleFd(handle), EPOLLRDHUP | EPOLLONESHOT, handle) != 0)
+        LOG_WARN("Watch client socket {} failed, the connection is gone.", connHandleFd(handle));
 }
 
-ImageDetector* ImageServer::getDetector() {
-    return _detectorQue.pop();
+void ImageServer::handleReadEvent(ConnHandle handle) {
+    LOG_TRACE("Handle a read event on {}.", connHandleFd(handle));
+    std::shared_ptr<DataChannel> channel = _connections.lookup(handle);
+    if(channel == nullptr) {
+        LOG_DEBUG("Read event of a closed connection on socket {}.", connHandleFd(handle));
+        return;
+    }
+    channel->setReadableAt(std::chrono::steady_clock::now());
+    _readQue.push(channel);
 }
 
-void ImageServer::addDetector(ImageDetector *detector) {
-    _detectorQue.push(detector);
+void ImageServer::handleShutdown(ConnHandle handle, bool readable) {
+    // a client may send its requests and then shut down writing, it has
+    // hung up only once everything it sent is read
+    int unread = 0;
+    if(ioctl(connHandleFd(handle), FIONREAD, &unread) != 0 || unread == 0) {
+        handleHangup(handle);
+        return;
+    }
+    std::shared_ptr<DataChannel> channel = _connections.lookup(handle);
+    if(channel == nullptr)
+        return;
+    channel->markPeerShutdown();
+    // while a request is in flight only the hangup is watched, finishing it rearms the read
+    if(readable)
+        handleReadEvent(handle);
 }
-    
-ImageGenerator* ImageServer::getGenerator() {
-    return _generatorQue.pop();
+
+void ImageServer::handleHangup(ConnHandle handle) {
+    LOG_INFO("Connection {} hung up.", connHandleFd(handle));
+    deleteConnection(handle);
 }
 
-void ImageServer::addGenerator(ImageGenerator *generator) {
-    _generatorQue.push(generator);
+std::shared_ptr<DataChannel> ImageServer::getReadTask() {
+    return _readQue.pop();
 }
 
-void* ImageServer::getTrtModel(TaskMode taskMode) {
-    if(taskMode == IMAGE_DETECTION) {
-        return getDetector();
-    }
-    else if(taskMode == IMAGE_GENERATION) {
-        return getGenerator();
-    }
-    else {
-        return nullptr;
+void ImageServer::loadModelChains(const Config &config) {
+    _chains.clear();
+    for(auto &chain : ::loadModelChains(config)) {
+        spdlog::info("Model chain {}: {}", chain.first, chain.second.spec);
+        _chains[chain.first] = chain.second;
     }
 }
 
-void ImageServer::addTrtModel(const TaskMode taskMode, void* trtModel) {
-    if(taskMode == IMAGE_DETECTION) {
-        ImageDetector *detector = (ImageDetector *)(trtModel);
-        addDetector(detector);
-    }
-    else if(taskMode == IMAGE_GENERATION) {
-        ImageGenerator *generator = (ImageGenerator *)(trtModel);
-        addGenerator(generator);
-    }
+const ModelChain* ImageServer::getModelChain(int id) {
+    auto it = _chains.find(id);
+    return it == _chains.end() ? nullptr : &it->second;
 }
 
-void ImageServer::addTaskToThreadPool(std::function<void(void *)> func, void *arg) {
-    _threadPool->threadPoolAdd(func, arg);
+bool ImageServer::addTaskToThreadPool(std::function<void(void *)> func, void *arg, const TaskAttr &attr) {
+    return _threadPool->threadPoolAdd(func, arg, attr);
 }
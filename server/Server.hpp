@@ -5,8 +5,10 @@
 #include <string.h>
 #include <queue>
 #include <map>
+#include <memory>
 
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
@@ -14,23 +16,50 @@
 #include <spdlog/spdlog.h>
 
 #include "Epoll.hpp"
+#include "Protocol.hpp"
 #include "Datachannel.hpp"
 #include "Threadpool.hpp"
+#include "ResultCache.hpp"
+#include "CancelToken.hpp"
+#include "Metrics.hpp"
+#include "Tracer.hpp"
+#include "Log.hpp"
+#include "AdminServer.hpp"
+#include "TrafficCapture.hpp"
+#include "BufferPool.hpp"
+#include "MemoryBudget.hpp"
+#include "ResolutionController.hpp"
+#include "ConnectionTable.hpp"
+#include "Config.hpp"
+#include "ModelChain.hpp"
+#include "ModelPool.hpp"
 #include "utils.hpp"
 
 class DataChannel;
 class ThreadPool;
 class ImageServer;
 
-typedef enum  {
-    IMAGE_DETECTION,
-    IMAGE_GENERATION,
-} TaskMode;
+// thrown when no instance of a model can be had, the request is answered STATUS_UNAVAILABLE
+class ModelUnavailable : public std::runtime_error {
+    public:
+        ModelUnavailable(const std::string &what) : std::runtime_error(what) {}
+};
 
 struct TaskConfig {
     TaskMode taskMode;
     ImageServer *server;
     cv::Size imgSize;
+    TimePoint arrival;              // the socket became readable
+    TimePoint queuedAt;             // the read request was handed to the scheduler
+    uint64_t requestId;
+    uint64_t traceId;               // requestId when the request is traced, 0 otherwise
+    CancelToken token;
+    RequestHeader header;           // filled by the read phase
+    PooledBuffer payload;
+    size_t budgetBytes;             // taken from the memory budget, released when finished
+    const ModelChain *chain;        // IMAGE_CHAIN only, set when the header is read
+    uint8_t sizePercent;            // FLAG_ADAPTIVE_SIZE: the scale imgSize was chosen at
+    GaugeGuard inFlight;            // armed once the request is read
 };
 
 /*ImageServer class create a TCP server to accept connections.
@@ -45,33 +74,52 @@ private:
 
     Epoll *_epoller;
     ThreadPool *_threadPool;
-    std::map<int, DataChannel *> _connections;
+    // written by the event loop thread only, tasks keep their own reference and a handle
+    ConnectionTable _connections;
+
+    ThreadSafeQueue<std::shared_ptr<DataChannel>> _readQue;
+
+    ResultCache *_resultCache;
+    MemoryBudget *_memoryBudget;
+    ResolutionController *_resolution;
+    std::map<int, ModelChain> _chains;           // written before run
+
+    AdminServer *_admin;
+    TrafficCapture *_capture;   // nullptr unless capturing
+    std::atomic<int64_t> _inFlight;
+    ModelPool *_models;
 
-    ThreadSafeQueue<ImageDetector *> _detectorQue; // 没有初始化
-    ThreadSafeQueue<ImageGenerator *> _generatorQue;  // 没有初始化
-    
-    ThreadSafeQueue<DataChannel *> _readQue;
+    void registerMetrics();
 public:
-    ImageServer(int port);
+    ImageServer(int port, int adminPort = DEFAULT_ADMIN_PORT);
     ~ImageServer();
     void run(); // start to accept connnections
     void handleNewConnection(); // handle new connections
-    void deleteConnection(int fd);
-    void handleReadEvent(int fd); // handle read event
+    // a stale handle, whose connection is gone, is ignored by all of these
+    void deleteConnection(ConnHandle handle);
+    void rearmConnection(ConnHandle handle); // wait for the next request on the connection
+    void watchHangup(ConnHandle handle); // only report a hangup while a request is in flight
+    void handleReadEvent(ConnHandle handle); // handle read event
+    void handleHangup(ConnHandle handle); // cancel in-flight work and drop the connection
+    // the client shut down its side, what it sent before is served first
+    void handleShutdown(ConnHandle handle, bool readable);
 
     int setBlocking(int fd);
     int setnonBlocking(int fd);
     int setKeepAlive(int fd);
 
-    DataChannel* getReadTask();
-    ImageDetector* getDetector();
-    void addDetector(ImageDetector *detector);
-    ImageGenerator* getGenerator();
-    void addGenerator(ImageGenerator *generator);
-    void* getTrtModel(TaskMode taskMode);
-    void addTrtModel(const TaskMode taskMode, void* trtModel);
+    std::shared_ptr<DataChannel> getReadTask();
+    ModelPool* getModelPool() { return _models; }
+    void loadModelChains(const Config &config); // called before run
+    const ModelChain* getModelChain(int id); // nullptr for an undeclared chain
+    ResultCache* getResultCache() { return _resultCache; }
+    MemoryBudget* getMemoryBudget() { return _memoryBudget; }
+    ResolutionController* getResolutionController() { return _resolution; }
+    std::atomic<int64_t>* getInFlightGauge() { return &_inFlight; }
+    void startCapture(const std::string &path, double sampleRate, size_t maxBytes);
+    TrafficCapture* getTrafficCapture() { return _capture; }
 
-    void addTaskToThreadPool(std::function<void(void *)> func, void *arg);
+    bool addTaskToThreadPool(std::function<void(void *)> func, void *arg, const TaskAttr &attr = TaskAttr());
     void getServerInfo();
 };
 
@@ -1,11 +1,19 @@
-
 #include "Threadpool.hpp"
+#include "Log.hpp"
 
 ThreadPool::ThreadPool(int poolSize) {
     pthread_mutex_init(&_mtx, NULL);
     pthread_cond_init(&_condv, NULL);
     if(poolSize <= 0 || poolSize > MAX_THREADS)
-        _poolSize = 8;
+        poolSize = 8;
+    _poolSize = poolSize;
+    _seq = 0;
+    for(int i = 0; i < TASK_CLASS_NUMS; ++i) {
+        _classes[i].virtualTime = 0;
+        _classes[i].running = 0;
+        _classes[i].limit = poolSize;
+        _classes[i].size = 0;
+    }
     _threadPool.resize(poolSize);
     _shutdown = running;
     for(int i = 0; i < poolSize; ++i)
@@ -19,30 +27,57 @@ ThreadPool::~ThreadPool() {
     pthread_cond_destroy(&_condv);
 }
 
-void ThreadPool::threadPoolAdd(std::function<void(void *)> func, void *arg) {
-    if(_taskQue.size() > MAX_QUEUE){
-        std::cout << "Task queue is full. Please wait a while and submit again." << std::endl;
-        return;
-    }
+bool ThreadPool::threadPoolAdd(std::function<void(void *)> func, void *arg, const TaskAttr &attr) {
     ThreadPoolTask task;
     task.func = func;
     task.arg = arg;
+    task.attr = attr;
     pthread_mutex_lock(&_mtx);
-    _taskQue.push(task);
+    ClassQueue &cls = _classes[attr.taskClass];
+    // reads are bounded by the number of connections, only requests are limited
+    if(attr.taskClass != TASK_CLASS_IO && cls.size >= MAX_QUEUE){
+        pthread_mutex_unlock(&_mtx);
+        LOG_EVERY_SEC(LOG_LEVEL_WARN, 1, "Task queue of class {} is full. Please wait a while and submit again.", (int)attr.taskClass);
+        return false;
+    }
+    task.seq = _seq++;
+    auto it = cls.flows.find(attr.flowId);
+    if(it == cls.flows.end()) {
+        // a flow that becomes backlogged starts at the current virtual time
+        it = cls.flows.emplace(attr.flowId, FlowQueue()).first;
+        it->second.tag = cls.virtualTime;
+    }
+    it->second.tasks.push(task);
+    cls.size++;
     pthread_cond_signal(&_condv);
     pthread_mutex_unlock(&_mtx);
+    return true;
+}
+
+void ThreadPool::setClassLimit(TaskClass taskClass, int limit) {
+    pthread_mutex_lock(&_mtx);
+    _classes[taskClass].limit = limit > 0 ? limit : 1;
+    pthread_cond_broadcast(&_condv);
+    pthread_mutex_unlock(&_mtx);
+}
+
+size_t ThreadPool::getQueueSize(TaskClass taskClass) {
+    pthread_mutex_lock(&_mtx);
+    size_t size = _classes[taskClass].size;
+    pthread_mutex_unlock(&_mtx);
+    return size;
 }
 
 void ThreadPool::threadPoolDestroy() {
     // Note: threadPoolDestroy will only be called by the main thread
-    std::cout << "Destroy the thread pool." << std::endl;
+    LOG_INFO("Destroy the thread pool.");
     pthread_mutex_lock(&_mtx);
     _shutdown = stopped;
     pthread_mutex_unlock(&_mtx);
-    std::cout << "Broadcasting shutdown signal to all threads..." << std::endl;
+    LOG_DEBUG("Broadcast the shutdown to {} threads.", _threadPool.size());
     pthread_cond_broadcast(&_condv);
     
-    for(int i = 0; i < _threadPool.size(); ++i){
+    for(size_t i = 0; i < _threadPool.size(); ++i){
         pthread_join(_threadPool[i], NULL);
         pthread_cond_broadcast(&_condv);
     }
@@ -58,22 +93,71 @@ void* ThreadPool::start_thread(void* args) {
     return NULL;
 }
 
+// Must be called with _mtx held.
+bool ThreadPool::pickTask(ThreadPoolTask &task) {
+    for(int c = 0; c < TASK_CLASS_NUMS; ++c) {
+        ClassQueue &cls = _classes[c];
+        if(cls.size == 0 || cls.running >= cls.limit)
+            continue;
+
+        double minTag = -1;
+        for(auto &flow : cls.flows)
+            if(minTag < 0 || flow.second.tag < minTag)
+                minTag = flow.second.tag;
+
+        // earliest deadline among the flows that are not ahead of their share,
+        // the flow with the least served work among equal deadlines
+        auto best = cls.flows.end();
+        for(auto it = cls.flows.begin(); it != cls.flows.end(); ++it) {
+            if(it->second.tag > minTag + FAIR_SLACK)
+                continue;
+            if(best == cls.flows.end()) {
+                best = it;
+                continue;
+            }
+            const TaskAttr &cur = it->second.tasks.top().attr;
+            const TaskAttr &top = best->second.tasks.top().attr;
+            if(cur.deadline < top.deadline || 
+                (cur.deadline == top.deadline && it->second.tag < best->second.tag))
+                best = it;
+        }
+
+        FlowQueue &flow = best->second;
+        task = flow.tasks.top();
+        flow.tasks.pop();
+        cls.virtualTime = std::max(cls.virtualTime, flow.tag);
+        flow.tag += task.attr.cost / task.attr.weight;
+        if(flow.tasks.empty())
+            cls.flows.erase(best);
+        cls.size--;
+        cls.running++;
+        return true;
+    }
+    return false;
+}
+
 void ThreadPool::worker() {
     while(true) {
         pthread_mutex_lock(&_mtx);
 
-        while(_taskQue.empty() && _shutdown != stopped)
+        ThreadPoolTask task;
+        while(_shutdown != stopped && !pickTask(task))
             pthread_cond_wait(&_condv, &_mtx);
 
         if(_shutdown == stopped) {
-            std::cout << "Tread exit : " << pthread_self() << std::endl;
             pthread_mutex_unlock(&_mtx);
+            LOG_DEBUG("Pool thread {} exits.", (uint64_t)pthread_self());
             pthread_exit(NULL);
         }
-
-        ThreadPoolTask task = _taskQue.front();
-        _taskQue.pop();
         pthread_mutex_unlock(&_mtx);
+
         (task.func)(task.arg);  // execute the task
+
+        // a class that was at its limit may have queued work for the idle workers now
+        pthread_mutex_lock(&_mtx);
+        ClassQueue &cls = _classes[task.attr.taskClass];
+        if(cls.running-- >= cls.limit && cls.size > 0)
+            pthread_cond_broadcast(&_condv);
+        pthread_mutex_unlock(&_mtx);
     }
-}
\ No newline at end of file
+}
@@ -6,39 +6,95 @@
 #include <pthread.h>
 #include <functional>
 #include <queue>
-
-#include "Datachannel.hpp"
+#include <map>
+#include <chrono>
+#include <stdint.h>
 
 const int MAX_THREADS = 64;
 const int MAX_QUEUE = 1024;
 const int DEFAULT_THREADS = 10;
+const double FAIR_SLACK = 4.0;  // cost units a flow may run ahead of the fairest one to meet a deadline
 
 typedef enum {
     running = 0,
     stopped = 1
 } PoolState;
 
+// scheduling classes, served in this order
+typedef enum {
+    TASK_CLASS_IO = 0,          // socket reads, short and bounded by the connections
+    TASK_CLASS_INTERACTIVE,     // latency-critical requests
+    TASK_CLASS_BATCH,           // expensive requests that tolerate queueing
+    TASK_CLASS_NUMS
+} TaskClass;
+
+struct TaskAttr {
+    TaskClass taskClass;
+    std::chrono::steady_clock::time_point deadline;  // time_point::max() without a deadline
+    uint64_t flowId;            // fairness key, the connection id of the task, never reused
+    double cost;                // relative amount of work
+    double weight;              // share of the flow within its class
+
+    TaskAttr()
+        : taskClass(TASK_CLASS_INTERACTIVE)
+        , deadline(std::chrono::steady_clock::time_point::max())
+        , flowId(0), cost(1.0), weight(1.0) {}
+};
+
 struct ThreadPoolTask {
     std::function<void(void *)> func;
     void *arg;
+    TaskAttr attr;
+    uint64_t seq;
 };
 
+// earliest deadline first, FIFO among equal deadlines
+struct LaterDeadline {
+    bool operator()(const ThreadPoolTask &left, const ThreadPoolTask &right) const {
+        if(left.attr.deadline != right.attr.deadline)
+            return left.attr.deadline > right.attr.deadline;
+        return left.seq > right.seq;
+    }
+};
+
+struct FlowQueue {
+    std::priority_queue<ThreadPoolTask, std::vector<ThreadPoolTask>, LaterDeadline> tasks;
+    double tag;                 // virtual finish time of the flow's served work
+};
+
+struct ClassQueue {
+    std::map<uint64_t, FlowQueue> flows;
+    double virtualTime;
+    int running;
+    int limit;                  // max workers running tasks of this class
+    size_t size;
+};
+
+/*ThreadPool runs tasks by class priority. A class only gets a worker while
+  it is below its concurrency limit. Within a class the connections share
+  the workers by weighted fair queueing, and among the connections that are
+  not ahead of their share the earliest deadline runs first.*/
 class ThreadPool {
 private:
     std::vector<pthread_t> _threadPool;
-    std::queue<ThreadPoolTask> _taskQue;
+    ClassQueue _classes[TASK_CLASS_NUMS];
+    uint64_t _seq;
     pthread_mutex_t _mtx;
     pthread_cond_t _condv;
     PoolState _shutdown; 
     int _poolSize;
+
+    bool pickTask(ThreadPoolTask &task);
 public:
     ThreadPool(int poolSize);
     ~ThreadPool();
-    void threadPoolAdd(std::function<void(void *)> func, void *arg);
+    bool threadPoolAdd(std::function<void(void *)> func, void *arg, const TaskAttr &attr = TaskAttr());
     void threadPoolDestroy();
+    void setClassLimit(TaskClass taskClass, int limit);
+    size_t getQueueSize(TaskClass taskClass);
 
     static void* start_thread(void* args);
     void worker();
 };
 
-#endif
\ No newline at end of file
+#endif
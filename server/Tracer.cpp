@@ -0,0 +1,175 @@
+#include "Tracer.hpp"
+#include "Hash.hpp"
+#include <signal.h>
+#include <string.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <fstream>
+#include <spdlog/spdlog.h>
+
+static thread_local uint64_t currentTrace = 0;
+static thread_local TraceRing *ownRing = nullptr;
+static std::atomic<int> nextTid(1);
+static int signalPipe = -1;
+
+Tracer::Tracer()
+    : _sampleThreshold(0), _epoch(std::chrono::steady_clock::now()) {
+    pthread_mutex_init(&_mtx, NULL);
+    _dumpPipe[0] = _dumpPipe[1] = -1;
+}
+
+Tracer::~Tracer() {
+    pthread_mutex_destroy(&_mtx);
+}
+
+void Tracer::setSampleRate(double rate) {
+    if(rate <= 0)
+        _sampleThreshold = 0;
+    else if(rate >= 1)
+        _sampleThreshold = UINT64_MAX;
+    else
+        _sampleThreshold = uint64_t(rate * 18446744073709551616.0);
+    spdlog::info("Trace sample rate {}", rate);
+}
+
+double Tracer::getSampleRate() const {
+    return _sampleThreshold.load() / 18446744073709551616.0;
+}
+
+uint64_t Tracer::startTrace(uint64_t requestId) {
+    uint64_t threshold = _sampleThreshold.load(std::memory_order_relaxed);
+    if(threshold == 0)
+        return 0;
+    // hashing spreads the sampled ids evenly instead of every Nth request
+    if(threshold != UINT64_MAX && hashAvalanche(requestId) >= threshold)
+        return 0;
+    return requestId;
+}
+
+TraceRing* Tracer::threadRing() {
+    if(ownRing == nullptr) {
+        TraceRing *ring = new TraceRing();
+        ring->tid = nextTid++;
+        ring->head.store(0);
+        for(int i = 0; i < TRACE_RING_SIZE; ++i)
+            ring->slots[i].seq.store(0);
+        pthread_mutex_lock(&_mtx);
+        _rings.push_back(ring);
+        pthread_mutex_unlock(&_mtx);
+        ownRing = ring;
+    }
+    return ownRing;
+}
+
+void Tracer::record(uint64_t traceId, Stage stage,
+    std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end) {
+    if(traceId == 0)
+        return;
+    TraceRing *ring = threadRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceSlot &slot = ring->slots[head % TRACE_RING_SIZE];
+    slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.traceId.store(traceId, std::memory_order_relaxed);
+    slot.beginUs.store(std::chrono::duration_cast<std::chrono::microseconds>(begin - _epoch).count(), std::memory_order_relaxed);
+    slot.endUs.store(std::chrono::duration_cast<std::chrono::microseconds>(end - _epoch).count(), std::memory_order_relaxed);
+    slot.stage.store(stage, std::memory_order_relaxed);
+    slot.seq.store(2 * head + 2, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string Tracer::renderChromeJson() {
+    std::vector<TraceRing *> rings;
+    pthread_mutex_lock(&_mtx);
+    rings = _rings;
+    pthread_mutex_unlock(&_mtx);
+
+    // every span is shown twice: on the worker that ran it and on the track of its request
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"workers\"}},\n";
+    json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"requests\"}}";
+    for(TraceRing *ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for(uint64_t i = first; i < head; ++i) {
+            TraceSlot &slot = ring->slots[i % TRACE_RING_SIZE];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            uint64_t traceId = slot.traceId.load(std::memory_order_relaxed);
+            int64_t beginUs = slot.beginUs.load(std::memory_order_relaxed);
+            int64_t endUs = slot.endUs.load(std::memory_order_relaxed);
+            int stage = slot.stage.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // the writer lapped us while copying
+            if(seq != 2 * i + 2 || slot.seq.load(std::memory_order_relaxed) != seq)
+                continue;
+            json += fmt::format(",\n{{\"name\":\"{}\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":{},\"dur\":{},"
+                "\"pid\":1,\"tid\":{},\"args\":{{\"trace\":{}}}}}",
+                stageName((Stage)stage), beginUs, endUs - beginUs, ring->tid, traceId);
+            json += fmt::format(",\n{{\"name\":\"{}\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":{},\"dur\":{},"
+                "\"pid\":2,\"tid\":{},\"args\":{{\"worker\":{}}}}}",
+                stageName((Stage)stage), beginUs, endUs - beginUs, traceId, ring->tid);
+        }
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+static void onDumpSignal(int) {
+    // only async-signal-safe work here, the dump thread does the rest
+    char byte = 1;
+    if(write(signalPipe, &byte, 1) < 0) {}
+}
+
+void Tracer::installSignalHandler(const std::string &dir) {
+    _dumpDir = dir;
+    if(pipe(_dumpPipe) != 0)
+        throw std::runtime_error("Trace dump pipe create failed.");
+    signalPipe = _dumpPipe[1];
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, dump_thread, this) != 0)
+        throw std::runtime_error("Trace dump thread create failed.");
+    pthread_detach(thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onDumpSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+void* Tracer::dump_thread(void *args) {
+    Tracer *tracer = (Tracer *)args;
+    char byte;
+    while(read(tracer->_dumpPipe[0], &byte, 1) > 0)
+        tracer->dumpToFile();
+    return NULL;
+}
+
+void Tracer::dumpToFile() {
+    static int dumps = 0;
+    std::string path = fmt::format("{}/imageserver-trace-{}-{}.json", _dumpDir, getpid(), dumps++);
+    std::ofstream out(path);
+    out << renderChromeJson();
+    if(out)
+        spdlog::info("Trace written to {}", path);
+    else
+        spdlog::error("Write trace {} failed.", path);
+}
+
+Tracer& getTracer() {
+    static Tracer tracer;
+    return tracer;
+}
+
+uint64_t getCurrentTrace() {
+    return currentTrace;
+}
+
+TraceScope::TraceScope(uint64_t traceId) : _previous(currentTrace) {
+    currentTrace = traceId;
+}
+
+TraceScope::~TraceScope() {
+    currentTrace = _previous;
+}
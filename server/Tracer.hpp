@@ -0,0 +1,79 @@
+/*Tracer records the stage spans of sampled requests. A request gets a trace
+  id when its socket becomes readable, the worker running it publishes the
+  id in a thread local so every stage timer on that thread adds a span.
+  Spans go into a ring buffer owned by the recording thread: the writer
+  never takes a lock and a dump reads the rings under a per-slot sequence
+  number, skipping slots overwritten while it copies them. A dump is Chrome
+  trace-event JSON that chrome://tracing and Perfetto open directly.*/
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include "Metrics.hpp"
+
+const int TRACE_RING_SIZE = 4096;       // spans kept per thread
+const char *const DEFAULT_TRACE_DIR = "/tmp";
+
+struct TraceSlot {
+    std::atomic<uint64_t> seq;          // odd while the writer fills the slot
+    std::atomic<uint64_t> traceId;
+    std::atomic<int64_t> beginUs;
+    std::atomic<int64_t> endUs;
+    std::atomic<int> stage;
+};
+
+struct TraceRing {
+    int tid;
+    std::atomic<uint64_t> head;         // spans written so far
+    TraceSlot slots[TRACE_RING_SIZE];
+};
+
+class Tracer {
+    private:
+        std::atomic<uint64_t> _sampleThreshold; // a trace id is sampled if its hash is below
+        std::chrono::steady_clock::time_point _epoch;
+        std::vector<TraceRing *> _rings;        // rings are never freed, threads may outlive a dump
+        pthread_mutex_t _mtx;                   // guards _rings
+        int _dumpPipe[2];
+        std::string _dumpDir;
+
+        TraceRing* threadRing();
+        static void* dump_thread(void *args);
+    public:
+        Tracer();
+        ~Tracer();
+
+        // fraction of requests traced, 0 disables tracing
+        void setSampleRate(double rate);
+        double getSampleRate() const;
+        // the trace id of a request, requestId if it is sampled and 0 otherwise
+        uint64_t startTrace(uint64_t requestId);
+        void record(uint64_t traceId, Stage stage,
+            std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+        std::string renderChromeJson();
+
+        // SIGUSR1 writes a dump into dir, the file name is logged
+        void installSignalHandler(const std::string &dir = DEFAULT_TRACE_DIR);
+        void dumpToFile();
+};
+
+// the process wide tracer
+Tracer& getTracer();
+
+// the trace of the request the calling thread works on, 0 for none
+uint64_t getCurrentTrace();
+
+// makes a trace current on this thread while the object lives
+class TraceScope {
+    private:
+        uint64_t _previous;
+    public:
+        TraceScope(uint64_t traceId);
+        ~TraceScope();
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "TrafficCapture.hpp"
+#include "Hash.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <stdexcept>
+#include <string.h>
+#include <spdlog/spdlog.h>
+
+TrafficCapture::TrafficCapture(const std::string &path, double sampleRate, size_t maxBytes)
+    : _path(path), _start(std::chrono::steady_clock::now()), _maxBytes(maxBytes)
+    , _full(false), _seq(0), _captured(0) {
+    if(sampleRate >= 1)
+        _sampleThreshold = UINT64_MAX;
+    else
+        _sampleThreshold = sampleRate <= 0 ? 0 : uint64_t(sampleRate * 18446744073709551616.0);
+
+    _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(_fd == -1)
+        throw std::runtime_error("Open capture file " + path + " failed.");
+    CaptureFileHeader header;
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.startUnixUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(write(_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(_fd);
+        throw std::runtime_error("Write capture file header failed.");
+    }
+    _bytes = sizeof(header);
+    pthread_mutex_init(&_mtx, NULL);
+    spdlog::info("Capture {:.2f}% of the requests into {}, at most {} MB.", sampleRate * 100, path, maxBytes >> 20);
+}
+
+TrafficCapture::~TrafficCapture() {
+    close(_fd);
+    pthread_mutex_destroy(&_mtx);
+}
+
+void TrafficCapture::record(TimePoint arrival, uint64_t connId, const RequestHeader &header,
+    const PooledBuffer &payload) {
+    uint64_t seq = _seq.fetch_add(1, std::memory_order_relaxed);
+    if(_sampleThreshold != UINT64_MAX && hashAvalanche(seq) >= _sampleThreshold)
+        return;
+
+    CaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.arrivalUs = arrival > _start ? std::chrono::duration_cast<std::chrono::microseconds>(arrival - _start).count() : 0;
+    record.connId = connId;
+    record.header = header;
+    record.header.payloadSize = payload.size();
+    struct iovec iov[2];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void *)payload.data();
+    iov[1].iov_len = payload.size();
+    size_t nbBytes = sizeof(record) + payload.size();
+
+    pthread_mutex_lock(&_mtx);
+    if(_full || _bytes + nbBytes > _maxBytes) {
+        if(!_full)
+            spdlog::warn("Capture {} reached its size cap, stop capturing.", _path);
+        _full = true;
+        pthread_mutex_unlock(&_mtx);
+        return;
+    }
+    // a short write would corrupt every following record, stop the capture instead
+    ssize_t written = writev(_fd, iov, 2);
+    if(written != (ssize_t)nbBytes) {
+        spdlog::error("Write capture {} failed, stop capturing.", _path);
+        _full = true;
+    }
+    else {
+        _bytes += nbBytes;
+        _captured++;
+    }
+    pthread_mutex_unlock(&_mtx);
+}
@@ -0,0 +1,37 @@
+/*TrafficCapture appends the sampled requests of the server to a capture
+  file (see CaptureFormat.hpp) so the traffic can be replayed later. It
+  stops once the file reaches its size cap.*/
+#ifndef TRAFFICCAPTURE_HPP
+#define TRAFFICCAPTURE_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "CancelToken.hpp"
+#include "BufferPool.hpp"
+#include "CaptureFormat.hpp"
+
+const size_t DEFAULT_CAPTURE_MAX_BYTES = 1024UL * 1024 * 1024;
+
+class TrafficCapture {
+    private:
+        int _fd;
+        std::string _path;
+        TimePoint _start;
+        uint64_t _sampleThreshold;
+        size_t _maxBytes;
+        size_t _bytes;
+        bool _full;
+        std::atomic<uint64_t> _seq;
+        std::atomic<uint64_t> _captured;
+        pthread_mutex_t _mtx;       // guards the file and _bytes
+    public:
+        // starts a new capture at path, an old one is replaced
+        TrafficCapture(const std::string &path, double sampleRate, size_t maxBytes = DEFAULT_CAPTURE_MAX_BYTES);
+        ~TrafficCapture();
+        void record(TimePoint arrival, uint64_t connId, const RequestHeader &header, const PooledBuffer &payload);
+        uint64_t getCaptured() const { return _captured.load(); }
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <vector>
 #include "Server.hpp"
 #include "Threadpool.hpp"
+#include "BatchRunner.hpp"
 
 void* handleRead(void* arg);
 void* handleProcess(void* arg);
@@ -18,12 +19,106 @@ void* handleWrite(void* arg);
     4. 
 */
 
+// shared by both modes, set before any model loads
+static void configureModelHost() {
+    // IMAGESERVER_HUGEPAGES=1 backs the model IO tensors by huge pages
+    const char *hugePages = getenv("IMAGESERVER_HUGEPAGES");
+    setHostArenaHugePages(hugePages != nullptr && atoi(hugePages) != 0);
+    // IMAGESERVER_MODEL_CACHE_DIR holds the compiled models, nodes sharing it build each one once
+    const char *modelCacheDir = getenv("IMAGESERVER_MODEL_CACHE_DIR");
+    const char *modelCacheMb = getenv("IMAGESERVER_MODEL_CACHE_MB");
+    getArtifactCache().configure(modelCacheDir ? modelCacheDir : DEFAULT_ARTIFACT_DIR,
+        modelCacheMb ? size_t(atol(modelCacheMb)) << 20 : DEFAULT_ARTIFACT_CACHE_BYTES);
+}
+
+// the built-in chains can be replaced or extended by IMAGESERVER_CONFIG=file,
+// which also sets the model slots, e.g. model.generator.slots = 4
+static Config loadConfig() {
+    Config config;
+    config.parse(DEFAULT_MODEL_CHAINS, "defaults");
+    const char *configPath = getenv("IMAGESERVER_CONFIG");
+    if(configPath != nullptr)
+        config.load(configPath);
+    return config;
+}
+
+static void configureModels(ModelPool *models, const Config &config) {
+    models->configure(config);
+    // IMAGESERVER_MODEL_BUDGET_MB bounds the resident models, idle ones are evicted and reloaded on demand
+    const char *modelBudgetMb = getenv("IMAGESERVER_MODEL_BUDGET_MB");
+    if(modelBudgetMb != nullptr)
+        models->getLoader()->setBudget(size_t(atol(modelBudgetMb)) << 20);
+}
+
+// server --batch <input> --out <dir> runs the models over files instead of serving, see BatchRunner.hpp.
+// Nothing listens, the batch mode loads only the model it runs
+static int runBatch(int argc, char *argv[]) {
+    try {
+        BatchOptions options = parseBatchOptions(argc, argv);
+        configureModelHost();
+        ModelPool models;
+        configureModels(&models, loadConfig());
+        BatchRunner runner(&models, options);
+        runner.run();
+    }
+    catch(std::runtime_error &err) {
+        spdlog::error("Batch failed! Error info: {}", err.what());
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
+    if(argc > 1 && std::string(argv[1]) == "--batch")
+        return runBatch(argc, argv);
+    // the server itself is configured by the environment only
+    if(argc > 1) {
+        spdlog::error("Unknown argument {}, the server takes none but --batch.", argv[1]);
+        exit(1);
+    }
     ImageServer *serv;
 
     // Open and initialize the Image server.
     try{
-        serv = new ImageServer(5001);
+        // IMAGESERVER_TRACE_RATE=0.01 traces 1% of the requests, kill -USR1 dumps them
+        const char *traceRate = getenv("IMAGESERVER_TRACE_RATE");
+        if(traceRate != nullptr)
+            getTracer().setSampleRate(atof(traceRate));
+        getTracer().installSignalHandler();
+        configureModelHost();
+        // IMAGESERVER_PORT and IMAGESERVER_ADMIN_PORT let several servers share a host behind the router
+        const char *port = getenv("IMAGESERVER_PORT");
+        const char *adminPort = getenv("IMAGESERVER_ADMIN_PORT");
+        serv = new ImageServer(port ? atoi(port) : 5001, adminPort ? atoi(adminPort) : DEFAULT_ADMIN_PORT);
+        // IMAGESERVER_MAX_FRAME_MB, _CONNECTION_BUDGET_MB and _MEMORY_BUDGET_MB bound the request bytes held
+        const char *maxFrameMb = getenv("IMAGESERVER_MAX_FRAME_MB");
+        const char *connectionBudgetMb = getenv("IMAGESERVER_CONNECTION_BUDGET_MB");
+        const char *memoryBudgetMb = getenv("IMAGESERVER_MEMORY_BUDGET_MB");
+        serv->getMemoryBudget()->setLimits(
+            memoryBudgetMb ? atol(memoryBudgetMb) << 20 : DEFAULT_MEMORY_BUDGET_BYTES,
+            connectionBudgetMb ? atol(connectionBudgetMb) << 20 : DEFAULT_CONNECTION_BUDGET_BYTES,
+            maxFrameMb ? atol(maxFrameMb) << 20 : DEFAULT_MAX_FRAME_BYTES);
+        // IMAGESERVER_GENERATION_SLO_MS is the latency size adaptive generation keeps under
+        const char *generationSloMs = getenv("IMAGESERVER_GENERATION_SLO_MS");
+        if(generationSloMs != nullptr)
+            serv->getResolutionController()->setSlo(atoi(generationSloMs));
+        // IMAGESERVER_CAPTURE=file records the requests for client/replay
+        const char *capturePath = getenv("IMAGESERVER_CAPTURE");
+        if(capturePath != nullptr) {
+            const char *captureRate = getenv("IMAGESERVER_CAPTURE_RATE");
+            const char *captureMaxMb = getenv("IMAGESERVER_CAPTURE_MAX_MB");
+            serv->startCapture(capturePath, captureRate ? atof(captureRate) : 1.0,
+                captureMaxMb ? atol(captureMaxMb) << 20 : DEFAULT_CAPTURE_MAX_BYTES);
+        }
+        Config config = loadConfig();
+        serv->loadModelChains(config);
+        configureModels(serv->getModelPool(), config);
+        // IMAGESERVER_LAZY_MODELS=1 loads each model on its first request instead of at startup.
+        // The router skips models that were never loaded, leave it off behind the router.
+        // Either way connections are accepted at once, /ready answers 200 once the first loads are done
+        const char *lazyModels = getenv("IMAGESERVER_LAZY_MODELS");
+        if(lazyModels == nullptr || atoi(lazyModels) == 0)
+            serv->getModelPool()->getLoader()->startAll();
         spdlog::info("Open server complete!");
         serv->getServerInfo();
     }
@@ -31,7 +126,7 @@ int main(int argc, char *argv[]) {
         spdlog::error("Open server failed! Error info: {}", err.what());
         exit(1);
     }
-    
+
     // Create child threads to receive, send and process data.
     int thread_err = 0;
     pthread_t parseThread;
@@ -53,14 +148,28 @@ int main(int argc, char *argv[]) {
 
 void* handleRead(void* arg) {
     ImageServer *serv = (ImageServer*) arg;
+    uint64_t nextRequestId = 1;
     while(true){
-        DataChannel* dataChannel = serv->getReadTask();
-        TaskConfig conf;
-        conf.taskMode = IMAGE_GENERATION;
-        conf.imgSize = cv::Size(512, 512);
-        conf.server = serv;
+        std::shared_ptr<DataChannel> dataChannel = serv->getReadTask();
+        // defaults for legacy clients, a request header overrides them.
+        // The task owns the config and frees it when finished.
+        TaskConfig *conf = new TaskConfig;
+        conf->taskMode = IMAGE_GENERATION;
+        conf->imgSize = cv::Size(512, 512);
+        conf->server = serv;
+        conf->arrival = dataChannel->getReadableAt();
+        conf->requestId = nextRequestId++;
+        conf->traceId = getTracer().startTrace(conf->requestId);
+        conf->budgetBytes = 0;
+        conf->chain = nullptr;
+        conf->sizePercent = 0;
+        // the bound shared_ptr keeps the channel alive until the task is done.
+        // Reading is scheduled first, the request is scheduled by its own class once read.
         std::function<void(void *)> func = std::bind(&DataChannel::handleImage, dataChannel, std::placeholders::_1);
-        serv->addTaskToThreadPool(func, &conf);
+        TaskAttr attr;
+        attr.taskClass = TASK_CLASS_IO;
+        attr.flowId = dataChannel->getConnId();
+        serv->addTaskToThreadPool(func, conf, attr);
     }
     return NULL;
 }
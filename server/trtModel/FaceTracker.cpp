@@ -0,0 +1,231 @@
+#include "FaceTracker.hpp"
+
+const float ASSOC_IOU_THRESH = 0.1f;     // IOUCalculate is DIoU, so it can go below zero
+const int MAX_MISSED_DETECTIONS = 2;
+const int MAX_FLOW_POINTS = 30;
+const int MIN_FLOW_POINTS = 4;
+const float MAX_FLOW_ERROR = 20.0f;
+const float MIN_FLOW_CONFIDENCE = 0.5f;
+
+static float medianOf(std::vector<float> values) {
+    size_t mid = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + mid, values.end());
+    return values[mid];
+}
+
+// mean distance of the points to their centroid
+static float spreadOf(const std::vector<cv::Point2f> &points) {
+    cv::Point2f centroid(0, 0);
+    for(const cv::Point2f &p : points)
+        centroid += p;
+    centroid = centroid * (1.0f / points.size());
+    float spread = 0;
+    for(const cv::Point2f &p : points)
+        spread += std::sqrt((p - centroid).x * (p - centroid).x + (p - centroid).y * (p - centroid).y);
+    return spread / points.size();
+}
+
+static void boxFromState(FaceBox &box, const cv::Mat &state) {
+    box.x = state.at<float>(0);
+    box.y = state.at<float>(1);
+    box.w = state.at<float>(2);
+    box.h = state.at<float>(3);
+}
+
+FaceTracker::FaceTracker(int detectInterval)
+    : mDetectInterval(detectInterval > 0 ? detectInterval : 1)
+    , mFramesSinceDetect(0)
+    , mNextId(0)
+    , mLowConfidence(false) {
+}
+
+FaceTracker::~FaceTracker() {
+
+}
+
+bool FaceTracker::needDetection() const {
+    return mPrevGray.empty() || mLowConfidence || mFramesSinceDetect + 1 >= mDetectInterval;
+}
+
+void FaceTracker::update(const cv::Mat &frame, const std::vector<FaceBox> &detections) {
+    cv::Mat gray;
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+
+    // predict every track to the current frame before association
+    for(TrackedFace &track : mTracks)
+        boxFromState(track.box, track.kf.predict());
+
+    // greedy association by descending IoU
+    std::vector<std::pair<float, std::pair<int, int>>> candidates;
+    for(int i = 0; i < (int)mTracks.size(); ++i)
+        for(int j = 0; j < (int)detections.size(); ++j) {
+            float iou = IOUCalculate(mTracks[i].box, detections[j]);
+            if(iou > ASSOC_IOU_THRESH)
+                candidates.push_back({iou, {i, j}});
+        }
+    std::sort(candidates.begin(), candidates.end(), [](const auto &left, const auto &right) {
+        return left.first > right.first;
+    });
+
+    std::vector<bool> trackMatched(mTracks.size(), false);
+    std::vector<bool> detMatched(detections.size(), false);
+    for(const auto &candidate : candidates) {
+        int i = candidate.second.first;
+        int j = candidate.second.second;
+        if(trackMatched[i] || detMatched[j])
+            continue;
+        trackMatched[i] = detMatched[j] = true;
+        _correctTrack(mTracks[i], detections[j]);
+        mTracks[i].box.confidence = detections[j].confidence;
+        mTracks[i].hits++;
+        mTracks[i].missed = 0;
+    }
+
+    std::vector<TrackedFace> alive;
+    for(int i = 0; i < (int)mTracks.size(); ++i) {
+        if(!trackMatched[i])
+            mTracks[i].missed++;
+        if(mTracks[i].missed <= MAX_MISSED_DETECTIONS && _isInside(mTracks[i].box, frame.size()))
+            alive.push_back(std::move(mTracks[i]));
+    }
+    mTracks = std::move(alive);
+
+    for(int j = 0; j < (int)detections.size(); ++j) {
+        if(detMatched[j])
+            continue;
+        TrackedFace track;
+        _initTrack(track, detections[j]);
+        mTracks.push_back(std::move(track));
+    }
+
+    for(TrackedFace &track : mTracks)
+        _sampleFeatures(track, gray);
+
+    mPrevGray = gray;
+    mFramesSinceDetect = 0;
+    mLowConfidence = false;
+}
+
+void FaceTracker::propagate(const cv::Mat &frame) {
+    cv::Mat gray;
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    ++mFramesSinceDetect;
+    if(mPrevGray.rows != gray.rows || mPrevGray.cols != gray.cols) {
+        // the stream changed resolution, the next frame has to be detected
+        mPrevGray = gray;
+        mLowConfidence = true;
+        return;
+    }
+
+    for(TrackedFace &track : mTracks) {
+        boxFromState(track.box, track.kf.predict());
+        if(track.points.empty()) {
+            track.flowConfidence = 0;
+            mLowConfidence = true;
+            continue;
+        }
+
+        std::vector<cv::Point2f> nextPoints;
+        std::vector<uchar> status;
+        std::vector<float> err;
+        cv::calcOpticalFlowPyrLK(mPrevGray, gray, track.points, nextPoints, status, err);
+
+        std::vector<cv::Point2f> prevGood, nextGood;
+        std::vector<float> dxs, dys;
+        for(size_t k = 0; k < nextPoints.size(); ++k) {
+            if(!status[k] || err[k] > MAX_FLOW_ERROR)
+                continue;
+            prevGood.push_back(track.points[k]);
+            nextGood.push_back(nextPoints[k]);
+            dxs.push_back(nextPoints[k].x - track.points[k].x);
+            dys.push_back(nextPoints[k].y - track.points[k].y);
+        }
+        track.flowConfidence = float(nextGood.size()) / float(track.points.size());
+        if((int)nextGood.size() < MIN_FLOW_POINTS) {
+            // keep the Kalman prediction and let the detector take over
+            track.points.clear();
+            mLowConfidence = true;
+            continue;
+        }
+
+        float scale = 1.0f;
+        float prevSpread = spreadOf(prevGood);
+        if(prevSpread > 1e-3f)
+            scale = std::min(std::max(spreadOf(nextGood) / prevSpread, 0.8f), 1.25f);
+
+        FaceBox measured = track.box;
+        measured.x += medianOf(dxs);
+        measured.y += medianOf(dys);
+        measured.w *= scale;
+        measured.h *= scale;
+        _correctTrack(track, measured);
+        track.points = nextGood;
+        if(track.flowConfidence < MIN_FLOW_CONFIDENCE)
+            mLowConfidence = true;
+    }
+
+    mTracks.erase(std::remove_if(mTracks.begin(), mTracks.end(), [&](const TrackedFace &track) {
+        return !_isInside(track.box, frame.size());
+    }), mTracks.end());
+    mPrevGray = gray;
+}
+
+void FaceTracker::drawTracks(cv::Mat &img) const {
+    for(const TrackedFace &track : mTracks) {
+        cv::Rect box(track.box.x - track.box.w / 2, track.box.y - track.box.h / 2, track.box.w, track.box.h);
+        cv::rectangle(img, box, cv::Scalar(255, 0, 0), 2);
+        cv::putText(img, std::to_string(track.id), cv::Point(box.x, box.y - 4),
+            cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(255, 0, 0), 2);
+    }
+}
+
+void FaceTracker::_initTrack(TrackedFace &track, const FaceBox &box) {
+    track.id = mNextId++;
+    track.box = box;
+    track.hits = 1;
+    track.missed = 0;
+    track.flowConfidence = 1.0f;
+
+    // constant velocity model over (cx, cy, w, h)
+    track.kf.init(8, 4, 0, CV_32F);
+    cv::setIdentity(track.kf.transitionMatrix);
+    for(int i = 0; i < 4; ++i)
+        track.kf.transitionMatrix.at<float>(i, i + 4) = 1.0f;
+    track.kf.measurementMatrix = cv::Mat::zeros(4, 8, CV_32F);
+    for(int i = 0; i < 4; ++i)
+        track.kf.measurementMatrix.at<float>(i, i) = 1.0f;
+    cv::setIdentity(track.kf.processNoiseCov, cv::Scalar(1e-2));
+    cv::setIdentity(track.kf.measurementNoiseCov, cv::Scalar(1e-1));
+    cv::setIdentity(track.kf.errorCovPost, cv::Scalar(1));
+    track.kf.statePost.at<float>(0) = box.x;
+    track.kf.statePost.at<float>(1) = box.y;
+    track.kf.statePost.at<float>(2) = box.w;
+    track.kf.statePost.at<float>(3) = box.h;
+}
+
+void FaceTracker::_correctTrack(TrackedFace &track, const FaceBox &box) {
+    cv::Mat measurement(4, 1, CV_32F);
+    measurement.at<float>(0) = box.x;
+    measurement.at<float>(1) = box.y;
+    measurement.at<float>(2) = box.w;
+    measurement.at<float>(3) = box.h;
+    boxFromState(track.box, track.kf.correct(measurement));
+}
+
+void FaceTracker::_sampleFeatures(TrackedFace &track, const cv::Mat &gray) {
+    // sample corners from the inner part of the box to stay off the background
+    cv::Rect box(track.box.x - track.box.w * 0.4f, track.box.y - track.box.h * 0.4f,
+        track.box.w * 0.8f, track.box.h * 0.8f);
+    box = box & cv::Rect(0, 0, gray.cols, gray.rows);
+    track.points.clear();
+    if(box.empty())
+        return;
+    cv::Mat mask = cv::Mat::zeros(gray.rows, gray.cols, CV_8UC1);
+    mask(box).setTo(cv::Scalar(255));
+    cv::goodFeaturesToTrack(gray, track.points, MAX_FLOW_POINTS, 0.01, 3, mask);
+}
+
+bool FaceTracker::_isInside(const FaceBox &box, cv::Size frameSize) const {
+    return box.w > 0 && box.h > 0 && box.x >= 0 && box.y >= 0 &&
+        box.x < frameSize.width && box.y < frameSize.height;
+}
@@ -0,0 +1,54 @@
+#ifndef FACETRACKER_HPP
+#define FACETRACKER_HPP
+
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include "imageDetector.hpp"
+
+const int DEFAULT_DETECT_INTERVAL = 5;
+
+struct TrackedFace {
+    int id;
+    FaceBox box;
+    int hits;                   // frames matched with a detection
+    int missed;                 // consecutive detection frames without a match
+    float flowConfidence;       // ratio of feature points tracked in the last frame
+    cv::KalmanFilter kf;        // state: cx, cy, w, h and their velocities
+    std::vector<cv::Point2f> points;
+};
+
+/*FaceTracker propagates detector boxes between detection frames of a video
+  stream. The detector runs every mDetectInterval frames, or earlier when the
+  optical flow loses the faces. Tracks are associated with new detections by
+  IoU and keep a stable id for as long as they are matched.*/
+class FaceTracker {
+    public:
+        FaceTracker(int detectInterval = DEFAULT_DETECT_INTERVAL);
+        ~FaceTracker();
+
+        // whether the next frame should go through the detector
+        bool needDetection() const;
+        // associate detector boxes of the current frame with the tracks
+        void update(const cv::Mat &frame, const std::vector<FaceBox> &detections);
+        // move the tracks to the current frame with optical flow
+        void propagate(const cv::Mat &frame);
+        void drawTracks(cv::Mat &img) const;
+        const std::vector<TrackedFace>& getTracks() const { return mTracks; }
+
+    private:
+        int mDetectInterval;
+        int mFramesSinceDetect;
+        int mNextId;
+        bool mLowConfidence;
+        cv::Mat mPrevGray;
+        std::vector<TrackedFace> mTracks;
+
+        void _initTrack(TrackedFace &track, const FaceBox &box);
+        void _correctTrack(TrackedFace &track, const FaceBox &box);
+        void _sampleFeatures(TrackedFace &track, const cv::Mat &gray);
+        bool _isInside(const FaceBox &box, cv::Size frameSize) const;
+};
+
+#endif
@@ -6,22 +6,45 @@ const std::string OUTPUT_NAME =  "generator/main/out_layer:0";
 
 using namespace nvinfer1;
 
-ImageGenerator::ImageGenerator(const std::string &onnxFile, bool isDynamic) 
-    : TrtPipeline(onnxFile, isDynamic) {
+ImageGenerator::ImageGenerator(const std::string &onnxFile, bool isDynamic, const CalibrationSet *calibration)
+    : TrtPipeline(onnxFile, isDynamic, calibration, [](cv::Mat &img, float *input, const Dims &dims) {
+        // NHWC, the generator works at the size of its input
+        cv::Mat resized;
+        cv::resize(img, resized, cv::Size(dims.d[2], dims.d[1]));
+        PreprocessGeneration(resized, input);
+    }) {
+    mInputIndex = getTensorIndex(INPUT_NAME);
+    mOutputIndex = getTensorIndex(OUTPUT_NAME);
 }
 
 ImageGenerator::~ImageGenerator() {
 
 }
 
+void ImageGenerator::generate(cv::Mat &img, std::shared_ptr<BufferManager> buffers,
+    std::shared_ptr<IExecutionContext> context, ToneMap &tone, bool keepTone) {
+    {
+        StageTimer timer(STAGE_PREPROCESS);
+        _preprocessInput(buffers, img);
+    }
+    {
+        StageTimer timer(STAGE_INFERENCE);
+        _runEngine(buffers, context);
+    }
+    StageTimer timer(STAGE_POSTPROCESS);
+    float* outputBuffer = static_cast<float*>(buffers->getHostBuffer(mOutputIndex));
+    if(keepTone)
+        PostprocessGeneration(outputBuffer, img, tone);
+    else
+        tone = PostprocessGeneration(outputBuffer, img);
+}
+
 void ImageGenerator::_preprocessInput(std::shared_ptr<BufferManager> buffers, cv::Mat &img) {
-    float* hostDataBuffer = static_cast<float*>(buffers->getHostBuffer(INPUT_NAME));
-    cv::Mat dst_img = cv::Mat(img.rows, img.cols, CV_32FC3, hostDataBuffer);
-    img.convertTo(dst_img, CV_32FC3);
+    float* hostDataBuffer = static_cast<float*>(buffers->getHostBuffer(mInputIndex));
+    PreprocessGeneration(img, hostDataBuffer);
 }
 
 void ImageGenerator::_postprocessOutput(std::shared_ptr<BufferManager> buffers, cv::Mat &img) {
-    float* outputBuffer = static_cast<float*>(buffers->getHostBuffer(OUTPUT_NAME));
-    cv::Mat image(img.rows, img.cols, CV_32FC3, outputBuffer);
-    cv::normalize(image, img, 0, 255, cv::NORM_MINMAX, CV_8UC3);
+    float* outputBuffer = static_cast<float*>(buffers->getHostBuffer(mOutputIndex));
+    PostprocessGeneration(outputBuffer, img);
 }
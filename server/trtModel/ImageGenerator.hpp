@@ -13,13 +13,26 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/highgui.hpp>
 #include "TrtPipeline.hpp"
+#include "imageProcess.hpp"
 #include "../server/utils.hpp"
 
 class ImageGenerator : public TrtPipeline {
     public:
-        ImageGenerator(const std::string &onnxFile, bool isDynamic);
+        // a calibration set builds the INT8 variant
+        ImageGenerator(const std::string &onnxFile, bool isDynamic, const CalibrationSet *calibration = nullptr);
         ~ImageGenerator();
+        virtual TrtPipeline* createSlot() const { return new ImageGenerator(*this); }
+
+        // run the generator. The output is stretched by its own range and the map used is
+        // returned in tone, or with keepTone it is mapped by tone as given
+        void generate(cv::Mat &img,
+            std::shared_ptr<BufferManager> buffers,
+            std::shared_ptr<nvinfer1::IExecutionContext> context,
+            ToneMap &tone, bool keepTone);
     private:        
+        int mInputIndex;
+        int mOutputIndex;
+
         virtual void _preprocessInput(std::shared_ptr<BufferManager> buffers, cv::Mat &img);
         virtual void _postprocessOutput(std::shared_ptr<BufferManager> buffers, cv::Mat &img);
 };
@@ -0,0 +1,127 @@
+#include "Int8Calibrator.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cuda_runtime.h>
+#include <spdlog/spdlog.h>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+
+CalibrationSet loadCalibrationSet(const std::string &dir) {
+    std::vector<std::string> names;
+    DIR *d = opendir(dir.c_str());
+    if(d == nullptr)
+        throw std::runtime_error("Can't open the calibration images " + dir);
+    while(struct dirent *ent = readdir(d))
+        names.push_back(ent->d_name);
+    closedir(d);
+    // a stable order, the digest and the split don't depend on the directory listing
+    std::sort(names.begin(), names.end());
+
+    std::vector<cv::Mat> samples;
+    for(const std::string &name : names) {
+        std::string ext = lowerExtension(name);
+        std::string path = dir + "/" + name;
+        if(isImageFile(ext)) {
+            cv::Mat img = cv::imread(path, cv::IMREAD_COLOR);
+            if(!img.empty())
+                samples.push_back(img);
+        }
+        else if(isVideoFile(ext)) {
+            cv::VideoCapture capture(path);
+            cv::Mat frame;
+            for(int i = 0; capture.read(frame) && (int)samples.size() < MAX_CALIBRATION_IMAGES; ++i)
+                if(i % CALIBRATION_FRAME_STRIDE == 0)
+                    samples.push_back(frame.clone());
+        }
+        if((int)samples.size() >= MAX_CALIBRATION_IMAGES)
+            break;
+    }
+    if(samples.empty())
+        throw std::runtime_error("No calibration images in " + dir);
+
+    CalibrationSet set;
+    set.digest = {0, 0};
+    for(size_t i = 0; i < samples.size(); ++i) {
+        const cv::Mat &img = samples[i];
+        Hash128 h = hashBytes(img.data, img.total() * img.elemSize(), img.cols * 65536 + img.rows);
+        set.digest.lo = hashCombine(set.digest.lo, h.lo);
+        set.digest.hi = hashCombine(set.digest.hi, h.hi);
+        if(i % VALIDATION_EVERY == VALIDATION_EVERY - 1)
+            set.validation.push_back(img);
+        else
+            set.images.push_back(img);
+    }
+    if(set.validation.empty()) {
+        spdlog::warn("Only {} calibration images in {}, the accuracy check reuses them.", samples.size(), dir);
+        set.validation = set.images;
+    }
+    spdlog::info("Calibration set {}: {} images, {} held out.", dir, set.images.size(), set.validation.size());
+    return set;
+}
+
+Int8Calibrator::Int8Calibrator(const CalibrationSet &set, const nvinfer1::Dims &dims, CalibrationPreprocess preprocess,
+    const std::string &tablePath)
+    : _set(set), _preprocess(preprocess), _dims(dims), _next(0), _device(nullptr), _tablePath(tablePath) {
+    size_t count = 1;
+    for(int i = 0; i < dims.nbDims; ++i)
+        count *= dims.d[i];
+    _host.resize(count);
+    if(cudaMalloc(&_device, count * sizeof(float)) != cudaSuccess)
+        throw std::runtime_error("Can't allocate the calibration input.");
+}
+
+Int8Calibrator::~Int8Calibrator() {
+    cudaFree(_device);
+}
+
+bool Int8Calibrator::getBatch(void *bindings[], const char * /*names*/[], int32_t nbBindings) noexcept {
+    if(_next >= _set.images.size() || nbBindings < 1)
+        return false;
+    cv::Mat img = _set.images[_next++].clone();
+    _preprocess(img, _host.data(), _dims);
+    if(cudaMemcpy(_device, _host.data(), _host.size() * sizeof(float), cudaMemcpyHostToDevice) != cudaSuccess)
+        return false;
+    bindings[0] = _device;
+    return true;
+}
+
+const void* Int8Calibrator::readCalibrationCache(size_t &length) noexcept {
+    length = 0;
+    FILE *fp = fopen(_tablePath.c_str(), "rb");
+    if(fp == nullptr)
+        return nullptr;
+    char chunk[4096];
+    size_t n;
+    _table.clear();
+    while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        _table.insert(_table.end(), chunk, chunk + n);
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if(failed || _table.empty())
+        return nullptr;
+    spdlog::info("[TRT] : Reuse the calibration table {}.", _tablePath);
+    length = _table.size();
+    return _table.data();
+}
+
+void Int8Calibrator::writeCalibrationCache(const void *cache, size_t length) noexcept {
+    // written aside and renamed, builds for other devices may read or write it meanwhile
+    std::string tmpPath = _tablePath + "." + std::to_string(getpid()) + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "wb");
+    if(fp == nullptr) {
+        spdlog::warn("[TRT] : Can't write the calibration table {} : {}", tmpPath, strerror(errno));
+        return;
+    }
+    bool written = fwrite(cache, 1, length, fp) == length && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    fclose(fp);
+    if(!written || rename(tmpPath.c_str(), _tablePath.c_str()) != 0) {
+        spdlog::warn("[TRT] : Can't write the calibration table {} : {}", _tablePath, strerror(errno));
+        unlink(tmpPath.c_str());
+    }
+}
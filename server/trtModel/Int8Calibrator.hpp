@@ -0,0 +1,54 @@
+#ifndef INT8CALIBRATOR_HPP
+#define INT8CALIBRATOR_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <NvInfer.h>
+#include <opencv2/core.hpp>
+#include "../server/Hash.hpp"
+
+const int MAX_CALIBRATION_IMAGES = 64;
+const int CALIBRATION_FRAME_STRIDE = 15;    // frames skipped between samples of a video
+const int VALIDATION_EVERY = 4;             // every 4th sample is held out for the accuracy check
+
+// sample images of the traffic, for the INT8 calibration and its accuracy check
+struct CalibrationSet {
+    std::vector<cv::Mat> images;        // the calibrator sees these
+    std::vector<cv::Mat> validation;    // held out, compared between FP32 and INT8
+    Hash128 digest;                     // of the files and the sampling, part of the plan's cache key
+};
+
+// loads the images, and frames sampled from the videos, of a directory. Throws when there are none
+CalibrationSet loadCalibrationSet(const std::string &dir);
+
+// writes one image into the input tensor of the given shape
+typedef std::function<void(cv::Mat &img, float *input, const nvinfer1::Dims &dims)> CalibrationPreprocess;
+
+/*Int8Calibrator feeds the calibration images through the model's own
+  preprocessing, one per batch, while TensorRT collects the activation
+  ranges of an INT8 build. The resulting calibration table is kept at
+  tablePath, next to the cached plans. A later build for the same model,
+  calibration set and TensorRT version, after the plan was evicted or for
+  another device, reads it back instead of calibrating again.*/
+class Int8Calibrator : public nvinfer1::IInt8EntropyCalibrator2 {
+    private:
+        const CalibrationSet &_set;
+        CalibrationPreprocess _preprocess;
+        nvinfer1::Dims _dims;
+        size_t _next;
+        std::vector<float> _host;
+        void *_device;
+        std::string _tablePath;
+        std::vector<char> _table;       // read back, TensorRT holds on to it during the build
+    public:
+        Int8Calibrator(const CalibrationSet &set, const nvinfer1::Dims &dims, CalibrationPreprocess preprocess,
+            const std::string &tablePath);
+        ~Int8Calibrator();
+        int32_t getBatchSize() const noexcept override { return 1; }
+        bool getBatch(void *bindings[], const char *names[], int32_t nbBindings) noexcept override;
+        const void* readCalibrationCache(size_t &length) noexcept override;
+        void writeCalibrationCache(const void *cache, size_t length) noexcept override;
+};
+
+#endif
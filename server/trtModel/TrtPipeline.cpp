@@ -1,43 +1,109 @@
 
 #include "TrtPipeline.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cuda_runtime.h>
 
 using namespace nvinfer1;
 
-TrtPipeline::TrtPipeline(const std::string onnxFile, bool isDynamic) {
+Logger TrtPipeline::gLogger;
+
+// a read-only mapping of a whole file, the pages are read in on first touch
+struct MappedFile {
+    void *data;
+    size_t size;
+
+    MappedFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            throw std::runtime_error("Can't open " + path);
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+            close(fd);
+            throw std::runtime_error("Can't read " + path);
+        }
+        size = fileStat.st_size;
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED)
+            throw std::runtime_error("Can't map " + path);
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    ~MappedFile() { munmap(data, size); }
+};
+
+static std::string deviceName() {
+    int device = 0;
+    cudaDeviceProp prop;
+    if(cudaGetDevice(&device) != cudaSuccess || cudaGetDeviceProperties(&prop, device) != cudaSuccess)
+        return "unknown";
+    return std::string(prop.name) + " sm" + std::to_string(prop.major) + std::to_string(prop.minor);
+}
+
+TrtPipeline::TrtPipeline(const std::string onnxFile, bool isDynamic,
+    const CalibrationSet *calibration, CalibrationPreprocess preprocess) {
     _isDynamic = isDynamic;
+    _precision = calibration != nullptr ? PRECISION_INT8 : PRECISION_FP32;
+    mModelVersion = 0;
+    mEngineBytes = 0;
+    mSessionUses = 0;
     _onnxModelFile = onnxFile;
-    size_t sep_pos = _onnxModelFile.find_last_of(".");
-    _trtModelFile = _onnxModelFile.substr(0, sep_pos) + ".plan";
-    if(ifFileExists(_trtModelFile.c_str()))
+    bool built = false;
+    _trtModelFile = getArtifactCache().getOrBuild(makeArtifactKey(calibration),
+        [&](const std::string &tmpPath) { loadOnnxModel(tmpPath, calibration, preprocess); }, built);
+    // a build deserialized its engine already
+    if(!built)
         loadTrtModel();
-    else
-        loadOnnxModel();
     if (mEngine == nullptr) 
-        spdlog::error("[TRT] : Failed loading engine!");
+        throw std::runtime_error("Failed loading engine of " + _onnxModelFile);
     spdlog::info("[TRT] : Succeeded loading engine!");
 }
 
+TrtPipeline::TrtPipeline(const TrtPipeline &model)
+    : _onnxModelFile(model._onnxModelFile), _trtModelFile(model._trtModelFile),
+    mRuntime(model.mRuntime), mEngine(model.mEngine), _isDynamic(model._isDynamic),
+    _precision(model._precision), mModelVersion(model.mModelVersion), mEngineBytes(model.mEngineBytes),
+    mSessionUses(0) {
+}
+
 TrtPipeline::~TrtPipeline() {
 
 }
 
+ArtifactKey TrtPipeline::makeArtifactKey(const CalibrationSet *calibration) const {
+    ArtifactKey key;
+    size_t dirEnd = _onnxModelFile.find_last_of('/');
+    std::string stem = _onnxModelFile.substr(dirEnd == std::string::npos ? 0 : dirEnd + 1);
+    key.name = stem.substr(0, stem.find_last_of('.'));
+    key.extension = ".plan";
+    MappedFile onnx(_onnxModelFile);
+    key.sourceDigest = hashBytes(onnx.data, onnx.size);
+    key.backend = "tensorrt-" + std::to_string(getInferLibVersion());
+    key.precision = _precision;
+    // another calibration set gives other activation ranges
+    if(calibration != nullptr)
+        key.precision += ":" + std::to_string(calibration->digest.lo) + "." + std::to_string(calibration->digest.hi);
+    key.profile = _isDynamic ? "nhwc3:" + std::to_string(DYNAMIC_MIN_SIZE) + "," +
+        std::to_string(DYNAMIC_OPT_SIZE) + "," + std::to_string(DYNAMIC_MAX_SIZE) : "static";
+    key.device = deviceName();
+    return key;
+}
+
 void TrtPipeline::loadTrtModel() {
     spdlog::info("Load TensorRT model : {}", _trtModelFile);
 
-    // create engine from TensorRT .plan file
-    std::ifstream engineFile(_trtModelFile, std::ios::binary);
-    engineFile.seekg(0, engineFile.end);
-    long int fsize = engineFile.tellg();
-    engineFile.seekg(0, engineFile.beg);
-    std::vector<char> engineBinaryData(fsize);
-    engineFile.read(engineBinaryData.data(), fsize);
-    engineFile.close();
-
+    // map the .plan file instead of copying it, the deserializer reads it once front to back
+    MappedFile engineFile(_trtModelFile);
     mRuntime = std::shared_ptr<IRuntime>(createInferRuntime(gLogger)); 
-    mEngine = std::shared_ptr<ICudaEngine>(mRuntime->deserializeCudaEngine(engineBinaryData.data(), fsize));
+    mEngine = std::shared_ptr<ICudaEngine>(mRuntime->deserializeCudaEngine(engineFile.data, engineFile.size));
+    mModelVersion = hashBytes(engineFile.data, engineFile.size).lo;
+    mEngineBytes = engineFile.size;
 }
 
-void TrtPipeline::loadOnnxModel() {
+void TrtPipeline::loadOnnxModel(const std::string &planFile, const CalibrationSet *calibration,
+    CalibrationPreprocess preprocess) {
     spdlog::info("[TRT] : Build TensorRT model from {}.", _onnxModelFile);
 
     // create engine from onnx file
@@ -51,29 +117,71 @@ void TrtPipeline::loadOnnxModel() {
     // only support one input dynamic
         IOptimizationProfile *profile = builder->createOptimizationProfile();
         ITensor *inputTensor = network->getInput(0);
-        profile->setDimensions(inputTensor->getName(), OptProfileSelector::kMIN, Dims{4, {1, 256, 256, 3}});
-        profile->setDimensions(inputTensor->getName(), OptProfileSelector::kOPT, Dims{4, {1, 512, 512, 3}});
-        profile->setDimensions(inputTensor->getName(), OptProfileSelector::kMAX, Dims{4, {1, 1024, 1024, 3}});
+        profile->setDimensions(inputTensor->getName(), OptProfileSelector::kMIN, Dims{4, {1, DYNAMIC_MIN_SIZE, DYNAMIC_MIN_SIZE, 3}});
+        profile->setDimensions(inputTensor->getName(), OptProfileSelector::kOPT, Dims{4, {1, DYNAMIC_OPT_SIZE, DYNAMIC_OPT_SIZE, 3}});
+        profile->setDimensions(inputTensor->getName(), OptProfileSelector::kMAX, Dims{4, {1, DYNAMIC_MAX_SIZE, DYNAMIC_MAX_SIZE, 3}});
         config->addOptimizationProfile(profile);
+        if(calibration != nullptr)
+            config->setCalibrationProfile(profile);
+    }
+    // calibrated at the profile's optimal shape, the calibrator lives until the build is done
+    std::unique_ptr<Int8Calibrator> calibrator;
+    if(calibration != nullptr) {
+        Dims inputDims = _isDynamic ? Dims{4, {1, DYNAMIC_OPT_SIZE, DYNAMIC_OPT_SIZE, 3}} : network->getInput(0)->getDimensions();
+        // the table doesn't depend on the device the plan is built for
+        ArtifactKey tableKey = makeArtifactKey(calibration);
+        tableKey.extension = ".calib";
+        tableKey.device = "any";
+        calibrator.reset(new Int8Calibrator(*calibration, inputDims, preprocess, getArtifactCache().getPath(tableKey)));
+        config->setFlag(BuilderFlag::kINT8);
+        config->setInt8Calibrator(calibrator.get());
+        spdlog::info("[TRT] : Calibrate INT8 on {} images.", calibration->images.size());
     }
     IHostMemory *engineBinaryData = builder->buildSerializedNetwork(*network, *config);
+    if(engineBinaryData == nullptr)
+        throw std::runtime_error("Failed building engine of " + _onnxModelFile);
 
     mRuntime = std::shared_ptr<IRuntime>(createInferRuntime(gLogger)); 
     mEngine = std::shared_ptr<ICudaEngine>(mRuntime->deserializeCudaEngine(engineBinaryData->data(), engineBinaryData->size()));
+    mModelVersion = hashBytes(engineBinaryData->data(), engineBinaryData->size()).lo;
+    mEngineBytes = engineBinaryData->size();
 
-    // save the serialize engine to disk
-    std::ofstream engineFile(_trtModelFile, std::ios::binary);
+    // save the serialize engine to the cache's temporary file, the cache renames it into place
+    std::ofstream engineFile(planFile, std::ios::binary | std::ios::trunc);
     engineFile.write(static_cast<char*>(engineBinaryData->data()), engineBinaryData->size());
+    engineFile.close();
     if(engineFile.fail())
-        spdlog::error("[TRT] : Failed saving .plan file!");
+        throw std::runtime_error("Failed saving " + planFile);
     spdlog::info("[TRT] : Succeeded saving .plan file!");
-    engineFile.close();
 }
 
 void TrtPipeline::inference(cv::Mat &image, std::shared_ptr<BufferManager> buffers, std::shared_ptr<IExecutionContext> context) {
     // Read the input data into the managed buffers
-    _preprocessInput(buffers, image);
+    {
+        StageTimer timer(STAGE_PREPROCESS);
+        _preprocessInput(buffers, image);
+    }
+    {
+        StageTimer timer(STAGE_INFERENCE);
+        _runEngine(buffers, context);
+    }
+    // Decode the output
+    StageTimer timer(STAGE_POSTPROCESS);
+    _postprocessOutput(buffers, image);
+}
 
+void TrtPipeline::warmUp(cv::Size size, int runs) {
+    TrtSession &session = getSession(size);
+    cv::Mat blank = cv::Mat::zeros(size, CV_8UC3);
+    for(int i = 0; i < runs; ++i) {
+        cv::Mat image = blank.clone();
+        _preprocessInput(session.buffers, image);
+        _runEngine(session.buffers, session.context);
+        _postprocessOutput(session.buffers, image);
+    }
+}
+
+void TrtPipeline::_runEngine(std::shared_ptr<BufferManager> buffers, std::shared_ptr<IExecutionContext> context) {
     // Memcpy from host input buffers to device input buffers
     buffers->copyInputToDevice();
 
@@ -82,9 +190,6 @@ void TrtPipeline::inference(cv::Mat &image, std::shared_ptr<BufferManager> buffe
 
     // Memcpy from device output buffers to host output buffers
     buffers->copyOutputToHost();
-
-    // Decode the output
-    _postprocessOutput(buffers, image);
 }
 
 std::shared_ptr<BufferManager> TrtPipeline::createBuffer() {
@@ -101,7 +206,44 @@ std::shared_ptr<IExecutionContext> TrtPipeline::createContext() {
 
 std::shared_ptr<IExecutionContext> TrtPipeline::createContext(cv::Size size) {
     std::shared_ptr<IExecutionContext> context = static_cast<std::shared_ptr<IExecutionContext>>(mEngine->createExecutionContext());
-    context->setInputShape(mEngine->getIOTensorName(0), Dims{4, {1, size.height, size.width, 3}});
+    // the buffers are sized from this shape, one outside the profile leaves it unresolved
+    if(!context->setInputShape(mEngine->getIOTensorName(0), Dims{4, {1, size.height, size.width, 3}}))
+        throw std::runtime_error("Input size " + std::to_string(size.width) + "x" + std::to_string(size.height) +
+            " is outside the profile of " + _onnxModelFile);
     return context;
 }
 
+TrtSession& TrtPipeline::getSession(cv::Size size) {
+    // a static engine has one shape whatever the image size
+    if(!_isDynamic)
+        size = cv::Size();
+    mSessionUses++;
+    for(TrtSession &session : mSessions) {
+        if(session.size == size) {
+            session.lastUsed = mSessionUses;
+            return session;
+        }
+    }
+    if(mSessions.size() >= MAX_CACHED_SESSIONS) {
+        auto oldest = mSessions.begin();
+        for(auto it = mSessions.begin(); it != mSessions.end(); ++it)
+            if(it->lastUsed < oldest->lastUsed)
+                oldest = it;
+        mSessions.erase(oldest);
+    }
+    TrtSession session;
+    session.context = _isDynamic ? createContext(size) : createContext();
+    session.buffers = createBuffer(session.context);
+    session.buffers->configContextTensorAddress(session.context);
+    session.size = size;
+    session.lastUsed = mSessionUses;
+    mSessions.push_back(session);
+    return mSessions.back();
+}
+
+int TrtPipeline::getTensorIndex(const std::string &tensorName) const {
+    for(int i = 0; i < mEngine->getNbIOTensors(); ++i)
+        if(tensorName == mEngine->getIOTensorName(i))
+            return i;
+    throw std::runtime_error("Model has no tensor " + tensorName);
+}
@@ -10,6 +10,10 @@
 #include <opencv2/core.hpp>
 #include "utils.hpp"
 #include "buffers.hpp"
+#include "Int8Calibrator.hpp"
+#include "../server/ArtifactCache.hpp"
+#include "../server/Hash.hpp"
+#include "../server/Metrics.hpp"
 
 class Logger : public nvinfer1::ILogger           
 {
@@ -21,10 +25,32 @@ class Logger : public nvinfer1::ILogger
     }
 };
 
+const size_t MAX_CACHED_SESSIONS = 4;   // input sizes a pipeline keeps a context for
+// input sides of the dynamic optimization profile
+const int DYNAMIC_MIN_SIZE = 256;
+const int DYNAMIC_OPT_SIZE = 512;
+const int DYNAMIC_MAX_SIZE = 1024;
+
+const char PRECISION_FP32[] = "fp32";
+const char PRECISION_INT8[] = "int8";
+
+// an execution context with its tensor buffers bound, reused while the input size repeats
+struct TrtSession {
+    std::shared_ptr<nvinfer1::IExecutionContext> context;
+    std::shared_ptr<BufferManager> buffers;
+    cv::Size size;
+    uint64_t lastUsed;
+};
+
 class TrtPipeline {
     public:
-        TrtPipeline(const std::string onnxFile, bool isDynamic = false);
-        ~TrtPipeline();
+        // with a calibration set the engine is built in INT8, calibrated on its images
+        TrtPipeline(const std::string onnxFile, bool isDynamic = false,
+            const CalibrationSet *calibration = nullptr, CalibrationPreprocess preprocess = nullptr);
+        virtual ~TrtPipeline();
+        // another execution slot of the loaded engine. Slots share the weights
+        // and each has its own contexts and buffers, so they run concurrently
+        virtual TrtPipeline* createSlot() const = 0;
         void inference(cv::Mat &image, 
             std::shared_ptr<BufferManager> buffers, 
             std::shared_ptr<nvinfer1::IExecutionContext> context);
@@ -32,11 +58,33 @@ class TrtPipeline {
         std::shared_ptr<BufferManager> createBuffer(std::shared_ptr<nvinfer1::IExecutionContext> context);
         std::shared_ptr<nvinfer1::IExecutionContext> createContext();
         std::shared_ptr<nvinfer1::IExecutionContext> createContext(cv::Size size);
+        // the cached session for the input size, valid until the next call. A pipeline
+        // is held by one request at a time, so no lock is needed
+        TrtSession& getSession(cv::Size size);
+        // index of an IO tensor for the BufferManager getters, resolve once at load
+        int getTensorIndex(const std::string &tensorName) const;
+        // run blank images through a session of the size, outside the stage timers,
+        // so the first requests don't pay for lazy allocations on the device
+        void warmUp(cv::Size size, int runs);
+        // size of the serialized engine, the weights every slot shares
+        size_t getWeightBytes() const { return mEngineBytes; }
+        // device memory a slot's context adds for its activations
+        size_t getSlotBytes() const { return mEngine->getDeviceMemorySize(); }
+        // digest of the serialized engine, changes whenever the model is rebuilt
+        uint64_t getModelVersion() const { return mModelVersion; }
+        const std::string& getPrecision() const { return _precision; }
     private:
+        // the compiled plan is cached under everything the build depends on
+        ArtifactKey makeArtifactKey(const CalibrationSet *calibration) const;
         void loadTrtModel();
-        void loadOnnxModel();
+        // builds the engine and writes its plan to planFile
+        void loadOnnxModel(const std::string &planFile, const CalibrationSet *calibration,
+            CalibrationPreprocess preprocess);
     protected:
-        Logger gLogger;
+        // the engine of a slot, sessions excluded
+        TrtPipeline(const TrtPipeline &model);
+
+        static Logger gLogger;      // outlives every runtime, whichever slot goes first
         std::string _onnxModelFile;
         std::string _trtModelFile;
 
@@ -44,6 +92,15 @@ class TrtPipeline {
         std::shared_ptr<nvinfer1::ICudaEngine> mEngine;
 
         bool _isDynamic;
+        std::string _precision;     // builder precision, part of the plan's cache key
+        uint64_t mModelVersion;
+        size_t mEngineBytes;
+        std::vector<TrtSession> mSessions;
+        uint64_t mSessionUses;
+
+        // copy inputs to device, run the engine and copy outputs back
+        void _runEngine(std::shared_ptr<BufferManager> buffers,
+            std::shared_ptr<nvinfer1::IExecutionContext> context);
 
         // image preprocess function
         virtual void _preprocessInput(std::shared_ptr<BufferManager> buffers, cv::Mat &img) = 0;
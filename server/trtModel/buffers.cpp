@@ -1,64 +1,109 @@
 #include "buffers.hpp"
+#include <atomic>
+#include <unistd.h>
+#include <sys/mman.h>
 
 using namespace nvinfer1;
 
+const size_t TENSOR_ALIGNMENT = 64;
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+static std::atomic<bool> hostArenaHugePages(false);
+
+void setHostArenaHugePages(bool enable) {
+    hostArenaHugePages = enable;
+}
+
+HostArena::HostArena(size_t size) : mData(nullptr), mSize(0), mPinned(false) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    if(hostArenaHugePages && size >= HUGE_PAGE_SIZE / 2) {
+        // reserved huge pages first, transparent huge pages when none are left
+        mSize = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        mData = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(mData == MAP_FAILED) {
+            mData = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(mData != MAP_FAILED)
+                madvise(mData, mSize, MADV_HUGEPAGE);
+        }
+    }
+    else {
+        mSize = (size + pageSize - 1) / pageSize * pageSize;
+        mData = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(mData == MAP_FAILED)
+        throw std::bad_alloc();
+    // pinned pages let cudaMemcpy DMA straight from the arena, still correct if it fails
+    mPinned = cudaHostRegister(mData, mSize, cudaHostRegisterDefault) == cudaSuccess;
+    if(!mPinned)
+        spdlog::warn("[TRT] : Pinning {} bytes of host tensors failed.", mSize);
+}
+
+HostArena::~HostArena() {
+    if(mPinned)
+        cudaHostUnregister(mData);
+    munmap(mData, mSize);
+}
+
 BufferManager::BufferManager(std::shared_ptr<ICudaEngine> engine, 
     std::shared_ptr<IExecutionContext> context)
-    : mEngine(engine) {
-    for (int i = 0; i < mEngine->getNbIOTensors(); ++i) {
-        std::string tensorName = std::string(mEngine->getIOTensorName(i));
-        IOTensorNames.push_back(tensorName);
-
-        // Create host and device buffers
-        auto dims = context ? context->getTensorShape(tensorName.c_str()) : mEngine->getTensorShape(tensorName.c_str());
-        auto dtype = engine->getTensorDataType(tensorName.c_str());
-        int  size = 1;
+    : mEngine(engine), mInputBytes(0), mTotalBytes(0) {
+    int nbTensors = mEngine->getNbIOTensors();
+    mBindings.resize(nbTensors);
+    for (int i = 0; i < nbTensors; ++i) {
+        TensorBinding &binding = mBindings[i];
+        binding.name = mEngine->getIOTensorName(i);
+        binding.isInput = mEngine->getTensorIOMode(binding.name.c_str()) == TensorIOMode::kINPUT;
+
+        auto dims = context ? context->getTensorShape(binding.name.c_str()) : mEngine->getTensorShape(binding.name.c_str());
+        size_t size = dataTypeToSize(mEngine->getTensorDataType(binding.name.c_str()));
         for (int j = 0; j < dims.nbDims; ++j)
             size *= dims.d[j];
-        size = size * dataTypeToSize(dtype);
-        std::unique_ptr<HostDeviceBuffer> hostDevBuf = std::make_unique<HostDeviceBuffer>();
-        hostDevBuf->deviceBuffer = GenericBuffer<DeviceAllocator, DeviceFree>(size, dtype);
-        hostDevBuf->hostBuffer = GenericBuffer<HostAllocator, HostFree>(size, dtype);
-        mManagedBuffers[tensorName] = std::move(hostDevBuf);
+        binding.nbBytes = size;
+    }
+    // inputs first so each direction is a single copy
+    for (int pass = 0; pass < 2; ++pass) {
+        for (TensorBinding &binding : mBindings) {
+            if (binding.isInput != (pass == 0))
+                continue;
+            binding.offset = mTotalBytes;
+            mTotalBytes += (binding.nbBytes + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+        }
+        if (pass == 0)
+            mInputBytes = mTotalBytes;
     }
+    mHostArena = std::make_unique<HostArena>(mTotalBytes);
+    mDeviceBuffer = GenericBuffer<DeviceAllocator, DeviceFree>(mTotalBytes, DataType::kUINT8);
 }
 
-void* BufferManager::getBuffer(const bool isHost, const std::string& tensorName) {
-    return isHost ? mManagedBuffers[tensorName]->hostBuffer.data() : mManagedBuffers[tensorName]->deviceBuffer.data();
+int BufferManager::findTensor(const std::string& tensorName) const {
+    for (size_t i = 0; i < mBindings.size(); ++i)
+        if (mBindings[i].name == tensorName)
+            return i;
+    return -1;
 }
 
 void* BufferManager::getHostBuffer(const std::string& tensorName) {
-    return getBuffer(true, tensorName);
+    int index = findTensor(tensorName);
+    return index < 0 ? nullptr : getHostBuffer(index);
 }
 
- void* BufferManager::getDeviceBuffer(const std::string& tensorName) {
-    return getBuffer(false, tensorName);
+void* BufferManager::getDeviceBuffer(const std::string& tensorName) {
+    int index = findTensor(tensorName);
+    return index < 0 ? nullptr : getDeviceBuffer(index);
 }
 
 void BufferManager::copyInputToDevice() {
-    for(const std::string &tensorName : IOTensorNames){
-        if(mEngine->getTensorIOMode(tensorName.c_str()) == TensorIOMode::kINPUT){
-            void* hostPtr = mManagedBuffers[tensorName]->hostBuffer.data();
-            void* devPtr = mManagedBuffers[tensorName]->deviceBuffer.data();
-            size_t size = mManagedBuffers[tensorName]->hostBuffer.nbBytes();
-            cudaMemcpy(devPtr, hostPtr, size, cudaMemcpyHostToDevice);
-        }  
-    }
-} 
+    cudaMemcpy(mDeviceBuffer.data(), mHostArena->data(), mInputBytes, cudaMemcpyHostToDevice);
+}
 
 void BufferManager::copyOutputToHost() {
-    for(const std::string &tensorName : IOTensorNames){
-        if(mEngine->getTensorIOMode(tensorName.c_str()) == TensorIOMode::kOUTPUT){
-            void* hostPtr = mManagedBuffers[tensorName]->hostBuffer.data();
-            void* devPtr = mManagedBuffers[tensorName]->deviceBuffer.data();
-            size_t size = mManagedBuffers[tensorName]->hostBuffer.nbBytes();
-            cudaMemcpy(hostPtr, devPtr, size, cudaMemcpyDeviceToHost);
-        }  
-    }
-} 
+    cudaMemcpy(static_cast<char*>(mHostArena->data()) + mInputBytes,
+        static_cast<char*>(mDeviceBuffer.data()) + mInputBytes, mTotalBytes - mInputBytes, cudaMemcpyDeviceToHost);
+}
 
 void BufferManager::printInfo(std::shared_ptr<IExecutionContext> context) {
-    for (const std::string &tensorName : IOTensorNames) {
+    for (const TensorBinding &binding : mBindings) {
+        const std::string &tensorName = binding.name;
         std::cout << std::string(mEngine->getTensorIOMode(tensorName.c_str()) == TensorIOMode::kINPUT ? "Input [" : "Output[");
         std::cout << tensorName << std::string("]-> ");
         std::cout << dataTypeToString(mEngine->getTensorDataType(tensorName.c_str())) << std::string(" ");
@@ -71,8 +116,8 @@ void BufferManager::printInfo(std::shared_ptr<IExecutionContext> context) {
 }
 
 void BufferManager::configContextTensorAddress(std::shared_ptr<IExecutionContext> context) {
-    for(const auto &item : mManagedBuffers)
-        context->setTensorAddress(item.first.c_str(), item.second->deviceBuffer.data());
+    for(size_t i = 0; i < mBindings.size(); ++i)
+        context->setTensorAddress(mBindings[i].name.c_str(), getDeviceBuffer(i));
 }
 
 
@@ -97,26 +97,35 @@ class DeviceFree {
         }
 };
 
-class HostAllocator {
+//! \brief  The HostArena class holds the host side of all IO tensors of a context in one block.
+//!
+//! \details The block is mapped 64 byte aligned, backed by huge pages when they are enabled
+//!          (MAP_HUGETLB, falling back to transparent huge pages) and registered with CUDA so
+//!          the copies to and from the device run as DMA without a staging buffer.
+//!
+class HostArena {
+    private:
+        void* mData;
+        size_t mSize;       //!< mapped bytes, rounded up to the page size
+        bool mPinned;
     public:
-        bool operator()(void** ptr, size_t size) const {
-            *ptr = malloc(size);
-            return *ptr != nullptr;
-        }
+        HostArena(size_t size);
+        ~HostArena();
+        HostArena(const HostArena&) = delete;
+        HostArena& operator=(const HostArena&) = delete;
+        void* data() const { return mData; }
+        size_t size() const { return mSize; }
 };
 
-class HostFree {
-    public:
-        void operator()(void* ptr) const {
-            free(ptr);
-        }
-};
+//! \brief Back the host arenas created from now on by huge pages.
+void setHostArenaHugePages(bool enable);
 
-//! \brief  The HostDeviceBuffer class groups together a pair of corresponding device and host buffers.
-class HostDeviceBuffer {
-public:
-    GenericBuffer<DeviceAllocator, DeviceFree> deviceBuffer;
-    GenericBuffer<HostAllocator, HostFree> hostBuffer;
+//! \brief The place of one IO tensor inside the host and device blocks.
+struct TensorBinding {
+    std::string name;
+    bool isInput;
+    size_t nbBytes;
+    size_t offset;
 };
 
 //!
@@ -130,16 +139,29 @@ public:
 class BufferManager {
     private:
         std::shared_ptr<nvinfer1::ICudaEngine> mEngine;   //!< The pointer to the engine
-        std::vector<std::string> IOTensorNames;
-        std::unordered_map<std::string, std::unique_ptr<HostDeviceBuffer>> mManagedBuffers; //!< The vector of pointers to managed buffers
+        std::vector<TensorBinding> mBindings;              //!< Indexed like the engine IO tensors
+        size_t mInputBytes;                                //!< Inputs come first, outputs start here
+        size_t mTotalBytes;
+        std::unique_ptr<HostArena> mHostArena;
+        GenericBuffer<DeviceAllocator, DeviceFree> mDeviceBuffer;
 
-        void* getBuffer(const bool isHost, const std::string& tensorName);
+        int findTensor(const std::string& tensorName) const;
 
     public:
         //! \brief Create a BufferManager for handling buffer interactions with engine.
         BufferManager(std::shared_ptr<nvinfer1::ICudaEngine> engine,
             std::shared_ptr<nvinfer1::IExecutionContext> context = std::shared_ptr<nvinfer1::IExecutionContext>(nullptr));
 
+        //! \brief Returns the device buffer of the IO tensor at index, see TrtPipeline::getTensorIndex.
+        void* getDeviceBuffer(int index) const {
+            return static_cast<char*>(mDeviceBuffer.data()) + mBindings[index].offset;
+        }
+
+        //! \brief Returns the host buffer of the IO tensor at index, see TrtPipeline::getTensorIndex.
+        void* getHostBuffer(int index) const {
+            return static_cast<char*>(mHostArena->data()) + mBindings[index].offset;
+        }
+
         //! \brief Returns the device buffer corresponding to tensorName.
         //!        Returns nullptr if no such tensor can be found.
         void* getDeviceBuffer(const std::string& tensorName);
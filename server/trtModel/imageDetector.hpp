@@ -13,30 +13,32 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/highgui.hpp>
 #include "TrtPipeline.hpp"
+#include "imageProcess.hpp"
 #include "../server/utils.hpp"
 
-struct FaceBox {
-    float confidence;
-    float x;
-    float y; 
-    float w;
-    float h;
-};
-
-float IOUCalculate(const FaceBox& det_a, const FaceBox& det_b);
-void NmsDetect(std::vector<FaceBox>& detections);
-
 class ImageDetector : public TrtPipeline {
     public:
-        ImageDetector(const std::string &onnxFile);
+        // a calibration set builds the INT8 variant
+        ImageDetector(const std::string &onnxFile, const CalibrationSet *calibration = nullptr);
         ~ImageDetector();
+        virtual TrtPipeline* createSlot() const { return new ImageDetector(*this); }
+
+        // run the detector and return the boxes in image coordinates without drawing them
+        std::vector<FaceBox> detect(cv::Mat &img, 
+            std::shared_ptr<BufferManager> buffers, 
+            std::shared_ptr<nvinfer1::IExecutionContext> context);
 
     private:        
         int mInputH;
         int mInputW;
+        int mInputIndex;
+        int mHeatmapIndex;
+        int mScaleIndex;
+        int mOffsetIndex;
 
         virtual void _preprocessInput(std::shared_ptr<BufferManager> buffers, cv::Mat &img);
         virtual void _postprocessOutput(std::shared_ptr<BufferManager> buffers, cv::Mat &img);
+        std::vector<FaceBox> _decodeOutput(std::shared_ptr<BufferManager> buffers, cv::Size imgSize);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include "imageProcess.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <opencv2/imgproc.hpp>
+
+const float confThreash = 0.5;
+const float NMSThreash = 0.2;
+
+float IOUCalculate(const FaceBox& det_a, const FaceBox& det_b) {
+    cv::Point2f center_a(det_a.x, det_a.y);
+    cv::Point2f center_b(det_b.x, det_b.y);
+    cv::Point2f left_up(std::min(det_a.x - det_a.w / 2, det_b.x - det_b.w / 2),
+        std::min(det_a.y - det_a.h / 2, det_b.y - det_b.h / 2));
+    cv::Point2f right_down(std::max(det_a.x + det_a.w / 2, det_b.x + det_b.w / 2),
+        std::max(det_a.y + det_a.h / 2, det_b.y + det_b.h / 2));
+    float distance_d = (center_a - center_b).x * (center_a - center_b).x + (center_a - center_b).y * (center_a - center_b).y;
+    float distance_c = (left_up - right_down).x * (left_up - right_down).x + (left_up - right_down).y * (left_up - right_down).y;
+    float inter_l = det_a.x - det_a.w / 2 > det_b.x - det_b.w / 2 ? det_a.x - det_a.w / 2 : det_b.x - det_b.w / 2;
+    float inter_t = det_a.y - det_a.h / 2 > det_b.y - det_b.h / 2 ? det_a.y - det_a.h / 2 : det_b.y - det_b.h / 2;
+    float inter_r = det_a.x + det_a.w / 2 < det_b.x + det_b.w / 2 ? det_a.x + det_a.w / 2 : det_b.x + det_b.w / 2;
+    float inter_b = det_a.y + det_a.h / 2 < det_b.y + det_b.h / 2 ? det_a.y + det_a.h / 2 : det_b.y + det_b.h / 2;
+    if (inter_b < inter_t || inter_r < inter_l)
+        return 0;
+    float inter_area = (inter_b - inter_t) * (inter_r - inter_l);
+    float union_area = det_a.w * det_a.h + det_b.w * det_b.h - inter_area;
+    if (union_area == 0)
+        return 0;
+    else
+        return inter_area / union_area - distance_d / distance_c;
+}
+
+void NmsDetect(std::vector<FaceBox>& detections) {
+    sort(detections.begin(), detections.end(), [=](const FaceBox& left, const FaceBox& right) {
+        return left.confidence > right.confidence;
+    });
+
+    for (int i = 0; i < (int)detections.size(); i++)
+        for (int j = i + 1; j < (int)detections.size(); j++)
+        {
+            float iou = IOUCalculate(detections[i], detections[j]);
+            if (iou > NMSThreash)
+                detections[j].confidence = 0;
+        }
+
+    detections.erase(std::remove_if(detections.begin(), detections.end(), [](const FaceBox& det)
+    { return det.confidence == 0; }), detections.end());
+}
+
+void PreprocessDetection(const cv::Mat &img, float *input, int inputW, int inputH) {
+    float ratio = float(inputW) / float(img.cols) < float(inputH) / float(img.rows) ? 
+        float(inputW) / float(img.cols) : float(inputH) / float(img.rows);
+    cv::Mat flt_img = cv::Mat::zeros(cv::Size(inputW, inputH), CV_8UC3);
+    cv::Mat rsz_img;
+    cv::resize(img, rsz_img, cv::Size(), ratio, ratio);
+    rsz_img.copyTo(flt_img(cv::Rect(0, 0, rsz_img.cols, rsz_img.rows)));
+    flt_img.convertTo(flt_img, CV_32FC3);
+
+    //HWC TO CHW
+    int channelLength = inputW * inputH;
+    std::vector<cv::Mat> split_img = {
+            cv::Mat(inputH, inputW, CV_32FC1, input + channelLength * 2),
+            cv::Mat(inputH, inputW, CV_32FC1, input + channelLength * 1),
+            cv::Mat(inputH, inputW, CV_32FC1, input)
+            };
+    cv::split(flt_img, split_img);
+}
+
+std::vector<FaceBox> DecodeDetection(const float *heatmap, const float *scale, const float *offset,
+    int inputW, int inputH, cv::Size imgSize) {
+    std::vector<FaceBox> result;
+    int image_size = inputW / 4 * inputH / 4;
+    float ratio = float(imgSize.width) / float(inputW) > float(imgSize.height) / float(inputH) ? 
+        float(imgSize.width) / float(inputW) : float(imgSize.height) / float(inputH);
+    for (int i = 0; i < inputH / 4; i++) {
+        for (int j = 0; j < inputW / 4; j++) {
+            int current = i * inputW / 4 + j;
+            if (heatmap[current] > confThreash) {
+                FaceBox headbox;
+                headbox.confidence = heatmap[current];
+                headbox.h = std::exp(scale[current]) * 4 * ratio;
+                headbox.w = std::exp((scale+image_size)[current]) * 4 * ratio;
+                headbox.x = ((float)j + offset[current] + 0.5f) * 4 * ratio;
+                headbox.y = ((float)i + (offset+image_size)[current] + 0.5f) * 4 * ratio;
+                result.push_back(headbox);
+            }
+        }
+    }
+    NmsDetect(result);
+    return result;
+}
+
+void DrawDetections(cv::Mat &img, const std::vector<FaceBox> &detections) {
+    for (const auto& boundingBox : detections) {
+        cv::Rect box(boundingBox.x - boundingBox.w / 2, boundingBox.y - boundingBox.h / 2, boundingBox.w, boundingBox.h);
+        cv::rectangle(img, box, cv::Scalar(255, 0, 0), 2);
+    }
+}
+
+void PreprocessGeneration(const cv::Mat &img, float *input) {
+    cv::Mat dst_img = cv::Mat(img.rows, img.cols, CV_32FC3, input);
+    img.convertTo(dst_img, CV_32FC3);
+}
+
+ToneMap PostprocessGeneration(const float *output, cv::Mat &img) {
+    cv::Mat image(img.rows, img.cols, CV_32FC3, const_cast<float *>(output));
+    // the min-max stretch of cv::normalize, kept so a region can be mapped the same way
+    double least = 0, most = 0;
+    cv::minMaxIdx(image.reshape(1), &least, &most);
+    ToneMap tone;
+    tone.scale = most - least > DBL_EPSILON ? 255.0 / (most - least) : 0.0;
+    tone.offset = -least * tone.scale;
+    image.convertTo(img, CV_8UC3, tone.scale, tone.offset);
+    return tone;
+}
+
+void PostprocessGeneration(const float *output, cv::Mat &img, const ToneMap &tone) {
+    cv::Mat image(img.rows, img.cols, CV_32FC3, const_cast<float *>(output));
+    image.convertTo(img, CV_8UC3, tone.scale, tone.offset);
+}
@@ -0,0 +1,41 @@
+/*Host side pre- and postprocessing of the models. They only depend on
+  OpenCV and work on plain host buffers, so they can run and be measured
+  without TensorRT or a GPU.*/
+#ifndef IMAGEPROCESS_HPP
+#define IMAGEPROCESS_HPP
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+struct FaceBox {
+    float confidence;
+    float x;
+    float y; 
+    float w;
+    float h;
+};
+
+float IOUCalculate(const FaceBox& det_a, const FaceBox& det_b);
+void NmsDetect(std::vector<FaceBox>& detections);
+
+// letterbox img into the CHW (BGR reversed) input of the detector
+void PreprocessDetection(const cv::Mat &img, float *input, int inputW, int inputH);
+// heatmap/scale/offset are the detector outputs at a quarter of the input size
+std::vector<FaceBox> DecodeDetection(const float *heatmap, const float *scale, const float *offset,
+    int inputW, int inputH, cv::Size imgSize);
+void DrawDetections(cv::Mat &img, const std::vector<FaceBox> &detections);
+
+// the linear map of the generator output to 8 bits, as cv::Mat::convertTo takes it
+struct ToneMap {
+    double scale;
+    double offset;
+};
+
+// img and the HWC generator input/output share the same size
+void PreprocessGeneration(const cv::Mat &img, float *input);
+// stretches the output to 0-255 by its own range, returns the map it used
+ToneMap PostprocessGeneration(const float *output, cv::Mat &img);
+// a region generated alone is mapped like the frame it is pasted into
+void PostprocessGeneration(const float *output, cv::Mat &img, const ToneMap &tone);
+
+#endif
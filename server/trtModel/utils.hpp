@@ -1,6 +1,7 @@
 #ifndef UTILS_TRT_HPP
 #define UTILS_TRT_HPP
 
+#include <algorithm>
 #include <string>
 #include <NvInfer.h>
 #include <sys/types.h>
@@ -13,6 +14,25 @@ inline bool ifFileExists(const char *FileName)
     return (stat(FileName, &my_stat) == 0);
 }
 
+// the extension of a file name in lower case with its dot, "" when there is none
+inline std::string lowerExtension(const std::string &name)
+{
+    size_t dot = name.find_last_of('.');
+    std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext;
+}
+
+inline bool isImageFile(const std::string &ext)
+{
+    return ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".bmp" || ext == ".webp";
+}
+
+inline bool isVideoFile(const std::string &ext)
+{
+    return ext == ".avi" || ext == ".mp4" || ext == ".mkv" || ext == ".mov";
+}
+
 inline std::string dataTypeToString(nvinfer1::DataType dataType)
 {
     switch (dataType)
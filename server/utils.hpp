@@ -1,6 +1,11 @@
 #ifndef UTILS_SERVER_HPP
 #define UTILS_SERVER_HPP
 
+#include <queue>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
 template <typename dataType>
 class ThreadSafeQueue {
 private:
@@ -27,7 +32,7 @@ public:
 
     dataType pop() {
         pthread_mutex_lock(&_mtx);
-        if(_queue.empty())
+        while(_queue.empty())
             pthread_cond_wait(&_condv, &_mtx);
         dataType data = _queue.front();
         _queue.pop();
@@ -35,9 +40,40 @@ public:
         return data;
     }
 
+    // wait at most timeoutMs for an element, returns false on timeout
+    bool popFor(dataType &data, int timeoutMs) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeoutMs / 1000;
+        ts.tv_nsec += (timeoutMs % 1000) * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&_mtx);
+        while(_queue.empty())
+            if(pthread_cond_timedwait(&_condv, &_mtx, &ts) == ETIMEDOUT)
+                break;
+        if(_queue.empty()) {
+            pthread_mutex_unlock(&_mtx);
+            return false;
+        }
+        data = _queue.front();
+        _queue.pop();
+        pthread_mutex_unlock(&_mtx);
+        return true;
+    }
+
     bool isEmpty() {
         return _queue.empty();
     }
+
+    size_t size() {
+        pthread_mutex_lock(&_mtx);
+        size_t nums = _queue.size();
+        pthread_mutex_unlock(&_mtx);
+        return nums;
+    }
 };
 
 #endif
\ No newline at end of file
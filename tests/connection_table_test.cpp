@@ -0,0 +1,74 @@
+#include <sys/resource.h>
+#include <gtest/gtest.h>
+#include "ConnectionTable.hpp"
+
+// the table only stores and hands back the pointer, a stand-in owner is enough to tell channels apart
+static std::shared_ptr<DataChannel> makeChannel() {
+    std::shared_ptr<int> owner = std::make_shared<int>(0);
+    return std::shared_ptr<DataChannel>(owner, reinterpret_cast<DataChannel *>(owner.get()));
+}
+
+TEST(ConnectionTable, HandlePacksFdAndGeneration) {
+    ConnHandle handle = makeConnHandle(1234, 0xdeadbeef);
+    EXPECT_EQ(connHandleFd(handle), 1234);
+    EXPECT_EQ(connHandleGeneration(handle), 0xdeadbeefu);
+}
+
+TEST(ConnectionTable, InsertLookupRemove) {
+    ConnectionTable table;
+    std::shared_ptr<DataChannel> channel = makeChannel();
+    ConnHandle handle = table.insert(7, channel);
+    EXPECT_EQ(connHandleFd(handle), 7);
+    EXPECT_EQ(connHandleGeneration(handle) & 1, 1u);
+    EXPECT_EQ(table.size(), 1u);
+    EXPECT_TRUE(table.isCurrent(handle));
+    EXPECT_EQ(table.lookup(handle), channel);
+
+    EXPECT_EQ(table.remove(handle), channel);
+    EXPECT_EQ(table.size(), 0u);
+    EXPECT_FALSE(table.isCurrent(handle));
+    EXPECT_EQ(table.lookup(handle), nullptr);
+    EXPECT_EQ(table.remove(handle), nullptr);
+    // the table no longer holds the channel
+    EXPECT_EQ(channel.use_count(), 1);
+}
+
+TEST(ConnectionTable, StaleHandleMissesAReusedFd) {
+    ConnectionTable table;
+    ConnHandle first = table.insert(7, makeChannel());
+    table.remove(first);
+    std::shared_ptr<DataChannel> second = makeChannel();
+    ConnHandle reused = table.insert(7, second);
+    EXPECT_NE(reused, first);
+    EXPECT_EQ(table.lookup(first), nullptr);
+    EXPECT_EQ(table.remove(first), nullptr);
+    EXPECT_EQ(table.lookup(reused), second);
+}
+
+TEST(ConnectionTable, RefusesAnOccupiedFd) {
+    ConnectionTable table;
+    table.insert(7, makeChannel());
+    EXPECT_THROW(table.insert(7, makeChannel()), std::runtime_error);
+    EXPECT_EQ(table.size(), 1u);
+}
+
+TEST(ConnectionTable, FdsBeyondTheLimit) {
+    ConnectionTable table;
+    struct rlimit limit;
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+    int maxFds = limit.rlim_cur == RLIM_INFINITY ? 65536 : (int)limit.rlim_cur;
+    EXPECT_THROW(table.insert(maxFds, makeChannel()), std::runtime_error);
+    EXPECT_THROW(table.insert(-1, makeChannel()), std::runtime_error);
+    EXPECT_EQ(table.lookup(makeConnHandle(maxFds, 1)), nullptr);
+    EXPECT_FALSE(table.isCurrent(makeConnHandle(-1, 1)));
+    // the last slot is in range, on a page of its own
+    ConnHandle last = table.insert(maxFds - 1, makeChannel());
+    EXPECT_TRUE(table.isCurrent(last));
+}
+
+TEST(ConnectionTable, UnallocatedPageIsEmpty) {
+    ConnectionTable table;
+    table.insert(1, makeChannel());
+    EXPECT_EQ(table.lookup(makeConnHandle(CONNECTION_PAGE_SLOTS + 1, 1)), nullptr);
+    EXPECT_EQ(table.lookup(makeConnHandle(2, 1)), nullptr);
+}
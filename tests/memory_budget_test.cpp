@@ -0,0 +1,122 @@
+#include <ctype.h>
+#include <string>
+#include <gtest/gtest.h>
+#include "MemoryBudget.hpp"
+
+// a connection as the budget sees it: its byte count and the order its callbacks ran in
+struct Connection {
+    std::atomic<size_t> bytes;
+    std::string *events;
+    char name;
+
+    Connection(std::string *events, char name) : bytes(0), events(events), name(name) {}
+    bool reserve(MemoryBudget &budget, size_t nbBytes) {
+        return budget.reserve(nbBytes, bytes, [this]() { *events += name; },
+            [this]() { *events += (char)tolower(name); });
+    }
+};
+
+TEST(MemoryBudget, RefusesFramesOverTheLimit) {
+    MemoryBudget budget(100, 100, 64);
+    EXPECT_TRUE(budget.checkFrame(64));
+    EXPECT_FALSE(budget.checkFrame(65));
+    EXPECT_EQ(budget.getStats().rejectedFrames, 1u);
+}
+
+TEST(MemoryBudget, ReservesWithinTheBudget) {
+    MemoryBudget budget(100, 100, 100);
+    std::string events;
+    Connection a(&events, 'A');
+    EXPECT_TRUE(a.reserve(budget, 40));
+    EXPECT_TRUE(a.reserve(budget, 60));
+    EXPECT_EQ(budget.getStats().usedBytes, 100u);
+    EXPECT_EQ(a.bytes.load(), 100u);
+    budget.release(100, a.bytes);
+    EXPECT_EQ(budget.getStats().usedBytes, 0u);
+    EXPECT_EQ(events, "");
+}
+
+TEST(MemoryBudget, EmptyBudgetAdmitsOneLargeFrame) {
+    MemoryBudget budget(100, 100, 1000);
+    std::string events;
+    Connection a(&events, 'A');
+    EXPECT_TRUE(a.reserve(budget, 500));
+    EXPECT_EQ(budget.getStats().usedBytes, 500u);
+}
+
+TEST(MemoryBudget, PausedConnectionsResumeInOrder) {
+    MemoryBudget budget(100, 100, 100);
+    std::string events;
+    Connection a(&events, 'A'), b(&events, 'B'), c(&events, 'C');
+    ASSERT_TRUE(a.reserve(budget, 80));
+    EXPECT_FALSE(b.reserve(budget, 50));
+    // fits, but waits behind the queued connection
+    EXPECT_FALSE(c.reserve(budget, 10));
+    EXPECT_EQ(events, "bc");
+    EXPECT_EQ(budget.getStats().pausedConnections, 2u);
+
+    budget.release(80, a.bytes);
+    EXPECT_EQ(events, "bcBC");
+    EXPECT_EQ(budget.getStats().usedBytes, 60u);
+    EXPECT_EQ(budget.getStats().pausedConnections, 0u);
+    EXPECT_EQ(budget.getStats().pauses, 2u);
+    // the resumed reads take their grants once
+    EXPECT_TRUE(budget.claim(b.bytes));
+    EXPECT_FALSE(budget.claim(b.bytes));
+    EXPECT_TRUE(budget.claim(c.bytes));
+}
+
+TEST(MemoryBudget, ConnectionBudgetPausesOneConnection) {
+    MemoryBudget budget(1000, 50, 100);
+    std::string events;
+    Connection a(&events, 'A'), b(&events, 'B');
+    ASSERT_TRUE(a.reserve(budget, 40));
+    EXPECT_FALSE(a.reserve(budget, 20));
+    budget.release(40, a.bytes);
+    EXPECT_EQ(events, "aA");
+    EXPECT_EQ(a.bytes.load(), 20u);
+    EXPECT_TRUE(b.reserve(budget, 40));
+}
+
+TEST(MemoryBudget, ChargeDoesNotWait) {
+    MemoryBudget budget(100, 100, 100);
+    std::string events;
+    Connection a(&events, 'A'), b(&events, 'B');
+    ASSERT_TRUE(a.reserve(budget, 50));
+    budget.charge(80, a.bytes);
+    EXPECT_EQ(budget.getStats().usedBytes, 130u);
+    EXPECT_FALSE(b.reserve(budget, 10));
+    budget.release(80, a.bytes);
+    EXPECT_EQ(events, "bB");
+}
+
+TEST(MemoryBudget, CancelLeavesTheQueue) {
+    MemoryBudget budget(100, 100, 100);
+    std::string events;
+    Connection a(&events, 'A'), b(&events, 'B'), c(&events, 'C');
+    ASSERT_TRUE(a.reserve(budget, 60));
+    ASSERT_FALSE(b.reserve(budget, 50));
+    ASSERT_FALSE(c.reserve(budget, 30));
+    // the head of the queue leaving lets the next connection in
+    budget.cancel(b.bytes);
+    EXPECT_EQ(events, "bcC");
+    EXPECT_FALSE(budget.claim(b.bytes));
+    EXPECT_EQ(budget.getStats().usedBytes, 90u);
+    EXPECT_EQ(b.bytes.load(), 0u);
+}
+
+TEST(MemoryBudget, CancelReturnsAnUnclaimedGrant) {
+    MemoryBudget budget(100, 100, 100);
+    std::string events;
+    Connection a(&events, 'A'), b(&events, 'B');
+    ASSERT_TRUE(a.reserve(budget, 80));
+    ASSERT_FALSE(b.reserve(budget, 50));
+    budget.release(80, a.bytes);
+    ASSERT_EQ(events, "bB");
+    ASSERT_EQ(budget.getStats().usedBytes, 50u);
+    // closed before its read claimed the bytes
+    budget.cancel(b.bytes);
+    EXPECT_FALSE(budget.claim(b.bytes));
+    EXPECT_EQ(budget.getStats().usedBytes, 0u);
+    EXPECT_EQ(b.bytes.load(), 0u);
+}
@@ -0,0 +1,59 @@
+#include <string.h>
+#include <gtest/gtest.h>
+#include "Protocol.hpp"
+
+TEST(Protocol, MagicPrefixReadsTheFullHeader) {
+    RequestHeader header;
+    memset(&header, 0, sizeof(header));
+    EXPECT_TRUE(parseRequestPrefix(PROTOCOL_MAGIC, header));
+    EXPECT_EQ(header.magic, PROTOCOL_MAGIC);
+    EXPECT_EQ(header.payloadSize, 0u);
+}
+
+TEST(Protocol, LegacyPrefixIsThePayloadSize) {
+    RequestHeader header;
+    memset(&header, 0, sizeof(header));
+    EXPECT_FALSE(parseRequestPrefix(123456, header));
+    EXPECT_EQ(header.magic, 0u);
+    EXPECT_EQ(header.payloadSize, 123456u);
+    EXPECT_EQ(header.taskMode, IMAGE_DETECTION);
+}
+
+TEST(Protocol, MagicIsSentInHostOrder) {
+    // the client writes the struct as it is, the server reads the first four bytes back
+    RequestHeader sent;
+    memset(&sent, 0, sizeof(sent));
+    sent.magic = PROTOCOL_MAGIC;
+    sent.payloadSize = 42;
+    sent.taskMode = IMAGE_GENERATION;
+    sent.width = 512;
+    sent.height = 384;
+    uint8_t wire[sizeof(RequestHeader)];
+    memcpy(wire, &sent, sizeof(sent));
+
+    uint32_t prefix;
+    memcpy(&prefix, wire, sizeof(prefix));
+    RequestHeader received;
+    memset(&received, 0, sizeof(received));
+    ASSERT_TRUE(parseRequestPrefix(prefix, received));
+    memcpy((uint8_t *)&received + sizeof(prefix), wire + sizeof(prefix), sizeof(received) - sizeof(prefix));
+    EXPECT_EQ(memcmp(&sent, &received, sizeof(sent)), 0);
+    EXPECT_EQ(received.width, 512);
+    EXPECT_EQ(received.height, 384);
+}
+
+TEST(Protocol, TaskModes) {
+    EXPECT_TRUE(isKnownTaskMode(IMAGE_DETECTION));
+    EXPECT_TRUE(isKnownTaskMode(IMAGE_GENERATION));
+    EXPECT_TRUE(isKnownTaskMode(IMAGE_TRACKING));
+    EXPECT_TRUE(isKnownTaskMode(IMAGE_CHAIN));
+    EXPECT_FALSE(isKnownTaskMode(IMAGE_CHAIN + 1));
+    EXPECT_FALSE(isKnownTaskMode(255));
+    EXPECT_FALSE(isKnownTaskMode(-1));
+}
+
+TEST(Protocol, StatusNames) {
+    EXPECT_STREQ(RESPONSE_STATUS_NAMES[STATUS_OK], "ok");
+    EXPECT_STREQ(RESPONSE_STATUS_NAMES[STATUS_OVERLOADED], "overloaded");
+    EXPECT_STREQ(RESPONSE_STATUS_NAMES[RESPONSE_STATUS_NUMS - 1], "unavailable");
+}
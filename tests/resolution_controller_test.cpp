@@ -0,0 +1,50 @@
+#include <chrono>
+#include <thread>
+#include <gtest/gtest.h>
+#include "ResolutionController.hpp"
+
+const int MIN_SIDE = 256;
+const int SLO_MS = 1000;
+
+// closes the current window with one observation of the delay
+static void closeWindow(ResolutionController &controller, int delayMs) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ADJUST_INTERVAL_MS + 10));
+    controller.observe(std::chrono::milliseconds(delayMs));
+}
+
+TEST(ResolutionController, FullScaleKeepsTheRequest) {
+    ResolutionController controller(MIN_SIDE, SLO_MS);
+    uint8_t sizePercent = 0;
+    cv::Size size = controller.choose(cv::Size(640, 480), 0, sizePercent);
+    EXPECT_EQ(size, cv::Size(640, 480));
+    EXPECT_EQ(sizePercent, 100);
+}
+
+TEST(ResolutionController, ScalesUnderLoadWithinWhatTheClientAccepts) {
+    ResolutionController controller(MIN_SIDE, SLO_MS);
+    // a window over the threshold moves one step, however many requests it saw
+    for(int i = 0; i < 10; ++i)
+        controller.observe(std::chrono::milliseconds(SLO_MS));
+    closeWindow(controller, SLO_MS);
+    ResolutionStats stats = controller.getStats();
+    ASSERT_EQ(stats.scalePercent, SCALE_LEVELS[1]);
+    EXPECT_EQ(stats.scaleDowns, 1u);
+
+    uint8_t sizePercent = 0;
+    // 88% of each side, rounded down to the alignment
+    EXPECT_EQ(controller.choose(cv::Size(512, 384), 0, sizePercent), cv::Size(448, 320));
+    EXPECT_EQ(sizePercent, 448 * 100 / 512);
+    // never below the generator's profile
+    EXPECT_EQ(controller.choose(cv::Size(288, 256), 0, sizePercent), cv::Size(256, 256));
+    // never below the least the client accepts, rounded up to the alignment
+    EXPECT_EQ(controller.choose(cv::Size(1024, 768), 90, sizePercent), cv::Size(928, 704));
+    EXPECT_EQ(controller.choose(cv::Size(512, 384), 100, sizePercent), cv::Size(512, 384));
+    EXPECT_EQ(sizePercent, 100);
+
+    // a quiet window steps back up
+    closeWindow(controller, (int)(SCALE_UP_AT * SLO_MS / 2));
+    stats = controller.getStats();
+    EXPECT_EQ(stats.scalePercent, 100);
+    EXPECT_EQ(stats.scaleUps, 1u);
+    EXPECT_EQ(controller.choose(cv::Size(512, 384), 0, sizePercent), cv::Size(512, 384));
+}
@@ -0,0 +1,126 @@
+#include <chrono>
+#include <thread>
+#include <gtest/gtest.h>
+#include "ResultCache.hpp"
+
+static CacheKey makeKey(uint64_t id, uint64_t modelVersion = 1) {
+    CacheKey key = {};
+    key.digest.lo = id;
+    key.digest.hi = 7;      // one shard for every key, so eviction order is observable
+    key.payloadSize = 100;
+    key.taskMode = IMAGE_DETECTION;
+    key.modelVersion = modelVersion;
+    return key;
+}
+
+static std::shared_ptr<const CachedResult> makeResult(size_t nbEncoded, int32_t trackId = 0) {
+    std::shared_ptr<CachedResult> result = std::make_shared<CachedResult>();
+    result->boxes.push_back(WireBox{trackId, 0.9f, 1, 2, 3, 4});
+    result->encoded.resize(nbEncoded);
+    return result;
+}
+
+TEST(ResultCache, MissThenHit) {
+    ResultCache cache;
+    std::shared_ptr<const CachedResult> result;
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_MISS);
+    std::shared_ptr<const CachedResult> computed = makeResult(10);
+    cache.complete(makeKey(1), computed);
+
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_HIT);
+    EXPECT_EQ(result, computed);
+    CacheStats stats = cache.getStats();
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.entries, 1u);
+    EXPECT_EQ(stats.bytes, computed->nbBytes());
+}
+
+TEST(ResultCache, ModelVersionIsPartOfTheKey) {
+    ResultCache cache;
+    std::shared_ptr<const CachedResult> result;
+    ASSERT_EQ(cache.lookup(makeKey(1, 1), result), CACHE_MISS);
+    cache.complete(makeKey(1, 1), makeResult(10));
+    EXPECT_EQ(cache.lookup(makeKey(1, 2), result), CACHE_MISS);
+    cache.abandon(makeKey(1, 2));
+}
+
+TEST(ResultCache, CoalescesConcurrentMisses) {
+    ResultCache cache;
+    std::shared_ptr<const CachedResult> result;
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_MISS);
+
+    CacheLookup waiterLookup = CACHE_MISS;
+    std::shared_ptr<const CachedResult> waiterResult;
+    std::thread waiter([&]() { waiterLookup = cache.lookup(makeKey(1), waiterResult); });
+    while(cache.getStats().coalesced == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::shared_ptr<const CachedResult> computed = makeResult(10);
+    cache.complete(makeKey(1), computed);
+    waiter.join();
+
+    EXPECT_EQ(waiterLookup, CACHE_HIT);
+    EXPECT_EQ(waiterResult, computed);
+    EXPECT_EQ(cache.getStats().misses, 1u);
+}
+
+TEST(ResultCache, AbandonHandsTheKeyToAWaiter) {
+    ResultCache cache;
+    std::shared_ptr<const CachedResult> result;
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_MISS);
+
+    CacheLookup waiterLookup = CACHE_HIT;
+    std::thread waiter([&]() {
+        std::shared_ptr<const CachedResult> waiterResult;
+        waiterLookup = cache.lookup(makeKey(1), waiterResult);
+    });
+    while(cache.getStats().coalesced == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    cache.abandon(makeKey(1));
+    waiter.join();
+
+    EXPECT_EQ(waiterLookup, CACHE_MISS);
+    EXPECT_EQ(cache.getStats().misses, 2u);
+    cache.abandon(makeKey(1));
+}
+
+TEST(ResultCache, CancelledWaiterGivesUp) {
+    ResultCache cache;
+    std::shared_ptr<const CachedResult> result;
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_MISS);
+
+    CancelToken token;
+    token.setDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(30));
+    EXPECT_THROW(cache.lookup(makeKey(1), result, &token), RequestCancelled);
+    cache.abandon(makeKey(1));
+}
+
+TEST(ResultCache, EvictsTheLeastRecentlyUsed) {
+    size_t entryBytes = makeResult(1000)->nbBytes();
+    ResultCache cache(CACHE_SHARDS * (2 * entryBytes + entryBytes / 2));
+    std::shared_ptr<const CachedResult> result;
+    for(uint64_t id = 1; id <= 2; ++id) {
+        ASSERT_EQ(cache.lookup(makeKey(id), result), CACHE_MISS);
+        cache.complete(makeKey(id), makeResult(1000, id));
+    }
+    // touch the first, the second is now the oldest
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_HIT);
+    ASSERT_EQ(cache.lookup(makeKey(3), result), CACHE_MISS);
+    cache.complete(makeKey(3), makeResult(1000, 3));
+
+    EXPECT_EQ(cache.getStats().evictions, 1u);
+    EXPECT_EQ(cache.lookup(makeKey(1), result), CACHE_HIT);
+    EXPECT_EQ(cache.lookup(makeKey(3), result), CACHE_HIT);
+    EXPECT_EQ(cache.lookup(makeKey(2), result), CACHE_MISS);
+    cache.abandon(makeKey(2));
+}
+
+TEST(ResultCache, OversizedResultIsNotKept) {
+    ResultCache cache(CACHE_SHARDS * 1024);
+    std::shared_ptr<const CachedResult> result;
+    ASSERT_EQ(cache.lookup(makeKey(1), result), CACHE_MISS);
+    cache.complete(makeKey(1), makeResult(4096));
+    EXPECT_EQ(cache.getStats().entries, 0u);
+    EXPECT_EQ(cache.lookup(makeKey(1), result), CACHE_MISS);
+    cache.abandon(makeKey(1));
+}
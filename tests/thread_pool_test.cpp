@@ -0,0 +1,176 @@
+#include <chrono>
+#include <vector>
+#include <pthread.h>
+#include <gtest/gtest.h>
+#include "Threadpool.hpp"
+
+// the order tasks ran in, and a gate that holds the workers until the queue is set up
+struct Recorder {
+    pthread_mutex_t mtx;
+    pthread_cond_t condv;
+    std::vector<int> order;
+    bool open;
+
+    Recorder() : open(false) {
+        pthread_mutex_init(&mtx, NULL);
+        pthread_cond_init(&condv, NULL);
+    }
+    ~Recorder() {
+        pthread_mutex_destroy(&mtx);
+        pthread_cond_destroy(&condv);
+    }
+    void add(int id) {
+        pthread_mutex_lock(&mtx);
+        order.push_back(id);
+        pthread_cond_broadcast(&condv);
+        pthread_mutex_unlock(&mtx);
+    }
+    void waitFor(size_t n) {
+        pthread_mutex_lock(&mtx);
+        while(order.size() < n)
+            pthread_cond_wait(&condv, &mtx);
+        pthread_mutex_unlock(&mtx);
+    }
+    void waitOpen() {
+        pthread_mutex_lock(&mtx);
+        while(!open)
+            pthread_cond_wait(&condv, &mtx);
+        pthread_mutex_unlock(&mtx);
+    }
+    void release() {
+        pthread_mutex_lock(&mtx);
+        open = true;
+        pthread_cond_broadcast(&condv);
+        pthread_mutex_unlock(&mtx);
+    }
+};
+
+static TaskAttr makeAttr(TaskClass taskClass, uint64_t flowId = 0) {
+    TaskAttr attr;
+    attr.taskClass = taskClass;
+    attr.flowId = flowId;
+    return attr;
+}
+
+static void record(ThreadPool &pool, Recorder &rec, int id, const TaskAttr &attr) {
+    ASSERT_TRUE(pool.threadPoolAdd([&rec, id](void *) { rec.add(id); }, nullptr, attr));
+}
+
+// occupies the only worker until the recorder is released
+static void block(ThreadPool &pool, Recorder &rec) {
+    Recorder started;
+    ASSERT_TRUE(pool.threadPoolAdd([&rec, &started](void *) { started.add(0); rec.waitOpen(); }, nullptr,
+        makeAttr(TASK_CLASS_IO, 1000)));
+    started.waitFor(1);
+}
+
+TEST(ThreadPool, ServesClassesInOrder) {
+    Recorder rec;
+    ThreadPool pool(1);
+    block(pool, rec);
+    record(pool, rec, TASK_CLASS_BATCH, makeAttr(TASK_CLASS_BATCH));
+    record(pool, rec, TASK_CLASS_INTERACTIVE, makeAttr(TASK_CLASS_INTERACTIVE));
+    record(pool, rec, TASK_CLASS_IO, makeAttr(TASK_CLASS_IO));
+    rec.release();
+    rec.waitFor(3);
+    EXPECT_EQ(rec.order, std::vector<int>({TASK_CLASS_IO, TASK_CLASS_INTERACTIVE, TASK_CLASS_BATCH}));
+}
+
+TEST(ThreadPool, EarliestDeadlineFirstWithinAFlow) {
+    Recorder rec;
+    ThreadPool pool(1);
+    block(pool, rec);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int deadlines[] = {3, 1, 0, 2};     // seconds from now, 0 is none
+    for(int deadline : deadlines) {
+        TaskAttr attr = makeAttr(TASK_CLASS_INTERACTIVE, 1);
+        if(deadline > 0)
+            attr.deadline = now + std::chrono::seconds(deadline);
+        record(pool, rec, deadline, attr);
+    }
+    rec.release();
+    rec.waitFor(4);
+    EXPECT_EQ(rec.order, std::vector<int>({1, 2, 3, 0}));
+}
+
+TEST(ThreadPool, FlowsShareTheWorkers) {
+    Recorder rec;
+    ThreadPool pool(1);
+    block(pool, rec);
+    // the first flow queues all of its work before the second one arrives
+    for(int i = 0; i < 3; ++i)
+        record(pool, rec, 1, makeAttr(TASK_CLASS_INTERACTIVE, 1));
+    for(int i = 0; i < 3; ++i)
+        record(pool, rec, 2, makeAttr(TASK_CLASS_INTERACTIVE, 2));
+    rec.release();
+    rec.waitFor(6);
+    EXPECT_EQ(rec.order, std::vector<int>({1, 2, 1, 2, 1, 2}));
+}
+
+TEST(ThreadPool, WeightScalesTheShare) {
+    Recorder rec;
+    ThreadPool pool(1);
+    block(pool, rec);
+    for(int i = 0; i < 4; ++i) {
+        TaskAttr attr = makeAttr(TASK_CLASS_INTERACTIVE, 1);
+        attr.weight = 2.0;
+        record(pool, rec, 1, attr);
+    }
+    for(int i = 0; i < 2; ++i)
+        record(pool, rec, 2, makeAttr(TASK_CLASS_INTERACTIVE, 2));
+    rec.release();
+    rec.waitFor(6);
+    EXPECT_EQ(rec.order, std::vector<int>({1, 2, 1, 1, 2, 1}));
+}
+
+TEST(ThreadPool, DeadlineMayRunAheadOfTheShareWithinTheSlack) {
+    Recorder rec;
+    ThreadPool pool(1);
+    block(pool, rec);
+    std::chrono::steady_clock::time_point soon = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    int urgent = (int)FAIR_SLACK + 3;
+    for(int i = 0; i < urgent; ++i) {
+        TaskAttr attr = makeAttr(TASK_CLASS_INTERACTIVE, 1);
+        attr.deadline = soon;
+        record(pool, rec, 1, attr);
+    }
+    record(pool, rec, 2, makeAttr(TASK_CLASS_INTERACTIVE, 2));
+    rec.release();
+    rec.waitFor(urgent + 1);
+    // the urgent flow runs until it is more than FAIR_SLACK ahead of the other one
+    std::vector<int> expected((int)FAIR_SLACK + 1, 1);
+    expected.push_back(2);
+    expected.resize(urgent + 1, 1);
+    EXPECT_EQ(rec.order, expected);
+}
+
+TEST(ThreadPool, ClassLimitLeavesWorkersToTheOthers) {
+    Recorder rec;
+    Recorder batchStarted;
+    ThreadPool pool(2);
+    pool.setClassLimit(TASK_CLASS_BATCH, 1);
+    for(int i = 0; i < 2; ++i)
+        ASSERT_TRUE(pool.threadPoolAdd([&](void *) { batchStarted.add(i); rec.waitOpen(); }, nullptr,
+            makeAttr(TASK_CLASS_BATCH, i)));
+    batchStarted.waitFor(1);
+    record(pool, rec, TASK_CLASS_INTERACTIVE, makeAttr(TASK_CLASS_INTERACTIVE));
+    rec.waitFor(1);
+    // the second worker ran the interactive task, not the second batch task
+    EXPECT_EQ(batchStarted.order.size(), 1u);
+    EXPECT_EQ(pool.getQueueSize(TASK_CLASS_BATCH), 1u);
+    rec.release();
+    batchStarted.waitFor(2);
+}
+
+TEST(ThreadPool, RefusesWhenTheQueueIsFull) {
+    Recorder rec;
+    ThreadPool pool(1);
+    block(pool, rec);
+    for(int i = 0; i < MAX_QUEUE; ++i)
+        ASSERT_TRUE(pool.threadPoolAdd([](void *) {}, nullptr, makeAttr(TASK_CLASS_BATCH, i % 8)));
+    EXPECT_FALSE(pool.threadPoolAdd([](void *) {}, nullptr, makeAttr(TASK_CLASS_BATCH)));
+    // reads are never refused
+    EXPECT_TRUE(pool.threadPoolAdd([](void *) {}, nullptr, makeAttr(TASK_CLASS_IO)));
+    EXPECT_EQ(pool.getQueueSize(TASK_CLASS_BATCH), (size_t)MAX_QUEUE);
+    rec.release();
+}